@@ -0,0 +1,64 @@
+#ifndef _DEF_CANCEL_TOKEN_H
+#define _DEF_CANCEL_TOKEN_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+struct libusb_device_handle;
+struct libusb_transfer;
+
+/*
+ * Stops the fel calls of a repair early. The thread that makes the calls
+ * installs its token with setCurrent(); fel.c's bulk transfers then go
+ * through bulkTransfer(), which submits them asynchronously and waits in
+ * short ticks. cancel(), from any thread, ends the transfer in flight with
+ * libusb_cancel_transfer() and fails every later one at once, so the fel
+ * call returns within milliseconds instead of waiting out the USB timeout.
+ *
+ * The waiting transfer also cancels the token itself when the step
+ * deadline has passed, or when the watched port no longer has a FEL
+ * device (fel_enum_present(), one socket read per tick).
+ */
+class CancelToken {
+public:
+	CancelToken();
+
+	/* From any thread; the first reason is kept */
+	void cancel(const std::string & reason);
+	bool cancelled();
+	std::string reason();
+	/* For the next repair: not cancelled, no deadline, no port */
+	void reset();
+	/* Cancels with 'reason' once usb_stats_now() passes 'deadline'; 0 for none */
+	void setDeadline(uint64_t deadline, const std::string & reason = "");
+	/* Cancels when the board leaves 'port' ("bus-port.port..."); empty to stop watching */
+	void watchPort(const std::string & port);
+	/* Sleeps up to 'ms', less if cancelled meanwhile; whether it was */
+	bool wait(unsigned ms);
+
+	/* The token of the fel calls made by the calling thread, null for none */
+	static CancelToken * current();
+	static void setCurrent(CancelToken * token);
+	/* libusb_bulk_transfer(), ended early by the calling thread's token if it has one */
+	static int bulkTransfer(libusb_device_handle * handle, unsigned char endpoint, unsigned char * data,
+		int length, int * transferred, unsigned timeout);
+
+private:
+	std::mutex lock;
+	std::condition_variable changed;
+	bool isCancelled;
+	std::string why;
+	uint64_t deadline;
+	std::string deadlineReason;
+	std::string port;
+	libusb_transfer * inFlight;
+
+	void check();
+
+	CancelToken(const CancelToken &);
+	CancelToken & operator=(const CancelToken &);
+};
+
+#endif
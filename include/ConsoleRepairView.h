@@ -2,13 +2,22 @@
 #define _DEF_CONSOLE_REPAIR_VIEW_H
 
 
+#include <map>
+#include "RepairClient.h"
 #include "RepairObserver.h"
 
 class ConsoleRepairView : public RepairObserver {
 	public:
 		ConsoleRepairView();
 		void main();
+		void setPort(const std::string & port) { this->port = port; }
 		virtual void onNotify(const std::string & progressText, float progressFraction, const std::string * details);
+		virtual void onDevice(const std::string & port, const std::string & sid);
+	private:
+		std::string device; // prefixed to every line
+		std::string port;
+
+		void remote(RepairClient & client);
 };
 
 #endif
@@ -0,0 +1,196 @@
+#ifndef _DEF_FEL_ASYNC_H
+#define _DEF_FEL_ASYNC_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+class RepairPlan;
+struct soc_sram_info;
+struct libusb_context;
+struct libusb_device_handle;
+struct libusb_transfer;
+
+/*
+ * The FEL protocol on libusb's asynchronous transfers, so that one thread
+ * can drive the repairs of every board of a station instead of one blocked
+ * thread per board.
+ *
+ * FelLoop is that thread. It runs libusb's event handling, where the
+ * transfers of all its devices complete, and the tasks and timers posted to
+ * it. It has a libusb context of its own, so the blocking fel calls of
+ * other threads never run its callbacks. A FelDevice is one board. Its
+ * operations return at once; their Done is called on the loop thread with 0
+ * or an error when the last transfer of the operation has completed. A
+ * device runs one operation at a time, the operations of different devices
+ * overlap.
+ *
+ * The operations are fel.c's aw_fel_read(), aw_fel_write(),
+ * aw_fel_execute() and the SPL sequence, and the steps of a RepairPlan,
+ * each a chain of transfers where fel.c blocks. Unlike fel.c they don't
+ * retry: the first USB error ends the operation. A plan step that runs past
+ * RepairPlan::deadlineMs() ends it as well.
+ */
+class FelLoop {
+public:
+	typedef std::function<void()> Task;
+
+	FelLoop();
+	/* Stops the loop; close its devices first */
+	~FelLoop();
+
+	bool start();
+	void stop();
+	/* Runs 'task' on the loop thread, from any thread */
+	void post(Task task);
+	/* Runs 'task' on the loop thread in 'ms' milliseconds, from any thread */
+	void after(unsigned ms, Task task);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	libusb_context * context;
+	pthread_mutex_t lock;
+	pthread_t thread;
+	bool started;
+	bool stopping;
+	std::deque<Task> tasks;
+	std::multimap<Clock::time_point, Task> timers;
+
+	static void * run(void * thisObj);
+	void wake();
+
+	FelLoop(const FelLoop &);
+	FelLoop & operator=(const FelLoop &);
+
+	friend class FelDevice;
+};
+
+class FelDevice {
+public:
+	/* 0, a LIBUSB_ERROR code, or PROTOCOL_ERROR (see error()) */
+	typedef std::function<void(int error)> Done;
+	typedef std::function<void(size_t step)> StepStarted;
+	static const int PROTOCOL_ERROR = 1;
+
+	explicit FelDevice(FelLoop & loop);
+	~FelDevice();
+
+	/*
+	 * Opens the FEL device on 'port' ("bus-port.port...", the first one if
+	 * empty), with the USB tuning stored for that port. Blocking, before
+	 * any operation and after the loop has started: 0, FEL_NOT_FOUND,
+	 * FEL_CANNOT_CLAIM_INTERFACE or a LIBUSB_ERROR code.
+	 */
+	int open(const std::string & port = "");
+	void close();
+	const std::string & port() const { return devicePort; }
+	/* Known after the first version() or spl() */
+	uint32_t socId() const { return soc; }
+	/* What went wrong in the last operation that failed */
+	const std::string & error() const { return errorText; }
+
+	void version(Done done);
+	void read(uint32_t address, void * buf, size_t length, Done done);
+	void write(uint32_t address, const void * buf, size_t length, Done done);
+	void execute(uint32_t address, Done done);
+	/* fel's "spl": runs the eGON SPL in 'buf', and writes the U-Boot image that follows it, if any */
+	void spl(const uint8_t * buf, size_t length, Done done);
+	/*
+	 * Runs the steps of 'plan', calling 'started' (if set) as each one
+	 * starts. A verify step reads the data back. A tune step is skipped,
+	 * the transfers use what fel stored for the port.
+	 */
+	void run(const RepairPlan & plan, Done done, StepStarted started = nullptr);
+
+	/* Ends the operation in flight with LIBUSB_ERROR_INTERRUPTED; from any thread */
+	void cancel();
+
+private:
+	typedef std::function<void()> Next;
+
+	FelLoop & loop;
+	libusb_device_handle * handle;
+	libusb_transfer * transfer;
+	int endpointIn, endpointOut;
+	int chunkSize;
+	unsigned timeoutMs;
+	std::string devicePort;
+	uint32_t soc;
+	soc_sram_info * sramInfo;
+	std::string errorText;
+
+	/* The operation in flight */
+	Done current;
+	std::atomic<unsigned> generation; // of the operation, so that stale timers and cancels do nothing
+	std::atomic<bool> cancelled;
+	std::string cancelReason;
+	bool inFlight;
+	std::function<void(int transferred)> transferred;
+	uint64_t traceStart, statsStart;
+	int opStats; // usb_stats_op of the FEL request in flight
+	uint32_t opLength;
+	uint64_t opStart;
+
+	/* Buffers of the operation in flight */
+	uint8_t usbRequest[32];
+	uint8_t responseBuf[13];
+	uint8_t felRequest[16];
+	uint8_t felStatus[8];
+	uint8_t reply[32];
+	uint32_t words[2];
+	std::vector<uint32_t> tt; // MMU translation table while the SPL runs, empty if the MMU is off
+	std::vector<uint8_t> scratch;
+	struct Piece {
+		const uint8_t * data;
+		uint32_t address;
+		uint32_t length;
+	};
+	std::vector<Piece> pieces; // of the SPL
+	void * source; // loaded source of the plan step
+	std::string sourceName;
+	const RepairPlan * plan;
+	StepStarted stepStarted;
+	size_t stepIndex; // of the plan step running, for its deadline
+
+	void begin(Done done, Next first);
+	void finish(int error);
+	void fail(int error, const std::string & text);
+	void stop(const std::string & reason);
+	static void onTransfer(libusb_transfer * transfer);
+	void completed();
+
+	void bulk(int endpoint, uint8_t * data, size_t length, Next next);
+	void usbResponse(Next next);
+	void usbWrite(const void * data, size_t length, Next next);
+	void usbRead(void * data, size_t length, Next next);
+	void sendRequest(int type, uint32_t address, uint32_t length, Next next);
+	void readStatus(Next next);
+	void felVersion(Next next);
+	void felRead(uint32_t address, void * buf, size_t length, Next next);
+	void felWrite(uint32_t address, const void * buf, size_t length, Next next);
+	void felExecute(uint32_t address, Next next);
+	void runCode(const uint32_t * code, size_t count, Next next);
+	void readRegister(const uint32_t * code, size_t count, uint32_t * word, Next next);
+	void runSpl(const uint8_t * buf, size_t length, Next next);
+	void backupMmu(Next next);
+	void loadSpl(const uint8_t * buf, uint32_t splLength, Next next);
+	void writePieces(size_t index, Next next);
+	void startSpl(Next next);
+	void restoreMmu(Next next);
+	void writeUboot(const uint8_t * buf, size_t length, Next next);
+	void passFelInformation(uint32_t scriptAddress, Next next);
+	void runStep(size_t index);
+	void unloadSource();
+
+	FelDevice(const FelDevice &);
+	FelDevice & operator=(const FelDevice &);
+};
+
+#endif
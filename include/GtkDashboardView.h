@@ -0,0 +1,100 @@
+#ifndef _DEF_GTK_DASHBOARD_VIEW_H
+#define _DEF_GTK_DASHBOARD_VIEW_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <gtk/gtk.h>
+
+#include "RepairClient.h"
+#include "RepairObserver.h"
+#include "RepairTool.h"
+
+/*
+ * One tile per board in FEL mode, for a station with a hub full of them:
+ * port, SID, phase, bytes, throughput and result. Each tile has its own
+ * RepairTool, pinned to the tile's port, and repairs on its own thread.
+ *
+ * The repair threads only write their tile's state under 'lock'. A timer
+ * on the main loop redraws the tiles that changed every RENDER_MS and
+ * looks for new boards every SCAN_TICKS of it, so however often a dozen
+ * repairs report, the main loop does a few redraws a second.
+ *
+ * Boards are found with fel_enum_devices(), so this needs sysfs. A tile
+ * stays when its board is unplugged, for the next board on that port.
+ * With chip-boot-repaird running, it does the repairs instead, and the
+ * tiles follow its progress stream.
+ */
+class GtkDashboardView : RepairClient::Listener {
+	public:
+		/* Whether boards can be found here */
+		static bool available();
+		/* Shows the window and runs the main loop until it is closed */
+		GtkDashboardView();
+		~GtkDashboardView();
+
+	private:
+		class Tile : public RepairObserver {
+			public:
+				Tile(GtkDashboardView * view, const std::string & port);
+
+				void onNotify(const std::string & progressText, float progressFraction, const std::string * details);
+				void onDevice(const std::string & port, const std::string & sid);
+				void onBytes(uint64_t done, uint64_t total);
+
+				GtkDashboardView * view;
+				std::string port;
+				RepairTool tool; // unless chip-boot-repaird repairs
+				GThread * thread; // of the last repair, joined before the next
+
+				/* Under view->lock */
+				bool running;
+				bool dirty; // changed since the last redraw
+				std::string sid, phase, details, result;
+				float fraction;
+				uint64_t done, total;
+				gint64 rateStart; // g_get_monotonic_time() of the first bytes, 0 before
+				uint64_t rateBytes; // done at rateStart
+				double rate; // bytes per second since rateStart
+
+				/* Main loop only */
+				bool present;
+				GtkWidget * frame;
+				GtkWidget * sidLabel;
+				GtkWidget * progbar;
+				GtkWidget * bytesLabel;
+				GtkWidget * detailsLabel;
+				GtkWidget * button;
+		};
+
+		static gboolean tick(gpointer thisObj);
+		static gpointer runRepair(gpointer tileObj);
+		static gpointer listen(gpointer thisObj);
+		static void onRepair(GtkWidget *, gpointer tileObj);
+		static void onRepairAll(GtkWidget *, gpointer thisObj);
+
+		RepairObserver * observer(const std::string & port);
+		void onDone(const std::string & port, bool ok);
+		void finished(Tile * tile, bool ok, const std::string * details = nullptr);
+
+		void scan();
+		void render();
+		void start(Tile * tile);
+		Tile * addTile(const std::string & port);
+
+		GMutex lock;
+		std::vector<Tile *> tiles; // added to under 'lock', for the daemon's events
+		RepairClient * client; // null if chip-boot-repaird is not running
+		GThread * listener; // of the daemon's events
+		unsigned ticks;
+
+		GtkWidget * window;
+		GtkWidget * vbox;
+		GtkWidget * header;
+		GtkWidget * countLabel;
+		GtkWidget * repairAllButton;
+		GtkWidget * scroller;
+		GtkWidget * table;
+};
+
+#endif
@@ -3,18 +3,27 @@
 
 #include <gtk/gtk.h>
 
+#include "RepairClient.h"
 #include "RepairObserver.h"
 
-class GtkRepairView : RepairObserver {
+class GtkRepairView : RepairObserver, RepairClient::Listener {
 	public:
 		static void * waitForFel(void * thisObj);
 		static void repairThread(GtkWidget *, void * thisObj);
-		GtkRepairView(int argc, char *argv[]);
+		/* Returns false if there is no usable display */
+		static bool init(int & argc, char ** & argv);
+		/* Tells the user and exits unless running as root */
+		static void requireRoot();
+		GtkRepairView();
 
 		void onNotify(const std::string & progressText, float progressFraction, const std::string * details);
+		RepairObserver * observer(const std::string & port);
 
 	private:
 		static void * repair(void * thisObj);
+		static void * listen(void * thisObj);
+		void prestage();
+		void repairRemotely();
 		GtkWidget *window;
 
 		GtkWidget *vbox;
@@ -27,6 +36,16 @@ class GtkRepairView : RepairObserver {
 		GtkWidget *halign;
 		GtkWidget *valign;
 
+		/* The Repair click, for the speculative mode */
+		GMutex clickLock;
+		GCond clickCond;
+		bool clicked;
+
+		/* chip-boot-repaird, if it is running; it then does the repair */
+		RepairClient * client;
+		GMutex portLock;
+		std::string remotePort; // of the board it repairs
+
 };
 
 #endif
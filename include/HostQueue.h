@@ -0,0 +1,46 @@
+#ifndef _DEF_HOST_QUEUE_H
+#define _DEF_HOST_QUEUE_H
+
+#include <pthread.h>
+#include <deque>
+#include <functional>
+#include <utility>
+
+/*
+ * Host-only work of a repair, run in order on a helper thread while the
+ * device is busy: mapping and checking the payloads, building the plan,
+ * hashing the payloads that get verified, writing the history and the
+ * metrics. That leaves USB operations on the critical path of a repair.
+ *
+ * add() returns the number of the job; wait() blocks until that job has
+ * run. Destruction runs whatever is still queued.
+ */
+class HostQueue {
+public:
+	typedef std::function<void()> Job;
+
+	HostQueue();
+	~HostQueue();
+
+	/* 'name' names the job's span, it must outlive the job (a string literal does) */
+	long add(const char * name, Job job);
+	bool done(long job);
+	void wait(long job);
+
+private:
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_t thread;
+	bool started;
+	bool stopping;
+	std::deque<std::pair<const char *, Job> > jobs;
+	long added;
+	long finished;
+
+	static void * run(void * thisObj);
+
+	HostQueue(const HostQueue &);
+	HostQueue & operator=(const HostQueue &);
+};
+
+#endif
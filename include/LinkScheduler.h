@@ -0,0 +1,57 @@
+#ifndef _DEF_LINK_SCHEDULER_H
+#define _DEF_LINK_SCHEDULER_H
+
+#include <string>
+
+#include "RepairPlan.h"
+
+class CancelToken;
+
+/*
+ * Keeps concurrent repairs from oversubscribing the USB links they share.
+ *
+ * Boards behind the same root port, directly or through hubs, share that
+ * port's link ("1-1.4.2" and "1-1.3" both use "1-1"). Each link has a few
+ * slots. A bulk-heavy plan step (write, fill or tune of at least
+ * BULK_BYTES) holds one of its link's slots while it runs. Everything else
+ * (probes, the SPL and its MMU handling, exec) runs without one. Consecutive
+ * bulk steps keep the slot they hold.
+ *
+ * The slots are flock()ed files, so they are shared by the repair processes
+ * of a station (one per board, see "--port"), and are freed when a process
+ * dies. They live in $CHIP_BOOT_REPAIR_LINKS, or chip-boot-repair/links
+ * under $XDG_RUNTIME_DIR or /tmp. $CHIP_BOOT_REPAIR_LINK_SLOTS sets the
+ * slots per link, DEFAULT_SLOTS if unset.
+ */
+class LinkScheduler {
+public:
+	static const uint32_t BULK_BYTES = 64 * 1024;
+	static const int DEFAULT_SLOTS = 2;
+
+	LinkScheduler();
+	~LinkScheduler();
+
+	/* The shared upstream link of a port: bus and root port */
+	static std::string link(const std::string & port);
+	static bool isBulk(const RepairPlan::Step & step);
+	static int slots();
+	static std::string directory();
+
+	/*
+	 * Blocks until a slot of the link of 'port' is free and takes it, unless
+	 * one is held already. Sets 'waited' if it had to wait. False if the
+	 * slots cannot be used; the step then runs unscheduled. Also false,
+	 * without a slot, once 'cancel' is cancelled.
+	 */
+	bool acquire(const std::string & port, bool * waited = nullptr, CancelToken * cancel = nullptr);
+	void release();
+	bool held() const { return fd >= 0; }
+
+private:
+	int fd;
+
+	LinkScheduler(const LinkScheduler &);
+	LinkScheduler & operator=(const LinkScheduler &);
+};
+
+#endif
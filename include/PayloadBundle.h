@@ -0,0 +1,82 @@
+#ifndef _DEF_PAYLOAD_BUNDLE_H
+#define _DEF_PAYLOAD_BUNDLE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * On-disk layout of a payload bundle (all fields little endian):
+ *
+ *   payload_bundle_header
+ *   payload_bundle_entry[count]
+ *   payload data, each entry starting at its own 'alignment'
+ *
+ * 'index_crc' covers the entry table, 'crc32' of an entry covers its data.
+ */
+#define PAYLOAD_BUNDLE_MAGIC	"CHIPPAYL"
+#define PAYLOAD_BUNDLE_FORMAT	1
+#define PAYLOAD_NAME_LEN	32
+
+struct payload_bundle_header {
+	char magic[8];
+	uint32_t format;	/* PAYLOAD_BUNDLE_FORMAT */
+	uint32_t version;	/* version of the payload set */
+	uint32_t count;		/* number of index entries */
+	uint32_t index_crc;
+} __attribute__((packed));
+
+struct payload_bundle_entry {
+	char name[PAYLOAD_NAME_LEN];
+	uint32_t load_addr;	/* 0 if the payload has no fixed address (SPL) */
+	uint32_t offset;	/* from the start of the bundle */
+	uint32_t size;
+	uint32_t alignment;
+	uint32_t crc32;
+	uint32_t reserved;
+} __attribute__((packed));
+
+class PayloadBundle {
+public:
+	struct Entry {
+		std::string name;
+		uint32_t loadAddress;
+		uint32_t size;
+		uint32_t alignment;
+		uint32_t crc32;
+		const uint8_t * data; // points into the mapping, valid while the bundle lives
+	};
+
+	/* Describes one input file when building a bundle */
+	struct Source {
+		std::string name;
+		uint32_t loadAddress;
+		uint32_t alignment;
+		std::string path;
+	};
+
+	static PayloadBundle * open(const std::string & path, std::string * error = nullptr);
+	static bool write(const std::string & path, uint32_t version, const std::vector<Source> & sources, std::string * error = nullptr);
+
+	/* Maps 'path' on the first call; every later call returns that same mapping */
+	static PayloadBundle * shared(const std::string & path, std::string * error = nullptr);
+	/* The mapping created by shared(path), or nullptr */
+	static PayloadBundle * shared();
+
+	~PayloadBundle();
+
+	uint32_t version() const { return bundleVersion; }
+	const std::vector<Entry> & entries() const { return index; }
+	const Entry * find(const std::string & name) const;
+	bool verify(std::string * error = nullptr) const;
+
+private:
+	PayloadBundle();
+
+	void * map;
+	size_t mapSize;
+	uint32_t bundleVersion;
+	std::vector<Entry> index;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef _DEF_REPAIR_CLIENT_H
+#define _DEF_REPAIR_CLIENT_H
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "RepairObserver.h"
+
+/*
+ * A frontend's connection to chip-boot-repaird (see RepairSocket.h), which
+ * does the repairs in its own process: the frontend needs neither root nor
+ * the USB devices. Requests are safe from any thread; listen() blocks on
+ * the progress stream of its own connection.
+ */
+class RepairClient {
+public:
+	struct Board {
+		std::string port;
+		bool repairing;
+		std::string sid;
+	};
+
+	/* What listen() reports, on its thread */
+	class Listener {
+		public:
+			/* Who gets the progress of the repair on 'port', null for nobody */
+			virtual RepairObserver * observer(const std::string & port) = 0;
+			virtual void onBoard(const std::string & port, bool present) {}
+			virtual void onDone(const std::string & port, bool ok) {}
+			virtual ~Listener() {}
+	};
+
+	RepairClient();
+	~RepairClient();
+
+	/* False if no daemon is running */
+	bool connect();
+	bool devices(std::vector<Board> & boards);
+	bool repair(const std::string & port, std::string * error = nullptr);
+	bool cancel(const std::string & port, std::string * error = nullptr);
+	/* Reports the daemon's events to 'listener' until it goes away, or stop() */
+	void listen(Listener * listener);
+	/* Makes listen() return, from another thread */
+	void stop();
+
+private:
+	std::mutex lock; // of the request connection
+	int fd;
+	std::string buffer;
+	int stream; // of listen(), -1 outside it
+	bool stopped;
+
+	bool request(const std::vector<std::string> & fields, std::string * error);
+
+	RepairClient(const RepairClient &);
+	RepairClient & operator=(const RepairClient &);
+};
+
+#endif
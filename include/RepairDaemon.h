@@ -0,0 +1,86 @@
+#ifndef _DEF_REPAIR_DAEMON_H
+#define _DEF_REPAIR_DAEMON_H
+
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "RepairObserver.h"
+#include "RepairWorker.h"
+
+/*
+ * chip-boot-repaird: the one process of a station that repairs boards.
+ * It serves RepairSocket.h's protocol to the frontends, which need neither
+ * root nor libusb. Each repair runs in a worker process of its own
+ * (RepairWorker.h), so a board that brings fel down costs only its repair.
+ * The daemon keeps the payloads mapped and hashed for the workers; the USB
+ * tuning and the link slots are files they share.
+ *
+ * One thread polls the socket, the clients and the workers, and lists the
+ * boards every SCAN_MS. The workers' progress goes to the subscribed
+ * clients' buffers, which that thread writes out. A client that lets
+ * MAX_BACKLOG bytes pile up is dropped.
+ *
+ * run() first repairs the boards whose repair a crash cut short, as the
+ * journal (RepairJournal.h) has them.
+ */
+class RepairDaemon {
+public:
+	static const unsigned SCAN_MS = 500;
+	static const size_t MAX_BACKLOG = 1024 * 1024;
+
+	RepairDaemon();
+	/* Cancels the repairs, and waits for their workers */
+	~RepairDaemon();
+
+	/* Binds RepairSocket::path(), unless another daemon has it */
+	bool listen(std::string * error);
+	/* Serves the clients; returns only if polling fails */
+	void run();
+
+private:
+	/* The repairs of a port, passed on to the clients */
+	class Job : public RepairObserver {
+		public:
+			Job(RepairDaemon * daemon, const std::string & port);
+
+			void onNotify(const std::string & progressText, float progressFraction, const std::string * details);
+			void onDevice(const std::string & port, const std::string & sid);
+			void onBytes(uint64_t done, uint64_t total);
+
+			RepairDaemon * daemon;
+			std::string port;
+			RepairWorker * worker; // of the repair in progress, null if none
+			std::string sid;
+			std::string lastNotify; // for clients that subscribe during the repair
+			float progressFraction;
+			uint64_t bytesDone; // of the last bytes event
+	};
+
+	struct Client {
+		int fd;
+		std::string in, out;
+		bool subscribed;
+		bool dropped;
+	};
+
+	int listenFd;
+	std::vector<Client *> clients;
+	std::map<std::string, Job *> jobs;
+	std::set<std::string> boards; // ports with a FEL device at the last scan
+
+	bool start(const std::string & port, std::string * error);
+	void recover();
+	std::vector<int> descriptors();
+	void readWorker(Job * job);
+	void broadcast(const std::string & line);
+	void handle(Client * client, const std::vector<std::string> & request);
+	void scan();
+	std::set<std::string> present();
+	bool readFrom(Client * client);
+	bool writeTo(Client * client);
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _DEF_REPAIR_HISTORY_H
+#define _DEF_REPAIR_HISTORY_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * Every repair that reached a device, appended as one CSV line:
+ *
+ *   time,host,port,soc,sid,bundle,outcome,wait_ms,load_ms,plan_ms,settle_ms,total_ms,bytes,retries,phases,error,crc
+ *
+ * 'time' is when the repair ended, in seconds since the epoch. 'wait_ms' is
+ * spent waiting for the device and is left out of 'total_ms'. 'phases' is
+ * the time of every plan step, as space separated "step=ms". The last field
+ * is the CRC-32 of everything before it, in hex, so a line cut short by a
+ * crash is recognised and skipped.
+ *
+ * A line is written with a single write() on an O_APPEND descriptor, so it
+ * is safe once the call returns, unless the machine itself goes down. For
+ * that, fsync() runs after every SYNC_RECORDS lines or SYNC_SECONDS
+ * seconds, and at exit.
+ *
+ * The file is $CHIP_BOOT_REPAIR_HISTORY if set, otherwise
+ * $XDG_STATE_HOME/chip-boot-repair/history.csv (~/.local/state by default).
+ */
+class RepairHistory {
+public:
+	struct Phase {
+		std::string name;
+		double ms;
+	};
+
+	struct Record {
+		int64_t time;
+		std::string host;
+		std::string port;
+		uint32_t socId;          // 0 if the SoC was never asked
+		std::string sid;         // Security ID of the chip, empty if unknown
+		uint32_t bundleVersion;
+		std::string outcome;     // "ok", "failed" or "skipped" (repaired before)
+		double waitMs, loadMs, planMs, settleMs, totalMs;
+		uint64_t bytes;
+		int retries;
+		std::vector<Phase> phases;
+		std::string error;       // last line of the fel output, when failed
+
+		Record();
+	};
+
+	static const int SYNC_RECORDS = 8;
+	static const int SYNC_SECONDS = 10;
+
+	static std::string path();
+	static bool append(const Record & record, std::string * error = nullptr);
+	/* fsync()s what was appended so far */
+	static void sync();
+	/* Whether the log has a successful repair of chip 'sid' with this bundle version */
+	static bool repaired(const std::string & sid, uint32_t bundleVersion);
+
+	/* Reads every intact record of 'path'; 'damaged' counts the lines skipped */
+	static bool load(const std::string & path, std::vector<Record> & records, std::string * error = nullptr,
+		size_t * damaged = nullptr);
+
+	static std::string format(const Record & record);
+	static bool parse(const std::string & line, Record & record);
+};
+
+#endif
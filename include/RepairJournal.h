@@ -0,0 +1,71 @@
+#ifndef _DEF_REPAIR_JOURNAL_H
+#define _DEF_REPAIR_JOURNAL_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * Where every repair in progress is, so that one cut short by a crash can
+ * be picked up by the next process. Each repair is a job with entries
+ * appended as one CSV line each:
+ *
+ *   time,job,port,device,sid,bundle,step,phase,bytes,state,crc
+ *
+ * 'device' is the USB device number of the board, which changes when it
+ * is replugged. 'step' is the index of the plan step that started ('phase'
+ * is its name), -1 before the plan. 'bytes' are those of the steps that
+ * completed. 'state' is "running" until the last entry of the job: "ok",
+ * "failed", "skipped", or for a job found cut short, "resumed",
+ * "restarted" or "abandoned". The CRC-32 ends the line as in the history
+ * (RepairHistory.h), so a line cut short is skipped.
+ *
+ * Each entry is a single write() on an O_APPEND descriptor, so it survives
+ * the process. sync() fsync()s once SYNC_ENTRIES entries or SYNC_MS have
+ * piled up, one fsync for the entries of every repair in the meantime.
+ * When a job ends and the file is over COMPACT_BYTES, only the last entry
+ * of the jobs still running is kept. The processes of a station (one per
+ * board, "--port") share the file: appends hold a shared flock(), the
+ * compaction an exclusive one.
+ *
+ * The file is $CHIP_BOOT_REPAIR_JOURNAL if set, otherwise journal.csv
+ * next to the history.
+ */
+class RepairJournal {
+public:
+	struct Entry {
+		int64_t time;
+		std::string job;
+		std::string port;
+		int device;              // -1 if unknown
+		std::string sid;
+		uint32_t bundleVersion;
+		int step;
+		std::string phase;
+		uint64_t bytes;
+		std::string state;
+
+		Entry();
+	};
+
+	static const int SYNC_ENTRIES = 16;
+	static const int SYNC_MS = 250;
+	static const long COMPACT_BYTES = 64 * 1024;
+
+	static std::string path();
+	/* A job id no other process has used: pid, time and a count */
+	static std::string newJob();
+	static bool append(const Entry & entry, std::string * error = nullptr);
+	/* fsync()s the entries appended so far, if it is due or 'force' */
+	static void sync(bool force = false);
+	/*
+	 * The last entry of every job that never ended and whose process is
+	 * gone, on 'port' if not empty, oldest first
+	 */
+	static std::vector<Entry> interrupted(const std::string & port = "");
+
+	static std::string format(const Entry & entry);
+	static bool parse(const std::string & line, Entry & entry);
+};
+
+#endif
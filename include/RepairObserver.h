@@ -1,9 +1,14 @@
 #ifndef _DEF_REPAIR_OBSERVER_H
 #define _DEF_REPAIR_OBSERVER_H
+#include <stdint.h>
 #include <string>
 class RepairObserver {
 	public:
 		virtual void onNotify(const std::string & progressText, float progressFraction, const std::string * details)=0;
+		/* The board the following notifications are about; sid is empty if the chip has none */
+		virtual void onDevice(const std::string & port, const std::string & sid) {}
+		/* Bytes of the repair plan done so far, of 'total'; as often as every transfer */
+		virtual void onBytes(uint64_t done, uint64_t total) {}
 		virtual ~RepairObserver() {}
 };
 
@@ -0,0 +1,75 @@
+#ifndef _DEF_REPAIR_PLAN_H
+#define _DEF_REPAIR_PLAN_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class PayloadBundle;
+
+/*
+ * A repair as a list of fel operations, one per line:
+ *
+ *   spl     SOURCE                          load and run the SPL
+ *   write   SOURCE [ADDRESS]                store SOURCE in memory
+ *   verify  SOURCE [ADDRESS]                check that memory holds SOURCE
+ *   exec    ADDRESS                         call ADDRESS
+ *   fill    ADDRESS LENGTH VALUE            fill memory with a byte
+ *   tune    ADDRESS LENGTH                  tune the USB port (see fel.c)
+ *
+ * SOURCE is "payload:NAME" for a bundle entry, or a file. An ADDRESS can
+ * be "payload:NAME" too, meaning the load address of that entry, which is
+ * also the default for write and verify. A line may end with a "quoted"
+ * progress text; the steps up to the next quoted text are reported under
+ * it. '#' starts a comment.
+ *
+ * parse() resolves every payload and address and checks the whole plan
+ * before anything touches the device.
+ */
+class RepairPlan {
+public:
+	struct Step {
+		int line;
+		std::string op;
+		std::vector<std::string> command; // the fel command, addresses resolved
+		std::string label;                // empty: part of the step before
+		uint32_t bytes;                   // of the source, fill or tune region; 0 for exec
+	};
+
+	static bool parse(const std::string & text, const PayloadBundle * bundle, RepairPlan & plan,
+		std::string * error = nullptr, const std::string & name = "plan");
+	static bool load(const std::string & path, const PayloadBundle * bundle, RepairPlan & plan,
+		std::string * error = nullptr);
+
+	const std::vector<Step> & steps() const { return stepList; }
+	bool executes() const;
+	/*
+	 * How long 'step' may take before the repair gives up on it: a few
+	 * times its bytes at 'bytesPerSecond' (usb_stats_write_rate(), or
+	 * UNMEASURED_RATE while it is 0), plus room for the round trips and
+	 * for the SPL setting up DRAM.
+	 */
+	static const unsigned UNMEASURED_RATE = 512 * 1024;
+	static unsigned deadlineMs(const Step & step, double bytesPerSecond);
+	/* Every step as one fel command line, so the whole plan runs in one device session */
+	std::vector<std::string> felArguments() const;
+	/*
+	 * Splits the plan at its first exec. 'stage' gets the steps before it;
+	 * 'finish' gets a verify of every write among them, then the exec and
+	 * the rest. False if there is nothing to split: no exec, or exec first.
+	 */
+	bool split(RepairPlan & stage, RepairPlan & finish) const;
+	/*
+	 * The rest of a repair that was cut short while 'step' ran, on a board
+	 * that stayed in FEL mode: a verify of every write before it (fills
+	 * again, tunes not), then 'step' and the rest. False if the earlier
+	 * steps did not leave their work in memory: 'step' is the spl or comes
+	 * before it, or follows an exec.
+	 */
+	bool resume(size_t step, RepairPlan & resumed) const;
+
+private:
+	std::vector<Step> stepList;
+};
+
+#endif
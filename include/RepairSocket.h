@@ -0,0 +1,43 @@
+#ifndef _DEF_REPAIR_SOCKET_H
+#define _DEF_REPAIR_SOCKET_H
+
+#include <string>
+#include <vector>
+
+/*
+ * The Unix socket of chip-boot-repaird, at $CHIP_BOOT_REPAIR_SOCKET or
+ * DEFAULT_PATH. Requests and replies are lines of tab-separated fields;
+ * a tab, newline or backslash inside a field is written \t, \n or \\.
+ *
+ *   devices           "board <port> <idle|repairing> <sid>" per board, then "end"
+ *   repair <port>     "ok", or "error <why>"
+ *   cancel <port>     "ok", or "error <why>"
+ *   subscribe         "ok", then the events below until the client hangs up,
+ *                     starting with the boards present and the last notify
+ *                     of every repair in progress:
+ *     board <port> <present|gone>
+ *     device <port> <sid>
+ *     notify <port> <per mille> <text> <details>    (no floats: clients set a locale)
+ *     bytes <port> <done> <total>     at most every BYTES_INTERVAL_MS
+ *     done <port> <ok|failed>
+ *
+ * A connection that subscribes does nothing else; a client uses another
+ * one for its requests.
+ */
+class RepairSocket {
+public:
+	static const char * const DEFAULT_PATH;
+	static const unsigned BYTES_INTERVAL_MS = 100;
+
+	static std::string path();
+	/* A connected socket, -1 if no daemon listens */
+	static int connect();
+
+	static std::string line(const std::vector<std::string> & fields);
+	static std::vector<std::string> fields(const std::string & line);
+	/* Takes the next line out of 'buffer', reading 'fd' for more as needed; false at the end */
+	static bool readLine(int fd, std::string & buffer, std::string & line);
+	static bool writeAll(int fd, const std::string & text);
+};
+
+#endif
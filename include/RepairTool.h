@@ -1,6 +1,7 @@
 #ifndef _DEF_REPAIR_TOOL_H
 #define _DEF_REPAIR_TOOL_H
 
+#include <stdint.h>
 #include <list>
 #include <iostream>
 #include <vector>
@@ -8,29 +9,127 @@
 using namespace std;
 using Strings = vector<string>;
 #include "RepairObserver.h"
+#include "RepairHistory.h"
+#include "RepairJournal.h"
+#include "LinkScheduler.h"
+#include "HostQueue.h"
+#include "CancelToken.h"
+
+class RepairPlan;
+
+/* Names of the payload bundle entries a repair uses */
+extern const std::string SPL_PAYLOAD;
+extern const std::string SPL_ECC_PAYLOAD;
+extern const std::string UBOOT_PAYLOAD;
+extern const std::string UBOOT_SCRIPT_PAYLOAD;
+
+void find_and_replace(string& source, string const& find, string const& replace);
+/* strdup()s every string with "PREFIX" replaced; the caller owns the array */
+char ** prefixedStringArray(const std::string & prefix, const Strings & strings);
+
 class RepairTool {
 public:
 	RepairTool();
 	static void runSimple(RepairObserver * view, bool wait);
 	bool repair(bool wait);
 	void repairLoop(bool wait);
-	static int staticCheckForFel();
+	/*
+	 * Stops the repair, staging or wait for a board in progress, from any
+	 * thread; it returns false within milliseconds, with the device let go
+	 * of. A repair also stops itself when its board is unplugged, or when a
+	 * plan step runs past its deadline (RepairPlan::deadlineMs()).
+	 */
+	void cancel(const std::string & reason = "Cancelled") { cancelToken.cancel(reason); }
+
+	/*
+	 * Speculative repair, for a frontend that waits for the operator: stage()
+	 * runs the plan up to its exec on the board that is plugged in (the SPL
+	 * sets up DRAM, the payloads are uploaded). finish() then only verifies
+	 * the uploads and runs the exec, or repairs from the start if the board
+	 * is not the one staged or lost what was uploaded. unstage() forgets a
+	 * board that went away. Nothing is logged for a staged board until
+	 * finish(). Opt-in with CHIP_BOOT_REPAIR_SPECULATIVE=1.
+	 *
+	 * repair() and finish() keep their progress in the journal
+	 * (RepairJournal.h). A repair of a board whose last one was cut short
+	 * by a crash, and that stayed in FEL mode since, verifies what was
+	 * uploaded and carries on from the step that was running.
+	 */
+	static bool speculative();
+	bool stage();
+	bool finish();
+	void unstage();
+	/* Whether the board last seen is still plugged in, without having been replugged */
+	bool boardPresent();
+	/* A FEL device on 'port' ("bus-port.port..."), or any if empty */
+	static int staticCheckForFel(const std::string & port = "");
 	static void staticWaitForFel(RepairObserver * observer = nullptr);
+	/* Rewrites the CHIP_BOOT_REPAIR_METRICS textfile, if set; done after every repair */
+	static void writeMetrics();
+	/* Maps and checks the payload bundle and the repair plan; safe to call from any thread */
+	static bool mapPayloads(std::string * error);
+	/* Hashes the payloads the plan verifies, after mapPayloads(); safe to call from any thread */
+	static void hashPayloads();
+	/* The plan mapPayloads() has checked, null before */
+	static const RepairPlan * repairPlan();
 
 	void addObserver(RepairObserver * observer);
+	/* Pause after starting the U-Boot script, 3 seconds unless set */
+	void setExecSettleTime(unsigned seconds) { execSettleTime = seconds; }
+	/* Only repair the board on this USB port, so each board of a station can have its own tool */
+	void setPort(const std::string & port) { this->port = port; }
 private:
 	std::list<RepairObserver *> * observers;
+	std::string progressText;
+	float progressFraction;
+	int retries;
+	unsigned execSettleTime;
+	const RepairPlan * plan;
+	std::string devicePort;
+	uint32_t socId;
+	std::string sid; // Security ID of the board, empty if it has none
+	std::vector<uint64_t> stepStarts; // usb_stats_now() at the start of every plan step
+	uint64_t planBytes, stepsBytes, stepBytes; // for onBytes(): all steps, the steps before this one, this one so far
+	std::string port;
+	LinkScheduler link;
+	bool quiet; // no progress while staging, the operator has not asked for a repair yet
+	bool staged;
+	bool pinned; // port was set by stage()
+	int boardDevice; // USB device number of the board, -1 if unknown
+	uint64_t stagedStart, stagedEnd;
+	RepairHistory::Record stagedRecord;
+	RepairJournal::Entry job; // of the repair in progress, no job if it is not journaled
+	int jobBase, jobSkip; // the full plan's step the plan running starts at, after jobSkip steps of its own
+	HostQueue host; // host-only work, off the critical path of the repair
+	CancelToken cancelToken; // of this tool's fel calls
+
+	static void onRetry(void * thisObj, uint32_t address, int attempt, int error);
+	static void onCommand(void * thisObj, int index, const char * command);
+	static void onDevice(void * thisObj, const char * port, uint32_t soc_id, const char * sid);
+	static void onBytes(void * thisObj, uint32_t bytes);
 
 	static int do_fel(const Strings & commands, char **returnBuffer);
-	void waitForFel();
-	int spl_write();
-	int spl_w_ecc_write();
-	int uboot_write();
-	int uboot_scr_write();
-	int fel_exe();
+	static Strings onPort(const Strings & commands, const std::string & port);
+	Strings onPort(const Strings & commands) const { return onPort(commands, port); }
+	void schedule(const RepairPlan::Step & step);
+	void setDeadline(const RepairPlan::Step & step);
+	bool waitForFel(long prepared);
+	long prepare();
+	bool loadPayloads();
+	bool runPlan(const RepairPlan * steps, RepairHistory::Record & record);
+	void writeHistory(RepairHistory::Record & record, const std::string & outcome);
+	void identify();
+	static int deviceNumber(const std::string & port);
+	void skip(RepairHistory::Record & record, uint64_t start);
+	int interruptedStep(RepairPlan & rest);
+	bool resume(const RepairPlan & rest, int step, RepairHistory::Record & record);
+	void startJob(int base = 0);
+	void journal();
+	void endJob(const std::string & state);
 	void complete();
 	int checkForFel();
 	void notify(const std::string & progressText, float progressFraction,const std::string * details= nullptr);
+	void notifyBytes();
 };
 
 #endif
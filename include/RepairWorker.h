@@ -0,0 +1,71 @@
+#ifndef _DEF_REPAIR_WORKER_H
+#define _DEF_REPAIR_WORKER_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "RepairObserver.h"
+
+/*
+ * One repair in a process of its own, fork()ed by chip-boot-repaird. fel.c
+ * gives up on a board through exit() and assert(), and a driver can crash
+ * the process it runs in; either way only that worker is lost, and with it
+ * the one board it was repairing. The journal (RepairJournal.h) has where
+ * it stopped, for the next repair of that board.
+ *
+ * The supervisor maps and hashes the payloads before it forks, and never
+ * opens a USB device (libusb contexts do not survive fork()): each worker
+ * shares those read-only pages and starts its own fel sessions.
+ *
+ * The worker's progress goes through a ring of SLOTS events in memory
+ * shared with the supervisor, with a byte on a pipe to wake it up; the
+ * pipe reaching its end means the worker is gone. Progress text longer
+ * than a slot is cut short. Bytes events are sent every
+ * RepairSocket::BYTES_INTERVAL_MS, and dropped while the ring is full.
+ * cancel() writes the reason on another pipe; a worker whose supervisor
+ * goes away cancels its repair.
+ */
+class RepairWorker {
+public:
+	static const unsigned SLOTS = 32;
+	static const unsigned SLOT_BYTES = 4096;
+	/* How long a worker has to stop once cancelled, when the supervisor stops, before it is killed */
+	static const unsigned KILL_MS = 5000;
+
+	explicit RepairWorker(const std::string & port);
+	/* Cancels the worker if it still runs, and reaps it */
+	~RepairWorker();
+
+	/* Forks the worker, which closes 'inherited': the supervisor's descriptors */
+	bool start(const std::vector<int> & inherited, std::string * error);
+	void cancel(const std::string & reason);
+	/* Readable when there are events waiting, or once the worker is gone */
+	int fd() const { return eventFds[0]; }
+	/* The supervisor's ends of the pipes, which the workers forked after this one close */
+	std::vector<int> descriptors() const { return { eventFds[0], cancelFds[1] }; }
+	/*
+	 * Passes the events waiting on to 'observer'. False once the worker is
+	 * gone: 'ok' is then its result, and 'error' why it died, if it did.
+	 */
+	bool read(RepairObserver * observer, bool & ok, std::string & error);
+
+private:
+	struct Ring;
+	class Reporter;
+
+	std::string port;
+	pid_t pid;
+	Ring * ring;
+	int eventFds[2];  // worker to supervisor
+	int cancelFds[2]; // supervisor to worker
+
+	void run();
+	bool reap(int options, bool & ok, std::string & error);
+
+	RepairWorker(const RepairWorker &);
+	RepairWorker & operator=(const RepairWorker &);
+};
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _DEF_STARTUP_H
+#define _DEF_STARTUP_H
+
+/*
+ * Cold start work that doesn't need a UI: libusb setup, mapping and checking
+ * the payload bundle, and the first FEL probe. begin() runs it on a
+ * background thread while the frontend initialises.
+ */
+class Startup {
+public:
+	static void begin();
+	static void wait();
+	/* Result of the first FEL probe (0 if a device was found) */
+	static int felResult();
+	/* Reports the time from launch to "ready to repair", once */
+	static void ready();
+
+private:
+	static void * run(void *);
+};
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef _DEF_TRACE_SPAN_H
+#define _DEF_TRACE_SPAN_H
+
+extern "C" {
+#include "spantrace.h"
+}
+
+/* A span from construction to the end of the scope, see spantrace.h */
+class TraceSpan {
+public:
+	/* 'category' and 'name' must outlive the span, string literals do */
+	TraceSpan(const char * category, const char * name)
+		: category(category), name(name), start(span_begin()) {}
+	~TraceSpan() { span_end(start, category, name); }
+
+private:
+	TraceSpan(const TraceSpan &) = delete;
+	TraceSpan & operator=(const TraceSpan &) = delete;
+
+	const char * category;
+	const char * name;
+	uint64_t start;
+};
+
+#endif
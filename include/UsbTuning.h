@@ -0,0 +1,35 @@
+#ifndef _DEF_USB_TUNING_H
+#define _DEF_USB_TUNING_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+/*
+ * Bulk transfer sizes and timeouts found by "fel tune", per USB port
+ * ("bus-port.port...", as in sysfs). They are kept in a small text file,
+ * so later sessions on the same port start with them:
+ *
+ *   # port chunk_bytes timeout_ms
+ *   1-1.4 1048576 1500
+ *
+ * The file is $CHIP_BOOT_REPAIR_TUNING if set, otherwise
+ * $XDG_CACHE_HOME/chip-boot-repair/usb-tuning (~/.cache by default).
+ */
+class UsbTuning {
+public:
+	struct Values {
+		uint32_t chunkSize;
+		uint32_t timeoutMs;
+	};
+
+	static std::string path();
+	static bool find(const std::string & port, Values & values);
+	/* Replaces the values of 'port' and rewrites the file atomically */
+	static bool save(const std::string & port, const Values & values, std::string * error = nullptr);
+
+private:
+	static std::map<std::string, Values> load(const std::string & path);
+};
+
+#endif
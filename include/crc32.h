@@ -0,0 +1,14 @@
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Standard CRC-32 (IEEE 802.3, as used by zlib and by U-Boot's crc32()).
+ * Pass 0 as 'crc' for the first block, and the previous result to continue
+ * over several blocks.
+ */
+uint32_t calc_crc32(const void *buf, size_t len, uint32_t crc);
+
+#endif
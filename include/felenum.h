@@ -0,0 +1,47 @@
+#ifndef _FELENUM_H
+#define _FELENUM_H
+
+/*
+ * Finds FEL devices (USB 1f3a:efe8) from the sysfs USB device tree, without
+ * opening every device on the host the way libusb enumeration does.
+ *
+ * fel_enum_devices() keeps the last scan and only scans again after a USB
+ * uevent from the kernel (or fel_enum_invalidate()), so polling for a
+ * board costs a non-blocking read of the uevent socket. Without a uevent
+ * socket every call scans.
+ *
+ * The tree is $CHIP_BOOT_REPAIR_SYSFS if set (a fake one, for tests),
+ * otherwise /sys/bus/usb/devices. Where there is no such tree the calls
+ * return -1, and the caller falls back to libusb.
+ */
+#define FEL_ENUM_PORT_LEN	32
+
+struct fel_enum_device {
+	int busnum;
+	int devnum;
+	char port[FEL_ENUM_PORT_LEN];	/* "bus-port.port...", the sysfs name */
+};
+
+/* Scans the tree at 'root'; returns the number of FEL devices (up to 'max' stored) or -1 */
+int fel_enum_scan(const char *root, struct fel_enum_device *devices, int max);
+
+/* Like fel_enum_scan() of the configured tree, from the cached snapshot when it is current */
+int fel_enum_devices(struct fel_enum_device *devices, int max);
+
+/*
+ * Whether there is a FEL device (on 'port' if not NULL). Also true where
+ * there is no sysfs, so that libusb has the last word.
+ */
+int fel_enum_present(const char *port);
+
+/* Forgets the snapshot, e.g. after changing a fake tree */
+void fel_enum_invalidate(void);
+
+/*
+ * In the child after fork(): lets go of the inherited uevent socket, which
+ * the parent still reads (each uevent reaches only one of them), and
+ * forgets the snapshot. The next call opens a socket of the child's own.
+ */
+void fel_enum_reset(void);
+
+#endif
@@ -1,9 +1,13 @@
 #ifndef _LIBSUNXI_H
 #define _LIBSUNXI_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 const int FEL_NO_PERMISSION = 1001;
 const int FEL_NOT_FOUND = 1002;
 const int FEL_CANNOT_CLAIM_INTERFACE = 1003;
+const int FEL_CANCELLED = 1004;
 
 void throw_exit(int);
 void throw_assert(int);
@@ -15,7 +19,94 @@ int call_main(int argc, char **argv, MAIN_FUNC main_func, char ** returnBuffer);
 /* The fel function */
 int fel(int argc, char **argv, char ** returnBuffer);
 
+/* fel arguments starting with this prefix name an entry of the payload bundle */
+#define LIBSUNXI_PAYLOAD_PREFIX "payload:"
+
+/* Returns the mapped payload data (not a copy), or NULL if there is no such entry */
+const void *libsunxi_find_payload(const char *name, size_t *size);
+
+/*
+ * Host-side block hashes (aw_block_hash) of a bundle entry, one per full
+ * 'block_size' bytes. Computed on the first call and kept, so a helper
+ * thread can compute them before fel needs them. NULL if there is no such
+ * entry. Safe to call from any thread.
+ */
+const uint32_t *libsunxi_payload_hashes(const char *name, size_t block_size, uint32_t *count);
+/* The block size of the hashes of fel's verify and sync commands */
+#define LIBSUNXI_HASH_BLOCK (64 * 1024)
+
+/* Called by fel.c when a write is resumed after a transient USB error */
+void libsunxi_on_retry(uint32_t address, int attempt, int error);
+
+typedef void (*RETRY_FUNC)(void *context, uint32_t address, int attempt, int error);
+/* Route retries of fel calls made by this thread to 'handler' (NULL to stop) */
+void libsunxi_set_retry_handler(RETRY_FUNC handler, void *context);
+
+/* Called by fel.c before each command of a fel call, counting from 0 */
+void libsunxi_on_command(int index, const char *command);
+
+typedef void (*COMMAND_FUNC)(void *context, int index, const char *command);
+/* Route the commands of fel calls made by this thread to 'handler' (NULL to stop) */
+void libsunxi_set_command_handler(COMMAND_FUNC handler, void *context);
+
+/*
+ * Called by fel.c with what it learns about the device: the USB port
+ * ("bus-port.port...") once it is open, the SoC id, and the Security ID
+ * ("sid" command). Whatever is not new is NULL or 0.
+ */
+void libsunxi_on_device(const char *port, uint32_t soc_id, const char *sid);
+
+typedef void (*DEVICE_FUNC)(void *context, const char *port, uint32_t soc_id, const char *sid);
+/* Route the devices of fel calls made by this thread to 'handler' (NULL to stop) */
+void libsunxi_set_device_handler(DEVICE_FUNC handler, void *context);
+
+/* Called by fel.c with the bytes moved by each successful bulk transfer */
+void libsunxi_on_bytes(uint32_t bytes);
+
+typedef void (*BYTES_FUNC)(void *context, uint32_t bytes);
+/* Route the transferred bytes of fel calls made by this thread to 'handler' (NULL to stop) */
+void libsunxi_set_bytes_handler(BYTES_FUNC handler, void *context);
+
+/* The process's stdout, also while a fel call has redirected it (for progress output) */
+int libsunxi_stdout_fd(void);
+/* The process's stderr, also while a fel call has redirected it */
+int libsunxi_stderr_fd(void);
+
+/*
+ * Bulk transfer size and timeout found by "fel tune" for a USB port
+ * ("bus-port.port..."). find returns 0 if the port was never tuned.
+ */
+int libsunxi_find_usb_tuning(const char *port, uint32_t *chunk_size, uint32_t *timeout_ms);
+void libsunxi_set_usb_tuning(const char *port, uint32_t chunk_size, uint32_t timeout_ms);
+
+/*
+ * fel.c's bulk transfers, which the CancelToken of the calling thread (see
+ * CancelToken.h) can end early; LIBUSB_ERROR_INTERRUPTED when it did.
+ */
+struct libusb_device_handle;
+int libsunxi_bulk_transfer(struct libusb_device_handle *usb, unsigned char ep, unsigned char *data,
+			   int length, int *done, unsigned int timeout);
+/* Whether the fel calls of this thread were cancelled; fel.c checks before each command */
+int libsunxi_cancelled(void);
+
 /* From fel.c */
 int fel_main(int argc, char **argv);
+void aw_stream_cleanup(void);
+/* Lets go of the device of a fel session that was left by exit(), so the next one can claim it */
+void aw_session_cleanup(void);
+
+/* Host-only parts of fel.c, usable without a device */
+struct soc_sram_info;
+void *load_file(const char *name, size_t *size);
+void unload_file(const char *name, void *buf);
+#define HEXDUMP_LINE_LEN 76 /* "00000000: " + 16 * "xx " + " " + 16 chars + "\n" */
+size_t hexdump_format(char *out, const uint8_t *buf, uint32_t offset, size_t size);
+uint32_t aw_block_hash(const uint8_t *buf, size_t len);
+uint32_t aw_check_spl_header(const uint8_t *buf, size_t len);
+/* ih_type of a mkimage header (5 firmware, 6 script), 0 if there is none, -1 if not for ARM */
+int get_image_type(const uint8_t *buf, size_t len);
+struct soc_sram_info *aw_find_sram_info(uint32_t soc_id);
+uint32_t *aw_build_spl_thunk(struct soc_sram_info *sram_info, size_t *thunk_size);
+void aw_check_mmu_tt(const uint32_t *tt);
 
 #endif
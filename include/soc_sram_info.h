@@ -0,0 +1,43 @@
+#ifndef _SOC_SRAM_INFO_H
+#define _SOC_SRAM_INFO_H
+
+#include <stdint.h>
+
+/*
+ * The 'sram_swap_buffers' structure is used to describe information about
+ * two buffers in SRAM, the content of which needs to be exchanged before
+ * calling the U-Boot SPL code and then exchanged again before returning
+ * control back to the FEL code from the BROM.
+ */
+
+typedef struct {
+	uint32_t buf1; /* BROM buffer */
+	uint32_t buf2; /* backup storage location */
+	uint32_t size; /* buffer size */
+} sram_swap_buffers;
+
+/*
+ * Each SoC variant may have its own list of memory buffers to be exchanged
+ * and the information about the placement of the thunk code, which handles
+ * the transition of execution from the BROM FEL code to the U-Boot SPL and
+ * back.
+ *
+ * Note: the entries in the 'swap_buffers' tables need to be sorted by 'buf1'
+ * addresses. And the 'buf1' addresses are the BROM data buffers, while 'buf2'
+ * addresses are the intended backup locations.
+ */
+typedef struct soc_sram_info {
+	uint32_t           soc_id;       /* ID of the SoC */
+	uint32_t           spl_addr;     /* SPL load address */
+	uint32_t           scratch_addr; /* A safe place to upload & run code */
+	uint32_t           thunk_addr;   /* Address of the thunk code */
+	uint32_t           thunk_size;   /* Maximal size of the thunk code */
+	uint32_t           needs_l2en;   /* Set the L2EN bit */
+	uint32_t           sid_addr;     /* Security ID (e-fuse) registers, 0 if unknown */
+	sram_swap_buffers *swap_buffers;
+} soc_sram_info;
+
+/* For SoCs without an entry of their own in fel.c's table */
+extern soc_sram_info generic_sram_info;
+
+#endif
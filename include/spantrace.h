@@ -0,0 +1,37 @@
+#ifndef _SPANTRACE_H
+#define _SPANTRACE_H
+
+#include <stdint.h>
+
+/*
+ * Timed spans of a repair, written as Chrome trace events (the JSON array
+ * format, for chrome://tracing or Perfetto). Every span is one complete
+ * ("X") event: microsecond ts and dur with nanosecond decimals, the thread,
+ * and in its args the device tag of that thread, plus the memory range for
+ * spans that have one.
+ *
+ * While no trace is open, span_begin() is a single load and span_end()
+ * returns right away.
+ */
+extern volatile int span_trace_active;
+
+/* Starts writing spans to 'path' (truncated). Returns 0, or -1 with errno set */
+int span_trace_open(const char *path);
+void span_trace_close(void);
+/* The file stays valid JSON for the trace viewers without the closing bracket */
+void span_trace_flush(void);
+uint64_t span_trace_now(void);
+
+/* Pass the result to span_end(); 0 when no trace is open */
+static inline uint64_t span_begin(void)
+{
+	return span_trace_active ? span_trace_now() : 0;
+}
+
+void span_end(uint64_t start, const char *category, const char *name);
+void span_end_range(uint64_t start, const char *category, const char *name,
+		    uint32_t address, uint32_t length);
+/* Tags the later spans of this thread, e.g. with the USB port of its device */
+void span_set_device(const char *device);
+
+#endif
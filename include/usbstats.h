@@ -0,0 +1,82 @@
+#ifndef _USBSTATS_H
+#define _USBSTATS_H
+
+#include <stdint.h>
+
+/*
+ * Counters and latency histograms of the FEL USB traffic, kept for the
+ * life of the process: per FEL operation (the whole request / data / status
+ * round trip, and the status read on its own) and per bulk transfer by
+ * direction and size class.
+ *
+ * The histograms are log-linear like HdrHistogram: 16 buckets per power of
+ * two nanoseconds, so any recorded latency is known to within 1/16.
+ */
+enum usb_stats_op {
+	USB_STATS_VERSION,
+	USB_STATS_READ,
+	USB_STATS_WRITE,
+	USB_STATS_EXEC,
+	USB_STATS_STATUS,
+	USB_STATS_OPS
+};
+
+enum usb_stats_size {
+	USB_STATS_UP_TO_64B,
+	USB_STATS_UP_TO_4K,
+	USB_STATS_UP_TO_64K,
+	USB_STATS_UP_TO_512K,
+	USB_STATS_UP_TO_4M,
+	USB_STATS_OVER_4M,
+	USB_STATS_SIZES
+};
+
+#define USB_STATS_SUB_BUCKETS	16
+#define USB_STATS_BUCKETS	(38 * USB_STATS_SUB_BUCKETS)	/* up to 2^41 ns, about 36 minutes */
+
+struct usb_stats_histogram {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t sum_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t buckets[USB_STATS_BUCKETS];
+};
+
+struct usb_stats {
+	struct usb_stats_histogram ops[USB_STATS_OPS];
+	struct usb_stats_histogram transfers[2][USB_STATS_SIZES];	/* [0] OUT, [1] IN */
+};
+
+extern const char *const usb_stats_op_names[USB_STATS_OPS];
+extern const char *const usb_stats_size_names[USB_STATS_SIZES];
+
+uint64_t usb_stats_now(void);
+/* 'result' is the libusb return code, 'transferred' what moved before it */
+void usb_stats_transfer(int in, uint32_t length, uint32_t transferred, uint64_t ns, int result);
+void usb_stats_op(enum usb_stats_op op, uint32_t length, uint64_t ns, int failed);
+/* Bytes moved by the bulk transfers of the calling thread so far (never reset) */
+uint64_t usb_stats_thread_bytes(void);
+
+/* Bytes per second of all FEL writes so far, round trips included; 0 before the first one */
+double usb_stats_write_rate(void);
+
+/* A consistent copy of everything recorded so far */
+void usb_stats_snapshot(struct usb_stats *stats);
+void usb_stats_reset(void);
+
+/* Upper bound of the bucket holding the p-th percentile (0-100), 0 if empty */
+uint64_t usb_stats_percentile(const struct usb_stats_histogram *histogram, double p);
+/* Lowest and highest value that falls into bucket 'index' */
+uint64_t usb_stats_bucket_low(int index);
+uint64_t usb_stats_bucket_high(int index);
+
+/*
+ * Writes the Prometheus text format (for node_exporter's textfile
+ * collector) to a temporary file renamed over 'path'. Returns 0, or -1 with
+ * errno set.
+ */
+int usb_stats_write_prometheus(const char *path);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _USBTRACE_H
+#define _USBTRACE_H
+
+#include <stdint.h>
+
+/*
+ * Capture of FEL USB sessions. A trace file is a usb_trace_header followed
+ * by usb_trace_record entries (all fields little endian), each followed by
+ * 'transferred' bytes of data if USB_TRACE_DATA is set.
+ *
+ * Transfers of up to USB_TRACE_INLINE_MAX bytes (the AWUC/AWUS framing,
+ * FEL requests and status) always keep their data, so a trace can be decoded
+ * without it; bulk data is kept only in a trace opened with 'payloads'.
+ * Records with endpoint 0 are markers, their data is the fel command line.
+ */
+#define USB_TRACE_MAGIC		"FELTRACE"
+#define USB_TRACE_VERSION	1
+#define USB_TRACE_INLINE_MAX	64
+
+#define USB_TRACE_PAYLOADS	1	/* header: all data was kept */
+#define USB_TRACE_DATA		1	/* record: data follows */
+
+struct usb_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct usb_trace_record {
+	uint64_t timestamp_ns;	/* CLOCK_MONOTONIC, since the trace was opened */
+	uint32_t duration_ns;
+	uint8_t endpoint;	/* with the direction bit, 0 for a marker */
+	uint8_t flags;
+	int16_t result;		/* libusb return code */
+	uint32_t length;	/* requested */
+	uint32_t transferred;
+	uint32_t crc32;		/* of the transferred data */
+} __attribute__((packed));
+
+/* Starts capturing to 'path' (truncated). Returns 0, or -1 with errno set */
+int usb_trace_open(const char *path, int payloads);
+void usb_trace_close(void);
+/* Pass to usb_trace_transfer() as 'start'; 0 when no trace is open */
+uint64_t usb_trace_now(void);
+void usb_trace_transfer(uint64_t start, int endpoint, const void *data,
+			int length, int transferred, int result);
+void usb_trace_mark(const char *text);
+void usb_trace_flush(void);
+
+#endif
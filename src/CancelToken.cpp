@@ -0,0 +1,152 @@
+#include <sys/time.h>
+#include <chrono>
+#include <libusb.h>
+
+extern "C" {
+#include "felenum.h"
+#include "usbstats.h"
+}
+#include "CancelToken.h"
+
+/* How often a waiting transfer looks at the deadline and the port */
+static const unsigned WATCH_MS = 50;
+
+static thread_local CancelToken * currentToken = nullptr;
+
+CancelToken::CancelToken() : isCancelled(false), deadline(0), inFlight(nullptr) {}
+
+void CancelToken::cancel(const std::string & reason) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (isCancelled)
+		return;
+	isCancelled = true;
+	why = reason;
+	if (inFlight)
+		libusb_cancel_transfer(inFlight); // its wait sees it complete as cancelled
+	changed.notify_all();
+}
+
+bool CancelToken::cancelled() {
+	std::lock_guard<std::mutex> guard(lock);
+	return isCancelled;
+}
+
+std::string CancelToken::reason() {
+	std::lock_guard<std::mutex> guard(lock);
+	return why;
+}
+
+void CancelToken::reset() {
+	std::lock_guard<std::mutex> guard(lock);
+	isCancelled = false;
+	why.clear();
+	deadline = 0;
+	deadlineReason.clear();
+	port.clear();
+}
+
+void CancelToken::setDeadline(uint64_t deadline, const std::string & reason) {
+	std::lock_guard<std::mutex> guard(lock);
+	this->deadline = deadline;
+	deadlineReason = reason;
+}
+
+void CancelToken::watchPort(const std::string & port) {
+	std::lock_guard<std::mutex> guard(lock);
+	this->port = port;
+}
+
+bool CancelToken::wait(unsigned ms) {
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait_for(guard, std::chrono::milliseconds(ms), [this] { return isCancelled; });
+	return isCancelled;
+}
+
+/* Cancels the token if its deadline has passed or its board is gone */
+void CancelToken::check() {
+	std::string reason, watched;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (isCancelled)
+			return;
+		if (deadline && usb_stats_now() >= deadline)
+			reason = deadlineReason.empty() ? "Deadline passed" : deadlineReason;
+		watched = port;
+	}
+	if (reason.empty() && !watched.empty() && !fel_enum_present(watched.c_str()))
+		reason = "The board on " + watched + " was unplugged";
+	if (!reason.empty())
+		cancel(reason);
+}
+
+//static
+CancelToken * CancelToken::current() {
+	return currentToken;
+}
+
+//static
+void CancelToken::setCurrent(CancelToken * token) {
+	currentToken = token;
+}
+
+static void LIBUSB_CALL onTransfer(libusb_transfer * transfer) {
+	*(int *)transfer->user_data = 1;
+}
+
+//static
+int CancelToken::bulkTransfer(libusb_device_handle * handle, unsigned char endpoint, unsigned char * data,
+		int length, int * transferred, unsigned timeout) {
+	CancelToken * token = currentToken;
+	if (!token)
+		return libusb_bulk_transfer(handle, endpoint, data, length, transferred, timeout);
+	*transferred = 0;
+	libusb_transfer * transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
+	int completed = 0;
+	libusb_fill_bulk_transfer(transfer, handle, endpoint, data, length, onTransfer, &completed, timeout);
+	int rc;
+	{
+		std::lock_guard<std::mutex> guard(token->lock);
+		rc = token->isCancelled ? LIBUSB_ERROR_INTERRUPTED : libusb_submit_transfer(transfer);
+		if (rc == 0)
+			token->inFlight = transfer;
+	}
+	if (rc != 0) {
+		libusb_free_transfer(transfer);
+		return rc;
+	}
+
+	while (!completed) {
+		struct timeval tv = { 0, WATCH_MS * 1000 };
+		rc = libusb_handle_events_timeout_completed(nullptr, &tv, &completed);
+		if (rc != 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+			/* as libusb_bulk_transfer() does: cancel it and give up on the events */
+			libusb_cancel_transfer(transfer);
+			while (!completed && libusb_handle_events_completed(nullptr, &completed) == 0)
+				;
+			break;
+		}
+		if (!completed)
+			token->check();
+	}
+	{
+		std::lock_guard<std::mutex> guard(token->lock);
+		token->inFlight = nullptr;
+	}
+	if (!completed)
+		return rc; // libusb still has the transfer, it cannot be freed
+
+	*transferred = transfer->actual_length;
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED: rc = 0; break;
+	case LIBUSB_TRANSFER_TIMED_OUT: rc = LIBUSB_ERROR_TIMEOUT; break;
+	case LIBUSB_TRANSFER_STALL: rc = LIBUSB_ERROR_PIPE; break;
+	case LIBUSB_TRANSFER_NO_DEVICE: rc = LIBUSB_ERROR_NO_DEVICE; break;
+	case LIBUSB_TRANSFER_OVERFLOW: rc = LIBUSB_ERROR_OVERFLOW; break;
+	case LIBUSB_TRANSFER_CANCELLED: rc = LIBUSB_ERROR_INTERRUPTED; break;
+	default: rc = LIBUSB_ERROR_IO; break;
+	}
+	libusb_free_transfer(transfer);
+	return rc;
+}
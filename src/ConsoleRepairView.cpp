@@ -0,0 +1,96 @@
+#include <unistd.h>
+#include <iostream>
+#include <sstream>
+
+extern "C" {
+#include "libsunxi.h"
+}
+
+#include "RepairTool.h"
+#include "ConsoleRepairView.h"
+#include "Startup.h"
+
+ConsoleRepairView::ConsoleRepairView() {
+}
+
+/*
+ * The boards of a console attached to chip-boot-repaird: each one gets a
+ * repair when it shows up, and its own view for the progress.
+ */
+class RemoteBoards : public RepairClient::Listener {
+	public:
+		RemoteBoards(RepairClient & client, const std::string & port) : client(client), port(port) {}
+		~RemoteBoards() {
+			for (auto & view : views)
+				delete view.second;
+		}
+
+		RepairObserver * observer(const std::string & port) {
+			auto view = views.find(port);
+			return view == views.end() ? nullptr : view->second;
+		}
+
+		void onBoard(const std::string & port, bool present) {
+			if (!present || (!this->port.empty() && port != this->port))
+				return;
+			ConsoleRepairView *& view = views[port];
+			if (!view) {
+				view = new ConsoleRepairView();
+				view->onDevice(port, "");
+			}
+			std::string error;
+			if (!client.repair(port, &error))
+				view->onNotify("Cannot repair", 0, &error);
+		}
+
+	private:
+		RepairClient & client;
+		std::string port;
+		std::map<std::string, ConsoleRepairView *> views;
+};
+
+/* Repairs every board chip-boot-repaird finds (on 'port' if set), until the daemon goes away */
+void ConsoleRepairView::remote(RepairClient & client) {
+	std::cerr << "Repairing through chip-boot-repaird" << std::endl;
+	RemoteBoards boards(client, port);
+	client.listen(&boards);
+	std::cerr << "Lost the connection to chip-boot-repaird" << std::endl;
+}
+
+void ConsoleRepairView::main() {
+	RepairClient client;
+	if (client.connect()) {
+		remote(client);
+		return;
+	}
+	if (geteuid() != 0) {
+		std::cerr << "You need to be root to run the C.H.I.P repair tool" << std::endl;
+		return;
+	}
+	Startup::wait();
+	RepairTool repairTool;
+	repairTool.addObserver(this);
+	repairTool.setPort(port);
+	if (!port.empty())
+		device = port;
+	repairTool.repairLoop(true);
+}
+
+/* Also called from inside fel calls, which redirect stdout */
+void ConsoleRepairView::onNotify(const std::string & progressText, float progressFraction, const std::string * details) {
+	std::ostringstream line;
+	if (!device.empty())
+		line << device << " ";
+	line << "[" << (int)(progressFraction * 100) << "%] " << progressText;
+	if (details && !details->empty())
+		line << " - " << *details;
+	line << std::endl;
+	std::cout.flush();
+	std::string text = line.str();
+	if (write(libsunxi_stdout_fd(), text.data(), text.size()) < 0)
+		return; // nowhere left to report it
+}
+
+void ConsoleRepairView::onDevice(const std::string & port, const std::string & sid) {
+	device = sid.empty() ? port : port + " " + sid;
+}
@@ -0,0 +1,799 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <libusb.h>
+
+#include "portable_endian.h"
+extern "C" {
+#include "libsunxi.h"
+#include "soc_sram_info.h"
+#include "usbstats.h"
+#include "usbtrace.h"
+}
+#include "FelAsync.h"
+#include "RepairPlan.h"
+#include "UsbTuning.h"
+
+/* The loop looks at its tasks at least this often, where libusb cannot be woken up */
+static const unsigned TICK_MS = 10;
+
+/* From fel.c */
+static const int AW_USB_READ = 0x11;
+static const int AW_USB_WRITE = 0x12;
+static const int AW_FEL_VERSION = 0x001;
+static const int AW_FEL_1_WRITE = 0x101;
+static const int AW_FEL_1_EXEC = 0x102;
+static const int AW_FEL_1_READ = 0x103;
+static const int AW_USB_MAX_BULK_SEND = 4 * 1024 * 1024;
+static const unsigned AW_USB_TIMEOUT = 60000;
+static const uint32_t SPL_LEN_LIMIT = 0x8000;
+static const unsigned SPL_WAIT_MS = 250;
+static const uint32_t MMU_TT_SIZE = 16 * 1024;
+static const uint32_t DRAM_BASE = 0x40000000;
+static const uint32_t DRAM_SIZE = 0x80000000;
+/* ${U-BOOT}/include/image.h */
+static const int IH_TYPE_FIRMWARE = 5;
+static const int IH_TYPE_SCRIPT = 6;
+static const size_t IH_HEADER_SIZE = 64;
+
+/* The code snippets of fel.c, in host order */
+static const uint32_t L2_ENABLE_CODE[] = {
+	0xee112f30, /* mrc        15, 0, r2, cr1, cr0, {1}  */
+	0xe3822002, /* orr        r2, r2, #2                */
+	0xee012f30, /* mcr        15, 0, r2, cr1, cr0, {1}  */
+	0xe12fff1e, /* bx         lr                        */
+};
+static const uint32_t TTBR0_CODE[] = {
+	0xee122f10, /* mrc        15, 0, r2, cr2, cr0, {0}  */
+	0xe58f2008, /* str        r2, [pc, #8]              */
+	0xe12fff1e, /* bx         lr                        */
+};
+static const uint32_t SCTLR_CODE[] = {
+	0xee112f10, /* mrc        15, 0, r2, cr1, cr0, {0}  */
+	0xe58f2008, /* str        r2, [pc, #8]              */
+	0xe12fff1e, /* bx         lr                        */
+};
+static const uint32_t MMU_DISABLE_CODE[] = {
+	0xee110f10, /* mrc        15, 0, r0, cr1, cr0, {0}  */
+	0xe3c00001, /* bic        r0, r0, #1                */
+	0xe3c00a01, /* bic        r0, r0, #4096             */
+	0xe3c00b02, /* bic        r0, r0, #2048             */
+	0xee010f10, /* mcr        15, 0, r0, cr1, cr0, {0}  */
+	0xe12fff1e, /* bx         lr                        */
+};
+static const uint32_t MMU_ENABLE_CODE[] = {
+	0xe3a00000, /* mov        r0, #0                    */
+	0xee080f17, /* mcr        15, 0, r0, cr8, cr7, {0}  */
+	0xee070f15, /* mcr        15, 0, r0, cr7, cr5, {0}  */
+	0xee070fd5, /* mcr        15, 0, r0, cr7, cr5, {6}  */
+	0xf57ff04f, /* dsb        sy                        */
+	0xf57ff06f, /* isb        sy                        */
+	0xee110f10, /* mrc        15, 0, r0, cr1, cr0, {0}  */
+	0xe3800001, /* orr        r0, r0, #1                */
+	0xe3800a01, /* orr        r0, r0, #4096             */
+	0xe3800b02, /* orr        r0, r0, #2048             */
+	0xee010f10, /* mcr        15, 0, r0, cr1, cr0, {0}  */
+	0xe12fff1e, /* bx         lr                        */
+};
+#define CODE(code) code, sizeof(code) / sizeof(code[0])
+
+static void putLe32(uint8_t * p, uint32_t value) {
+	value = htole32(value);
+	memcpy(p, &value, sizeof(value));
+}
+
+static std::string hex(uint32_t value) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "0x%08X", value);
+	return buf;
+}
+
+FelLoop::FelLoop() : context(nullptr), started(false), stopping(false) {
+	pthread_mutex_init(&lock, nullptr);
+}
+
+FelLoop::~FelLoop() {
+	stop();
+	pthread_mutex_destroy(&lock);
+}
+
+bool FelLoop::start() {
+	if (started)
+		return true;
+	if (libusb_init(&context) != 0)
+		return false;
+	stopping = false;
+	started = pthread_create(&thread, nullptr, FelLoop::run, this) == 0;
+	if (!started) {
+		libusb_exit(context);
+		context = nullptr;
+	}
+	return started;
+}
+
+void FelLoop::stop() {
+	if (!started)
+		return;
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_mutex_unlock(&lock);
+	wake();
+	pthread_join(thread, nullptr);
+	started = false;
+	tasks.clear();
+	timers.clear();
+	libusb_exit(context);
+	context = nullptr;
+}
+
+void FelLoop::post(Task task) {
+	pthread_mutex_lock(&lock);
+	tasks.push_back(task);
+	pthread_mutex_unlock(&lock);
+	wake();
+}
+
+void FelLoop::after(unsigned ms, Task task) {
+	pthread_mutex_lock(&lock);
+	timers.insert(std::make_pair(Clock::now() + std::chrono::milliseconds(ms), task));
+	pthread_mutex_unlock(&lock);
+	wake();
+}
+
+/* Cuts the event handling of the loop short, with a libusb that can (1.0.21 on) */
+void FelLoop::wake() {
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(context);
+#endif
+}
+
+//static
+void * FelLoop::run(void * thisObj) {
+	FelLoop * loop = (FelLoop *)thisObj;
+	pthread_mutex_lock(&loop->lock);
+	while (!loop->stopping) {
+		std::deque<Task> due;
+		due.swap(loop->tasks);
+		Clock::time_point now = Clock::now();
+		while (!loop->timers.empty() && loop->timers.begin()->first <= now) {
+			due.push_back(loop->timers.begin()->second);
+			loop->timers.erase(loop->timers.begin());
+		}
+		Clock::duration wait = std::chrono::milliseconds(TICK_MS);
+		if (!due.empty())
+			wait = Clock::duration::zero(); // what they start may complete right away
+		else if (!loop->timers.empty() && loop->timers.begin()->first - now < wait)
+			wait = loop->timers.begin()->first - now;
+		pthread_mutex_unlock(&loop->lock);
+
+		for (auto & task : due)
+			task();
+		long long us = std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+		struct timeval tv = { (time_t)(us / 1000000), (suseconds_t)(us % 1000000) };
+		libusb_handle_events_timeout_completed(loop->context, &tv, nullptr);
+		pthread_mutex_lock(&loop->lock);
+	}
+	pthread_mutex_unlock(&loop->lock);
+	return nullptr;
+}
+
+FelDevice::FelDevice(FelLoop & loop) : loop(loop), handle(nullptr), transfer(nullptr), endpointIn(0),
+	endpointOut(0), chunkSize(AW_USB_MAX_BULK_SEND), timeoutMs(AW_USB_TIMEOUT), soc(0), sramInfo(nullptr),
+	generation(0), cancelled(false), inFlight(false), traceStart(0), statsStart(0), opStats(0),
+	opLength(0), opStart(0), source(nullptr), plan(nullptr), stepIndex(0) {}
+
+FelDevice::~FelDevice() {
+	close();
+}
+
+/* "bus-port.port...", as fel.c names ports */
+static std::string portPath(libusb_device * device) {
+	uint8_t ports[8];
+	int n = libusb_get_port_numbers(device, ports, sizeof(ports));
+	std::string path = std::to_string(libusb_get_bus_number(device)) + "-";
+	if (n <= 0)
+		return path + "0";
+	for (int i = 0; i < n; i++)
+		path += (i ? "." : "") + std::to_string(ports[i]);
+	return path;
+}
+
+int FelDevice::open(const std::string & port) {
+	close();
+	libusb_device ** list;
+	if (!loop.context)
+		return LIBUSB_ERROR_NOT_SUPPORTED; // the loop was not started
+	ssize_t n = libusb_get_device_list(loop.context, &list);
+	if (n < 0)
+		return (int)n;
+	libusb_device * found = nullptr;
+	for (ssize_t i = 0; i < n && !found; i++) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(list[i], &desc) == 0 && desc.idVendor == 0x1f3a &&
+				desc.idProduct == 0xefe8 && (port.empty() || portPath(list[i]) == port))
+			found = list[i];
+	}
+	int rc = found ? libusb_open(found, &handle) : FEL_NOT_FOUND;
+	if (found)
+		devicePort = portPath(found);
+	libusb_free_device_list(list, 1);
+	if (rc != 0) {
+		handle = nullptr;
+		return rc;
+	}
+
+	rc = libusb_claim_interface(handle, 0);
+#if defined(__linux__)
+	if (rc != 0) {
+		libusb_detach_kernel_driver(handle, 0);
+		rc = libusb_claim_interface(handle, 0);
+	}
+#endif
+	struct libusb_config_descriptor * config;
+	if (rc == 0 && libusb_get_active_config_descriptor(libusb_get_device(handle), &config) == 0) {
+		for (int i = 0; i < config->bNumInterfaces; i++) {
+			const struct libusb_interface & interface = config->interface[i];
+			for (int j = 0; j < interface.num_altsetting; j++) {
+				const struct libusb_interface_descriptor & setting = interface.altsetting[j];
+				for (int k = 0; k < setting.bNumEndpoints; k++) {
+					const struct libusb_endpoint_descriptor & ep = setting.endpoint[k];
+					if ((ep.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+						continue;
+					if ((ep.bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+						endpointIn = ep.bEndpointAddress;
+					else
+						endpointOut = ep.bEndpointAddress;
+				}
+			}
+		}
+		libusb_free_config_descriptor(config);
+	}
+	transfer = rc == 0 ? libusb_alloc_transfer(0) : nullptr;
+	if (!transfer || !endpointIn || !endpointOut) {
+		close();
+		return FEL_CANNOT_CLAIM_INTERFACE;
+	}
+
+	UsbTuning::Values tuning;
+	chunkSize = AW_USB_MAX_BULK_SEND;
+	timeoutMs = AW_USB_TIMEOUT;
+	if (UsbTuning::find(devicePort, tuning)) {
+		chunkSize = tuning.chunkSize;
+		timeoutMs = tuning.timeoutMs;
+	}
+	soc = 0;
+	sramInfo = nullptr;
+	return 0;
+}
+
+void FelDevice::close() {
+	if (transfer)
+		libusb_free_transfer(transfer);
+	transfer = nullptr;
+	if (handle) {
+		libusb_release_interface(handle, 0);
+		libusb_close(handle);
+	}
+	handle = nullptr;
+	endpointIn = endpointOut = 0;
+}
+
+void FelDevice::begin(Done done, Next first) {
+	current = done;
+	cancelled = false;
+	cancelReason = "Cancelled";
+	errorText.clear();
+	unsigned op = ++generation;
+	loop.post([this, first, op] {
+		if (op != generation)
+			return;
+		if (!handle)
+			fail(LIBUSB_ERROR_NO_DEVICE, "No FEL device is open");
+		else
+			first();
+	});
+}
+
+void FelDevice::finish(int error) {
+	Done done;
+	done.swap(current);
+	generation++;
+	unloadSource();
+	tt.clear();
+	if (done)
+		done(error);
+}
+
+void FelDevice::fail(int error, const std::string & text) {
+	errorText = text;
+	finish(error);
+}
+
+void FelDevice::cancel() {
+	cancelled = true;
+	unsigned op = generation;
+	loop.post([this, op] {
+		if (op == generation && current)
+			stop("Cancelled");
+	});
+}
+
+/* On the loop thread: ends the operation in flight with LIBUSB_ERROR_INTERRUPTED and 'reason' */
+void FelDevice::stop(const std::string & reason) {
+	cancelled = true;
+	cancelReason = reason;
+	if (inFlight)
+		libusb_cancel_transfer(transfer); // completes as cancelled
+	else
+		fail(LIBUSB_ERROR_INTERRUPTED, reason); // between transfers: waiting for the SPL
+}
+
+void FelDevice::version(Done done) {
+	begin(done, [this] { felVersion([this] { finish(0); }); });
+}
+
+void FelDevice::read(uint32_t address, void * buf, size_t length, Done done) {
+	begin(done, [=] { felRead(address, buf, length, [this] { finish(0); }); });
+}
+
+void FelDevice::write(uint32_t address, const void * buf, size_t length, Done done) {
+	begin(done, [=] { felWrite(address, buf, length, [this] { finish(0); }); });
+}
+
+void FelDevice::execute(uint32_t address, Done done) {
+	begin(done, [=] { felExecute(address, [this] { finish(0); }); });
+}
+
+void FelDevice::spl(const uint8_t * buf, size_t length, Done done) {
+	begin(done, [=] { runSpl(buf, length, [this] { finish(0); }); });
+}
+
+void FelDevice::run(const RepairPlan & steps, Done done, StepStarted started) {
+	plan = &steps;
+	stepStarted = started;
+	begin(done, [this] { runStep(0); });
+}
+
+/* One bulk transfer of up to a chunk, then the rest of 'length' */
+void FelDevice::bulk(int endpoint, uint8_t * data, size_t length, Next next) {
+	if (length == 0) {
+		next();
+		return;
+	}
+	if (cancelled) {
+		fail(LIBUSB_ERROR_INTERRUPTED, "Cancelled");
+		return;
+	}
+	int chunk = length < (size_t)chunkSize ? length : chunkSize;
+	transferred = [=](int done) { bulk(endpoint, data + done, length - done, next); };
+	libusb_fill_bulk_transfer(transfer, handle, endpoint, data, chunk, FelDevice::onTransfer, this, timeoutMs);
+	traceStart = usb_trace_now();
+	statsStart = usb_stats_now();
+	int rc = libusb_submit_transfer(transfer);
+	if (rc != 0) {
+		usb_stats_transfer(endpoint & LIBUSB_ENDPOINT_IN, chunk, 0, usb_stats_now() - statsStart, rc);
+		usb_trace_transfer(traceStart, endpoint, data, chunk, 0, rc);
+		fail(rc, std::string("USB transfer failed: ") + libusb_error_name(rc));
+		return;
+	}
+	inFlight = true;
+}
+
+//static
+void FelDevice::onTransfer(libusb_transfer * transfer) {
+	((FelDevice *)transfer->user_data)->completed();
+}
+
+void FelDevice::completed() {
+	inFlight = false;
+	int rc;
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED: rc = 0; break;
+	case LIBUSB_TRANSFER_TIMED_OUT: rc = LIBUSB_ERROR_TIMEOUT; break;
+	case LIBUSB_TRANSFER_STALL: rc = LIBUSB_ERROR_PIPE; break;
+	case LIBUSB_TRANSFER_NO_DEVICE: rc = LIBUSB_ERROR_NO_DEVICE; break;
+	case LIBUSB_TRANSFER_OVERFLOW: rc = LIBUSB_ERROR_OVERFLOW; break;
+	case LIBUSB_TRANSFER_CANCELLED: rc = LIBUSB_ERROR_INTERRUPTED; break;
+	default: rc = LIBUSB_ERROR_IO; break;
+	}
+	int done = rc == 0 ? transfer->actual_length : 0;
+	usb_stats_transfer(transfer->endpoint & LIBUSB_ENDPOINT_IN, transfer->length, done,
+			   usb_stats_now() - statsStart, rc);
+	usb_trace_transfer(traceStart, transfer->endpoint, transfer->buffer, transfer->length, done, rc);
+	if (rc == LIBUSB_ERROR_INTERRUPTED)
+		fail(rc, cancelReason);
+	else if (rc != 0)
+		fail(rc, std::string("USB transfer failed: ") + libusb_error_name(rc));
+	else if (done == 0)
+		fail(LIBUSB_ERROR_IO, "USB transfer moved nothing");
+	else {
+		std::function<void(int)> then;
+		then.swap(transferred); // the next bulk() sets it again
+		then(done);
+	}
+}
+
+/* The AWUC / data / AWUS framing of aw_usb_write() and aw_usb_read() */
+static void fillUsbRequest(uint8_t * request, int type, uint32_t length) {
+	memset(request, 0, 32);
+	memcpy(request, "AWUC", 4);
+	putLe32(request + 8, length);
+	putLe32(request + 12, 0x0c000000);
+	request[16] = type & 0xff;
+	request[17] = type >> 8;
+	putLe32(request + 18, length);
+}
+
+void FelDevice::usbResponse(Next next) {
+	bulk(endpointIn, responseBuf, sizeof(responseBuf), [=] {
+		if (memcmp(responseBuf, "AWUS", 4) != 0)
+			fail(PROTOCOL_ERROR, "FEL: bad USB response");
+		else
+			next();
+	});
+}
+
+void FelDevice::usbWrite(const void * data, size_t length, Next next) {
+	fillUsbRequest(usbRequest, AW_USB_WRITE, length);
+	bulk(endpointOut, usbRequest, sizeof(usbRequest), [=] {
+		bulk(endpointOut, (uint8_t *)data, length, [=] { usbResponse(next); });
+	});
+}
+
+void FelDevice::usbRead(void * data, size_t length, Next next) {
+	fillUsbRequest(usbRequest, AW_USB_READ, length);
+	bulk(endpointOut, usbRequest, sizeof(usbRequest), [=] {
+		bulk(endpointIn, (uint8_t *)data, length, [=] { usbResponse(next); });
+	});
+}
+
+void FelDevice::sendRequest(int type, uint32_t address, uint32_t length, Next next) {
+	opStart = usb_stats_now();
+	opLength = type == AW_FEL_VERSION ? sizeof(reply) : length;
+	opStats = type == AW_FEL_VERSION ? USB_STATS_VERSION : type == AW_FEL_1_WRITE ? USB_STATS_WRITE :
+		  type == AW_FEL_1_EXEC ? USB_STATS_EXEC : USB_STATS_READ;
+	memset(felRequest, 0, sizeof(felRequest));
+	putLe32(felRequest, type);
+	putLe32(felRequest + 4, address);
+	putLe32(felRequest + 8, length);
+	usbWrite(felRequest, sizeof(felRequest), next);
+}
+
+void FelDevice::readStatus(Next next) {
+	uint64_t start = usb_stats_now();
+	usbRead(felStatus, sizeof(felStatus), [=] {
+		uint64_t end = usb_stats_now();
+		usb_stats_op(USB_STATS_STATUS, sizeof(felStatus), end - start, 0);
+		usb_stats_op((enum usb_stats_op)opStats, opLength, end - opStart, 0);
+		next();
+	});
+}
+
+void FelDevice::felVersion(Next next) {
+	sendRequest(AW_FEL_VERSION, 0, 0, [=] {
+		usbRead(reply, sizeof(reply), [=] {
+			readStatus([=] {
+				uint32_t id;
+				memcpy(&id, reply + 8, sizeof(id));
+				soc = (le32toh(id) >> 8) & 0xFFFF;
+				sramInfo = aw_find_sram_info(soc);
+				if (!sramInfo)
+					sramInfo = &generic_sram_info;
+				next();
+			});
+		});
+	});
+}
+
+void FelDevice::felRead(uint32_t address, void * buf, size_t length, Next next) {
+	sendRequest(AW_FEL_1_READ, address, length, [=] {
+		usbRead(buf, length, [=] { readStatus(next); });
+	});
+}
+
+void FelDevice::felWrite(uint32_t address, const void * buf, size_t length, Next next) {
+	sendRequest(AW_FEL_1_WRITE, address, length, [=] {
+		usbWrite(buf, length, [=] { readStatus(next); });
+	});
+}
+
+void FelDevice::felExecute(uint32_t address, Next next) {
+	sendRequest(AW_FEL_1_EXEC, address, 0, [=] { readStatus(next); });
+}
+
+/* Uploads one of the code snippets to scratch SRAM and calls it */
+void FelDevice::runCode(const uint32_t * code, size_t count, Next next) {
+	scratch.resize(count * 4);
+	for (size_t i = 0; i < count; i++)
+		putLe32(scratch.data() + i * 4, code[i]);
+	felWrite(sramInfo->scratch_addr, scratch.data(), scratch.size(), [=] {
+		felExecute(sramInfo->scratch_addr, next);
+	});
+}
+
+/* Runs a snippet that stores a register after its 3 instructions, and reads it into 'word' */
+void FelDevice::readRegister(const uint32_t * code, size_t count, uint32_t * word, Next next) {
+	runCode(code, count, [=] {
+		felRead(sramInfo->scratch_addr + 0x14, word, sizeof(*word), [=] {
+			*word = le32toh(*word);
+			next();
+		});
+	});
+}
+
+/*
+ * aw_fel_write_and_execute_spl() and the U-Boot image part of
+ * aw_fel_process_spl_and_uboot(). The stack pointers are not read, fel.c
+ * only prints them.
+ */
+void FelDevice::runSpl(const uint8_t * buf, size_t length, Next next) {
+	felVersion([=] {
+		uint32_t splLength;
+		if (!sramInfo->swap_buffers) {
+			fail(PROTOCOL_ERROR, "SPL: Unsupported SoC type");
+			return;
+		}
+		try {
+			splLength = aw_check_spl_header(buf, length);
+		} catch (...) {
+			fail(PROTOCOL_ERROR, "SPL: bad eGON header");
+			return;
+		}
+		Next written = [=] {
+			if (length > SPL_LEN_LIMIT)
+				writeUboot(buf + SPL_LEN_LIMIT, length - SPL_LEN_LIMIT, next);
+			else
+				next();
+		};
+		Next backup = [=] { backupMmu([=] { loadSpl(buf, splLength, written); }); };
+		if (sramInfo->needs_l2en)
+			runCode(CODE(L2_ENABLE_CODE), backup);
+		else
+			backup();
+	});
+}
+
+/* aw_backup_and_disable_mmu(): keeps the translation table in 'tt', empty if the MMU is off */
+void FelDevice::backupMmu(Next next) {
+	tt.clear();
+	readRegister(CODE(TTBR0_CODE), &words[0], [=] {
+		readRegister(CODE(SCTLR_CODE), &words[1], [=] {
+			uint32_t ttbr0 = words[0], sctlr = words[1];
+			if (!(sctlr & 1)) {
+				next();
+				return;
+			}
+			if ((sctlr >> 28) & 1) {
+				fail(PROTOCOL_ERROR, "TEX remap is enabled!");
+				return;
+			}
+			if (ttbr0 & 0x3FFF) {
+				fail(PROTOCOL_ERROR, "Unexpected TTBR0 (" + hex(ttbr0) + ")");
+				return;
+			}
+			tt.resize(MMU_TT_SIZE / 4);
+			felRead(ttbr0, tt.data(), MMU_TT_SIZE, [=] {
+				for (auto & entry : tt)
+					entry = le32toh(entry);
+				try {
+					aw_check_mmu_tt(tt.data());
+				} catch (...) {
+					fail(PROTOCOL_ERROR, "MMU: unexpected translation table");
+					return;
+				}
+				runCode(CODE(MMU_DISABLE_CODE), next);
+			});
+		});
+	});
+}
+
+/* Writes the SPL around the BROM buffers it would overwrite, then the thunk that runs it */
+void FelDevice::loadSpl(const uint8_t * buf, uint32_t splLength, Next next) {
+	sram_swap_buffers * swap = sramInfo->swap_buffers;
+	uint32_t limit = SPL_LEN_LIMIT, address = sramInfo->spl_addr, left = splLength;
+	pieces.clear();
+	for (size_t i = 0; swap[i].size; i++) {
+		if (swap[i].buf2 >= sramInfo->spl_addr && swap[i].buf2 < sramInfo->spl_addr + limit)
+			limit = swap[i].buf2 - sramInfo->spl_addr;
+		if (left > 0 && address < swap[i].buf1) {
+			uint32_t n = swap[i].buf1 - address < left ? swap[i].buf1 - address : left;
+			pieces.push_back(Piece { buf, address, n });
+			address += n;
+			buf += n;
+			left -= n;
+		}
+		if (left > 0 && address == swap[i].buf1) {
+			uint32_t n = swap[i].size < left ? swap[i].size : left;
+			pieces.push_back(Piece { buf, swap[i].buf2, n });
+			address += n;
+			buf += n;
+			left -= n;
+		}
+	}
+	if (sramInfo->thunk_addr < limit)
+		limit = sramInfo->thunk_addr;
+	if (splLength > limit) {
+		fail(PROTOCOL_ERROR, "SPL: too large (need " + std::to_string(splLength) + ", have " +
+			std::to_string(limit) + ")");
+		return;
+	}
+	if (left > 0)
+		pieces.push_back(Piece { buf, address, left });
+	writePieces(0, [=] { startSpl(next); });
+}
+
+void FelDevice::writePieces(size_t index, Next next) {
+	if (index == pieces.size()) {
+		next();
+		return;
+	}
+	felWrite(pieces[index].address, pieces[index].data, pieces[index].length, [=] { writePieces(index + 1, next); });
+}
+
+void FelDevice::startSpl(Next next) {
+	size_t size;
+	uint32_t * thunk;
+	try {
+		thunk = aw_build_spl_thunk(sramInfo, &size);
+	} catch (...) {
+		fail(PROTOCOL_ERROR, "SPL: the thunk does not fit");
+		return;
+	}
+	scratch.assign((uint8_t *)thunk, (uint8_t *)thunk + size);
+	free(thunk);
+	felWrite(sramInfo->thunk_addr, scratch.data(), scratch.size(), [=] {
+		felExecute(sramInfo->thunk_addr, [=] {
+			/* fel.c's workaround, as a timer: the loop serves the other devices meanwhile */
+			unsigned op = generation;
+			loop.after(SPL_WAIT_MS, [=] {
+				if (op != generation)
+					return;
+				felRead(sramInfo->spl_addr + 4, reply, 8, [=] {
+					if (memcmp(reply, "eGON.FEL", 8) != 0) {
+						fail(PROTOCOL_ERROR, "SPL: failure code '" + std::string((char *)reply, 8) + "'");
+						return;
+					}
+					restoreMmu(next);
+				});
+			});
+		});
+	});
+}
+
+/* aw_restore_and_enable_mmu() */
+void FelDevice::restoreMmu(Next next) {
+	if (tt.empty()) {
+		next();
+		return;
+	}
+	readRegister(CODE(TTBR0_CODE), &words[0], [=] {
+		for (uint32_t i = DRAM_BASE >> 20; i < ((uint64_t)DRAM_BASE + DRAM_SIZE) >> 20; i++) {
+			tt[i] &= ~((7 << 12) | (1 << 3) | (1 << 2));
+			tt[i] |= (1 << 12);
+		}
+		tt[0xFFF] &= ~((7 << 12) | (1 << 3) | (1 << 2));
+		tt[0xFFF] |= (1 << 12) | (1 << 3) | (1 << 2);
+		for (auto & entry : tt)
+			entry = htole32(entry);
+		felWrite(words[0], tt.data(), MMU_TT_SIZE, [=] {
+			runCode(CODE(MMU_ENABLE_CODE), [=] {
+				tt.clear();
+				next();
+			});
+		});
+	});
+}
+
+/* aw_fel_write_uboot_image() */
+void FelDevice::writeUboot(const uint8_t * buf, size_t length, Next next) {
+	if (length <= IH_HEADER_SIZE) {
+		next();
+		return;
+	}
+	if (get_image_type(buf, length) != IH_TYPE_FIRMWARE) {
+		fail(PROTOCOL_ERROR, "Invalid U-Boot image");
+		return;
+	}
+	uint32_t size, address;
+	memcpy(&size, buf + 12, sizeof(size));
+	memcpy(&address, buf + 16, sizeof(address));
+	size = be32toh(size);
+	address = be32toh(address);
+	if (size != length - IH_HEADER_SIZE) {
+		fail(PROTOCOL_ERROR, "U-Boot image data size mismatch");
+		return;
+	}
+	felWrite(address, buf + IH_HEADER_SIZE, size, next);
+}
+
+/* pass_fel_information(): the script address for a sunxi SPL (header version 1) */
+void FelDevice::passFelInformation(uint32_t scriptAddress, Next next) {
+	Next pass = [=] {
+		felRead(sramInfo->spl_addr + 0x14, reply, 4, [=] {
+			if (memcmp(reply, "SPL", 3) != 0 || reply[3] != 1) {
+				next();
+				return;
+			}
+			putLe32((uint8_t *)&words[0], scriptAddress);
+			felWrite(sramInfo->spl_addr + 0x18, &words[0], sizeof(words[0]), next);
+		});
+	};
+	if (sramInfo)
+		pass();
+	else
+		felVersion(pass);
+}
+
+void FelDevice::unloadSource() {
+	if (source)
+		unload_file(sourceName.c_str(), source);
+	source = nullptr;
+}
+
+/* The fel command of a plan step; RepairPlan::parse() has checked it */
+void FelDevice::runStep(size_t index) {
+	unloadSource();
+	if (index == plan->steps().size()) {
+		finish(0);
+		return;
+	}
+	const RepairPlan::Step & step = plan->steps()[index];
+	const std::vector<std::string> & command = step.command;
+	Next next = [this, index] { runStep(index + 1); };
+	if (stepStarted)
+		stepStarted(index);
+	stepIndex = index;
+	unsigned op = generation;
+	unsigned ms = RepairPlan::deadlineMs(step, usb_stats_write_rate());
+	loop.after(ms, [this, op, index, ms] {
+		if (op == generation && stepIndex == index && current)
+			stop("Step " + std::to_string(index + 1) + " (" + plan->steps()[index].op + ") took longer than " +
+				std::to_string(ms) + " ms");
+	});
+
+	if (step.op == "tune") {
+		next();
+		return;
+	}
+	if (step.op == "exec") {
+		felExecute(strtoul(command[1].c_str(), nullptr, 0), next);
+		return;
+	}
+	if (step.op == "fill") {
+		scratch.assign(strtoul(command[2].c_str(), nullptr, 0), (uint8_t)strtoul(command[3].c_str(), nullptr, 0));
+		felWrite(strtoul(command[1].c_str(), nullptr, 0), scratch.data(), scratch.size(), next);
+		return;
+	}
+
+	size_t size;
+	try {
+		source = load_file(command.back().c_str(), &size);
+	} catch (...) {
+		fail(PROTOCOL_ERROR, "Cannot load " + command.back());
+		return;
+	}
+	sourceName = command.back();
+	const uint8_t * data = (const uint8_t *)source;
+	if (step.op == "spl") {
+		runSpl(data, size, next);
+		return;
+	}
+	uint32_t address = strtoul(command[1].c_str(), nullptr, 0);
+	if (step.op == "write") {
+		felWrite(address, data, size, [=] {
+			if (get_image_type(data, size) == IH_TYPE_SCRIPT)
+				passFelInformation(address, next);
+			else
+				next();
+		});
+		return;
+	}
+	scratch.resize(size);
+	felRead(address, scratch.data(), size, [=] {
+		if (memcmp(scratch.data(), data, size) != 0)
+			fail(PROTOCOL_ERROR, "Verify failed at " + hex(address));
+		else
+			next();
+	});
+}
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <gtk/gtk.h>
+
+extern "C" {
+#include "felenum.h"
+}
+#include "GtkDashboardView.h"
+#include "GtkRepairView.h"
+#include "Startup.h"
+
+/* How often the tiles that changed are redrawn */
+static const guint RENDER_MS = 100;
+/* Looking for boards every this many redraws */
+static const unsigned SCAN_TICKS = 5;
+static const int MAX_BOARDS = 64;
+static const guint COLUMNS = 4;
+
+static const std::string READY = "Ready";
+
+GtkDashboardView::Tile::Tile(GtkDashboardView * view, const std::string & port) : view(view), port(port),
+	thread(nullptr), running(false), dirty(true), phase(READY), fraction(0), done(0), total(0),
+	rateStart(0), rateBytes(0), rate(0), present(true) {
+	tool.setPort(port);
+	tool.addObserver(this);
+}
+
+void GtkDashboardView::Tile::onNotify(const std::string & progressText, float progressFraction, const std::string * details) {
+	g_mutex_lock(&view->lock);
+	phase = progressText;
+	fraction = progressFraction;
+	this->details = details ? *details : "";
+	dirty = true;
+	g_mutex_unlock(&view->lock);
+}
+
+void GtkDashboardView::Tile::onDevice(const std::string & port, const std::string & sid) {
+	g_mutex_lock(&view->lock);
+	this->sid = sid;
+	dirty = true;
+	g_mutex_unlock(&view->lock);
+}
+
+void GtkDashboardView::Tile::onBytes(uint64_t done, uint64_t total) {
+	gint64 now = g_get_monotonic_time();
+	g_mutex_lock(&view->lock);
+	this->done = done;
+	this->total = total;
+	if (!rateStart) {
+		rateStart = now;
+		rateBytes = done;
+	} else if (now > rateStart) {
+		rate = (done - rateBytes) * 1e6 / (now - rateStart);
+	}
+	dirty = true;
+	g_mutex_unlock(&view->lock);
+}
+
+//static
+bool GtkDashboardView::available() {
+	struct fel_enum_device devices[1];
+	return fel_enum_devices(devices, 1) >= 0;
+}
+
+//static
+gpointer GtkDashboardView::runRepair(gpointer tileObj) {
+	Tile * tile = (Tile *)tileObj;
+	tile->view->finished(tile, tile->tool.repair(false));
+	return nullptr;
+}
+
+void GtkDashboardView::finished(Tile * tile, bool ok, const std::string * details) {
+	g_mutex_lock(&lock);
+	tile->result = ok ? "Repaired" : "Not repaired";
+	if (details)
+		tile->details = *details;
+	tile->running = false;
+	tile->dirty = true;
+	g_mutex_unlock(&lock);
+}
+
+/* The tile of 'port', for chip-boot-repaird's events */
+RepairObserver * GtkDashboardView::observer(const std::string & port) {
+	Tile * found = nullptr;
+	g_mutex_lock(&lock);
+	for (auto tile : tiles) {
+		if (tile->port == port)
+			found = tile;
+	}
+	g_mutex_unlock(&lock);
+	return found;
+}
+
+void GtkDashboardView::onDone(const std::string & port, bool ok) {
+	if (Tile * tile = (Tile *)observer(port))
+		finished(tile, ok);
+}
+
+//static
+gpointer GtkDashboardView::listen(gpointer thisObj) {
+	GtkDashboardView * view = (GtkDashboardView *)thisObj;
+	view->client->listen(view);
+	g_mutex_lock(&view->lock);
+	for (auto tile : view->tiles) {
+		if (tile->running) {
+			tile->phase = "Lost the connection to chip-boot-repaird";
+			tile->running = false;
+			tile->dirty = true;
+		}
+	}
+	g_mutex_unlock(&view->lock);
+	return nullptr;
+}
+
+/* Starts a repair of the tile's board, unless there is none or it is being repaired */
+void GtkDashboardView::start(Tile * tile) {
+	if (!tile->present)
+		return;
+	g_mutex_lock(&lock);
+	bool running = tile->running;
+	if (!running) {
+		tile->running = true;
+		tile->phase = "Queued"; // until the fel calls of the boards before it are done
+		tile->details.clear();
+		tile->result.clear();
+		tile->fraction = 0;
+		tile->done = tile->total = 0;
+		tile->rateStart = 0;
+		tile->rate = 0;
+		tile->dirty = true;
+	}
+	g_mutex_unlock(&lock);
+	if (running)
+		return;
+	if (client) {
+		std::string error;
+		if (!client->repair(tile->port, &error))
+			finished(tile, false, &error);
+		return;
+	}
+	if (tile->thread)
+		g_thread_join(tile->thread); // has returned, or is about to
+	tile->thread = g_thread_new("repair", GtkDashboardView::runRepair, tile);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+//static
+void GtkDashboardView::onRepair(GtkWidget * widget, gpointer tileObj) {
+	Tile * tile = (Tile *)tileObj;
+	tile->view->start(tile);
+	tile->view->render();
+}
+
+//static
+void GtkDashboardView::onRepairAll(GtkWidget * widget, gpointer thisObj) {
+	GtkDashboardView * view = (GtkDashboardView *)thisObj;
+	for (auto tile : view->tiles)
+		view->start(tile);
+	view->render();
+}
+#pragma GCC diagnostic pop
+
+GtkDashboardView::Tile * GtkDashboardView::addTile(const std::string & port) {
+	Tile * tile = new Tile(this, port);
+	g_mutex_lock(&lock);
+	guint index = tiles.size();
+	tiles.push_back(tile);
+	g_mutex_unlock(&lock);
+
+	tile->frame = gtk_frame_new(port.c_str());
+	GtkWidget * box = gtk_vbox_new(FALSE, 3);
+	gtk_container_set_border_width(GTK_CONTAINER(box), 5);
+	tile->sidLabel = gtk_label_new("");
+	tile->progbar = gtk_progress_bar_new();
+	tile->bytesLabel = gtk_label_new("");
+	tile->detailsLabel = gtk_label_new("");
+	gtk_label_set_line_wrap(GTK_LABEL(tile->detailsLabel), TRUE);
+	gtk_widget_set_size_request(tile->detailsLabel, 220, -1);
+	tile->button = gtk_button_new_with_label("Repair");
+	g_signal_connect(tile->button, "clicked", G_CALLBACK(GtkDashboardView::onRepair), tile);
+	GtkWidget * halign = gtk_alignment_new(1, 0, 0, 0);
+	gtk_container_add(GTK_CONTAINER(halign), tile->button);
+
+	gtk_box_pack_start(GTK_BOX(box), tile->sidLabel, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(box), tile->progbar, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(box), tile->bytesLabel, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(box), tile->detailsLabel, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(box), halign, FALSE, FALSE, 0);
+	gtk_container_add(GTK_CONTAINER(tile->frame), box);
+
+	guint rows = index / COLUMNS + 1;
+	gtk_table_resize(GTK_TABLE(table), rows, COLUMNS);
+	gtk_table_attach_defaults(GTK_TABLE(table), tile->frame,
+		index % COLUMNS, index % COLUMNS + 1, index / COLUMNS, index / COLUMNS + 1);
+	gtk_widget_show_all(tile->frame);
+	return tile;
+}
+
+/* New boards get a tile; a tile whose board came back is ready again */
+void GtkDashboardView::scan() {
+	struct fel_enum_device devices[MAX_BOARDS];
+	int count = fel_enum_devices(devices, MAX_BOARDS);
+	if (count > MAX_BOARDS)
+		count = MAX_BOARDS;
+	std::vector<bool> found(tiles.size(), false);
+	for (int i = 0; i < count; i++) {
+		std::string port = devices[i].port;
+		size_t t = 0;
+		while (t < tiles.size() && tiles[t]->port != port)
+			t++;
+		if (t == tiles.size()) {
+			addTile(port);
+			found.push_back(true);
+		} else {
+			found[t] = true;
+		}
+	}
+	for (size_t t = 0; t < tiles.size(); t++) {
+		Tile * tile = tiles[t];
+		if (tile->present == found[t])
+			continue;
+		tile->present = found[t];
+		g_mutex_lock(&lock);
+		if (tile->present && !tile->running) {
+			/* another board, or the same one again: nothing shown is about it */
+			tile->sid.clear();
+			tile->phase = READY;
+			tile->details.clear();
+			tile->result.clear();
+			tile->fraction = 0;
+			tile->done = tile->total = 0;
+			tile->rate = 0;
+		}
+		tile->dirty = true;
+		g_mutex_unlock(&lock);
+	}
+}
+
+static std::string megabytes(uint64_t bytes) {
+	char text[32];
+	snprintf(text, sizeof(text), "%.1f", bytes / (1024.0 * 1024.0));
+	return text;
+}
+
+/* Redraws the tiles that changed, from a copy of their state so the repair threads do not wait on GTK */
+void GtkDashboardView::render() {
+	int present = 0, running = 0;
+	for (auto tile : tiles) {
+		g_mutex_lock(&lock);
+		bool dirty = tile->dirty;
+		bool busy = tile->running;
+		std::string sid = tile->sid, phase = tile->phase, details = tile->details, result = tile->result;
+		float fraction = tile->total ? (float)tile->done / tile->total : tile->fraction;
+		uint64_t done = tile->done, total = tile->total;
+		double rate = tile->rate;
+		tile->dirty = false;
+		g_mutex_unlock(&lock);
+		present += tile->present;
+		running += busy;
+		if (!dirty)
+			continue;
+
+		std::string sidText = sid.empty() ? "SID unknown" : "SID " + sid;
+		gtk_label_set_text(GTK_LABEL(tile->sidLabel), sidText.c_str());
+		if (!tile->present && !busy)
+			phase = "Not in FEL mode";
+		gtk_progress_bar_set_text(GTK_PROGRESS_BAR(tile->progbar), phase.c_str());
+		gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(tile->progbar), fraction > 1 ? 1 : fraction);
+		std::string bytesText;
+		if (total) {
+			bytesText = megabytes(done) + " of " + megabytes(total) + " MiB";
+			if (rate > 0)
+				bytesText += ", " + megabytes(rate) + " MiB/s";
+		}
+		gtk_label_set_text(GTK_LABEL(tile->bytesLabel), bytesText.c_str());
+		std::string detailsText = result.empty() ? details : details.empty() ? result : result + ": " + details;
+		gtk_label_set_text(GTK_LABEL(tile->detailsLabel), detailsText.c_str());
+		gtk_widget_set_sensitive(tile->button, tile->present && !busy);
+	}
+
+	char count[64];
+	snprintf(count, sizeof(count), "%d boards in FEL mode, %d being repaired", present, running);
+	gtk_label_set_text(GTK_LABEL(countLabel), count);
+}
+
+//static
+gboolean GtkDashboardView::tick(gpointer thisObj) {
+	GtkDashboardView * view = (GtkDashboardView *)thisObj;
+	if (view->ticks++ % SCAN_TICKS == 0)
+		view->scan();
+	if (view->ticks == 1)
+		Startup::ready();
+	view->render();
+	return TRUE;
+}
+
+GtkDashboardView::GtkDashboardView() : client(new RepairClient()), listener(nullptr), ticks(0) {
+	g_mutex_init(&lock);
+	if (!client->connect()) {
+		delete client;
+		client = nullptr;
+		GtkRepairView::requireRoot(); // the repairs run in this process
+	}
+
+	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	gtk_window_set_position(GTK_WINDOW(window), GTK_WIN_POS_CENTER);
+	gtk_window_set_default_size(GTK_WINDOW(window), 960, 480);
+	gtk_window_set_title(GTK_WINDOW(window), "C.H.I.P. Boot Repair");
+	gtk_container_set_border_width(GTK_CONTAINER(window), 10);
+
+	g_signal_connect(G_OBJECT(window), "destroy",
+			G_CALLBACK(gtk_main_quit), G_OBJECT(window));
+
+	vbox = gtk_vbox_new(FALSE, 5);
+	gtk_container_add(GTK_CONTAINER(window), vbox);
+
+	header = gtk_hbox_new(FALSE, 5);
+	countLabel = gtk_label_new("");
+	repairAllButton = gtk_button_new_with_label("Repair all");
+	g_signal_connect(repairAllButton, "clicked",
+			G_CALLBACK(GtkDashboardView::onRepairAll), this);
+	gtk_box_pack_start(GTK_BOX(header), countLabel, FALSE, FALSE, 0);
+	gtk_box_pack_end(GTK_BOX(header), repairAllButton, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(vbox), header, FALSE, FALSE, 0);
+
+	table = gtk_table_new(1, COLUMNS, TRUE);
+	gtk_table_set_row_spacings(GTK_TABLE(table), 5);
+	gtk_table_set_col_spacings(GTK_TABLE(table), 5);
+	scroller = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroller), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+	gtk_scrolled_window_add_with_viewport(GTK_SCROLLED_WINDOW(scroller), table);
+	gtk_box_pack_start(GTK_BOX(vbox), scroller, TRUE, TRUE, 0);
+
+	if (client)
+		listener = g_thread_new("daemon", GtkDashboardView::listen, this);
+	gdk_threads_add_timeout(RENDER_MS, GtkDashboardView::tick, this);
+	tick(this);
+
+	gtk_widget_show_all(window);
+
+	gtk_main();
+}
+
+GtkDashboardView::~GtkDashboardView() {
+	/* chip-boot-repaird's repairs go on without the window */
+	if (listener) {
+		client->stop();
+		g_thread_join(listener);
+	}
+	delete client;
+	for (auto tile : tiles)
+		tile->tool.cancel("The window was closed");
+	for (auto tile : tiles) {
+		if (tile->thread)
+			g_thread_join(tile->thread);
+		delete tile;
+	}
+	g_mutex_clear(&lock);
+}
@@ -2,6 +2,10 @@
 #include <glib/gprintf.h>
 #include "RepairTool.h"
 #include "GtkRepairView.h"
+#include "Startup.h"
+
+/* How often a staged board is checked for removal while waiting for the click */
+static const gint64 REMOVAL_POLL_US = 250 * 1000;
 
 const std::string DESCRIPTION = "This tool will repair issues related to the NAND memory on C.H.I.P.\n The whole process takes just a few seconds.";
 void GtkRepairView::onNotify(const std::string & progressText, float progressFraction, const std::string * details) {
@@ -17,18 +21,100 @@ void GtkRepairView::onNotify(const std::string & progressText, float progressFra
 void * GtkRepairView::waitForFel(void * thisObj) {
 	gdk_threads_enter();
 	GtkRepairView * view = (GtkRepairView *)thisObj;
-	RepairTool::staticWaitForFel(view);
+	if (Startup::felResult() != 0)
+		RepairTool::staticWaitForFel(view);
+	Startup::ready();
 	const std::string message = "Click Repair to begin";
 	gtk_widget_set_sensitive(view->button, TRUE);
 	gdk_threads_leave();
 	view->onNotify("C.H.I.P. in FEL mode found",0.05, &message);
+	if (RepairTool::speculative() && !view->client)
+		view->prestage();
 	return view->button;
 }
 
+/* Stages the board until Repair is clicked, and the next one if it is unplugged first, see RepairTool.h */
+void GtkRepairView::prestage() {
+	const std::string message = "Click Repair to begin";
+	RepairTool * tool = new RepairTool();
+	tool->addObserver(this);
+	for (;;) {
+		tool->stage();
+		bool go = false;
+		while (!go) {
+			g_mutex_lock(&clickLock);
+			if (!clicked)
+				g_cond_wait_until(&clickCond, &clickLock, g_get_monotonic_time() + REMOVAL_POLL_US);
+			go = clicked;
+			g_mutex_unlock(&clickLock);
+			if (!go && !tool->boardPresent())
+				break;
+		}
+		if (go)
+			break;
+
+		tool->unstage();
+		gdk_threads_enter();
+		gtk_widget_set_sensitive(button, FALSE);
+		gdk_threads_leave();
+		onNotify("Waiting for a C.H.I.P. in FEL mode...", 0, nullptr);
+		g_mutex_lock(&clickLock);
+		clicked = false; // a click on a board that is gone is not one for the next board
+		g_mutex_unlock(&clickLock);
+		RepairTool::staticWaitForFel(this);
+		gdk_threads_enter();
+		gtk_widget_set_sensitive(button, TRUE);
+		gdk_threads_leave();
+		onNotify("C.H.I.P. in FEL mode found", 0.05, &message);
+	}
+	tool->finish();
+	delete tool;
+}
+
 //static
 void * GtkRepairView::repair(void * thisObj) {
 	GtkRepairView * view = (GtkRepairView *)thisObj;
-	RepairTool::runSimple(view,false);
+	if (view->client)
+		view->repairRemotely();
+	else
+		RepairTool::runSimple(view,false);
+	return nullptr;
+}
+
+/* Has chip-boot-repaird repair the first board it is not repairing already */
+void GtkRepairView::repairRemotely() {
+	std::vector<RepairClient::Board> boards;
+	std::string error = "chip-boot-repaird finds no C.H.I.P. in FEL mode";
+	if (client->devices(boards)) {
+		for (auto & board : boards) {
+			if (board.repairing)
+				continue;
+			g_mutex_lock(&portLock);
+			remotePort = board.port;
+			g_mutex_unlock(&portLock);
+			if (client->repair(board.port, &error))
+				return;
+			break;
+		}
+	} else {
+		error = "Lost the connection to chip-boot-repaird";
+	}
+	onNotify("Repair failed", 0, &error);
+}
+
+RepairObserver * GtkRepairView::observer(const std::string & port) {
+	g_mutex_lock(&portLock);
+	bool ours = port == remotePort;
+	g_mutex_unlock(&portLock);
+	return ours ? this : nullptr;
+}
+
+//static
+void * GtkRepairView::listen(void * thisObj) {
+	GtkRepairView * view = (GtkRepairView *)thisObj;
+	view->client->listen(view);
+	const std::string details = "Restart it, then this tool";
+	view->onNotify("Lost the connection to chip-boot-repaird", 0, &details);
 	return nullptr;
 }
 
@@ -37,17 +123,27 @@ void * GtkRepairView::repair(void * thisObj) {
 void GtkRepairView::repairThread(GtkWidget * widget,void * thisObj) {
 	GtkRepairView * view = (GtkRepairView *)thisObj;
 	gtk_widget_set_sensitive(view->button, FALSE);
+	if (RepairTool::speculative()) {
+		/* the waitForFel thread has the board staged, it finishes the repair */
+		g_mutex_lock(&view->clickLock);
+		view->clicked = true;
+		g_cond_signal(&view->clickCond);
+		g_mutex_unlock(&view->clickLock);
+		return;
+	}
 	g_thread_new("repair", GtkRepairView::repair, view);
 }
 #pragma GCC diagnostic pop
 
 
-GtkRepairView::GtkRepairView(int argc, char *argv[]) {
-
+//static
+bool GtkRepairView::init(int & argc, char ** & argv) {
 	gdk_threads_init();
+	return gtk_init_check(&argc, &argv);
+}
 
-	gtk_init(&argc, &argv);
-
+//static
+void GtkRepairView::requireRoot() {
 	uid_t uid=getuid(), euid=geteuid();
 	if (uid!=0 || uid!=euid) {
 		GtkWidget *dialog;
@@ -61,6 +157,17 @@ GtkRepairView::GtkRepairView(int argc, char *argv[]) {
 		gtk_widget_destroy(dialog);
 		exit(1);
 	}
+}
+
+GtkRepairView::GtkRepairView() : clicked(false), client(new RepairClient()) {
+	g_mutex_init(&clickLock);
+	g_cond_init(&clickCond);
+	g_mutex_init(&portLock);
+	if (!client->connect()) {
+		delete client;
+		client = nullptr;
+		requireRoot(); // the repair runs in this process
+	}
 
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	gtk_window_set_position(GTK_WINDOW(window), GTK_WIN_POS_CENTER);
@@ -103,6 +210,9 @@ GtkRepairView::GtkRepairView(int argc, char *argv[]) {
 	gtk_box_pack_start(GTK_BOX(vbox), halign, FALSE, FALSE, 0);
 
 
+	if (client)
+		g_thread_new("daemon", GtkRepairView::listen, this);
+
 	/* Create new thread */
 	auto thread = g_thread_new("waitForFel", GtkRepairView::waitForFel, this);
 
@@ -118,11 +228,4 @@ GtkRepairView::GtkRepairView(int argc, char *argv[]) {
 
 }
 
-void show_error() {
-}
-
-int main(int argc, char *argv[]) {
-	auto view = new GtkRepairView(argc,argv);
-	delete view;
-}
 
@@ -0,0 +1,80 @@
+#include "HostQueue.h"
+#include "TraceSpan.h"
+
+HostQueue::HostQueue() : started(false), stopping(false), added(0), finished(0) {
+	pthread_mutex_init(&lock, nullptr);
+	pthread_cond_init(&changed, nullptr);
+}
+
+HostQueue::~HostQueue() {
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+	if (started)
+		pthread_join(thread, nullptr);
+	pthread_cond_destroy(&changed);
+	pthread_mutex_destroy(&lock);
+}
+
+long HostQueue::add(const char * name, Job job) {
+	pthread_mutex_lock(&lock);
+	/* the thread is only started once there is work, most tools never queue any */
+	if (!started)
+		started = pthread_create(&thread, nullptr, HostQueue::run, this) == 0;
+	long number = ++added;
+	if (started) {
+		jobs.push_back(std::make_pair(name, job));
+		pthread_cond_broadcast(&changed);
+		pthread_mutex_unlock(&lock);
+		return number;
+	}
+	pthread_mutex_unlock(&lock);
+	/* no helper thread: the job runs right away */
+	{
+		TraceSpan span("host", name);
+		job();
+	}
+	pthread_mutex_lock(&lock);
+	finished++;
+	pthread_mutex_unlock(&lock);
+	return number;
+}
+
+bool HostQueue::done(long job) {
+	pthread_mutex_lock(&lock);
+	bool result = finished >= job;
+	pthread_mutex_unlock(&lock);
+	return result;
+}
+
+void HostQueue::wait(long job) {
+	pthread_mutex_lock(&lock);
+	while (finished < job)
+		pthread_cond_wait(&changed, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+//static
+void * HostQueue::run(void * thisObj) {
+	HostQueue * queue = (HostQueue *)thisObj;
+	pthread_mutex_lock(&queue->lock);
+	for (;;) {
+		while (queue->jobs.empty() && !queue->stopping)
+			pthread_cond_wait(&queue->changed, &queue->lock);
+		if (queue->jobs.empty())
+			break;
+		std::pair<const char *, Job> job = queue->jobs.front();
+		queue->jobs.pop_front();
+		pthread_mutex_unlock(&queue->lock);
+		{
+			TraceSpan span("host", job.first);
+			job.second();
+		}
+		pthread_mutex_lock(&queue->lock);
+		queue->finished++;
+		pthread_cond_broadcast(&queue->changed);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return nullptr;
+}
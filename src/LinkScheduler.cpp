@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+#include "LinkScheduler.h"
+#include "CancelToken.h"
+
+LinkScheduler::LinkScheduler() : fd(-1) {}
+
+LinkScheduler::~LinkScheduler() {
+	release();
+}
+
+std::string LinkScheduler::link(const std::string & port) {
+	return port.substr(0, port.find('.'));
+}
+
+bool LinkScheduler::isBulk(const RepairPlan::Step & step) {
+	return (step.op == "write" || step.op == "fill" || step.op == "tune") && step.bytes >= BULK_BYTES;
+}
+
+int LinkScheduler::slots() {
+	const char * slots = getenv("CHIP_BOOT_REPAIR_LINK_SLOTS");
+	int n = slots ? atoi(slots) : 0;
+	return n > 0 ? n : DEFAULT_SLOTS;
+}
+
+std::string LinkScheduler::directory() {
+	const char * links = getenv("CHIP_BOOT_REPAIR_LINKS");
+	if (links && *links)
+		return links;
+	const char * runtime = getenv("XDG_RUNTIME_DIR");
+	return std::string(runtime && *runtime ? runtime : "/tmp") + "/chip-boot-repair/links";
+}
+
+#ifdef _WIN32
+
+/* One repair process per station there, nothing to share */
+bool LinkScheduler::acquire(const std::string & port, bool * waited, CancelToken * cancel) {
+	if (waited)
+		*waited = false;
+	return false;
+}
+
+void LinkScheduler::release() {}
+
+#else
+
+/* How often a repair waiting for a slot looks again */
+static const useconds_t POLL_US = 20 * 1000;
+
+/* mkdir -p */
+static void makeDirectories(const std::string & path) {
+	for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+		mkdir(path.substr(0, slash).c_str(), 0755);
+	mkdir(path.c_str(), 0755);
+}
+
+bool LinkScheduler::acquire(const std::string & port, bool * waited, CancelToken * cancel) {
+	if (waited)
+		*waited = false;
+	if (held())
+		return true;
+	if (port.empty())
+		return false;
+	std::string dir = directory();
+	makeDirectories(dir);
+	int n = slots();
+	std::vector<int> files;
+	for (int i = 0; i < n; i++) {
+		std::string path = dir + "/" + link(port) + "." + std::to_string(i);
+		int file = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+		if (file < 0) {
+			for (int f : files)
+				close(f);
+			return false;
+		}
+		files.push_back(file);
+	}
+	for (;;) {
+		for (int i = 0; i < n && fd < 0; i++) {
+			if (flock(files[i], LOCK_EX | LOCK_NB) == 0) {
+				fd = files[i];
+				files[i] = -1;
+			}
+		}
+		if (fd >= 0 || (cancel && cancel->cancelled()))
+			break;
+		if (waited)
+			*waited = true;
+		usleep(POLL_US);
+	}
+	for (int f : files) {
+		if (f >= 0)
+			close(f);
+	}
+	return fd >= 0;
+}
+
+void LinkScheduler::release() {
+	if (fd < 0)
+		return;
+	close(fd); // drops the lock
+	fd = -1;
+}
+
+#endif
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <mutex>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "portable_endian.h"
+extern "C" {
+#include "crc32.h"
+}
+#include "PayloadBundle.h"
+
+static void setError(std::string * error, const std::string & message) {
+	if (error)
+		*error = message;
+}
+
+PayloadBundle::PayloadBundle() : map(nullptr), mapSize(0), bundleVersion(0) {
+}
+
+PayloadBundle::~PayloadBundle() {
+	if (!map)
+		return;
+#ifdef _WIN32
+	free(map);
+#else
+	munmap(map, mapSize);
+#endif
+}
+
+/* One open() plus one mmap(); the entries point straight into the mapping */
+PayloadBundle * PayloadBundle::open(const std::string & path, std::string * error) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		setError(error, "Cannot open payload bundle " + path);
+		return nullptr;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(payload_bundle_header)) {
+		close(fd);
+		setError(error, "Payload bundle " + path + " is truncated");
+		return nullptr;
+	}
+
+	PayloadBundle * bundle = new PayloadBundle();
+	bundle->mapSize = st.st_size;
+#ifdef _WIN32
+	bundle->map = malloc(bundle->mapSize);
+	if (bundle->map && read(fd, bundle->map, bundle->mapSize) != (int)bundle->mapSize) {
+		free(bundle->map);
+		bundle->map = nullptr;
+	}
+#else
+	bundle->map = mmap(nullptr, bundle->mapSize, PROT_READ, MAP_SHARED, fd, 0);
+	if (bundle->map == MAP_FAILED)
+		bundle->map = nullptr;
+#endif
+	close(fd); // the mapping keeps the file alive, even if it is replaced meanwhile
+	if (!bundle->map) {
+		delete bundle;
+		setError(error, "Cannot map payload bundle " + path);
+		return nullptr;
+	}
+
+	const uint8_t * base = (const uint8_t *)bundle->map;
+	const payload_bundle_header * header = (const payload_bundle_header *)base;
+	uint32_t count = le32toh(header->count);
+	if (memcmp(header->magic, PAYLOAD_BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+	    le32toh(header->format) != PAYLOAD_BUNDLE_FORMAT) {
+		delete bundle;
+		setError(error, path + " is not a payload bundle");
+		return nullptr;
+	}
+	/* the count is checked before multiplying, where size_t is 32 bits it could wrap */
+	if (count > (bundle->mapSize - sizeof(*header)) / sizeof(payload_bundle_entry) ||
+	    calc_crc32(header + 1, count * sizeof(payload_bundle_entry), 0) != le32toh(header->index_crc)) {
+		delete bundle;
+		setError(error, "Payload bundle " + path + " has a corrupt index");
+		return nullptr;
+	}
+
+	bundle->bundleVersion = le32toh(header->version);
+	const payload_bundle_entry * entries = (const payload_bundle_entry *)(header + 1);
+	size_t indexEnd = sizeof(*header) + count * sizeof(payload_bundle_entry);
+	for (uint32_t i = 0; i < count; i++) {
+		Entry entry;
+		uint32_t offset = le32toh(entries[i].offset);
+		entry.name = std::string(entries[i].name, strnlen(entries[i].name, PAYLOAD_NAME_LEN));
+		entry.loadAddress = le32toh(entries[i].load_addr);
+		entry.size = le32toh(entries[i].size);
+		entry.alignment = le32toh(entries[i].alignment);
+		entry.crc32 = le32toh(entries[i].crc32);
+		if (offset < indexEnd || offset > bundle->mapSize || entry.size > bundle->mapSize - offset) {
+			delete bundle;
+			setError(error, "Payload " + entry.name + " lies outside of " + path);
+			return nullptr;
+		}
+		if (!entry.alignment || offset % entry.alignment) {
+			delete bundle;
+			setError(error, "Payload " + entry.name + " is misaligned in " + path);
+			return nullptr;
+		}
+		entry.data = base + offset;
+		bundle->index.push_back(entry);
+	}
+	return bundle;
+}
+
+bool PayloadBundle::verify(std::string * error) const {
+	for (auto & entry : index) {
+		if (calc_crc32(entry.data, entry.size, 0) != entry.crc32) {
+			setError(error, "Payload " + entry.name + " failed its CRC check");
+			return false;
+		}
+	}
+	return true;
+}
+
+const PayloadBundle::Entry * PayloadBundle::find(const std::string & name) const {
+	for (auto & entry : index) {
+		if (entry.name == name)
+			return &entry;
+	}
+	return nullptr;
+}
+
+static std::mutex sharedLock;
+static PayloadBundle * sharedBundle = nullptr;
+
+PayloadBundle * PayloadBundle::shared(const std::string & path, std::string * error) {
+	std::lock_guard<std::mutex> guard(sharedLock);
+	if (!sharedBundle) {
+		PayloadBundle * bundle = open(path, error);
+		if (bundle && !bundle->verify(error)) {
+			delete bundle;
+			bundle = nullptr;
+		}
+		sharedBundle = bundle;
+	}
+	return sharedBundle;
+}
+
+PayloadBundle * PayloadBundle::shared() {
+	std::lock_guard<std::mutex> guard(sharedLock);
+	return sharedBundle;
+}
+
+static bool slurpFile(const std::string & path, std::string & data) {
+	FILE * in = fopen(path.c_str(), "rb");
+	if (!in)
+		return false;
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		data.append(buf, n);
+	fclose(in);
+	return true;
+}
+
+/* Writes to a temporary file and renames it over 'path', so readers never see half a bundle */
+bool PayloadBundle::write(const std::string & path, uint32_t version, const std::vector<Source> & sources, std::string * error) {
+	std::vector<std::string> contents(sources.size());
+	std::vector<payload_bundle_entry> entries(sources.size());
+	uint32_t offset = sizeof(payload_bundle_header) + sources.size() * sizeof(payload_bundle_entry);
+
+	for (size_t i = 0; i < sources.size(); i++) {
+		const Source & source = sources[i];
+		uint32_t alignment = source.alignment ? source.alignment : 4;
+		if (source.name.size() >= PAYLOAD_NAME_LEN) {
+			setError(error, "Payload name too long: " + source.name);
+			return false;
+		}
+		if (!slurpFile(source.path, contents[i])) {
+			setError(error, "Cannot read " + source.path);
+			return false;
+		}
+		offset = (offset + alignment - 1) / alignment * alignment;
+		memset(&entries[i], 0, sizeof(entries[i]));
+		strncpy(entries[i].name, source.name.c_str(), PAYLOAD_NAME_LEN - 1);
+		entries[i].load_addr = htole32(source.loadAddress);
+		entries[i].offset = htole32(offset);
+		entries[i].size = htole32(contents[i].size());
+		entries[i].alignment = htole32(alignment);
+		entries[i].crc32 = htole32(calc_crc32(contents[i].data(), contents[i].size(), 0));
+		offset += contents[i].size();
+	}
+
+	payload_bundle_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PAYLOAD_BUNDLE_MAGIC, sizeof(header.magic));
+	header.format = htole32(PAYLOAD_BUNDLE_FORMAT);
+	header.version = htole32(version);
+	header.count = htole32(entries.size());
+	header.index_crc = htole32(calc_crc32(entries.data(), entries.size() * sizeof(payload_bundle_entry), 0));
+
+	std::string tempPath = path + ".tmp";
+	FILE * out = fopen(tempPath.c_str(), "wb");
+	if (!out) {
+		setError(error, "Cannot create " + tempPath);
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+	if (!entries.empty())
+		ok = ok && fwrite(entries.data(), sizeof(payload_bundle_entry), entries.size(), out) == entries.size();
+	for (size_t i = 0; ok && i < entries.size(); i++) {
+		long pad = le32toh(entries[i].offset) - ftell(out);
+		while (ok && pad-- > 0)
+			ok = fputc(0, out) != EOF;
+		ok = ok && fwrite(contents[i].data(), 1, contents[i].size(), out) == contents[i].size();
+	}
+	ok = (fclose(out) == 0) && ok;
+	if (!ok || rename(tempPath.c_str(), path.c_str()) != 0) {
+		remove(tempPath.c_str());
+		setError(error, "Cannot write " + path);
+		return false;
+	}
+	return true;
+}
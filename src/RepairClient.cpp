@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "RepairClient.h"
+#include "RepairSocket.h"
+
+RepairClient::RepairClient() : fd(-1), stream(-1), stopped(false) {}
+
+RepairClient::~RepairClient() {
+#ifndef _WIN32
+	if (fd >= 0)
+		close(fd);
+#endif
+}
+
+bool RepairClient::connect() {
+	std::lock_guard<std::mutex> guard(lock);
+	if (fd < 0)
+		fd = RepairSocket::connect();
+	return fd >= 0;
+}
+
+/* One request and its "ok" or "error" reply */
+bool RepairClient::request(const std::vector<std::string> & fields, std::string * error) {
+	std::lock_guard<std::mutex> guard(lock);
+	std::string line;
+	if (fd < 0 || !RepairSocket::writeAll(fd, RepairSocket::line(fields))
+			|| !RepairSocket::readLine(fd, buffer, line)) {
+		if (error)
+			*error = "Lost the connection to chip-boot-repaird";
+		return false;
+	}
+	std::vector<std::string> reply = RepairSocket::fields(line);
+	if (reply[0] == "ok")
+		return true;
+	if (error)
+		*error = reply.size() > 1 ? reply[1] : line;
+	return false;
+}
+
+bool RepairClient::devices(std::vector<Board> & boards) {
+	std::lock_guard<std::mutex> guard(lock);
+	boards.clear();
+	if (fd < 0 || !RepairSocket::writeAll(fd, RepairSocket::line({ "devices" })))
+		return false;
+	std::string line;
+	while (RepairSocket::readLine(fd, buffer, line)) {
+		std::vector<std::string> fields = RepairSocket::fields(line);
+		if (fields[0] == "end")
+			return true;
+		if (fields[0] == "board" && fields.size() >= 4)
+			boards.push_back({ fields[1], fields[2] == "repairing", fields[3] });
+	}
+	return false;
+}
+
+bool RepairClient::repair(const std::string & port, std::string * error) {
+	return request({ "repair", port }, error);
+}
+
+bool RepairClient::cancel(const std::string & port, std::string * error) {
+	return request({ "cancel", port }, error);
+}
+
+void RepairClient::listen(Listener * listener) {
+	int stream = RepairSocket::connect();
+	if (stream < 0)
+		return;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (stopped) {
+#ifndef _WIN32
+			close(stream);
+#endif
+			return;
+		}
+		this->stream = stream;
+	}
+	std::string buffer, line;
+	if (RepairSocket::writeAll(stream, RepairSocket::line({ "subscribe" }))) {
+		while (RepairSocket::readLine(stream, buffer, line)) {
+			std::vector<std::string> fields = RepairSocket::fields(line);
+			const std::string & event = fields[0];
+			if (fields.size() < 2)
+				continue; // the "ok"
+			const std::string & port = fields[1];
+			if (event == "board" && fields.size() >= 3) {
+				listener->onBoard(port, fields[2] == "present");
+			} else if (event == "done" && fields.size() >= 3) {
+				listener->onDone(port, fields[2] == "ok");
+			} else if (RepairObserver * observer = listener->observer(port)) {
+				if (event == "device" && fields.size() >= 3) {
+					observer->onDevice(port, fields[2]);
+				} else if (event == "notify" && fields.size() >= 4) {
+					const std::string * details = fields.size() >= 5 && !fields[4].empty() ? &fields[4] : nullptr;
+					observer->onNotify(fields[3], atoi(fields[2].c_str()) / 1000.0f, details);
+				} else if (event == "bytes" && fields.size() >= 4) {
+					observer->onBytes(strtoull(fields[2].c_str(), nullptr, 10), strtoull(fields[3].c_str(), nullptr, 10));
+				}
+			}
+		}
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	this->stream = -1;
+#ifndef _WIN32
+	close(stream);
+#endif
+}
+
+void RepairClient::stop() {
+	std::lock_guard<std::mutex> guard(lock);
+	stopped = true;
+#ifndef _WIN32
+	if (stream >= 0)
+		shutdown(stream, SHUT_RDWR); // listen()'s read returns
+#endif
+}
@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+#include "felenum.h"
+#include "usbstats.h"
+}
+#include "RepairDaemon.h"
+#include "RepairJournal.h"
+#include "RepairSocket.h"
+
+static const int MAX_BOARDS = 64;
+
+/* Members of this group may use the socket ($CHIP_BOOT_REPAIR_SOCKET_GROUP), root only if there is none */
+static const char * socketGroup() {
+	const char * group = getenv("CHIP_BOOT_REPAIR_SOCKET_GROUP");
+	return group && *group ? group : "plugdev";
+}
+
+RepairDaemon::Job::Job(RepairDaemon * daemon, const std::string & port) : daemon(daemon), port(port),
+	worker(nullptr), progressFraction(0), bytesDone(0) {}
+
+void RepairDaemon::Job::onNotify(const std::string & progressText, float progressFraction, const std::string * details) {
+	std::string line = RepairSocket::line({ "notify", port, std::to_string((int)(progressFraction * 1000)),
+		progressText, details ? *details : "" });
+	this->progressFraction = progressFraction;
+	lastNotify = line;
+	daemon->broadcast(line);
+}
+
+void RepairDaemon::Job::onDevice(const std::string & port, const std::string & sid) {
+	this->sid = sid;
+	daemon->broadcast(RepairSocket::line({ "device", this->port, sid }));
+}
+
+/* The worker sends them every BYTES_INTERVAL_MS at most */
+void RepairDaemon::Job::onBytes(uint64_t done, uint64_t total) {
+	if (done == bytesDone)
+		return;
+	bytesDone = done;
+	daemon->broadcast(RepairSocket::line({ "bytes", port, std::to_string(done), std::to_string(total) }));
+}
+
+RepairDaemon::RepairDaemon() : listenFd(-1) {}
+
+RepairDaemon::~RepairDaemon() {
+	for (auto & job : jobs) {
+		if (job.second->worker)
+			job.second->worker->cancel("chip-boot-repaird is stopping");
+	}
+	for (auto & job : jobs) {
+		delete job.second->worker; // waits for it to stop
+		delete job.second;
+	}
+	for (auto client : clients) {
+		close(client->fd);
+		delete client;
+	}
+	if (listenFd >= 0) {
+		close(listenFd);
+		unlink(RepairSocket::path().c_str());
+	}
+}
+
+bool RepairDaemon::listen(std::string * error) {
+	std::string path = RepairSocket::path();
+	struct sockaddr_un address;
+	if (path.size() >= sizeof(address.sun_path)) {
+		*error = "Socket path too long: " + path;
+		return false;
+	}
+	int other = RepairSocket::connect();
+	if (other >= 0) {
+		close(other);
+		*error = "chip-boot-repaird is already running on " + path;
+		return false;
+	}
+	unlink(path.c_str()); // left over by a daemon that died
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path.c_str());
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	mode_t mask = umask(0117);
+	bool bound = listenFd >= 0 && bind(listenFd, (struct sockaddr *)&address, sizeof(address)) == 0;
+	umask(mask);
+	if (!bound || ::listen(listenFd, 16) != 0) {
+		*error = path + ": " + strerror(errno);
+		return false;
+	}
+	struct group * group = getgrnam(socketGroup());
+	if (group && chown(path.c_str(), -1, group->gr_gid) != 0)
+		perror(path.c_str());
+	fcntl(listenFd, F_SETFD, FD_CLOEXEC);
+	boards = present();
+	return true;
+}
+
+void RepairDaemon::broadcast(const std::string & line) {
+	for (auto client : clients) {
+		if (!client->subscribed || client->dropped)
+			continue;
+		client->out += line;
+		if (client->out.size() > MAX_BACKLOG)
+			client->dropped = true;
+	}
+}
+
+/* What a worker must not keep open: the socket, the clients and the other workers' pipes */
+std::vector<int> RepairDaemon::descriptors() {
+	std::vector<int> fds = { listenFd };
+	for (auto client : clients)
+		fds.push_back(client->fd);
+	for (auto & entry : jobs) {
+		if (entry.second->worker) {
+			for (int fd : entry.second->worker->descriptors())
+				fds.push_back(fd);
+		}
+	}
+	return fds;
+}
+
+/* Passes on the events of the worker of 'job', and tells the clients when it is done */
+void RepairDaemon::readWorker(Job * job) {
+	bool ok;
+	std::string error;
+	if (job->worker->read(job, ok, error))
+		return;
+	if (!error.empty())
+		job->onNotify("Repair failed", job->progressFraction, &error);
+	delete job->worker;
+	job->worker = nullptr;
+	broadcast(RepairSocket::line({ "done", job->port, ok ? "ok" : "failed" }));
+}
+
+std::set<std::string> RepairDaemon::present() {
+	struct fel_enum_device devices[MAX_BOARDS];
+	int count = fel_enum_devices(devices, MAX_BOARDS);
+	std::set<std::string> ports;
+	for (int i = 0; i < count && i < MAX_BOARDS; i++)
+		ports.insert(devices[i].port);
+	return ports;
+}
+
+/* Tells the subscribers about boards that came and went */
+void RepairDaemon::scan() {
+	std::set<std::string> now = present();
+	for (auto & port : now) {
+		if (!boards.count(port))
+			broadcast(RepairSocket::line({ "board", port, "present" }));
+	}
+	for (auto & port : boards) {
+		if (!now.count(port))
+			broadcast(RepairSocket::line({ "board", port, "gone" }));
+	}
+	boards = now;
+}
+
+/* Starts a repair of the board on 'port' */
+bool RepairDaemon::start(const std::string & port, std::string * error) {
+	auto found = jobs.find(port);
+	Job * job = found == jobs.end() ? nullptr : found->second;
+	if (job && job->worker) {
+		*error = "Already repairing the board on " + port;
+		return false;
+	}
+	if (!fel_enum_present(port.c_str())) {
+		*error = "No C.H.I.P. in FEL mode on " + port;
+		return false;
+	}
+	RepairWorker * worker = new RepairWorker(port);
+	if (!worker->start(descriptors(), error)) {
+		delete worker;
+		return false;
+	}
+	if (!job)
+		job = jobs[port] = new Job(this, port);
+	job->worker = worker;
+	job->sid.clear();
+	job->lastNotify.clear();
+	job->progressFraction = 0;
+	job->bytesDone = 0;
+	return true;
+}
+
+/*
+ * Repairs again the boards whose repairs a crash of the daemon cut short,
+ * RepairTool picks each up where it was (RepairJournal.h). A board that is
+ * gone lost what was uploaded, its job is abandoned.
+ */
+void RepairDaemon::recover() {
+	for (auto & entry : RepairJournal::interrupted()) {
+		std::string error;
+		if (boards.count(entry.port)) {
+			if (start(entry.port, &error))
+				fprintf(stderr, "Resuming the repair on %s\n", entry.port.c_str());
+			continue;
+		}
+		entry.state = "abandoned";
+		entry.time = time(nullptr);
+		RepairJournal::append(entry);
+	}
+}
+
+/* One request line of a client; the reply goes to its buffer */
+void RepairDaemon::handle(Client * client, const std::vector<std::string> & request) {
+	const std::string & command = request[0];
+	std::string port = request.size() > 1 ? request[1] : "";
+	auto found = jobs.find(port);
+	Job * job = found == jobs.end() ? nullptr : found->second;
+
+	if (command == "devices") {
+		std::set<std::string> ports = present();
+		for (auto & entry : jobs) {
+			if (entry.second->worker)
+				ports.insert(entry.first);
+		}
+		for (auto & board : ports) {
+			auto it = jobs.find(board);
+			bool running = it != jobs.end() && it->second->worker;
+			std::string sid = it != jobs.end() ? it->second->sid : "";
+			client->out += RepairSocket::line({ "board", board, running ? "repairing" : "idle", sid });
+		}
+		client->out += RepairSocket::line({ "end" });
+	} else if (command == "repair" && !port.empty()) {
+		std::string error;
+		client->out += start(port, &error) ? RepairSocket::line({ "ok" }) : RepairSocket::line({ "error", error });
+	} else if (command == "cancel" && !port.empty()) {
+		if (job && job->worker) {
+			job->worker->cancel("Cancelled by a client of chip-boot-repaird");
+			client->out += RepairSocket::line({ "ok" });
+		} else {
+			client->out += RepairSocket::line({ "error", "Not repairing a board on " + port });
+		}
+	} else if (command == "subscribe") {
+		client->subscribed = true;
+		client->out += RepairSocket::line({ "ok" });
+		for (auto & board : boards)
+			client->out += RepairSocket::line({ "board", board, "present" });
+		for (auto & entry : jobs) {
+			if (!entry.second->worker)
+				continue;
+			if (!entry.second->sid.empty())
+				client->out += RepairSocket::line({ "device", entry.first, entry.second->sid });
+			client->out += entry.second->lastNotify;
+		}
+	} else {
+		client->out += RepairSocket::line({ "error", "Unknown request: " + command });
+	}
+}
+
+/* False once the client has hung up */
+bool RepairDaemon::readFrom(Client * client) {
+	char data[4096];
+	ssize_t size = recv(client->fd, data, sizeof(data), MSG_DONTWAIT);
+	if (size < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	if (size == 0)
+		return false;
+	client->in.append(data, size);
+	size_t end;
+	while ((end = client->in.find('\n')) != std::string::npos) {
+		std::string line = client->in.substr(0, end);
+		client->in.erase(0, end + 1);
+		if (!client->subscribed)
+			handle(client, RepairSocket::fields(line));
+	}
+	return client->in.size() <= MAX_BACKLOG;
+}
+
+/* False if the client is gone */
+bool RepairDaemon::writeTo(Client * client) {
+	while (!client->out.empty()) {
+		ssize_t size = send(client->fd, client->out.data(), client->out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (size < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		client->out.erase(0, size);
+	}
+	return true;
+}
+
+void RepairDaemon::run() {
+	recover();
+	uint64_t lastScan = usb_stats_now();
+	for (;;) {
+		std::vector<struct pollfd> fds = { { listenFd, POLLIN, 0 } };
+		std::vector<Job *> working;
+		for (auto & entry : jobs) {
+			if (entry.second->worker) {
+				fds.push_back({ entry.second->worker->fd(), POLLIN, 0 });
+				working.push_back(entry.second);
+			}
+		}
+		for (auto client : clients)
+			fds.push_back({ client->fd, (short)(POLLIN | (client->out.empty() ? 0 : POLLOUT)), 0 });
+		if (poll(fds.data(), fds.size(), SCAN_MS) < 0 && errno != EINTR) {
+			perror("poll");
+			return;
+		}
+
+		for (size_t i = 0; i < working.size(); i++) {
+			if (fds[1 + i].revents)
+				readWorker(working[i]);
+		}
+		/* clients only come and go further down, so fds still match */
+		for (size_t i = 1 + working.size(); i < fds.size(); i++) {
+			Client * client = clients[i - 1 - working.size()];
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				client->dropped = client->dropped || !readFrom(client);
+		}
+		if (usb_stats_now() - lastScan >= SCAN_MS * 1000000ull) {
+			scan();
+			lastScan = usb_stats_now();
+		}
+		for (size_t i = 0; i < clients.size(); i++) {
+			Client * client = clients[i];
+			if (!client->dropped)
+				client->dropped = !writeTo(client);
+			if (client->dropped) {
+				close(client->fd);
+				delete client;
+				clients.erase(clients.begin() + i--);
+			}
+		}
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(listenFd, nullptr, nullptr);
+			if (fd >= 0) {
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+				clients.push_back(new Client { fd, "", "", false, false });
+			}
+		}
+	}
+}
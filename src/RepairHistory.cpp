@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <set>
+#include <sstream>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#define mkdir(path, mode) _mkdir(path)
+#define fsync _commit
+#else
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include "crc32.h"
+}
+#include "RepairHistory.h"
+
+static const int FIELDS = 17;
+
+static void setError(std::string * error, const std::string & message) {
+	if (error)
+		*error = message;
+}
+
+RepairHistory::Record::Record() : time(0), socId(0), bundleVersion(0), waitMs(0), loadMs(0), planMs(0),
+	settleMs(0), totalMs(0), bytes(0), retries(0) {}
+
+std::string RepairHistory::path() {
+	const char * path = getenv("CHIP_BOOT_REPAIR_HISTORY");
+	if (path && *path)
+		return path;
+	const char * state = getenv("XDG_STATE_HOME");
+	if (state && *state)
+		return std::string(state) + "/chip-boot-repair/history.csv";
+	const char * home = getenv("HOME");
+	return std::string(home ? home : ".") + "/.local/state/chip-boot-repair/history.csv";
+}
+
+/* Keeps a field free of the separators of the format */
+static std::string clean(const std::string & text, const char * separators) {
+	std::string result = text;
+	for (auto & c : result) {
+		if (c == ',' || c == '\n' || c == '\r' || strchr(separators, c))
+			c = ' ';
+	}
+	return result;
+}
+
+static std::string number(const char * format, double value) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), format, value);
+	return buf;
+}
+
+std::string RepairHistory::format(const Record & record) {
+	std::string phases;
+	for (auto & phase : record.phases) {
+		if (!phases.empty())
+			phases += ' ';
+		phases += clean(phase.name, " =") + "=" + number("%.1f", phase.ms);
+	}
+	char soc[16] = "";
+	if (record.socId)
+		snprintf(soc, sizeof(soc), "%04x", record.socId);
+
+	std::string line = std::to_string(record.time) + "," + clean(record.host, "") + "," +
+		clean(record.port, "") + "," + soc + "," + clean(record.sid, "") + "," +
+		std::to_string(record.bundleVersion) + "," +
+		clean(record.outcome, "") + "," + number("%.1f", record.waitMs) + "," +
+		number("%.1f", record.loadMs) + "," + number("%.1f", record.planMs) + "," +
+		number("%.1f", record.settleMs) + "," + number("%.1f", record.totalMs) + "," +
+		std::to_string(record.bytes) + "," + std::to_string(record.retries) + "," + phases + "," +
+		clean(record.error, "");
+	char crc[16];
+	snprintf(crc, sizeof(crc), ",%08x", calc_crc32(line.data(), line.size(), 0));
+	return line + crc;
+}
+
+bool RepairHistory::parse(const std::string & line, Record & record) {
+	size_t last = line.rfind(',');
+	if (last == std::string::npos)
+		return false;
+	char * end;
+	unsigned long crc = strtoul(line.c_str() + last + 1, &end, 16);
+	if (end == line.c_str() + last + 1 || (*end && *end != '\r') || crc != calc_crc32(line.data(), last, 0))
+		return false;
+
+	std::vector<std::string> fields;
+	std::istringstream split(line);
+	for (std::string field; std::getline(split, field, ','); )
+		fields.push_back(field);
+	if (fields.size() != FIELDS)
+		return false;
+
+	Record result;
+	result.time = strtoll(fields[0].c_str(), nullptr, 10);
+	result.host = fields[1];
+	result.port = fields[2];
+	result.socId = strtoul(fields[3].c_str(), nullptr, 16);
+	result.sid = fields[4];
+	result.bundleVersion = strtoul(fields[5].c_str(), nullptr, 10);
+	result.outcome = fields[6];
+	result.waitMs = atof(fields[7].c_str());
+	result.loadMs = atof(fields[8].c_str());
+	result.planMs = atof(fields[9].c_str());
+	result.settleMs = atof(fields[10].c_str());
+	result.totalMs = atof(fields[11].c_str());
+	result.bytes = strtoull(fields[12].c_str(), nullptr, 10);
+	result.retries = atoi(fields[13].c_str());
+	std::istringstream phases(fields[14]);
+	for (std::string word; phases >> word; ) {
+		size_t equals = word.rfind('=');
+		if (equals == std::string::npos)
+			continue;
+		Phase phase = { word.substr(0, equals), atof(word.c_str() + equals + 1) };
+		result.phases.push_back(phase);
+	}
+	result.error = fields[15];
+	record = result;
+	return true;
+}
+
+/* mkdir -p of everything before the last slash */
+static void makeParents(const std::string & path) {
+	for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+		mkdir(path.substr(0, slash).c_str(), 0755);
+}
+
+/* The open log, shared by every repair of the process */
+static std::mutex historyLock;
+static int historyFd = -1;
+static std::string historyPath;
+static int unsynced = 0;
+static time_t lastSync = 0;
+/* "sid/bundle version" of every successful repair, read on first use */
+static std::set<std::string> * repairedChips = nullptr;
+static std::string repairedPath;
+
+static std::string chipKey(const std::string & sid, uint32_t bundleVersion) {
+	return sid + "/" + std::to_string(bundleVersion);
+}
+
+static void syncLocked() {
+	if (historyFd >= 0 && unsynced) {
+		fsync(historyFd);
+		unsynced = 0;
+	}
+	lastSync = time(nullptr);
+}
+
+static void syncAtExit() {
+	RepairHistory::sync();
+}
+
+static bool openLocked(const std::string & filePath, std::string * error) {
+	if (historyFd >= 0 && historyPath == filePath)
+		return true;
+	if (historyFd >= 0) {
+		syncLocked();
+		close(historyFd);
+		historyFd = -1;
+	}
+	makeParents(filePath);
+	int fd = open(filePath.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd < 0) {
+		setError(error, "Cannot open " + filePath + ": " + strerror(errno));
+		return false;
+	}
+	/* a new file gets the header, one cut short by a crash gets its line ended */
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size == 0) {
+		static const char HEADER[] = "time,host,port,soc,sid,bundle,outcome,wait_ms,load_ms,plan_ms,"
+			"settle_ms,total_ms,bytes,retries,phases,error,crc\n";
+		if (write(fd, HEADER, strlen(HEADER)) < 0) {
+			setError(error, "Cannot write " + filePath + ": " + strerror(errno));
+			close(fd);
+			return false;
+		}
+	} else {
+		FILE * in = fopen(filePath.c_str(), "rb");
+		if (in && fseek(in, -1, SEEK_END) == 0 && fgetc(in) != '\n' && write(fd, "\n", 1) < 0) {
+			fclose(in);
+			setError(error, "Cannot write " + filePath + ": " + strerror(errno));
+			close(fd);
+			return false;
+		}
+		if (in)
+			fclose(in);
+	}
+
+	static bool registered = false;
+	if (!registered)
+		atexit(syncAtExit);
+	registered = true;
+	historyFd = fd;
+	historyPath = filePath;
+	lastSync = time(nullptr);
+	return true;
+}
+
+bool RepairHistory::append(const Record & record, std::string * error) {
+	std::string line = format(record) + "\n";
+	std::lock_guard<std::mutex> guard(historyLock);
+	std::string filePath = path();
+	if (!openLocked(filePath, error))
+		return false;
+	if (write(historyFd, line.data(), line.size()) != (ssize_t)line.size()) {
+		setError(error, "Cannot write " + filePath + ": " + strerror(errno));
+		return false;
+	}
+	if (repairedChips && repairedPath == filePath && record.outcome == "ok" && !record.sid.empty())
+		repairedChips->insert(chipKey(record.sid, record.bundleVersion));
+	if (++unsynced >= SYNC_RECORDS || time(nullptr) - lastSync >= SYNC_SECONDS)
+		syncLocked();
+	return true;
+}
+
+void RepairHistory::sync() {
+	std::lock_guard<std::mutex> guard(historyLock);
+	syncLocked();
+}
+
+bool RepairHistory::repaired(const std::string & sid, uint32_t bundleVersion) {
+	std::lock_guard<std::mutex> guard(historyLock);
+	std::string filePath = path();
+	if (!repairedChips || repairedPath != filePath) {
+		std::vector<Record> records;
+		load(filePath, records); // no log yet: nothing was repaired
+		delete repairedChips;
+		repairedChips = new std::set<std::string>();
+		repairedPath = filePath;
+		for (auto & record : records) {
+			if (record.outcome == "ok" && !record.sid.empty())
+				repairedChips->insert(chipKey(record.sid, record.bundleVersion));
+		}
+	}
+	return repairedChips->count(chipKey(sid, bundleVersion)) > 0;
+}
+
+bool RepairHistory::load(const std::string & path, std::vector<Record> & records, std::string * error,
+		size_t * damaged) {
+	FILE * in = fopen(path.c_str(), "r");
+	if (!in) {
+		setError(error, "Cannot open " + path);
+		return false;
+	}
+	size_t skipped = 0;
+	std::string line;
+	char buf[4096];
+	while (fgets(buf, sizeof(buf), in)) {
+		line += buf;
+		if (line.back() != '\n' && !feof(in))
+			continue; // longer than the buffer
+		if (line.back() == '\n')
+			line.pop_back();
+		Record record;
+		if (parse(line, record))
+			records.push_back(record);
+		else if (line.compare(0, 5, "time,") != 0 && !line.empty())
+			skipped++;
+		line.clear();
+	}
+	fclose(in);
+	if (damaged)
+		*damaged = skipped;
+	return true;
+}
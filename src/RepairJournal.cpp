@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <map>
+#include <set>
+#include <mutex>
+#include <sstream>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <process.h>
+#define mkdir(path, mode) _mkdir(path)
+#define fsync _commit
+#define getpid _getpid
+#define ftruncate _chsize
+#else
+#include <signal.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include "crc32.h"
+}
+#include "RepairHistory.h"
+#include "RepairJournal.h"
+
+static const int FIELDS = 11;
+
+/* std::chrono binds it to a reference, so it needs a definition */
+const int RepairJournal::SYNC_MS;
+
+typedef std::chrono::steady_clock Clock;
+
+RepairJournal::Entry::Entry() : time(0), device(-1), bundleVersion(0), step(-1), bytes(0), state("running") {}
+
+std::string RepairJournal::path() {
+	const char * path = getenv("CHIP_BOOT_REPAIR_JOURNAL");
+	if (path && *path)
+		return path;
+	std::string history = RepairHistory::path();
+	size_t slash = history.rfind('/');
+	return (slash == std::string::npos ? "" : history.substr(0, slash + 1)) + "journal.csv";
+}
+
+std::string RepairJournal::newJob() {
+	static std::mutex countLock;
+	static unsigned count = 0;
+	std::lock_guard<std::mutex> guard(countLock);
+	return std::to_string(getpid()) + "-" + std::to_string(time(nullptr)) + "-" + std::to_string(++count);
+}
+
+/* Keeps a field free of the separators of the format */
+static std::string clean(const std::string & text) {
+	std::string result = text;
+	for (auto & c : result) {
+		if (c == ',' || c == '\n' || c == '\r')
+			c = ' ';
+	}
+	return result;
+}
+
+std::string RepairJournal::format(const Entry & entry) {
+	std::string line = std::to_string(entry.time) + "," + clean(entry.job) + "," + clean(entry.port) + "," +
+		std::to_string(entry.device) + "," + clean(entry.sid) + "," + std::to_string(entry.bundleVersion) + "," +
+		std::to_string(entry.step) + "," + clean(entry.phase) + "," + std::to_string(entry.bytes) + "," +
+		clean(entry.state);
+	char crc[16];
+	snprintf(crc, sizeof(crc), ",%08x", calc_crc32(line.data(), line.size(), 0));
+	return line + crc;
+}
+
+bool RepairJournal::parse(const std::string & line, Entry & entry) {
+	size_t last = line.rfind(',');
+	if (last == std::string::npos)
+		return false;
+	char * end;
+	unsigned long crc = strtoul(line.c_str() + last + 1, &end, 16);
+	if (end == line.c_str() + last + 1 || (*end && *end != '\r' && *end != '\n') ||
+	    crc != calc_crc32(line.data(), last, 0))
+		return false;
+
+	std::vector<std::string> fields;
+	std::istringstream split(line);
+	for (std::string field; std::getline(split, field, ','); )
+		fields.push_back(field);
+	if (fields.size() != FIELDS)
+		return false;
+
+	Entry result;
+	result.time = strtoll(fields[0].c_str(), nullptr, 10);
+	result.job = fields[1];
+	result.port = fields[2];
+	result.device = atoi(fields[3].c_str());
+	result.sid = fields[4];
+	result.bundleVersion = strtoul(fields[5].c_str(), nullptr, 10);
+	result.step = atoi(fields[6].c_str());
+	result.phase = fields[7];
+	result.bytes = strtoull(fields[8].c_str(), nullptr, 10);
+	result.state = fields[9];
+	entry = result;
+	return true;
+}
+
+/* The last entry of every job in 'text', in the order the jobs started */
+static std::vector<RepairJournal::Entry> lastEntries(const std::string & text) {
+	std::vector<RepairJournal::Entry> entries;
+	std::map<std::string, size_t> jobs;
+	std::istringstream lines(text);
+	for (std::string line; std::getline(lines, line); ) {
+		RepairJournal::Entry entry;
+		if (!RepairJournal::parse(line, entry))
+			continue; // cut short by a crash
+		auto job = jobs.find(entry.job);
+		if (job == jobs.end()) {
+			jobs[entry.job] = entries.size();
+			entries.push_back(entry);
+		} else {
+			entries[job->second] = entry;
+		}
+	}
+	return entries;
+}
+
+static bool readAll(int fd, std::string & text) {
+	text.clear();
+	if (lseek(fd, 0, SEEK_SET) != 0)
+		return false;
+	char buf[4096];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		text.append(buf, n);
+	return n == 0;
+}
+
+/* mkdir -p of everything before the last slash */
+static void makeParents(const std::string & path) {
+	for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+		mkdir(path.substr(0, slash).c_str(), 0755);
+}
+
+/* Between the processes of a station; a process's own threads take journalLock */
+static void lockFile(int fd, bool exclusive) {
+#ifndef _WIN32
+	while (flock(fd, exclusive ? LOCK_EX : LOCK_SH) != 0 && errno == EINTR)
+		;
+#endif
+}
+
+static void unlockFile(int fd) {
+#ifndef _WIN32
+	flock(fd, LOCK_UN);
+#endif
+}
+
+/* The open journal, shared by every repair of the process */
+static std::mutex journalLock;
+static int journalFd = -1;
+static std::string journalPath;
+static long journalPid = 0; // that opened journalFd
+static int unsynced = 0;
+static Clock::time_point lastSync;
+static std::set<std::string> openJobs; // of this process, not interrupted
+
+static void syncAtExit() {
+	RepairJournal::sync(true);
+}
+
+static bool openLocked(const std::string & filePath, std::string * error) {
+	if (journalFd >= 0 && journalPath == filePath && journalPid == getpid())
+		return true;
+	if (journalFd >= 0 && journalPid != getpid()) {
+		close(journalFd); // a fork()ed worker: its flock()s need a file of its own
+		journalFd = -1;
+	}
+	if (journalFd >= 0) {
+		fsync(journalFd);
+		close(journalFd);
+		journalFd = -1;
+	}
+	makeParents(filePath);
+	int fd = open(filePath.c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+	if (fd < 0) {
+		if (error)
+			*error = "Cannot open " + filePath + ": " + strerror(errno);
+		return false;
+	}
+	static bool registered = false;
+	if (!registered)
+		atexit(syncAtExit);
+	registered = true;
+	journalFd = fd;
+	journalPath = filePath;
+	journalPid = getpid();
+	unsynced = 0;
+	lastSync = Clock::now();
+	return true;
+}
+
+/* Rewrites the journal with only the jobs still running, in every process. Under journalLock */
+static void compactLocked() {
+	lockFile(journalFd, true);
+	std::string text, kept;
+	if (readAll(journalFd, text)) {
+		for (auto & entry : lastEntries(text)) {
+			if (entry.state == "running")
+				kept += RepairJournal::format(entry) + "\n";
+		}
+		if (ftruncate(journalFd, 0) == 0 && write(journalFd, kept.data(), kept.size()) == (ssize_t)kept.size()) {
+			fsync(journalFd);
+			unsynced = 0;
+			lastSync = Clock::now();
+		}
+	}
+	unlockFile(journalFd);
+}
+
+bool RepairJournal::append(const Entry & entry, std::string * error) {
+	std::string line = format(entry) + "\n";
+	std::lock_guard<std::mutex> guard(journalLock);
+	std::string filePath = path();
+	if (!openLocked(filePath, error))
+		return false;
+	lockFile(journalFd, false);
+	/* a process that died mid-write left its line unended; end it, or this one joins it */
+	char last;
+	if (lseek(journalFd, -1, SEEK_END) >= 0 && read(journalFd, &last, 1) == 1 && last != '\n')
+		line.insert(0, "\n");
+	bool written = write(journalFd, line.data(), line.size()) == (ssize_t)line.size();
+	unlockFile(journalFd);
+	if (!written) {
+		if (error)
+			*error = "Cannot write " + filePath + ": " + strerror(errno);
+		return false;
+	}
+	unsynced++;
+	if (entry.state == "running")
+		openJobs.insert(entry.job);
+	else
+		openJobs.erase(entry.job);
+	struct stat st;
+	if (entry.state != "running" && fstat(journalFd, &st) == 0 && st.st_size > COMPACT_BYTES)
+		compactLocked();
+	return true;
+}
+
+void RepairJournal::sync(bool force) {
+	std::lock_guard<std::mutex> guard(journalLock);
+	if (journalFd < 0 || !unsynced)
+		return;
+	if (!force && unsynced < SYNC_ENTRIES &&
+	    Clock::now() - lastSync < std::chrono::milliseconds(SYNC_MS))
+		return;
+	fsync(journalFd);
+	unsynced = 0;
+	lastSync = Clock::now();
+}
+
+/* Whether the process that started 'job' still runs it */
+static bool jobAlive(const std::string & job) {
+	{
+		std::lock_guard<std::mutex> guard(journalLock);
+		if (openJobs.count(job))
+			return true;
+	}
+#ifndef _WIN32
+	/* another process, unless it is gone or the pid came back after a reboot as ours */
+	long pid = strtol(job.c_str(), nullptr, 10);
+	if (pid > 0 && pid != getpid() && (kill(pid, 0) == 0 || errno == EPERM))
+		return true;
+#endif
+	return false;
+}
+
+std::vector<RepairJournal::Entry> RepairJournal::interrupted(const std::string & port) {
+	std::vector<Entry> result;
+	FILE * in = fopen(path().c_str(), "rb");
+	if (!in)
+		return result; // no journal, nothing was cut short
+	std::string text;
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		text.append(buf, n);
+	fclose(in);
+	for (auto & entry : lastEntries(text)) {
+		if (entry.state == "running" && (port.empty() || entry.port == port) && !jobAlive(entry.job))
+			result.push_back(entry);
+	}
+	return result;
+}
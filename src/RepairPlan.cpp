@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <sstream>
+
+#ifdef _WIN32
+#include <io.h>
+#define access _access
+#define R_OK 4
+#else
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
+
+extern "C" {
+#include "libsunxi.h"
+}
+#include "PayloadBundle.h"
+#include "RepairPlan.h"
+
+/* Where DRAM starts on sunxi: nothing there is usable before the SPL has run */
+static const uint32_t DRAM_BASE = 0x40000000;
+
+/* Step deadlines: this many times the time of the step's bytes, plus the fixed part */
+static const double DEADLINE_SLACK = 4;
+static const unsigned DEADLINE_BASE_MS = 3000;
+/* fel's tune writes its region once per probed chunk size (aw_tune_chunk_sizes) */
+static const unsigned TUNE_PASSES = 7;
+
+static void setError(std::string * error, const std::string & message) {
+	if (error)
+		*error = message;
+}
+
+static std::string hexAddress(uint32_t address) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "0x%08x", address);
+	return buf;
+}
+
+static bool isPayload(const std::string & word) {
+	return word.compare(0, strlen(LIBSUNXI_PAYLOAD_PREFIX), LIBSUNXI_PAYLOAD_PREFIX) == 0;
+}
+
+/* Splits a line into words and an optional trailing "quoted" label; false on a stray quote */
+static bool splitLine(const std::string & line, std::vector<std::string> & words, std::string & label) {
+	size_t quote = line.find('"');
+	size_t comment = line.find('#');
+	std::string rest = line.substr(0, std::min(quote, comment));
+	if (quote != std::string::npos && quote < comment) {
+		size_t end = line.find('"', quote + 1);
+		if (end == std::string::npos)
+			return false;
+		label = line.substr(quote + 1, end - quote - 1);
+		std::string tail = line.substr(end + 1);
+		size_t first = tail.find_first_not_of(" \t\r");
+		if (first != std::string::npos && tail[first] != '#')
+			return false; // nothing but a comment may follow the label
+	}
+	std::istringstream split(rest);
+	for (std::string word; split >> word; )
+		words.push_back(word);
+	return true;
+}
+
+/* Checks a plan line against the bundle and turns it into a fel command */
+class StepParser {
+public:
+	StepParser(const PayloadBundle * bundle, bool splDone, std::string & problem)
+		: bundle(bundle), splDone(splDone), problem(problem) {}
+
+	bool source(const std::string & word, const PayloadBundle::Entry ** entry) {
+		*entry = nullptr;
+		if (isPayload(word)) {
+			std::string name = word.substr(strlen(LIBSUNXI_PAYLOAD_PREFIX));
+			*entry = bundle ? bundle->find(name) : nullptr;
+			if (!*entry)
+				return fail("the payload bundle has no " + name);
+			return true;
+		}
+		if (access(word.c_str(), R_OK) != 0)
+			return fail("cannot read " + word);
+		return true;
+	}
+
+	bool address(const std::string & word, uint32_t & value) {
+		if (isPayload(word)) {
+			const PayloadBundle::Entry * entry;
+			if (!source(word, &entry))
+				return false;
+			if (!entry->loadAddress)
+				return fail(word + " has no load address");
+			value = entry->loadAddress;
+		} else if (!number(word, value)) {
+			return fail("bad address " + word);
+		}
+		if (value >= DRAM_BASE && !splDone)
+			return fail(hexAddress(value) + " is in DRAM, which needs an spl step first");
+		return true;
+	}
+
+	bool number(const std::string & word, uint32_t & value) {
+		char * end;
+		unsigned long n = strtoul(word.c_str(), &end, 0);
+		if (word.empty() || *end || n > 0xffffffffUL)
+			return false;
+		value = n;
+		return true;
+	}
+
+	bool fail(const std::string & message) {
+		problem = message;
+		return false;
+	}
+
+private:
+	const PayloadBundle * bundle;
+	bool splDone;
+	std::string & problem;
+};
+
+/* Size of a checked SOURCE */
+static uint32_t sourceSize(const std::string & word, const PayloadBundle::Entry * entry) {
+	struct stat st;
+	if (entry)
+		return entry->size;
+	return stat(word.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+static bool parseStep(const std::vector<std::string> & words, const PayloadBundle * bundle, bool splDone,
+		RepairPlan::Step & step, std::string & problem) {
+	StepParser parser(bundle, splDone, problem);
+	const std::string & op = words[0];
+	size_t args = words.size() - 1;
+	const PayloadBundle::Entry * entry;
+	uint32_t address, length, value;
+	step.op = op;
+	step.bytes = 0;
+
+	if (op == "spl") {
+		if (args != 1)
+			return parser.fail("usage: spl SOURCE");
+		if (!parser.source(words[1], &entry))
+			return false;
+		step.command = { "spl", words[1] };
+		step.bytes = sourceSize(words[1], entry);
+	} else if (op == "write" || op == "verify") {
+		if (args < 1 || args > 2)
+			return parser.fail("usage: " + op + " SOURCE [ADDRESS]");
+		if (!parser.source(words[1], &entry))
+			return false;
+		if (args == 2) {
+			if (!parser.address(words[2], address))
+				return false;
+		} else if (!entry || !entry->loadAddress) {
+			return parser.fail(words[1] + " needs an address");
+		} else if (!parser.address(words[1], address)) {
+			return false;
+		}
+		step.command = { op, hexAddress(address), words[1] };
+		step.bytes = sourceSize(words[1], entry);
+	} else if (op == "exec") {
+		if (args != 1)
+			return parser.fail("usage: exec ADDRESS");
+		if (!parser.address(words[1], address))
+			return false;
+		step.command = { "exe", hexAddress(address) };
+	} else if (op == "fill") {
+		if (args != 3)
+			return parser.fail("usage: fill ADDRESS LENGTH VALUE");
+		if (!parser.address(words[1], address))
+			return false;
+		if (!parser.number(words[2], length) || length == 0)
+			return parser.fail("bad length " + words[2]);
+		if (!parser.number(words[3], value) || value > 0xff)
+			return parser.fail("bad byte value " + words[3]);
+		step.command = { "fill", hexAddress(address), hexAddress(length), std::to_string(value) };
+		step.bytes = length;
+	} else if (op == "tune") {
+		if (args != 2)
+			return parser.fail("usage: tune ADDRESS LENGTH");
+		if (!parser.address(words[1], address))
+			return false;
+		if (!parser.number(words[2], length) || length < 64 * 1024)
+			return parser.fail("tune needs a length of at least 64 KiB");
+		step.command = { "tune", hexAddress(address), hexAddress(length) };
+		step.bytes = length;
+	} else {
+		return parser.fail("unknown operation " + op);
+	}
+	return true;
+}
+
+bool RepairPlan::parse(const std::string & text, const PayloadBundle * bundle, RepairPlan & plan,
+		std::string * error, const std::string & name) {
+	std::vector<Step> steps;
+	bool splDone = false;
+	std::istringstream lines(text);
+	int lineNumber = 0;
+	for (std::string line; std::getline(lines, line); ) {
+		lineNumber++;
+		std::vector<std::string> words;
+		std::string label;
+		std::string problem;
+		Step step;
+		step.line = lineNumber;
+		if (!splitLine(line, words, label)) {
+			problem = "bad quoting";
+		} else if (words.empty()) {
+			if (label.empty())
+				continue;
+			problem = "a progress text needs an operation";
+		} else if (parseStep(words, bundle, splDone, step, problem)) {
+			step.label = label;
+			splDone = splDone || step.op == "spl";
+			steps.push_back(step);
+			continue;
+		}
+		setError(error, name + ":" + std::to_string(lineNumber) + ": " + problem);
+		return false;
+	}
+	if (steps.empty()) {
+		setError(error, name + " has no steps");
+		return false;
+	}
+	plan.stepList = steps;
+	return true;
+}
+
+bool RepairPlan::load(const std::string & path, const PayloadBundle * bundle, RepairPlan & plan, std::string * error) {
+	FILE * in = fopen(path.c_str(), "r");
+	if (!in) {
+		setError(error, "Cannot open " + path);
+		return false;
+	}
+	std::string text;
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		text.append(buf, n);
+	fclose(in);
+	return parse(text, bundle, plan, error, path);
+}
+
+bool RepairPlan::executes() const {
+	for (auto & step : stepList) {
+		if (step.op == "exec")
+			return true;
+	}
+	return false;
+}
+
+unsigned RepairPlan::deadlineMs(const Step & step, double bytesPerSecond) {
+	if (bytesPerSecond <= 0)
+		bytesPerSecond = UNMEASURED_RATE;
+	double bytes = step.op == "tune" ? (double)step.bytes * TUNE_PASSES : step.bytes;
+	return DEADLINE_BASE_MS + (unsigned)(DEADLINE_SLACK * bytes * 1000 / bytesPerSecond);
+}
+
+std::vector<std::string> RepairPlan::felArguments() const {
+	std::vector<std::string> arguments = { "./fel" };
+	for (auto & step : stepList)
+		arguments.insert(arguments.end(), step.command.begin(), step.command.end());
+	return arguments;
+}
+
+bool RepairPlan::split(RepairPlan & stage, RepairPlan & finish) const {
+	size_t exec = 0;
+	while (exec < stepList.size() && stepList[exec].op != "exec")
+		exec++;
+	if (exec == 0 || exec == stepList.size())
+		return false;
+	stage.stepList.assign(stepList.begin(), stepList.begin() + exec);
+	finish.stepList.clear();
+	for (size_t i = 0; i < exec; i++) {
+		if (stepList[i].op != "write")
+			continue;
+		Step verify = stepList[i];
+		verify.op = "verify";
+		verify.command[0] = "verify";
+		verify.label = finish.stepList.empty() ? "Verify upload..." : "";
+		finish.stepList.push_back(verify);
+	}
+	finish.stepList.insert(finish.stepList.end(), stepList.begin() + exec, stepList.end());
+	return true;
+}
+
+bool RepairPlan::resume(size_t step, RepairPlan & resumed) const {
+	if (step >= stepList.size())
+		return false;
+	bool splDone = false;
+	for (size_t i = 0; i < step; i++) {
+		if (stepList[i].op == "exec")
+			return false;
+		splDone = splDone || stepList[i].op == "spl";
+	}
+	if (!splDone)
+		return false;
+	resumed.stepList.clear();
+	for (size_t i = 0; i < step; i++) {
+		Step again = stepList[i];
+		if (again.op == "write") {
+			again.op = "verify";
+			again.command[0] = "verify";
+		} else if (again.op != "fill") {
+			continue;
+		}
+		again.label = resumed.stepList.empty() ? "Verify upload..." : "";
+		resumed.stepList.push_back(again);
+	}
+	resumed.stepList.insert(resumed.stepList.end(), stepList.begin() + step, stepList.end());
+	return true;
+}
@@ -0,0 +1,120 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // macOS: a daemon that went away raises SIGPIPE
+#endif
+
+#include "RepairSocket.h"
+
+const char * const RepairSocket::DEFAULT_PATH = "/var/run/chip-boot-repaird.sock";
+
+//static
+std::string RepairSocket::path() {
+	const char * path = getenv("CHIP_BOOT_REPAIR_SOCKET");
+	return path && *path ? path : DEFAULT_PATH;
+}
+
+//static
+int RepairSocket::connect() {
+#ifdef _WIN32
+	return -1;
+#else
+	std::string name = path();
+	struct sockaddr_un address;
+	if (name.size() >= sizeof(address.sun_path))
+		return -1;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, name.c_str());
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (::connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+#endif
+}
+
+//static
+std::string RepairSocket::line(const std::vector<std::string> & fields) {
+	std::string text;
+	for (size_t i = 0; i < fields.size(); i++) {
+		if (i)
+			text += '\t';
+		for (char c : fields[i]) {
+			switch (c) {
+			case '\t': text += "\\t"; break;
+			case '\n': text += "\\n"; break;
+			case '\\': text += "\\\\"; break;
+			default: text += c; break;
+			}
+		}
+	}
+	return text + '\n';
+}
+
+//static
+std::vector<std::string> RepairSocket::fields(const std::string & line) {
+	std::vector<std::string> fields(1);
+	for (size_t i = 0; i < line.size(); i++) {
+		char c = line[i];
+		if (c == '\t') {
+			fields.push_back("");
+		} else if (c == '\\' && i + 1 < line.size()) {
+			c = line[++i];
+			fields.back() += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+		} else if (c != '\n' && c != '\r') {
+			fields.back() += c;
+		}
+	}
+	return fields;
+}
+
+//static
+bool RepairSocket::readLine(int fd, std::string & buffer, std::string & line) {
+#ifdef _WIN32
+	return false;
+#else
+	for (;;) {
+		size_t end = buffer.find('\n');
+		if (end != std::string::npos) {
+			line = buffer.substr(0, end);
+			buffer.erase(0, end + 1);
+			return true;
+		}
+		char data[4096];
+		ssize_t size = read(fd, data, sizeof(data));
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size <= 0)
+			return false;
+		buffer.append(data, size);
+	}
+#endif
+}
+
+//static
+bool RepairSocket::writeAll(int fd, const std::string & text) {
+#ifdef _WIN32
+	return false;
+#else
+	size_t done = 0;
+	while (done < text.size()) {
+		ssize_t size = send(fd, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size <= 0)
+			return false;
+		done += size;
+	}
+	return true;
+#endif
+}
@@ -2,9 +2,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <string>
 #include <iostream>
 #include <vector>
+#include <mutex>
+#include <algorithm>
 
 using namespace std;
 
@@ -21,9 +24,17 @@ using namespace std;
 
 extern "C" {
 #include "libsunxi.h"
+#include "usbstats.h"
+#include "felenum.h"
 }
 #include "RepairTool.h"
 #include "RepairObserver.h"
+#include "PayloadBundle.h"
+#include "RepairHistory.h"
+#include "RepairPlan.h"
+#include "LinkScheduler.h"
+#include "Startup.h"
+#include "TraceSpan.h"
 int timeout = 30;
 
 const int SUCCESS = 0;
@@ -63,12 +74,40 @@ const std::string filePrefix() {
 	return PREFIX;
 }
 
+/* The payload bundle can be swapped atomically by renaming a new one over it */
+const std::string payloadBundlePath() {
+	const char * path = getenv("CHIP_BOOT_REPAIR_PAYLOAD");
+	if (path && *path)
+		return path;
+	return filePrefix() + "payload.bundle";
+}
+
+const std::string SPL_PAYLOAD = "sunxi-spl.bin";
+const std::string SPL_ECC_PAYLOAD = "sunxi-spl-with-ecc.bin";
+const std::string UBOOT_PAYLOAD = "padded-uboot";
+const std::string UBOOT_SCRIPT_PAYLOAD = "uboot.scr";
+
 Strings fel_ver = { "./fel", "ver"};
-Strings fel_spl = { "./fel", "spl", "PREFIXsunxi-spl.bin"};
-Strings fel_write_spl = { "./fel", "write", "0x43200000", "PREFIXsunxi-spl-with-ecc.bin" };
-Strings fel_write_uboot = { "./fel", "write", "0x4a000000", "PREFIXpadded-uboot" };
-Strings fel_write_uboot_script = { "./fel", "write", "0x43100000", "PREFIXuboot.scr" };
-Strings fel_execute = { "./fel", "exe", "0x4a000000" };
+Strings fel_sid = { "./fel", "sid"};
+
+/*
+ * The built-in repair, see RepairPlan.h. The tune step probes bulk transfer
+ * sizes on a port that has no tuning yet; its scratch data goes where
+ * U-Boot is written next, in DRAM the SPL has set up.
+ */
+const std::string DEFAULT_PLAN =
+	"spl payload:" + SPL_PAYLOAD + " \"Upload SPL...\"\n"
+	"tune payload:" + UBOOT_PAYLOAD + " 0x400000\n"
+	"write payload:" + SPL_ECC_PAYLOAD + " \"Upload SPL with ECC...\"\n"
+	"write payload:" + UBOOT_PAYLOAD + " \"Upload uboot...\"\n"
+	"write payload:" + UBOOT_SCRIPT_PAYLOAD + " \"Uboot scr write...\"\n"
+	"exec payload:" + UBOOT_PAYLOAD + " \"Execute uboot script...\"\n";
+
+/* A plan file to run instead of the built-in one */
+const std::string repairPlanPath() {
+	const char * path = getenv("CHIP_BOOT_REPAIR_PLAN");
+	return path ? path : "";
+}
 
 // From http://bits.minhazulhaque.com/cpp/find-and-replace-all-occurrences-in-cpp-string.html
 void find_and_replace(string& source, string const& find, string const& replace)
@@ -92,24 +131,555 @@ char ** prefixedStringArray(const std::string & prefix, const Strings & strings)
 }
 
 
+/* CHIP_BOOT_REPAIR_SKIP_REPAIRED=1 leaves alone boards the history has repaired with these payloads */
+static bool skipRepairedBoards() {
+	const char * skip = getenv("CHIP_BOOT_REPAIR_SKIP_REPAIRED");
+	return skip && *skip && strcmp(skip, "0") != 0;
+}
+
+static uint32_t bundleVersion() {
+	return PayloadBundle::shared() ? PayloadBundle::shared()->version() : 0;
+}
+
 bool RepairTool::repair(bool wait) {
-	if (wait)
-		waitForFel();
-	spl_write();
-	spl_w_ecc_write();
-	uboot_write();
-	uboot_scr_write();
-	fel_exe();
+	TraceSpan span("repair", "repair");
+	RepairHistory::Record record;
+	uint64_t start = usb_stats_now();
+	cancelToken.reset();
+	long prepared = prepare();
+	devicePort.clear();
+	socId = 0;
+	sid.clear();
+	libsunxi_set_device_handler(&RepairTool::onDevice, this);
+	CancelToken::setCurrent(&cancelToken);
+	if (wait) {
+		uint64_t waitStart = usb_stats_now();
+		bool found = waitForFel(prepared);
+		record.waitMs = (usb_stats_now() - waitStart) / 1e6;
+		if (!found) {
+			libsunxi_set_device_handler(nullptr, nullptr);
+			CancelToken::setCurrent(nullptr);
+			return false;
+		}
+	}
+	identify();
+	/* only the part of the preparation the device did not hide */
+	uint64_t loadStart = usb_stats_now();
+	host.wait(prepared);
+	if (!loadPayloads()) {
+		libsunxi_set_device_handler(nullptr, nullptr);
+		CancelToken::setCurrent(nullptr);
+		return false;
+	}
+	record.loadMs = (usb_stats_now() - loadStart) / 1e6;
+	RepairPlan rest;
+	int resumeStep = interruptedStep(rest);
+	startJob();
+	if (skipRepairedBoards() && !sid.empty() && RepairHistory::repaired(sid, bundleVersion())) {
+		skip(record, start);
+		libsunxi_set_device_handler(nullptr, nullptr);
+		CancelToken::setCurrent(nullptr);
+		return true;
+	}
+	retries = 0;
+	libsunxi_set_retry_handler(&RepairTool::onRetry, this);
+	const RepairPlan * full = plan;
+	bool ok = resumeStep >= 0 && resume(rest, resumeStep, record);
+	if (!ok && !cancelToken.cancelled()) {
+		record.error.clear();
+		jobBase = 0;
+		ok = runPlan(full, record);
+	}
+	libsunxi_set_retry_handler(nullptr, nullptr);
+	libsunxi_set_device_handler(nullptr, nullptr);
+	CancelToken::setCurrent(nullptr);
+	record.totalMs = (usb_stats_now() - start) / 1e6 - record.waitMs;
+	host.add("write_metrics", writeMetrics);
+	writeHistory(record, ok ? "ok" : "failed");
+	if (ok)
+		complete();
+	return ok;
+}
+
+/* Reads the Security ID, so the repair is known by the board and not only by its port */
+void RepairTool::identify() {
+	TraceSpan span("repair", "identify");
+	char * output = nullptr;
+	do_fel(onPort(fel_sid), &output);
+	free(output);
+	for (auto observer : *observers)
+		observer->onDevice(devicePort, sid);
+}
+
+/* A plan step as named in the history log: the operation and the payload it uses */
+static std::string stepName(const RepairPlan::Step & step) {
+	for (auto & word : step.command) {
+		if (word.compare(0, strlen(LIBSUNXI_PAYLOAD_PREFIX), LIBSUNXI_PAYLOAD_PREFIX) == 0)
+			return step.op + ":" + word.substr(strlen(LIBSUNXI_PAYLOAD_PREFIX));
+	}
+	return step.op;
+}
+
+/*
+ * Ends the jobs of the journal that were cut short on this board's port:
+ * the last one is "resumed" if its board is still in FEL mode, on the same
+ * USB device number and with the same payloads, and the step it was at can
+ * be picked up (RepairPlan::resume()); that step is returned, with 'rest'
+ * of the plan from it. Any other job is "restarted" on the same board, or
+ * "abandoned". -1 if there is nothing to resume.
+ */
+int RepairTool::interruptedStep(RepairPlan & rest) {
+	std::vector<RepairJournal::Entry> entries = RepairJournal::interrupted(devicePort);
+	if (devicePort.empty() || entries.empty())
+		return -1;
+	int device = deviceNumber(devicePort);
+	int step = -1;
+	for (size_t i = 0; i < entries.size(); i++) {
+		RepairJournal::Entry & entry = entries[i];
+		bool sameBoard = !sid.empty() && entry.sid == sid;
+		if (i + 1 == entries.size() && sameBoard && device >= 0 && entry.device == device &&
+		    entry.bundleVersion == bundleVersion() && entry.step >= 0 && entry.step < (int)plan->steps().size() &&
+		    entry.phase == stepName(plan->steps()[entry.step]) && plan->resume(entry.step, rest)) {
+			entry.state = "resumed";
+			step = entry.step;
+		} else {
+			entry.state = sameBoard ? "restarted" : "abandoned";
+		}
+		entry.time = time(nullptr);
+		RepairJournal::append(entry);
+	}
+	return step;
+}
+
+/* Runs the 'rest' of a plan that a crash cut short at 'step'; false to repair from the start */
+bool RepairTool::resume(const RepairPlan & rest, int step, RepairHistory::Record & record) {
+	TraceSpan span("repair", "resume");
+	std::string details = "Picking up from " + stepName(plan->steps()[step]) + ", where the last repair stopped";
+	notify("Resuming the repair...", 0.1, &details);
+	jobBase = step;
+	quiet = true; // a failed verify is not the end of the repair
+	bool ok = runPlan(&rest, record);
+	quiet = false;
+	return ok;
+}
+
+/* Journals a repair of the board identified, from step 'base' of the plan, see RepairJournal.h */
+void RepairTool::startJob(int base) {
+	endJob("restarted");
+	job = RepairJournal::Entry();
+	job.job = RepairJournal::newJob();
+	job.port = devicePort;
+	job.device = deviceNumber(devicePort);
+	job.sid = sid;
+	job.bundleVersion = bundleVersion();
+	job.phase = "identify";
+	jobBase = base;
+	journal();
+}
+
+/* Appends where the job is; the fsync()s are batched on the host queue, and forced when it ends */
+void RepairTool::journal() {
+	job.time = time(nullptr);
+	std::string error;
+	if (!RepairJournal::append(job, &error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		job.job.clear(); // not journaled, rather than an error per step
+		return;
+	}
+	bool force = job.state != "running";
+	host.add("sync_journal", [force] { RepairJournal::sync(force); });
+}
+
+void RepairTool::endJob(const std::string & state) {
+	if (job.job.empty())
+		return;
+	job.state = state;
+	journal();
+	job.job.clear();
+}
+
+/* A board repaired before: logged, and left alone until it is unplugged */
+void RepairTool::skip(RepairHistory::Record & record, uint64_t start) {
+	record.totalMs = (usb_stats_now() - start) / 1e6 - record.waitMs;
+	writeHistory(record, "skipped");
+	std::string details = "This C.H.I.P. was already repaired. You may unplug it and connect the next one.";
+	notify("Already repaired", 1.0, &details);
+
+	TraceSpan span("repair", "wait_for_removal");
+	std::string repaired = sid;
+	do {
+		if (cancelToken.wait(1000))
+			break; // also when the board was unplugged during the last probe
+		sid.clear();
+		char * output = nullptr;
+		do_fel(onPort(fel_sid), &output);
+		free(output);
+	} while (sid == repaired);
+}
+
+/* CHIP_BOOT_REPAIR_SPECULATIVE=1 stages boards while the GTK view waits for the Repair click */
+bool RepairTool::speculative() {
+	const char * speculative = getenv("CHIP_BOOT_REPAIR_SPECULATIVE");
+	return speculative && *speculative && strcmp(speculative, "0") != 0;
+}
+
+static std::mutex planLock;
+static RepairPlan * sharedPlan = nullptr;
+static RepairPlan * sharedStage = nullptr; // sharedPlan split for speculative repairs, null if it cannot be
+static RepairPlan * sharedFinish = nullptr;
+
+static bool payloadsMapped() {
+	std::lock_guard<std::mutex> guard(planLock);
+	return sharedPlan != nullptr;
+}
+
+/* The USB device number of the board on 'port'; it changes when the board is replugged */
+int RepairTool::deviceNumber(const std::string & port) {
+	struct fel_enum_device devices[16];
+	int n = fel_enum_devices(devices, 16);
+	for (int i = 0; i < n && i < 16; i++) {
+		if (devices[i].port == port)
+			return devices[i].devnum;
+	}
+	return -1;
+}
+
+bool RepairTool::stage() {
+	TraceSpan span("repair", "stage");
+	unstage();
+	stagedRecord = RepairHistory::Record();
+	stagedStart = usb_stats_now();
+	cancelToken.reset();
+	long prepared = prepare();
+	devicePort.clear();
+	socId = 0;
+	sid.clear();
+	libsunxi_set_device_handler(&RepairTool::onDevice, this);
+	CancelToken::setCurrent(&cancelToken);
+	identify();
+	boardDevice = deviceNumber(devicePort);
+	uint64_t loadStart = usb_stats_now();
+	host.wait(prepared);
+	if (!loadPayloads()) {
+		libsunxi_set_device_handler(nullptr, nullptr);
+		CancelToken::setCurrent(nullptr);
+		return false;
+	}
+	stagedRecord.loadMs = (usb_stats_now() - loadStart) / 1e6;
+	/* a board to skip is left to finish(), which repair()s it */
+	if (!sharedStage || devicePort.empty() ||
+	    (skipRepairedBoards() && !sid.empty() && RepairHistory::repaired(sid, bundleVersion()))) {
+		libsunxi_set_device_handler(nullptr, nullptr);
+		CancelToken::setCurrent(nullptr);
+		return false;
+	}
+	if (port.empty()) {
+		port = devicePort; // finish() must talk to the same board
+		pinned = true;
+	}
+	retries = 0;
+	quiet = true;
+	libsunxi_set_retry_handler(&RepairTool::onRetry, this);
+	staged = runPlan(sharedStage, stagedRecord);
+	libsunxi_set_retry_handler(nullptr, nullptr);
+	libsunxi_set_device_handler(nullptr, nullptr);
+	CancelToken::setCurrent(nullptr);
+	quiet = false;
+	stagedEnd = usb_stats_now();
+	if (staged) {
+		std::string details = "Click Repair to begin";
+		notify(FEL_FOUND, 0.05, &details);
+	}
+	return staged;
+}
+
+bool RepairTool::finish() {
+	if (!staged) {
+		unstage();
+		return repair(false);
+	}
+	TraceSpan span("repair", "finish");
+	cancelToken.reset();
+	RepairHistory::Record record = stagedRecord;
+	record.waitMs += (usb_stats_now() - stagedEnd) / 1e6; // the operator's time, not the repair's
+	std::string stagedSid = sid;
+	int stagedDevice = boardDevice;
+	libsunxi_set_device_handler(&RepairTool::onDevice, this);
+	CancelToken::setCurrent(&cancelToken);
+	identify();
+	bool ok = false;
+	if (sid == stagedSid && (stagedDevice < 0 || deviceNumber(devicePort) == stagedDevice)) {
+		const std::vector<RepairPlan::Step> & steps = repairPlan()->steps();
+		int exec = 0;
+		while (exec < (int)steps.size() && steps[exec].op != "exec")
+			exec++;
+		startJob(exec);
+		quiet = true; // a failed verify is not the end of the repair
+		libsunxi_set_retry_handler(&RepairTool::onRetry, this);
+		ok = runPlan(sharedFinish, record);
+		libsunxi_set_retry_handler(nullptr, nullptr);
+		quiet = false;
+	}
+	libsunxi_set_device_handler(nullptr, nullptr);
+	CancelToken::setCurrent(nullptr);
+	unstage();
+	if (!ok)
+		return repair(false);
+	record.totalMs = (usb_stats_now() - stagedStart) / 1e6 - record.waitMs;
+	host.add("write_metrics", writeMetrics);
+	writeHistory(record, "ok");
 	complete();
 	return true;
 }
 
+void RepairTool::unstage() {
+	staged = false;
+	if (pinned)
+		port.clear();
+	pinned = false;
+}
+
+bool RepairTool::boardPresent() {
+	if (devicePort.empty())
+		return staticCheckForFel(port) == SUCCESS;
+	int device = deviceNumber(devicePort);
+	if (device < 0 || boardDevice < 0)
+		return staticCheckForFel(devicePort) == SUCCESS && (boardDevice < 0 || device == boardDevice);
+	return device == boardDevice;
+}
+
+static std::string hostName() {
+	char name[256] = "";
+#ifdef _WIN32
+	const char * computer = getenv("COMPUTERNAME");
+	if (computer)
+		snprintf(name, sizeof(name), "%s", computer);
+#else
+	if (gethostname(name, sizeof(name)) != 0)
+		name[0] = 0;
+	name[sizeof(name) - 1] = 0;
+#endif
+	return name;
+}
+
+/* Appends the repair to the history log, see RepairHistory.h */
+void RepairTool::writeHistory(RepairHistory::Record & record, const std::string & outcome) {
+	record.time = time(nullptr);
+	record.host = hostName();
+	record.port = devicePort;
+	record.socId = socId;
+	record.sid = sid;
+	record.bundleVersion = bundleVersion();
+	record.outcome = outcome;
+	record.retries = retries;
+	endJob(outcome);
+	host.add("write_history", [record] {
+		std::string error;
+		if (!RepairHistory::append(record, &error))
+			fprintf(stderr, "%s\n", error.c_str());
+	});
+}
+
+/* CHIP_BOOT_REPAIR_METRICS=file.prom keeps a Prometheus textfile of the USB statistics, see usbstats.h */
+void RepairTool::writeMetrics() {
+	const char * path = getenv("CHIP_BOOT_REPAIR_METRICS");
+	if (path && *path && usb_stats_write_prometheus(path) != 0)
+		perror(path);
+}
+
+/* Progress of the labelled steps, spread from 10% to 90% */
+static float stepFraction(int label, int labels) {
+	return labels > 1 ? 0.1f + 0.8f * label / (labels - 1) : 0.1f;
+}
+
+//static
+void RepairTool::onCommand(void * thisObj, int index, const char * command) {
+	RepairTool * tool = (RepairTool *)thisObj;
+	const std::vector<RepairPlan::Step> & steps = tool->plan->steps();
+	tool->stepStarts.push_back(usb_stats_now());
+	if (index >= 0 && index < (int)steps.size()) {
+		tool->schedule(steps[index]);
+		tool->setDeadline(steps[index]);
+		tool->stepsBytes = 0;
+		for (int i = 0; i < index; i++)
+			tool->stepsBytes += steps[i].bytes;
+		tool->stepBytes = 0;
+		tool->notifyBytes();
+	}
+	const RepairPlan * full = repairPlan();
+	int step = index - tool->jobSkip + tool->jobBase;
+	if (!tool->job.job.empty() && index >= tool->jobSkip && full && step < (int)full->steps().size()) {
+		tool->job.step = step;
+		tool->job.phase = stepName(full->steps()[step]);
+		tool->job.bytes = 0;
+		for (int i = 0; i < step; i++)
+			tool->job.bytes += full->steps()[i].bytes;
+		tool->journal();
+	}
+	if (tool->quiet || index < 0 || index >= (int)steps.size() || steps[index].label.empty())
+		return;
+	int label = 0, labels = 0;
+	for (int i = 0; i < (int)steps.size(); i++) {
+		if (steps[i].label.empty())
+			continue;
+		if (i < index)
+			label++;
+		labels++;
+	}
+	tool->notify(steps[index].label, stepFraction(label, labels));
+}
+
+static std::string lastLine(const std::string & text) {
+	size_t end = text.find_last_not_of("\r\n");
+	if (end == std::string::npos)
+		return "";
+	size_t start = text.find_last_of('\n', end);
+	start = start == std::string::npos ? 0 : start + 1;
+	return text.substr(start, end + 1 - start);
+}
+
+//static
+void RepairTool::onDevice(void * thisObj, const char * port, uint32_t soc_id, const char * sid) {
+	RepairTool * tool = (RepairTool *)thisObj;
+	if (port) {
+		tool->devicePort = port;
+		tool->cancelToken.watchPort(port);
+	}
+	if (soc_id)
+		tool->socId = soc_id;
+	if (sid)
+		tool->sid = sid;
+}
+
+/* Bulk-heavy steps wait for room on the USB link shared with other boards, see LinkScheduler.h */
+void RepairTool::schedule(const RepairPlan::Step & step) {
+	if (!LinkScheduler::isBulk(step)) {
+		link.release();
+		return;
+	}
+	if (link.held())
+		return;
+	TraceSpan span("repair", "link_wait");
+	bool waited = false;
+	link.acquire(devicePort, &waited, &cancelToken);
+	if (waited) {
+		std::string details = "Waiting for the USB link " + LinkScheduler::link(devicePort);
+		notify(progressText, progressFraction, &details);
+	}
+}
+
+/* A step that takes far longer than its bytes at the rate measured so far ends the repair */
+void RepairTool::setDeadline(const RepairPlan::Step & step) {
+	unsigned ms = RepairPlan::deadlineMs(step, usb_stats_write_rate());
+	cancelToken.setDeadline(usb_stats_now() + ms * (uint64_t)1000000,
+		"The " + stepName(step) + " step took longer than " + std::to_string(ms) + " ms");
+}
+
+/* The fel command line, on the board of this tool if it has one */
+Strings RepairTool::onPort(const Strings & commands, const std::string & port) {
+	if (port.empty())
+		return commands;
+	Strings result = commands;
+	result.insert(result.begin() + 1, { "--port", port });
+	return result;
+}
+
+/* The whole plan as one fel call, so the device is opened once */
+bool RepairTool::runPlan(const RepairPlan * steps, RepairHistory::Record & record) {
+	char * output = nullptr;
+	plan = steps;
+	const RepairPlan * full = repairPlan();
+	/* what a finish or resumed plan does before the full plan's steps */
+	jobSkip = full ? std::max(0, (int)plan->steps().size() - ((int)full->steps().size() - jobBase)) : 0;
+	stepStarts.clear();
+	planBytes = 0;
+	for (auto & step : plan->steps())
+		planBytes += step.bytes;
+	libsunxi_set_command_handler(&RepairTool::onCommand, this);
+	libsunxi_set_bytes_handler(&RepairTool::onBytes, this);
+	int result;
+	uint64_t bytes = usb_stats_thread_bytes();
+	uint64_t start = usb_stats_now(), end;
+	{
+		TraceSpan span("repair", "plan");
+		result = do_fel(onPort(plan->felArguments()), &output);
+	}
+	end = usb_stats_now();
+	libsunxi_set_command_handler(nullptr, nullptr);
+	libsunxi_set_bytes_handler(nullptr, nullptr);
+	if (result == SUCCESS && !quiet) {
+		for (auto observer : *observers)
+			observer->onBytes(planBytes, planBytes);
+	}
+	cancelToken.setDeadline(0);
+	link.release();
+	record.planMs += (end - start) / 1e6;
+	record.bytes += usb_stats_thread_bytes() - bytes;
+	for (size_t i = 0; i < stepStarts.size() && i < plan->steps().size(); i++) {
+		uint64_t stepEnd = i + 1 < stepStarts.size() ? stepStarts[i + 1] : end;
+		RepairHistory::Phase phase = { stepName(plan->steps()[i]), (stepEnd - stepStarts[i]) / 1e6 };
+		record.phases.push_back(phase);
+	}
+	if (result == SUCCESS && plan->executes()) {
+		TraceSpan span("repair", "exec_settle");
+		uint64_t settleStart = usb_stats_now();
+		cancelToken.wait(execSettleTime * 1000);
+		record.settleMs = (usb_stats_now() - settleStart) / 1e6;
+	}
+	if (result == FEL_CANCELLED) {
+		std::string details = cancelToken.reason();
+		if (!quiet)
+			notify("Repair stopped", progressFraction, &details);
+		record.error = details.substr(0, 200);
+	} else if (result != SUCCESS) {
+		std::string details = output;
+		if (!quiet)
+			notify("Repair failed", progressFraction, &details);
+		record.error = lastLine(details).substr(0, 200); // why fel gave up
+	}
+	free(output);
+	return result == SUCCESS;
+}
+
+//static
+void RepairTool::onBytes(void * thisObj, uint32_t bytes) {
+	RepairTool * tool = (RepairTool *)thisObj;
+	tool->stepBytes += bytes;
+	tool->notifyBytes();
+}
+
+/*
+ * Each step counts for its bytes: what it moved, up to that. Tune moves
+ * its region several times and verify hardly any of it, and the progress
+ * should neither overshoot nor stall at them.
+ */
+void RepairTool::notifyBytes() {
+	if (quiet || stepStarts.empty() || stepStarts.size() > plan->steps().size())
+		return;
+	size_t index = stepStarts.size() - 1;
+	uint64_t done = stepsBytes + std::min<uint64_t>(stepBytes, plan->steps()[index].bytes);
+	for (auto observer : *observers)
+		observer->onBytes(done, planBytes);
+}
+
+//static
+void RepairTool::onRetry(void * thisObj, uint32_t address, int attempt, int error) {
+	RepairTool * tool = (RepairTool *)thisObj;
+	char details[128];
+	snprintf(details, sizeof(details), "USB error %d at 0x%08x, resuming transfer (attempt %d)", error, address, attempt);
+	std::string detailsText = details;
+	tool->retries++;
+	tool->notify(tool->progressText, tool->progressFraction, &detailsText);
+}
+
 void RepairTool::repairLoop(bool wait) {
 	for (;;)
 		repair(wait);
 }
 
-RepairTool::RepairTool() {
+RepairTool::RepairTool() : progressFraction(0), retries(0), execSettleTime(3), plan(nullptr), socId(0),
+	planBytes(0), stepsBytes(0), stepBytes(0), quiet(false), staged(false), pinned(false), boardDevice(-1), stagedStart(0), stagedEnd(0),
+	jobBase(0), jobSkip(0) {
 	observers = new std::list<RepairObserver *>();
 }
 
@@ -123,8 +693,11 @@ void RepairTool::addObserver(RepairObserver * observer) {
  * @callback: an optional callback to call after calling fel
  */
 int RepairTool::do_fel(const Strings & commands, char **returnBuffer) {
+	/* fel.c keeps global state and call_main redirects stdout, one call at a time */
+	static std::mutex felLock;
+	std::lock_guard<std::mutex> guard(felLock);
 	int argc = commands.size();
-	char ** argv = prefixedStringArray(filePrefix(),commands); // this will leak, but don't care for now
+	char ** argv = prefixedStringArray(LIBSUNXI_PAYLOAD_PREFIX,commands); // this will leak, but don't care for now
 
 	char * buffer;
     int result = fel(argc, argv, &buffer);
@@ -138,15 +711,97 @@ int RepairTool::do_fel(const Strings & commands, char **returnBuffer) {
 }
 
 
+/*
+ * Maps and checks the payload bundle once per process; the fel calls use it
+ * without copying. The repair plan is checked against it at the same time.
+ */
+bool RepairTool::mapPayloads(std::string * error) {
+	PayloadBundle * bundle = PayloadBundle::shared(payloadBundlePath(), error);
+	if (!bundle)
+		return false;
+	std::lock_guard<std::mutex> guard(planLock);
+	if (sharedPlan)
+		return true;
+	RepairPlan * plan = new RepairPlan();
+	std::string path = repairPlanPath();
+	bool ok = path.empty() ? RepairPlan::parse(DEFAULT_PLAN, bundle, *plan, error, "built-in plan")
+		: RepairPlan::load(path, bundle, *plan, error);
+	if (!ok) {
+		delete plan;
+		return false;
+	}
+	RepairPlan * stage = new RepairPlan(), * finish = new RepairPlan();
+	if (plan->split(*stage, *finish)) {
+		sharedStage = stage;
+		sharedFinish = finish;
+	} else {
+		delete stage;
+		delete finish;
+	}
+	sharedPlan = plan;
+	return true;
+}
+
+const RepairPlan * RepairTool::repairPlan() {
+	std::lock_guard<std::mutex> guard(planLock);
+	return sharedPlan;
+}
+
+/*
+ * Queues what a repair needs from the host: the payloads and the plan (the
+ * job returned, which the plan waits for), then the hashes its verify steps
+ * compare with. It runs while the tool waits for the board and identifies it.
+ */
+long RepairTool::prepare() {
+	long prepared = host.add("map_payloads", [] { mapPayloads(nullptr); });
+	host.add("hash_payloads", hashPayloads);
+	return prepared;
+}
+
+/* Hashes every payload a verify step checks, so that fel does not have to while the device waits */
+void RepairTool::hashPayloads() {
+	std::vector<const RepairPlan *> plans;
+	{
+		std::lock_guard<std::mutex> guard(planLock);
+		plans = { sharedPlan, speculative() ? sharedFinish : nullptr };
+	}
+	for (auto plan : plans) {
+		if (!plan)
+			continue;
+		for (auto & step : plan->steps()) {
+			const std::string & source = step.command.back();
+			if (step.op != "verify" || source.compare(0, strlen(LIBSUNXI_PAYLOAD_PREFIX), LIBSUNXI_PAYLOAD_PREFIX) != 0)
+				continue;
+			uint32_t count;
+			libsunxi_payload_hashes(source.c_str() + strlen(LIBSUNXI_PAYLOAD_PREFIX), LIBSUNXI_HASH_BLOCK, &count);
+		}
+	}
+}
+
+bool RepairTool::loadPayloads() {
+	TraceSpan span("repair", "load_payloads");
+	std::string error;
+	if (mapPayloads(&error)) {
+		plan = sharedPlan;
+		return true;
+	}
+	notify("Cannot load the repair payload", 0, &error);
+	return false;
+}
+
 const std::string FEL_NO_PERMISSION_STRING = "You don't have permission to run this program.\n Close and run: sudo chip-boot-repair";
 const std::string FEL_NOT_FOUND_STRING = "FEL Device not found";
 const std::string FEL_CANNOT_CLAIM_INTERFACE_STRING = "Disconnect CHIP, close the application, and try again.";
 const std::string FEL_NEED_TO_BE_ROOT = "You need to bee root to run chip-repair-tool";
 
-int RepairTool::staticCheckForFel() {
+int RepairTool::staticCheckForFel(const std::string & port) {
+	TraceSpan span("repair", "probe");
+	/* most polls find nothing, sysfs knows that without a fel session */
+	if (!fel_enum_present(port.empty() ? nullptr : port.c_str()))
+		return FEL_NOT_FOUND;
 	int result = 0;
 	char * buffer;
-    result = do_fel(fel_ver, &buffer);
+    result = do_fel(onPort(fel_ver, port), &buffer);
 	if (result == SUCCESS) {
 		if (buffer[0] != 'A')
 			result = FAILURE;
@@ -179,7 +834,7 @@ void RepairTool::staticWaitForFel(RepairObserver * observer) {
 
 int RepairTool::checkForFel(){
 	notify("Waiting for a C.H.I.P. in FEL mode...", 0);
-	int result = staticCheckForFel();
+	int result = staticCheckForFel(port);
 	if (result == SUCCESS) {
 		notify(FEL_FOUND, 0.05);
 	}
@@ -187,33 +842,6 @@ int RepairTool::checkForFel(){
 	return result;
 }
 
-int RepairTool::spl_write(){
-	notify("Upload SPL...", 0.1);
-	return do_fel(fel_spl, NULL);
-}
-
-int RepairTool::spl_w_ecc_write(){
-	notify("Upload SPL with ECC...", 0.3);
-	return do_fel(fel_write_spl, NULL);
-}
-
-int RepairTool::uboot_write(){
-	notify("Upload uboot...", 0.5);
-	return do_fel(fel_write_uboot, NULL);
-}
-
-int RepairTool::uboot_scr_write(){
-	notify("Uboot scr write...", 0.7);
-	return do_fel(fel_write_uboot_script, NULL);
-}
-
-int RepairTool::fel_exe(){
-	notify("Execute uboot script...", 0.9);
-	int result = do_fel(fel_execute, NULL);
-	sleep(3);
-	return result;
-}
-
 void RepairTool::complete() {
 	std::string details = "You may remove the jumper and unplug your C.H.I.P. now.";
 #ifdef _WIN32
@@ -222,16 +850,24 @@ void RepairTool::complete() {
 	notify("Repair Completed!", 1.0, &details);
 }
 void RepairTool::notify(const std::string & progressText, float progressFraction, const std::string * details) {
+	this->progressText = progressText;
+	this->progressFraction = progressFraction;
 	for (auto observer : *observers) {
 		observer->onNotify(progressText,progressFraction,details);
 	}
 }
 
-void RepairTool::waitForFel() {
+/* False if cancelled before a board showed up */
+bool RepairTool::waitForFel(long prepared) {
+	TraceSpan span("repair", "wait_for_fel");
   while (true) {
 		if (checkForFel() == SUCCESS)
 			break;
-		sleep(1);
-//This doesnt compile		std::this_thread::sleep_for(std::chrono::seconds(1));
+		if (host.done(prepared) && !payloadsMapped())
+			break; // loadPayloads() tells why, no need to wait for a board first
+		if (cancelToken.wait(1000))
+			return false;
 	}
+	Startup::ready();
+	return true;
 }
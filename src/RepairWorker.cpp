@@ -0,0 +1,245 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+extern "C" {
+#include "felenum.h"
+#include "usbstats.h"
+}
+#include "RepairHistory.h"
+#include "RepairJournal.h"
+#include "RepairSocket.h"
+#include "RepairTool.h"
+#include "RepairWorker.h"
+
+enum EventType { EVENT_NOTIFY, EVENT_DEVICE, EVENT_BYTES };
+
+/* In memory shared by the worker, which writes the slots, and the supervisor, which reads them */
+struct RepairWorker::Ring {
+	struct Slot {
+		uint32_t type;
+		int32_t fraction;     // per mille, of a notify
+		uint32_t textSize;    // notify text, or device port
+		int32_t detailsSize;  // notify details, or device SID; -1 for none
+		uint64_t done, total; // bytes
+		char data[SLOT_BYTES - 32]; // the text, then the details
+	};
+
+	std::atomic<uint32_t> head; // slots written
+	std::atomic<uint32_t> tail; // slots read
+	Slot slots[SLOTS];
+};
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "the ring's counters are shared between processes");
+
+/* The observer of the worker's repair: its events go to the ring */
+class RepairWorker::Reporter : public RepairObserver {
+	public:
+		Reporter(RepairWorker * worker) : worker(worker), bytesSent(0) {}
+
+		void onNotify(const std::string & progressText, float progressFraction, const std::string * details) {
+			push(EVENT_NOTIFY, progressText, (int)(progressFraction * 1000), details, 0, 0);
+		}
+
+		void onDevice(const std::string & port, const std::string & sid) {
+			push(EVENT_DEVICE, port, 0, &sid, 0, 0);
+		}
+
+		void onBytes(uint64_t done, uint64_t total) {
+			uint64_t now = usb_stats_now();
+			if (done < total && now - bytesSent < RepairSocket::BYTES_INTERVAL_MS * 1000000ull)
+				return;
+			bytesSent = now;
+			push(EVENT_BYTES, "", 0, nullptr, done, total);
+		}
+
+	private:
+		RepairWorker * worker;
+		uint64_t bytesSent; // usb_stats_now() of the last bytes event
+
+		/* Waits for a free slot, except for bytes events, or if the supervisor is gone */
+		void push(uint32_t type, const std::string & text, int fraction, const std::string * details,
+			uint64_t done, uint64_t total) {
+			Ring * ring = worker->ring;
+			uint32_t head = ring->head.load(std::memory_order_relaxed);
+			while (head - ring->tail.load(std::memory_order_acquire) >= SLOTS) {
+				if (type == EVENT_BYTES || !wake())
+					return;
+				usleep(1000);
+			}
+			Ring::Slot & slot = ring->slots[head % SLOTS];
+			slot.type = type;
+			slot.fraction = fraction;
+			slot.textSize = std::min(text.size(), sizeof(slot.data));
+			memcpy(slot.data, text.data(), slot.textSize);
+			slot.detailsSize = -1;
+			if (details) {
+				slot.detailsSize = std::min(details->size(), sizeof(slot.data) - slot.textSize);
+				memcpy(slot.data + slot.textSize, details->data(), slot.detailsSize);
+			}
+			slot.done = done;
+			slot.total = total;
+			ring->head.store(head + 1, std::memory_order_release);
+			wake();
+		}
+
+		/* False if the supervisor is gone */
+		bool wake() {
+			char byte = 0;
+			return write(worker->eventFds[1], &byte, 1) == 1 || errno == EAGAIN || errno == EINTR;
+		}
+};
+
+RepairWorker::RepairWorker(const std::string & port) : port(port), pid(-1), ring(nullptr) {
+	eventFds[0] = eventFds[1] = cancelFds[0] = cancelFds[1] = -1;
+}
+
+RepairWorker::~RepairWorker() {
+	if (pid > 0) {
+		cancel("chip-boot-repaird is stopping");
+		bool ok;
+		std::string error;
+		for (unsigned ms = 0; ms < KILL_MS && !reap(WNOHANG, ok, error); ms += 10)
+			usleep(10000);
+		if (pid > 0) {
+			kill(pid, SIGKILL);
+			reap(0, ok, error);
+		}
+	}
+	for (int fd : { eventFds[0], eventFds[1], cancelFds[0], cancelFds[1] }) {
+		if (fd >= 0)
+			close(fd);
+	}
+	if (ring)
+		munmap(ring, sizeof(Ring));
+}
+
+bool RepairWorker::start(const std::vector<int> & inherited, std::string * error) {
+	void * shared = mmap(nullptr, sizeof(Ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED || pipe(eventFds) != 0 || pipe(cancelFds) != 0) {
+		*error = std::string("Cannot start a repair process: ") + strerror(errno);
+		if (shared != MAP_FAILED)
+			munmap(shared, sizeof(Ring));
+		return false;
+	}
+	ring = (Ring *)shared;
+	ring->head.store(0);
+	ring->tail.store(0);
+	fflush(nullptr); // or the worker writes out what the supervisor had buffered
+	pid = fork();
+	if (pid < 0) {
+		*error = std::string("Cannot start a repair process: ") + strerror(errno);
+		return false;
+	}
+	if (pid == 0) {
+		for (int fd : inherited)
+			close(fd);
+		close(eventFds[0]);
+		close(cancelFds[1]);
+		run();
+	}
+	close(eventFds[1]);
+	close(cancelFds[0]);
+	eventFds[1] = cancelFds[0] = -1;
+	fcntl(eventFds[0], F_SETFL, O_NONBLOCK);
+	fcntl(cancelFds[1], F_SETFL, O_NONBLOCK);
+	return true;
+}
+
+/* The worker process: one repair, then its exit status says how it went */
+void RepairWorker::run() {
+	fel_enum_reset(); // the supervisor keeps reading its uevent socket
+	signal(SIGPIPE, SIG_IGN);
+	fcntl(eventFds[1], F_SETFL, O_NONBLOCK);
+	bool ok;
+	{
+		RepairTool tool;
+		Reporter reporter(this);
+		tool.setPort(port);
+		tool.addObserver(&reporter);
+		int doneFds[2];
+		if (pipe(doneFds) != 0)
+			_exit(2);
+		std::thread watcher([&] {
+			struct pollfd fds[] = { { cancelFds[0], POLLIN, 0 }, { doneFds[0], POLLIN, 0 } };
+			while (poll(fds, 2, -1) < 0 && errno == EINTR)
+				;
+			if (!fds[0].revents)
+				return;
+			char reason[512];
+			ssize_t size = ::read(cancelFds[0], reason, sizeof(reason) - 1);
+			if (size > 0 && reason[size - 1] == '\n')
+				size--;
+			tool.cancel(size > 0 ? std::string(reason, size) : "chip-boot-repaird stopped");
+		});
+		ok = tool.repair(false);
+		close(doneFds[1]);
+		watcher.join();
+		close(doneFds[0]);
+	} // the tool's host queue finishes writing the history
+	RepairHistory::sync();
+	RepairJournal::sync(true);
+	_exit(ok ? 0 : 1);
+}
+
+void RepairWorker::cancel(const std::string & reason) {
+	std::string line = reason + "\n";
+	if (cancelFds[1] >= 0 && write(cancelFds[1], line.data(), line.size()) < 0)
+		return; // the worker is gone already
+}
+
+bool RepairWorker::read(RepairObserver * observer, bool & ok, std::string & error) {
+	char data[256];
+	ssize_t size;
+	while ((size = ::read(eventFds[0], data, sizeof(data))) > 0)
+		;
+	bool gone = size == 0;
+	uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+	for (; tail != ring->head.load(std::memory_order_acquire); tail++) {
+		const Ring::Slot & slot = ring->slots[tail % SLOTS];
+		std::string text(slot.data, slot.textSize);
+		std::string details = slot.detailsSize < 0 ? "" : std::string(slot.data + slot.textSize, slot.detailsSize);
+		if (slot.type == EVENT_NOTIFY)
+			observer->onNotify(text, slot.fraction / 1000.0f, slot.detailsSize < 0 ? nullptr : &details);
+		else if (slot.type == EVENT_DEVICE)
+			observer->onDevice(text, details);
+		else if (slot.type == EVENT_BYTES)
+			observer->onBytes(slot.done, slot.total);
+		ring->tail.store(tail + 1, std::memory_order_release);
+	}
+	if (!gone)
+		return true;
+	reap(0, ok, error);
+	return false;
+}
+
+/* waitpid() with 'options'; true once the worker has been reaped */
+bool RepairWorker::reap(int options, bool & ok, std::string & error) {
+	int status;
+	pid_t result;
+	while ((result = waitpid(pid, &status, options)) < 0 && errno == EINTR)
+		;
+	if (result == 0)
+		return false;
+	pid = -1;
+	ok = result > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	if (result < 0)
+		error = "The repair process on " + port + " was lost: " + strerror(errno);
+	else if (WIFSIGNALED(status))
+		error = "The repair process on " + port + " crashed: " + strsignal(WTERMSIG(status));
+	else if (WEXITSTATUS(status) > 1)
+		error = "The repair process on " + port + " exited with status " + std::to_string(WEXITSTATUS(status));
+	else
+		error.clear();
+	return true;
+}
@@ -0,0 +1,73 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <libusb.h>
+#include <chrono>
+#include <sstream>
+
+extern "C" {
+#include "libsunxi.h"
+}
+#include "RepairTool.h"
+#include "Startup.h"
+
+using Clock = std::chrono::steady_clock;
+
+static Clock::time_point launchTime;
+static pthread_t thread;
+static bool started = false;
+static bool joined = false;
+static bool reported = false;
+static int probeResult = -1;
+static pthread_mutex_t joinLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t reportLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* To the real stderr: a fel call on another thread may have redirected it */
+static void report(const std::string & line) {
+	std::string text = line + "\n";
+	if (write(libsunxi_stderr_fd(), text.data(), text.size()) < 0)
+		return; // nowhere to report to
+}
+
+void Startup::begin() {
+	launchTime = Clock::now();
+	started = pthread_create(&thread, nullptr, Startup::run, nullptr) == 0;
+}
+
+//static
+void * Startup::run(void *) {
+	/* the default context stays alive, so every fel call reuses it */
+	libusb_init(nullptr);
+	std::string error;
+	if (!RepairTool::mapPayloads(&error))
+		report(error);
+	probeResult = RepairTool::staticCheckForFel();
+	if (probeResult == 0)
+		ready();
+	return nullptr;
+}
+
+void Startup::wait() {
+	pthread_mutex_lock(&joinLock);
+	if (started && !joined) {
+		pthread_join(thread, nullptr);
+		joined = true;
+	}
+	pthread_mutex_unlock(&joinLock);
+}
+
+int Startup::felResult() {
+	wait();
+	return probeResult;
+}
+
+void Startup::ready() {
+	pthread_mutex_lock(&reportLock);
+	if (started && !reported) {
+		double ms = std::chrono::duration<double, std::milli>(Clock::now() - launchTime).count();
+		std::ostringstream line;
+		line << "Ready to repair " << ms << " ms after launch";
+		report(line.str());
+		reported = true;
+	}
+	pthread_mutex_unlock(&reportLock);
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <mutex>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define mkdir(path, mode) _mkdir(path)
+#else
+#include <unistd.h>
+#endif
+
+#include "UsbTuning.h"
+
+static void setError(std::string * error, const std::string & message) {
+	if (error)
+		*error = message;
+}
+
+/* Serialises writers within the process, the rename keeps other processes safe */
+static std::mutex tuningLock;
+
+std::string UsbTuning::path() {
+	const char * path = getenv("CHIP_BOOT_REPAIR_TUNING");
+	if (path && *path)
+		return path;
+	const char * cache = getenv("XDG_CACHE_HOME");
+	if (cache && *cache)
+		return std::string(cache) + "/chip-boot-repair/usb-tuning";
+	const char * home = getenv("HOME");
+	return std::string(home ? home : ".") + "/.cache/chip-boot-repair/usb-tuning";
+}
+
+std::map<std::string, UsbTuning::Values> UsbTuning::load(const std::string & path) {
+	std::map<std::string, Values> result;
+	FILE * in = fopen(path.c_str(), "r");
+	if (!in)
+		return result;
+	char line[256], port[128];
+	while (fgets(line, sizeof(line), in)) {
+		Values values;
+		if (line[0] == '#' ||
+		    sscanf(line, "%127s %u %u", port, &values.chunkSize, &values.timeoutMs) != 3 ||
+		    values.chunkSize == 0 || values.timeoutMs == 0)
+			continue;
+		result[port] = values;
+	}
+	fclose(in);
+	return result;
+}
+
+bool UsbTuning::find(const std::string & port, Values & values) {
+	std::map<std::string, Values> all = load(path());
+	auto it = all.find(port);
+	if (it == all.end())
+		return false;
+	values = it->second;
+	return true;
+}
+
+/* mkdir -p of everything before the last slash */
+static void makeParents(const std::string & path) {
+	for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+		mkdir(path.substr(0, slash).c_str(), 0755);
+}
+
+bool UsbTuning::save(const std::string & port, const Values & values, std::string * error) {
+	std::lock_guard<std::mutex> guard(tuningLock);
+	std::string filePath = path();
+	std::map<std::string, Values> all = load(filePath);
+	all[port] = values;
+
+	makeParents(filePath);
+	std::string tempPath = filePath + ".tmp" + std::to_string(getpid());
+	FILE * out = fopen(tempPath.c_str(), "w");
+	if (!out) {
+		setError(error, "Cannot create " + tempPath + ": " + strerror(errno));
+		return false;
+	}
+	bool ok = fprintf(out, "# port chunk_bytes timeout_ms\n") > 0;
+	for (auto & entry : all)
+		ok = ok && fprintf(out, "%s %u %u\n", entry.first.c_str(), entry.second.chunkSize, entry.second.timeoutMs) > 0;
+	ok = (fclose(out) == 0) && ok;
+	if (!ok || rename(tempPath.c_str(), filePath.c_str()) != 0) {
+		remove(tempPath.c_str());
+		setError(error, "Cannot write " + filePath);
+		return false;
+	}
+	return true;
+}
@@ -33,16 +33,30 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 #include "portable_endian.h"
+#include "soc_sram_info.h"
 
 /* These ifdefs make it so instead of assert and exit, a throw happens */
 #ifdef LIBSUNXI
 #include "libsunxi.h"
+#include "usbtrace.h"
+#include "spantrace.h"
+#include "usbstats.h"
+#include "felenum.h"
 #undef assert
 #define assert(expr) throw_assert(expr)
 #define exit(expr) throw_exit(expr)
+#else
+#define span_begin() 0
+#define span_end(start, category, name) ((void)(start))
+#define span_end_range(start, category, name, address, length) ((void)(start))
+#define span_set_device(device)
 #endif
 
 struct  aw_usb_request {
@@ -70,7 +84,7 @@ static const int AW_USB_WRITE = 0x12;
 
 static int AW_USB_FEL_BULK_EP_OUT;
 static int AW_USB_FEL_BULK_EP_IN;
-static int timeout = 60000;
+static int timeout = 60000; /* ms per bulk transfer, see aw_fel_tune() */
 static int verbose = 0; /* Makes the 'fel' tool more talkative if non-zero */
 static int progress = 0; /* Makes the 'fel' tool show a progress bar when transferring large files */
 static uint32_t uboot_entry = 0; /* entry point (address) of U-Boot */
@@ -86,7 +100,19 @@ static void pr_info(const char *fmt, ...)
 	}
 }
 
-static const int AW_USB_MAX_BULK_SEND = 4 * 1024 * 1024; // 4 MiB per bulk request
+static const int AW_USB_MAX_BULK_SEND = 4 * 1024 * 1024; // 4 MiB per bulk request, until tuned
+static const int AW_USB_TIMEOUT = 60000; // ms per bulk transfer, until tuned
+static const int AW_USB_MIN_TUNED_TIMEOUT = 1000;
+static const int AW_USB_MAX_RETRIES = 3;
+static const size_t AW_FEL_CHECKPOINT = 512 * 1024; // resume granularity of aw_fel_write and aw_fel_read
+
+/* Less reliable than clock_gettime, but does not require linking with -lrt */
+static double gettime(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + (double)tv.tv_usec / 1000000.;
+}
 
 typedef void (*progress_cb_t)(int total,int sent,int len);
 
@@ -111,16 +137,68 @@ void progress_bar(int total,int sent,int len)
 	}
 }
 
+/*
+ * Inside a recoverable FEL request (usb_recoverable set), a retryable libusb
+ * error doesn't exit. It is kept in usb_error instead, and all further bulk
+ * transfers are skipped until aw_fel_recover() has recovered and cleared it.
+ */
+static int usb_recoverable = 0;
+static int usb_error = 0;
+/* Successful OUT transfers, so aw_fel_execute() knows whether its request got through */
+static unsigned usb_sent = 0;
+
+/* Bulk transfers are split into chunks of this size, tuned per USB port */
+static int usb_bulk_chunk = AW_USB_MAX_BULK_SEND;
+/* Longest single OUT transfer (in seconds) since the last reset, for aw_fel_tune() */
+static double usb_slowest_send = 0;
+
+static int usb_error_retryable(int rc)
+{
+	return rc == LIBUSB_ERROR_TIMEOUT || rc == LIBUSB_ERROR_PIPE ||
+	       rc == LIBUSB_ERROR_OVERFLOW || rc == LIBUSB_ERROR_IO;
+}
+
+/*
+ * One libusb bulk transfer (usb_bulk_send and usb_bulk_recv both end up
+ * here), counted in the USB statistics and recorded if a trace is open
+ */
+static int aw_bulk_transfer(libusb_device_handle *usb, int ep, void *data, int length, int *done)
+{
+#ifdef LIBSUNXI
+	uint64_t start = usb_trace_now();
+	uint64_t stats_start = usb_stats_now();
+	int rc = libsunxi_bulk_transfer(usb, ep, data, length, done, timeout);
+	usb_stats_transfer(ep & LIBUSB_ENDPOINT_IN, length, rc == 0 ? *done : 0,
+			   usb_stats_now() - stats_start, rc);
+	usb_trace_transfer(start, ep, data, length, rc == 0 ? *done : 0, rc);
+	if (rc == 0)
+		libsunxi_on_bytes(*done);
+	return rc;
+#else
+	return libusb_bulk_transfer(usb, ep, data, length, done, timeout);
+#endif
+}
+
 void usb_bulk_send(libusb_device_handle *usb, int ep, const void *data, int length, progress_cb_t progress_cb)
 {
 	int rc, sent, total=length, len;
-	while (length > 0) {
-		len = length < AW_USB_MAX_BULK_SEND ? length : AW_USB_MAX_BULK_SEND;
-		rc = libusb_bulk_transfer(usb, ep, (void *)data, len, &sent, timeout);
+	double t;
+	while (length > 0 && !usb_error) {
+		len = length < usb_bulk_chunk ? length : usb_bulk_chunk;
+		t = gettime();
+		rc = aw_bulk_transfer(usb, ep, (void *)data, len, &sent);
+		t = gettime() - t;
+		if (t > usb_slowest_send)
+			usb_slowest_send = t;
+		if (rc != 0 && usb_recoverable && usb_error_retryable(rc)) {
+			usb_error = rc;
+			return;
+		}
 		if (rc != 0) {
 			fprintf(stderr, "libusb usb_bulk_send error %d\n", rc);
 			exit(2);
 		}
+		usb_sent++;
 		length -= sent;
 		data += sent;
 
@@ -132,9 +210,15 @@ void usb_bulk_send(libusb_device_handle *usb, int ep, const void *data, int leng
 
 void usb_bulk_recv(libusb_device_handle *usb, int ep, void *data, int length)
 {
-	int rc, recv;
-	while (length > 0) {
-		rc = libusb_bulk_transfer(usb, ep, data, length, &recv, timeout);
+	int rc, recv, len;
+	while (length > 0 && !usb_error) {
+		/* in chunks as well, so the tuned timeout holds for every transfer */
+		len = length < usb_bulk_chunk ? length : usb_bulk_chunk;
+		rc = aw_bulk_transfer(usb, ep, data, len, &recv);
+		if (rc != 0 && usb_recoverable && usb_error_retryable(rc)) {
+			usb_error = rc;
+			return;
+		}
 		if (rc != 0) {
 			fprintf(stderr, "usb_bulk_recv error %d\n", rc);
 			exit(2);
@@ -199,6 +283,8 @@ void aw_read_usb_response(libusb_device_handle *usb)
 {
 	char buf[13];
 	usb_bulk_recv(usb, AW_USB_FEL_BULK_EP_IN, &buf, sizeof(buf));
+	if (usb_error)
+		return; /* nothing was received, the transfer will be retried */
 	assert(strcmp(buf, "AWUS") == 0);
 }
 
@@ -228,9 +314,23 @@ static const int AW_FEL_1_WRITE = 0x101;
 static const int AW_FEL_1_EXEC  = 0x102;
 static const int AW_FEL_1_READ  = 0x103;
 
+#ifdef LIBSUNXI
+/* The FEL operation in flight, for the statistics: from the request to its status */
+static enum usb_stats_op fel_op_type;
+static uint32_t fel_op_length;
+static uint64_t fel_op_start;
+#endif
+
 void aw_send_fel_request(libusb_device_handle *usb, int type, uint32_t addr, uint32_t length)
 {
 	struct aw_fel_request req;
+#ifdef LIBSUNXI
+	fel_op_start = usb_stats_now();
+	fel_op_length = length;
+	fel_op_type = type == AW_FEL_VERSION ? USB_STATS_VERSION :
+		      type == AW_FEL_1_WRITE ? USB_STATS_WRITE :
+		      type == AW_FEL_1_EXEC ? USB_STATS_EXEC : USB_STATS_READ;
+#endif
 	memset(&req, 0, sizeof(req));
 	req.request = htole32(type);
 	req.address = htole32(addr);
@@ -241,16 +341,88 @@ void aw_send_fel_request(libusb_device_handle *usb, int type, uint32_t addr, uin
 void aw_read_fel_status(libusb_device_handle *usb)
 {
 	char buf[8];
+#ifdef LIBSUNXI
+	uint64_t start = usb_stats_now(), end;
 	aw_usb_read(usb, &buf, sizeof(buf), NULL);
+	end = usb_stats_now();
+	usb_stats_op(USB_STATS_STATUS, sizeof(buf), end - start, usb_error);
+	usb_stats_op(fel_op_type, fel_op_type == USB_STATS_VERSION ? sizeof(struct aw_fel_version) : fel_op_length,
+		     end - fel_op_start, usb_error);
+#else
+	aw_usb_read(usb, &buf, sizeof(buf), NULL);
+#endif
+}
+
+/*
+ * Bring the FEL endpoints back after a failed transfer: a stall only needs
+ * the halt cleared, anything else gets a port reset (the BROM stays in FEL
+ * mode and DRAM keeps its contents).
+ */
+static int aw_usb_recover(libusb_device_handle *usb, int error)
+{
+	if (error == LIBUSB_ERROR_PIPE &&
+	    libusb_clear_halt(usb, AW_USB_FEL_BULK_EP_OUT) == 0 &&
+	    libusb_clear_halt(usb, AW_USB_FEL_BULK_EP_IN) == 0)
+		return 0;
+	return libusb_reset_device(usb);
+}
+
+static void aw_report_retry(uint32_t offset, int attempt, int error)
+{
+	fprintf(stderr, "USB error %d at 0x%08X, retrying (%d/%d)\n",
+		error, offset, attempt, AW_USB_MAX_RETRIES);
+#ifdef LIBSUNXI
+	libsunxi_on_retry(offset, attempt, error);
+#endif
+}
+
+/*
+ * Ends a recoverable FEL request, which the caller started by setting
+ * usb_recoverable: 0 if it went through. After a retryable error the link
+ * is recovered and the error returned, for the caller to repeat the
+ * request. fel exits once AW_USB_MAX_RETRIES retries in a row have
+ * failed, or if the link cannot be recovered.
+ */
+static int aw_fel_recover(libusb_device_handle *usb, uint32_t offset, int *attempt)
+{
+	int error = usb_error;
+
+	usb_recoverable = 0;
+	usb_error = 0;
+	if (!error) {
+		*attempt = 0;
+		return 0;
+	}
+	if (++*attempt > AW_USB_MAX_RETRIES || aw_usb_recover(usb, error) != 0) {
+		fprintf(stderr, "libusb error %d at 0x%08X, giving up\n", error, offset);
+		exit(2);
+	}
+	aw_report_retry(offset, *attempt, error);
+	return error;
+}
+
+/* At least one bulk chunk, so that a checkpoint never splits one */
+static size_t aw_fel_checkpoint(void)
+{
+	return (size_t)usb_bulk_chunk > AW_FEL_CHECKPOINT ? (size_t)usb_bulk_chunk : AW_FEL_CHECKPOINT;
 }
 
 void aw_fel_get_version(libusb_device_handle *usb, struct aw_fel_version *buf)
 {
-	aw_send_fel_request(usb, AW_FEL_VERSION, 0, 0);
-	aw_usb_read(usb, buf, sizeof(*buf), NULL);
-	aw_read_fel_status(usb);
+	int attempt = 0;
+	uint64_t span = span_begin();
+	do {
+		usb_recoverable = 1;
+		aw_send_fel_request(usb, AW_FEL_VERSION, 0, 0);
+		aw_usb_read(usb, buf, sizeof(*buf), NULL);
+		aw_read_fel_status(usb);
+	} while (aw_fel_recover(usb, 0, &attempt));
+	span_end(span, "fel", "version");
 
 	buf->soc_id = (le32toh(buf->soc_id) >> 8) & 0xFFFF;
+#ifdef LIBSUNXI
+	libsunxi_on_device(NULL, buf->soc_id, NULL);
+#endif
 	buf->unknown_0a = le32toh(buf->unknown_0a);
 	buf->protocol = le32toh(buf->protocol);
 	buf->scratchpad = le16toh(buf->scratchpad);
@@ -282,19 +454,37 @@ void aw_fel_print_version(libusb_device_handle *usb)
 		buf.scratchpad, buf.pad[0], buf.pad[1]);
 }
 
+/* Checkpointed like aw_fel_write(): a read has no side effects, so a failed checkpoint is read again */
 void aw_fel_read(libusb_device_handle *usb, uint32_t offset, void *buf, size_t len)
 {
-	aw_send_fel_request(usb, AW_FEL_1_READ, offset, len);
-	aw_usb_read(usb, buf, len, progress ? progress_bar : NULL);
-	if (progress) {
+	size_t done = 0, checkpoint = aw_fel_checkpoint();
+	int attempt = 0;
+	uint64_t span = span_begin();
+
+	while (done < len) {
+		size_t chunk = len - done < checkpoint ? len - done : checkpoint;
+
+		usb_recoverable = 1;
+		aw_send_fel_request(usb, AW_FEL_1_READ, offset + done, chunk);
+		aw_usb_read(usb, (uint8_t *)buf + done, chunk, NULL);
+		aw_read_fel_status(usb);
+		if (aw_fel_recover(usb, offset + done, &attempt))
+			continue;
+		done += chunk;
+		progress_bar(len, done, chunk);
+	}
+	if (progress && len > checkpoint) {
 		fprintf(stderr,"\n");
 	}
-
-	aw_read_fel_status(usb);
+	span_end_range(span, "fel", "read", offset, len);
 }
 
 void aw_fel_write(libusb_device_handle *usb, void *buf, uint32_t offset, size_t len)
 {
+	size_t done = 0, checkpoint;
+	int attempt = 0;
+	uint64_t span = span_begin();
+
 	/* safeguard against overwriting an already loaded U-Boot binary */
 	if (uboot_size > 0 && offset <= uboot_entry + uboot_size && offset + len >= uboot_entry) {
 		fprintf(stderr, "ERROR: Attempt to overwrite U-Boot! "
@@ -303,67 +493,128 @@ void aw_fel_write(libusb_device_handle *usb, void *buf, uint32_t offset, size_t
 			uboot_entry, uboot_entry + uboot_size);
 		exit(1);
 	}
-	aw_send_fel_request(usb, AW_FEL_1_WRITE, offset, len);
-	aw_usb_write(usb, buf, len, progress ? progress_bar : NULL);
-	if (progress) {
+
+	/*
+	 * Every checkpoint is a FEL write of its own. After a retryable error
+	 * the link is recovered and the write resumes at the last checkpoint
+	 * the device has confirmed. A checkpoint holds at least one bulk chunk.
+	 */
+	checkpoint = aw_fel_checkpoint();
+	while (done < len) {
+		size_t chunk = len - done < checkpoint ? len - done : checkpoint;
+
+		usb_recoverable = 1;
+		aw_send_fel_request(usb, AW_FEL_1_WRITE, offset + done, chunk);
+		aw_usb_write(usb, (uint8_t *)buf + done, chunk, NULL);
+		aw_read_fel_status(usb);
+		if (aw_fel_recover(usb, offset + done, &attempt))
+			continue;
+		done += chunk;
+		progress_bar(len, done, chunk);
+	}
+	if (progress && len > checkpoint) {
 		fprintf(stderr,"\n");
 	}
-	aw_read_fel_status(usb);
+	span_end_range(span, "fel", "write", offset, len);
 }
 
+/*
+ * An exec is repeated only if the device never got its request. Once it
+ * has, the code may have run, so a lost status just leaves the link
+ * recovered and fel goes on without it.
+ */
 void aw_fel_execute(libusb_device_handle *usb, uint32_t offset)
 {
-	aw_send_fel_request(usb, AW_FEL_1_EXEC, offset, 0);
-	aw_read_fel_status(usb);
+	int attempt = 0;
+	uint64_t span = span_begin();
+	for (;;) {
+		unsigned sent = usb_sent;
+		int delivered;
+
+		usb_recoverable = 1;
+		aw_send_fel_request(usb, AW_FEL_1_EXEC, offset, 0);
+		delivered = usb_sent - sent >= 2; /* the AWUC header, then the request */
+		aw_read_fel_status(usb);
+		if (!aw_fel_recover(usb, offset, &attempt))
+			break;
+		if (delivered) {
+			fprintf(stderr, "Status of the exec at 0x%08X lost, not executing it again\n", offset);
+			break;
+		}
+	}
+	span_end_range(span, "fel", "exec", offset, 0);
 }
 
-void hexdump(void *data, uint32_t offset, size_t size)
+#ifndef HEXDUMP_LINE_LEN
+#define HEXDUMP_LINE_LEN 76 /* "00000000: " + 16 * "xx " + " " + 16 chars + "\n" */
+#endif
+
+/*
+ * Format 'size' bytes as hexdump lines into 'out', which must have room for
+ * HEXDUMP_LINE_LEN bytes per started 16 byte line. Returns the text length.
+ */
+size_t hexdump_format(char *out, const uint8_t *buf, uint32_t offset, size_t size)
 {
+	static const char hex[] = "0123456789abcdef";
+	char *p = out;
 	size_t j;
-	unsigned char *buf = data;
-	for (j = 0; j < size; j+=16) {
+	for (j = 0; j < size; j += 16) {
+		uint32_t addr = offset + j;
 		size_t i;
-		printf("%08lx: ",(long int)offset + j);
+		int shift;
+		for (shift = 28; shift >= 0; shift -= 4)
+			*p++ = hex[(addr >> shift) & 0xF];
+		*p++ = ':';
+		*p++ = ' ';
 		for (i = 0; i < 16; i++) {
 			if ((j+i) < size) {
-				printf("%02x ", buf[j+i]);
+				*p++ = hex[buf[j+i] >> 4];
+				*p++ = hex[buf[j+i] & 0xF];
 			} else {
-				printf("__ ");
+				*p++ = '_';
+				*p++ = '_';
 			}
+			*p++ = ' ';
 		}
-		printf(" ");
+		*p++ = ' ';
 		for (i = 0; i < 16; i++) {
-			if (j+i >= size) {
-				printf(".");
-			} else if (isprint(buf[j+i])) {
-				printf("%c", buf[j+i]);
-			} else {
-				printf(".");
-			}
+			if (j+i >= size || !isprint(buf[j+i]))
+				*p++ = '.';
+			else
+				*p++ = buf[j+i];
 		}
-		printf("\n");
+		*p++ = '\n';
 	}
+	return p - out;
 }
 
-int save_file(const char *name, void *data, size_t size)
+/* Returns non-zero for "payload:<name>" arguments, which live in the payload bundle */
+static int is_payload(const char *name)
 {
-	FILE *out = fopen(name, "wb");
-	int rc;
-	if (!out) {
-		perror("Failed to open output file: ");
-		exit(1);
-	}
-	rc = fwrite(data, size, 1, out);
-	fclose(out);
-	return rc;
+#ifdef LIBSUNXI
+	return strncmp(name, LIBSUNXI_PAYLOAD_PREFIX, strlen(LIBSUNXI_PAYLOAD_PREFIX)) == 0;
+#else
+	return 0;
+#endif
 }
 
 void *load_file(const char *name, size_t *size)
 {
 	size_t bufsize = 8192;
 	size_t offset = 0;
-	char *buf = malloc(bufsize);
+	char *buf;
 	FILE *in;
+#ifdef LIBSUNXI
+	if (is_payload(name)) {
+		const void *payload = libsunxi_find_payload(name + strlen(LIBSUNXI_PAYLOAD_PREFIX), size);
+		if (!payload) {
+			fprintf(stderr, "Payload %s not found in bundle\n", name);
+			exit(1);
+		}
+		return (void *)payload; /* read-only mapping, see unload_file() */
+	}
+#endif
+	buf = malloc(bufsize);
 	if (strcmp(name, "-") == 0)
 		in = stdin;
 	else
@@ -389,58 +640,361 @@ void *load_file(const char *name, size_t *size)
 	return buf;
 }
 
-void aw_fel_hexdump(libusb_device_handle *usb, uint32_t offset, size_t size)
+/* Releases a buffer returned by load_file() */
+void unload_file(const char *name, void *buf)
 {
-	unsigned char buf[size];
-	aw_fel_read(usb, offset, buf, size);
-	hexdump(buf, offset, size);
+	if (!is_payload(name))
+		free(buf);
 }
 
-void aw_fel_dump(libusb_device_handle *usb, uint32_t offset, size_t size)
+/*
+ * Streaming support: a helper thread and the main thread hand fixed-size
+ * chunks to each other through two buffers, so that file I/O overlaps the
+ * USB transfers while memory use stays bounded at two chunks.
+ */
+#define AW_STREAM_CHUNK (1024 * 1024)
+#define AW_STREAM_POLL_MS 100 /* how soon a helper blocked on a pipe sees an abort */
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	pthread_t       thread;
+	uint8_t        *buf[2];
+	size_t          len[2];
+	int             full[2];
+	int             done;  /* the stream has ended, on either side */
+	int             error; /* errno seen by the helper thread */
+	int             abort; /* the main thread gave up on the stream */
+	int             joined;
+	int             fd;
+	int             owns_fd; /* chunk_ring_stop() closes it */
+	uint32_t        address; /* device address of the first chunk */
+	int             hexdump; /* format the output of a read stream */
+} chunk_ring;
+
+/* The stream in progress, so that aw_stream_cleanup() can stop its thread */
+static chunk_ring *active_ring = NULL;
+
+static chunk_ring *chunk_ring_start(int fd, int owns_fd, uint32_t address, int hexdump,
+				    void *(*helper)(void *))
 {
-	unsigned char buf[size];
-	aw_fel_read(usb, offset, buf, size);
-	fwrite(buf, size, 1, stdout);
+	chunk_ring *ring = calloc(1, sizeof(*ring));
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	ring->buf[0] = malloc(AW_STREAM_CHUNK);
+	ring->buf[1] = malloc(AW_STREAM_CHUNK);
+	ring->fd = fd;
+	ring->owns_fd = owns_fd;
+	ring->address = address;
+	ring->hexdump = hexdump;
+	if (pthread_create(&ring->thread, NULL, helper, ring) != 0) {
+		fprintf(stderr, "Failed to start the streaming thread\n");
+		exit(1);
+	}
+	active_ring = ring;
+	return ring;
 }
-void aw_fel_fill(libusb_device_handle *usb, uint32_t offset, size_t size, unsigned char value)
+
+/* Waits for the helper thread to consume everything up to the end of the stream */
+static void chunk_ring_drain(chunk_ring *ring)
+{
+	pthread_join(ring->thread, NULL);
+	ring->joined = 1;
+}
+
+static void chunk_ring_stop(chunk_ring *ring)
 {
-	unsigned char buf[size];
-	memset(buf, value, size);
-	aw_fel_write(usb, buf, offset, size);
+	if (!ring->joined) {
+		pthread_mutex_lock(&ring->lock);
+		ring->abort = 1;
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+		pthread_join(ring->thread, NULL);
+	}
+
+	if (ring->owns_fd)
+		close(ring->fd);
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring->buf[0]);
+	free(ring->buf[1]);
+	free(ring);
+	if (active_ring == ring)
+		active_ring = NULL;
 }
 
 /*
- * The 'sram_swap_buffers' structure is used to describe information about
- * two buffers in SRAM, the content of which needs to be exchanged before
- * calling the U-Boot SPL code and then exchanged again before returning
- * control back to the FEL code from the BROM.
+ * Waits until slot 'idx' is full (consumer) or empty (producer). Returns the
+ * slot's buffer, or NULL when the stream was aborted or has ended.
  */
+static uint8_t *chunk_ring_wait(chunk_ring *ring, int idx, int want_full)
+{
+	uint8_t *buf = NULL;
+	pthread_mutex_lock(&ring->lock);
+	while (!ring->abort && ring->full[idx] != want_full && !ring->done)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	if (!ring->abort && ring->full[idx] == want_full)
+		buf = ring->buf[idx];
+	pthread_mutex_unlock(&ring->lock);
+	return buf;
+}
 
-typedef struct {
-	uint32_t buf1; /* BROM buffer */
-	uint32_t buf2; /* backup storage location */
-	uint32_t size; /* buffer size */
-} sram_swap_buffers;
+static void chunk_ring_set(chunk_ring *ring, int idx, int full, size_t len)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->full[idx] = full;
+	ring->len[idx] = len;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void chunk_ring_finish(chunk_ring *ring, int error)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->done = 1;
+	if (!ring->error)
+		ring->error = error;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
 
 /*
- * Each SoC variant may have its own list of memory buffers to be exchanged
- * and the information about the placement of the thunk code, which handles
- * the transition of execution from the BROM FEL code to the U-Boot SPL and
- * back.
- *
- * Note: the entries in the 'swap_buffers' tables need to be sorted by 'buf1'
- * addresses. And the 'buf1' addresses are the BROM data buffers, while 'buf2'
- * addresses are the intended backup locations.
+ * For the helper thread: waits until the file is ready for 'events' (POLLIN
+ * or POLLOUT), which a pipe or a terminal may never be. 0 once the main
+ * thread has given up on the stream.
  */
-typedef struct {
-	uint32_t           soc_id;       /* ID of the SoC */
-	uint32_t           spl_addr;     /* SPL load address */
-	uint32_t           scratch_addr; /* A safe place to upload & run code */
-	uint32_t           thunk_addr;   /* Address of the thunk code */
-	uint32_t           thunk_size;   /* Maximal size of the thunk code */
-	uint32_t           needs_l2en;   /* Set the L2EN bit */
-	sram_swap_buffers *swap_buffers;
-} soc_sram_info;
+static int chunk_ring_poll(chunk_ring *ring, short events)
+{
+	struct pollfd pfd;
+	pfd.fd = ring->fd;
+	pfd.events = events;
+	for (;;) {
+		int aborted;
+		pthread_mutex_lock(&ring->lock);
+		aborted = ring->abort;
+		pthread_mutex_unlock(&ring->lock);
+		if (aborted)
+			return 0;
+		if (poll(&pfd, 1, AW_STREAM_POLL_MS) != 0)
+			return 1; /* ready, or an error for read() or write() to report */
+	}
+}
+
+/* Stops the helper thread of a stream that was left by exit(), and closes its file */
+void aw_stream_cleanup(void)
+{
+	if (active_ring)
+		chunk_ring_stop(active_ring);
+}
+
+/* Producer thread: reads the input file into the ring, one chunk ahead */
+static void *file_reader_thread(void *arg)
+{
+	chunk_ring *ring = arg;
+	uint8_t *buf;
+	int idx = 0, error = 0;
+
+	while ((buf = chunk_ring_wait(ring, idx, 0)) != NULL) {
+		size_t len = 0;
+		while (len < AW_STREAM_CHUNK) {
+			ssize_t n;
+			if (!chunk_ring_poll(ring, POLLIN))
+				break;
+			n = read(ring->fd, buf + len, AW_STREAM_CHUNK - len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				error = errno;
+			if (n <= 0)
+				break;
+			len += n;
+		}
+		if (len > 0)
+			chunk_ring_set(ring, idx, 1, len);
+		if (len < AW_STREAM_CHUNK)
+			break;
+		idx ^= 1;
+	}
+	chunk_ring_finish(ring, error);
+	return NULL;
+}
+
+/*
+ * Write a file to memory without loading all of it first: the next chunk is
+ * read from disk while the current one goes over USB. Returns the number of
+ * bytes written, and the image type found at the start of the file.
+ */
+size_t aw_fel_write_file(libusb_device_handle *usb, uint32_t offset,
+			 const char *name, int *image_type)
+{
+	size_t written = 0, total = 0;
+	struct stat st;
+	chunk_ring *ring;
+	uint8_t *buf;
+	int fd, idx = 0, error, show_progress = progress;
+
+	if (is_payload(name)) {
+		/* already in memory */
+		buf = load_file(name, &total);
+		if (image_type)
+			*image_type = get_image_type(buf, total);
+		aw_fel_write(usb, buf, offset, total);
+		unload_file(name, buf);
+		return total;
+	}
+
+	fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY);
+	if (fd < 0) {
+		perror("Failed to open input file: ");
+		exit(1);
+	}
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		total = st.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	ring = chunk_ring_start(fd, fd != STDIN_FILENO, offset, 0, file_reader_thread);
+	while ((buf = chunk_ring_wait(ring, idx, 1)) != NULL) {
+		size_t len = ring->len[idx];
+		if (written == 0 && image_type)
+			*image_type = get_image_type(buf, len);
+		progress = 0; /* one bar for the whole file, not one per chunk */
+		aw_fel_write(usb, buf, offset + written, len);
+		progress = show_progress;
+		written += len;
+		progress_bar(total, written, len);
+		chunk_ring_set(ring, idx, 0, 0);
+		idx ^= 1;
+	}
+	error = ring->error;
+	chunk_ring_stop(ring);
+	if (progress && written > AW_STREAM_CHUNK)
+		fprintf(stderr, "\n");
+
+	if (error) {
+		fprintf(stderr, "Failed to read %s: %s\n", name, strerror(error));
+		exit(1);
+	}
+	return written;
+}
+
+static int write_all(chunk_ring *ring, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	while (len > 0) {
+		ssize_t n;
+		if (!chunk_ring_poll(ring, POLLOUT)) {
+			errno = EINTR; /* aborted, nobody looks at the error */
+			return -1;
+		}
+		n = write(ring->fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Consumer thread: writes the chunks read from the device to the output */
+static void *file_writer_thread(void *arg)
+{
+	chunk_ring *ring = arg;
+	uint32_t address = ring->address;
+	char *text = NULL;
+	uint8_t *buf;
+	int idx = 0, error = 0;
+
+	if (ring->hexdump)
+		text = malloc(AW_STREAM_CHUNK / 16 * HEXDUMP_LINE_LEN);
+
+	while ((buf = chunk_ring_wait(ring, idx, 1)) != NULL) {
+		size_t len = ring->len[idx];
+		const void *out = buf;
+		if (text) {
+			out = text;
+			len = hexdump_format(text, buf, address, len);
+		}
+		address += ring->len[idx];
+		if (write_all(ring, out, len) != 0) {
+			error = errno;
+			break;
+		}
+		chunk_ring_set(ring, idx, 0, 0);
+		idx ^= 1;
+	}
+	if (error)
+		chunk_ring_finish(ring, error);
+	free(text);
+	return NULL;
+}
+
+/*
+ * Read a memory region to a file descriptor in bounded chunks, either raw or
+ * as a hexdump. The next chunk is read over USB while the writer thread
+ * stores the previous one. 'fd' is closed at the end, unless it is stdout.
+ */
+void aw_fel_read_to_fd(libusb_device_handle *usb, uint32_t offset, size_t size,
+		       int fd, int hexdump)
+{
+	size_t done = 0;
+	chunk_ring *ring;
+	uint8_t *buf;
+	int idx = 0, error, show_progress = progress;
+
+	fflush(stdout); /* keep earlier output in front of ours */
+	ring = chunk_ring_start(fd, fd != STDOUT_FILENO, offset, hexdump, file_writer_thread);
+	while (done < size && (buf = chunk_ring_wait(ring, idx, 0)) != NULL) {
+		size_t len = size - done < AW_STREAM_CHUNK ? size - done : AW_STREAM_CHUNK;
+		progress = 0; /* one bar for the whole region, not one per chunk */
+		aw_fel_read(usb, offset + done, buf, len);
+		progress = show_progress;
+		done += len;
+		progress_bar(size, done, len);
+		chunk_ring_set(ring, idx, 1, len);
+		idx ^= 1;
+	}
+	chunk_ring_finish(ring, 0);
+	chunk_ring_drain(ring);
+	error = ring->error;
+	chunk_ring_stop(ring);
+	if (progress && size > AW_STREAM_CHUNK)
+		fprintf(stderr, "\n");
+
+	if (error) {
+		fprintf(stderr, "Failed to write output: %s\n", strerror(error));
+		exit(1);
+	}
+}
+
+void aw_fel_hexdump(libusb_device_handle *usb, uint32_t offset, size_t size)
+{
+	aw_fel_read_to_fd(usb, offset, size, STDOUT_FILENO, 1);
+}
+
+void aw_fel_dump(libusb_device_handle *usb, uint32_t offset, size_t size)
+{
+	aw_fel_read_to_fd(usb, offset, size, STDOUT_FILENO, 0);
+}
+
+void aw_fel_fill(libusb_device_handle *usb, uint32_t offset, size_t size, unsigned char value)
+{
+	size_t chunk = size < AW_STREAM_CHUNK ? size : AW_STREAM_CHUNK;
+	size_t done;
+	unsigned char *buf = malloc(chunk);
+	uint64_t span = span_begin();
+	memset(buf, value, chunk);
+	for (done = 0; done < size; done += chunk) {
+		if (chunk > size - done)
+			chunk = size - done;
+		aw_fel_write(usb, buf, offset + done, chunk);
+	}
+	free(buf);
+	span_end_range(span, "fel", "fill", offset, size);
+}
 
 /*
  * The FEL code from BROM in A10/A13/A20 sets up two stacks for itself. One
@@ -474,6 +1028,7 @@ soc_sram_info soc_sram_info_table[] = {
 		.soc_id       = 0x1623, /* Allwinner A10 */
 		.scratch_addr = 0x2000,
 		.thunk_addr   = 0xAE00, .thunk_size = 0x200,
+		.sid_addr     = 0x01C23800,
 		.swap_buffers = a10_a13_a20_sram_swap_buffers,
 		.needs_l2en   = 1,
 	},
@@ -481,6 +1036,7 @@ soc_sram_info soc_sram_info_table[] = {
 		.soc_id       = 0x1625, /* Allwinner A13 */
 		.scratch_addr = 0x2000,
 		.thunk_addr   = 0xAE00, .thunk_size = 0x200,
+		.sid_addr     = 0x01C23800,
 		.swap_buffers = a10_a13_a20_sram_swap_buffers,
 		.needs_l2en   = 1,
 	},
@@ -488,36 +1044,42 @@ soc_sram_info soc_sram_info_table[] = {
 		.soc_id       = 0x1651, /* Allwinner A20 */
 		.scratch_addr = 0x2000,
 		.thunk_addr   = 0xAE00, .thunk_size = 0x200,
+		.sid_addr     = 0x01C23800,
 		.swap_buffers = a10_a13_a20_sram_swap_buffers,
 	},
 	{
 		.soc_id       = 0x1650, /* Allwinner A23 */
 		.scratch_addr = 0x2000,
 		.thunk_addr   = 0x46E00, .thunk_size = 0x200,
+		.sid_addr     = 0x01C23800,
 		.swap_buffers = a31_sram_swap_buffers,
 	},
 	{
 		.soc_id       = 0x1633, /* Allwinner A31 */
 		.scratch_addr = 0x2000,
 		.thunk_addr   = 0x46E00, .thunk_size = 0x200,
+		.sid_addr     = 0x01C23800,
 		.swap_buffers = a31_sram_swap_buffers,
 	},
 	{
 		.soc_id       = 0x1667, /* Allwinner A33 */
 		.scratch_addr = 0x2000,
 		.thunk_addr   = 0x46E00, .thunk_size = 0x200,
+		.sid_addr     = 0x01C23800,
 		.swap_buffers = a31_sram_swap_buffers,
 	},
 	{
 		.soc_id       = 0x1673, /* Allwinner A83T */
 		.scratch_addr = 0x2000,
 		.thunk_addr   = 0x46E00, .thunk_size = 0x200,
+		.sid_addr     = 0x01C14200,
 		.swap_buffers = a31_sram_swap_buffers,
 	},
 	{
 		.soc_id       = 0x1680, /* Allwinner H3 */
 		.scratch_addr = 0x2000,
 		.thunk_addr   = 0x46E00, .thunk_size = 0x200,
+		.sid_addr     = 0x01C14200,
 		.swap_buffers = a31_sram_swap_buffers,
 	},
 	{ 0 } /* End of the table */
@@ -544,31 +1106,63 @@ soc_sram_info generic_sram_info = {
 	.swap_buffers = generic_sram_swap_buffers,
 };
 
+soc_sram_info *aw_find_sram_info(uint32_t soc_id)
+{
+	int i;
+	for (i = 0; soc_sram_info_table[i].swap_buffers; i++)
+		if (soc_sram_info_table[i].soc_id == soc_id)
+			return &soc_sram_info_table[i];
+	return NULL;
+}
+
 soc_sram_info *aw_fel_get_sram_info(libusb_device_handle *usb)
 {
 	/* persistent sram_info, retrieves result pointer once and caches it */
 	static soc_sram_info *result = NULL;
+	static uint32_t soc_id;
 	if (result == NULL) {
-		int i;
-
 		struct aw_fel_version buf;
 		aw_fel_get_version(usb, &buf);
+		soc_id = buf.soc_id;
 
-		for (i = 0; soc_sram_info_table[i].swap_buffers; i++)
-			if (soc_sram_info_table[i].soc_id == buf.soc_id) {
-				result = &soc_sram_info_table[i];
-				break;
-			}
-
+		result = aw_find_sram_info(buf.soc_id);
 		if (!result) {
 			printf("Warning: no 'soc_sram_info' data for your SoC (id=%04X)\n",
 			       buf.soc_id);
 			result = &generic_sram_info;
 		}
 	}
+#ifdef LIBSUNXI
+	libsunxi_on_device(NULL, soc_id, NULL); /* also when cached by an earlier session */
+#endif
 	return result;
 }
 
+/*
+ * Reads the 128 bit Security ID, unique per chip, as "xxxxxxxx:xxxxxxxx:
+ * xxxxxxxx:xxxxxxxx" into 'sid' (at least 36 bytes). Returns 0 for SoCs
+ * without a known SID address, and for chips with an unprogrammed SID.
+ */
+int aw_fel_get_sid(libusb_device_handle *usb, char *sid, size_t size)
+{
+	soc_sram_info *sram_info = aw_fel_get_sram_info(usb);
+	uint32_t key[4];
+	int i;
+
+	if (!sram_info->sid_addr)
+		return 0;
+	aw_fel_read(usb, sram_info->sid_addr, key, sizeof(key));
+	for (i = 0; i < 4; i++)
+		key[i] = le32toh(key[i]);
+	if ((key[0] | key[1] | key[2] | key[3]) == 0)
+		return 0;
+	snprintf(sid, size, "%08x:%08x:%08x:%08x", key[0], key[1], key[2], key[3]);
+#ifdef LIBSUNXI
+	libsunxi_on_device(NULL, 0, sid);
+#endif
+	return 1;
+}
+
 static uint32_t fel_to_spl_thunk[] = {
 	#include "fel-to-spl-thunk.h"
 };
@@ -659,6 +1253,22 @@ uint32_t aw_get_sctlr(libusb_device_handle *usb, soc_sram_info *sram_info)
 	return sctlr;
 }
 
+/* Basic sanity checks to be sure that this is a valid table */
+void aw_check_mmu_tt(const uint32_t *tt)
+{
+	uint32_t i;
+	for (i = 0; i < 4096; i++) {
+		if (((tt[i] >> 1) & 1) != 1 || ((tt[i] >> 18) & 1) != 0) {
+			fprintf(stderr, "MMU: not a section descriptor\n");
+			exit(1);
+		}
+		if ((tt[i] >> 20) != i) {
+			fprintf(stderr, "MMU: not a direct mapping\n");
+			exit(1);
+		}
+	}
+}
+
 uint32_t *aw_backup_and_disable_mmu(libusb_device_handle *usb,
                                     soc_sram_info *sram_info)
 {
@@ -699,17 +1309,7 @@ uint32_t *aw_backup_and_disable_mmu(libusb_device_handle *usb,
 	for (i = 0; i < 4096; i++)
 		tt[i] = le32toh(tt[i]);
 
-	/* Basic sanity checks to be sure that this is a valid table */
-	for (i = 0; i < 4096; i++) {
-		if (((tt[i] >> 1) & 1) != 1 || ((tt[i] >> 18) & 1) != 0) {
-			fprintf(stderr, "MMU: not a section descriptor\n");
-			exit(1);
-		}
-		if ((tt[i] >> 20) != i) {
-			fprintf(stderr, "MMU: not a direct mapping\n");
-			exit(1);
-		}
-	}
+	aw_check_mmu_tt(tt);
 
 	pr_info("Disabling I-cache, MMU and branch prediction...");
 	aw_fel_write(usb, arm_code, sram_info->scratch_addr, sizeof(arm_code));
@@ -779,24 +1379,15 @@ void aw_restore_and_enable_mmu(libusb_device_handle *usb,
  */
 #define SPL_LEN_LIMIT 0x8000
 
-void aw_fel_write_and_execute_spl(libusb_device_handle *usb,
-				  uint8_t *buf, size_t len)
+/*
+ * Check the eGON header and checksum of an SPL image. Returns the SPL length
+ * from the header.
+ */
+uint32_t aw_check_spl_header(const uint8_t *buf, size_t len)
 {
-	soc_sram_info *sram_info = aw_fel_get_sram_info(usb);
-	sram_swap_buffers *swap_buffers;
-	char header_signature[9] = { 0 };
-	size_t i, thunk_size;
-	uint32_t *thunk_buf;
-	uint32_t sp, sp_irq;
-	uint32_t spl_checksum, spl_len, spl_len_limit = SPL_LEN_LIMIT;
-	uint32_t *buf32 = (uint32_t *)buf;
-	uint32_t cur_addr = sram_info->spl_addr;
-	uint32_t *tt = NULL;
-
-	if (!sram_info || !sram_info->swap_buffers) {
-		fprintf(stderr, "SPL: Unsupported SoC type\n");
-		exit(1);
-	}
+	const uint32_t *buf32 = (const uint32_t *)buf;
+	uint32_t spl_checksum, spl_len;
+	size_t i;
 
 	if (len < 32 || memcmp(buf + 4, "eGON.BT0", 8) != 0) {
 		fprintf(stderr, "SPL: eGON header is not found\n");
@@ -811,14 +1402,70 @@ void aw_fel_write_and_execute_spl(libusb_device_handle *usb,
 		exit(1);
 	}
 
-	len = spl_len;
-	for (i = 0; i < len / 4; i++)
+	for (i = 0; i < spl_len / 4; i++)
 		spl_checksum -= le32toh(buf32[i]);
 
 	if (spl_checksum != 0) {
 		fprintf(stderr, "SPL: checksum check failed\n");
 		exit(1);
 	}
+	return spl_len;
+}
+
+/*
+ * Build the FEL-to-SPL thunk for this SoC: the thunk code, followed by the
+ * SPL address and the swap buffer table, in little endian. The caller frees
+ * the result.
+ */
+uint32_t *aw_build_spl_thunk(soc_sram_info *sram_info, size_t *thunk_size)
+{
+	sram_swap_buffers *swap_buffers = sram_info->swap_buffers;
+	uint32_t *thunk_buf;
+	size_t i, n;
+
+	for (n = 0; swap_buffers[n].size; n++)
+		;
+	*thunk_size = sizeof(fel_to_spl_thunk) + sizeof(sram_info->spl_addr) +
+		      (n + 1) * sizeof(*swap_buffers);
+
+	if (*thunk_size > sram_info->thunk_size) {
+		fprintf(stderr, "SPL: bad thunk size (need %d, have %d)\n",
+			(int)sizeof(fel_to_spl_thunk), sram_info->thunk_size);
+		exit(1);
+	}
+
+	thunk_buf = malloc(*thunk_size);
+	memcpy(thunk_buf, fel_to_spl_thunk, sizeof(fel_to_spl_thunk));
+	memcpy(thunk_buf + sizeof(fel_to_spl_thunk) / sizeof(uint32_t),
+	       &sram_info->spl_addr, sizeof(sram_info->spl_addr));
+	memcpy(thunk_buf + sizeof(fel_to_spl_thunk) / sizeof(uint32_t) + 1,
+	       swap_buffers, (n + 1) * sizeof(*swap_buffers));
+
+	for (i = 0; i < *thunk_size / sizeof(uint32_t); i++)
+		thunk_buf[i] = htole32(thunk_buf[i]);
+	return thunk_buf;
+}
+
+void aw_fel_write_and_execute_spl(libusb_device_handle *usb,
+				  uint8_t *buf, size_t len)
+{
+	soc_sram_info *sram_info = aw_fel_get_sram_info(usb);
+	sram_swap_buffers *swap_buffers;
+	char header_signature[9] = { 0 };
+	size_t i, thunk_size;
+	uint32_t *thunk_buf;
+	uint32_t sp, sp_irq;
+	uint32_t spl_len, spl_len_limit = SPL_LEN_LIMIT;
+	uint32_t cur_addr = sram_info->spl_addr;
+	uint32_t *tt = NULL;
+	uint64_t span = span_begin(), step;
+
+	if (!sram_info || !sram_info->swap_buffers) {
+		fprintf(stderr, "SPL: Unsupported SoC type\n");
+		exit(1);
+	}
+
+	len = spl_len = aw_check_spl_header(buf, len);
 
 	if (sram_info->needs_l2en) {
 		pr_info("Enabling the L2 cache\n");
@@ -828,7 +1475,9 @@ void aw_fel_write_and_execute_spl(libusb_device_handle *usb,
 	aw_get_stackinfo(usb, sram_info, &sp_irq, &sp);
 	pr_info("Stack pointers: sp_irq=0x%08X, sp=0x%08X\n", sp_irq, sp);
 
+	step = span_begin();
 	tt = aw_backup_and_disable_mmu(usb, sram_info);
+	span_end(step, "fel", "mmu_backup");
 
 	swap_buffers = sram_info->swap_buffers;
 	for (i = 0; swap_buffers[i].size; i++) {
@@ -869,24 +1518,8 @@ void aw_fel_write_and_execute_spl(libusb_device_handle *usb,
 	if (len > 0)
 		aw_fel_write(usb, buf, cur_addr, len);
 
-	thunk_size = sizeof(fel_to_spl_thunk) + sizeof(sram_info->spl_addr) +
-		     (i + 1) * sizeof(*swap_buffers);
-
-	if (thunk_size > sram_info->thunk_size) {
-		fprintf(stderr, "SPL: bad thunk size (need %d, have %d)\n",
-			(int)sizeof(fel_to_spl_thunk), sram_info->thunk_size);
-		exit(1);
-	}
-
-	thunk_buf = malloc(thunk_size);
-	memcpy(thunk_buf, fel_to_spl_thunk, sizeof(fel_to_spl_thunk));
-	memcpy(thunk_buf + sizeof(fel_to_spl_thunk) / sizeof(uint32_t),
-	       &sram_info->spl_addr, sizeof(sram_info->spl_addr));
-	memcpy(thunk_buf + sizeof(fel_to_spl_thunk) / sizeof(uint32_t) + 1,
-	       swap_buffers, (i + 1) * sizeof(*swap_buffers));
-
-	for (i = 0; i < thunk_size / sizeof(uint32_t); i++)
-		thunk_buf[i] = htole32(thunk_buf[i]);
+	step = span_begin();
+	thunk_buf = aw_build_spl_thunk(sram_info, &thunk_size);
 
 	pr_info("=> Executing the SPL...");
 	aw_fel_write(usb, thunk_buf, sram_info->thunk_addr, thunk_size);
@@ -894,9 +1527,12 @@ void aw_fel_write_and_execute_spl(libusb_device_handle *usb,
 	pr_info(" done.\n");
 
 	free(thunk_buf);
+	span_end(step, "fel", "spl_thunk");
 
 	/* TODO: Try to find and fix the bug, which needs this workaround */
+	step = span_begin();
 	usleep(250000);
+	span_end(step, "fel", "spl_wait");
 
 	/* Read back the result and check if everything was fine */
 	aw_fel_read(usb, sram_info->spl_addr + 4, header_signature, 8);
@@ -907,8 +1543,12 @@ void aw_fel_write_and_execute_spl(libusb_device_handle *usb,
 	}
 
 	/* re-enable the MMU if it was enabled by BROM */
-	if(tt != NULL)
+	if(tt != NULL) {
+		step = span_begin();
 		aw_restore_and_enable_mmu(usb, sram_info, tt);
+		span_end(step, "fel", "mmu_restore");
+	}
+	span_end_range(span, "fel", "spl", sram_info->spl_addr, spl_len);
 }
 
 /*
@@ -1047,6 +1687,181 @@ void pass_fel_information(libusb_device_handle *usb, uint32_t script_address)
 	}
 }
 
+/*
+ * Block hashes, computed on the device so that only the hashes have to cross
+ * USB: FNV-1a, one hash per block. It goes byte by byte: over whole words
+ * the multiplication only carries a change upwards, and changes to the top
+ * bits of two words could cancel out.
+ */
+#define AW_SYNC_BLOCK		(64 * 1024)	/* LIBSUNXI_HASH_BLOCK */
+#define AW_HASH_RESULTS		0x100	/* results follow the code in scratch SRAM */
+#define AW_HASH_MAX_BLOCKS	1024	/* 4 KiB of results per run */
+#define FNV_BASIS		0x811C9DC5
+#define FNV_PRIME		0x01000193
+
+uint32_t aw_block_hash(const uint8_t *buf, size_t len)
+{
+	uint32_t hash = FNV_BASIS;
+	size_t i;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ buf[i]) * FNV_PRIME;
+	return hash;
+}
+
+/*
+ * Hash 'count' blocks of 'block_size' bytes (not 0) starting at 'addr' on
+ * the device.
+ */
+void aw_fel_hash_blocks(libusb_device_handle *usb, uint32_t addr,
+			uint32_t block_size, uint32_t count, uint32_t *hashes)
+{
+	soc_sram_info *sram_info = aw_fel_get_sram_info(usb);
+	uint32_t results = sram_info->scratch_addr + AW_HASH_RESULTS;
+	uint32_t arm_code[] = {
+		htole32(0xe92d0070), /* push       {r4, r5, r6}              */
+		htole32(0xe59f003c), /* ldr        r0, [pc, #60] ; addr      */
+		htole32(0xe59f103c), /* ldr        r1, [pc, #60] ; size      */
+		htole32(0xe59f203c), /* ldr        r2, [pc, #60] ; count     */
+		htole32(0xe59f303c), /* ldr        r3, [pc, #60] ; results   */
+		htole32(0xe59fc03c), /* ldr        ip, [pc, #60] ; prime     */
+		/* next block: */
+		htole32(0xe59f403c), /* ldr        r4, [pc, #60] ; basis     */
+		htole32(0xe1a05001), /* mov        r5, r1                    */
+		/* next byte: */
+		htole32(0xe4d06001), /* ldrb       r6, [r0], #1              */
+		htole32(0xe0244006), /* eor        r4, r4, r6                */
+		htole32(0xe004049c), /* mul        r4, ip, r4                */
+		htole32(0xe2555001), /* subs       r5, r5, #1                */
+		htole32(0x1afffffa), /* bne        next byte                 */
+		htole32(0xe4834004), /* str        r4, [r3], #4              */
+		htole32(0xe2522001), /* subs       r2, r2, #1                */
+		htole32(0x1afffff5), /* bne        next block                */
+		htole32(0xe8bd0070), /* pop        {r4, r5, r6}              */
+		htole32(0xe12fff1e), /* bx         lr                        */
+		0, 0, 0, 0,          /* addr, size, count, results           */
+		htole32(FNV_PRIME),
+		htole32(FNV_BASIS),
+	};
+	uint32_t *params = arm_code + 18;
+	uint32_t i;
+	uint64_t span = span_begin();
+	uint32_t start_addr = addr, blocks = count;
+
+	while (count > 0) {
+		uint32_t n = count < AW_HASH_MAX_BLOCKS ? count : AW_HASH_MAX_BLOCKS;
+		params[0] = htole32(addr);
+		params[1] = htole32(block_size);
+		params[2] = htole32(n);
+		params[3] = htole32(results);
+		aw_fel_write(usb, arm_code, sram_info->scratch_addr, sizeof(arm_code));
+		aw_fel_execute(usb, sram_info->scratch_addr);
+		aw_fel_read(usb, results, hashes, n * sizeof(uint32_t));
+		for (i = 0; i < n; i++)
+			hashes[i] = le32toh(hashes[i]);
+		addr += n * block_size;
+		hashes += n;
+		count -= n;
+	}
+	span_end_range(span, "fel", "hash", start_addr, blocks * block_size);
+}
+
+/* Hash of block 'i' of a buffer, from 'known' if its hashes were computed before */
+static uint32_t aw_buf_block_hash(const uint8_t *buf, uint32_t i, const uint32_t *known)
+{
+	return known ? known[i] : aw_block_hash(buf + i * AW_SYNC_BLOCK, AW_SYNC_BLOCK);
+}
+
+/* The block hashes of a bundle payload, kept by libsunxi; NULL for a file */
+static const uint32_t *payload_block_hashes(const char *name, size_t len)
+{
+#ifdef LIBSUNXI
+	const uint32_t *hashes;
+	uint32_t count;
+
+	if (!is_payload(name))
+		return NULL;
+	hashes = libsunxi_payload_hashes(name + strlen(LIBSUNXI_PAYLOAD_PREFIX), AW_SYNC_BLOCK, &count);
+	return hashes && count == len / AW_SYNC_BLOCK ? hashes : NULL;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Like aw_fel_write(), but compare block hashes with what is already in
+ * device memory first and only send the blocks that differ (runs of changed
+ * blocks go out as one write). Returns the number of bytes actually sent.
+ * 'known' holds the hashes of the blocks of 'buf' if they are known, or is NULL.
+ */
+size_t aw_fel_sync(libusb_device_handle *usb, uint32_t offset,
+		   uint8_t *buf, size_t len, const uint32_t *known)
+{
+	uint32_t count = (offset % 4) ? 0 : len / AW_SYNC_BLOCK;
+	uint32_t *device_hashes = malloc((count + 1) * sizeof(uint32_t));
+	size_t tail = len - (size_t)count * AW_SYNC_BLOCK;
+	size_t sent = 0;
+	uint32_t i, first;
+	uint64_t span = span_begin();
+
+	aw_fel_hash_blocks(usb, offset, AW_SYNC_BLOCK, count, device_hashes);
+	for (i = 0; i < count; i++) {
+		if (aw_buf_block_hash(buf, i, known) == device_hashes[i])
+			continue;
+		first = i;
+		while (i + 1 < count && aw_buf_block_hash(buf, i + 1, known) != device_hashes[i + 1])
+			i++;
+		aw_fel_write(usb, buf + first * AW_SYNC_BLOCK,
+			     offset + first * AW_SYNC_BLOCK, (i - first + 1) * AW_SYNC_BLOCK);
+		sent += (i - first + 1) * AW_SYNC_BLOCK;
+	}
+	free(device_hashes);
+
+	/* a partial last block is not worth a hash round trip */
+	if (tail > 0) {
+		aw_fel_write(usb, buf + len - tail, offset + len - tail, tail);
+		sent += tail;
+	}
+	span_end_range(span, "fel", "sync", offset, len);
+	return sent;
+}
+
+/*
+ * Check that device memory at 'offset' holds 'buf': full blocks by their
+ * hashes (computed on the device), a partial last block by reading it back.
+ * 'known' is as for aw_fel_sync().
+ */
+void aw_fel_verify(libusb_device_handle *usb, uint32_t offset,
+		   const uint8_t *buf, size_t len, const uint32_t *known)
+{
+	uint32_t count = (offset % 4) ? 0 : len / AW_SYNC_BLOCK;
+	uint32_t *device_hashes = malloc((count + 1) * sizeof(uint32_t));
+	size_t tail = len - (size_t)count * AW_SYNC_BLOCK;
+	uint32_t i;
+	uint64_t span = span_begin();
+
+	aw_fel_hash_blocks(usb, offset, AW_SYNC_BLOCK, count, device_hashes);
+	for (i = 0; i < count; i++) {
+		if (aw_buf_block_hash(buf, i, known) != device_hashes[i]) {
+			fprintf(stderr, "ERROR: Verify failed, 0x%08X-0x%08X differs\n",
+				offset + i * AW_SYNC_BLOCK, offset + (i + 1) * AW_SYNC_BLOCK);
+			exit(1);
+		}
+	}
+	free(device_hashes);
+
+	if (tail > 0) {
+		uint8_t *device_tail = malloc(tail);
+		aw_fel_read(usb, offset + len - tail, device_tail, tail);
+		if (memcmp(device_tail, buf + len - tail, tail) != 0) {
+			fprintf(stderr, "ERROR: Verify failed, 0x%08X-0x%08X differs\n",
+				offset + (uint32_t)(len - tail), offset + (uint32_t)len);
+			exit(1);
+		}
+		free(device_tail);
+	}
+	span_end_range(span, "fel", "verify", offset, len);
+}
+
 static int aw_fel_get_endpoint(libusb_device_handle *usb)
 {
 	struct libusb_device *dev = libusb_get_device(usb);
@@ -1087,14 +1902,107 @@ static int aw_fel_get_endpoint(libusb_device_handle *usb)
 	return 0;
 }
 
-/* Less reliable than clock_gettime, but does not require linking with -lrt */
-static double gettime(void)
+/* "bus-port.port...", as in sysfs: the same physical port keeps its path across replugs */
+static void aw_usb_port_path(libusb_device *dev, char *path, size_t size)
 {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return tv.tv_sec + (double)tv.tv_usec / 1000000.;
+	uint8_t ports[8];
+	int i, n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	size_t len = snprintf(path, size, "%d-", libusb_get_bus_number(dev));
+
+	if (n <= 0)
+		snprintf(path + len, size - len, "0");
+	for (i = 0; i < n && len < size; i++)
+		len += snprintf(path + len, size - len, i ? ".%d" : "%d", ports[i]);
 }
+
+static const int aw_tune_chunk_sizes[] = {
+	64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024,
+	1024 * 1024, 2 * 1024 * 1024, 4 * 1024 * 1024
+};
+
+/*
+ * Write 'len' bytes of scratch data to 'offset' (DRAM the caller doesn't
+ * need, so after the SPL has run) once per bulk chunk size, and keep the
+ * fastest size. The timeout becomes four times the slowest single transfer
+ * seen at that size. Under LIBSUNXI the result is stored for the USB port,
+ * and later sessions on that port start with it.
+ */
+void aw_fel_tune(libusb_device_handle *usb, const char *port, uint32_t offset, size_t len)
+{
+	uint8_t *buf = malloc(len);
+	double best_rate = 0, best_slowest = 0;
+	int best_chunk = AW_USB_MAX_BULK_SEND;
+	size_t i;
+	uint64_t span = span_begin();
+
+	if (!buf) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < len; i++)
+		buf[i] = i * 31 + (i >> 12); /* neither zeros nor repeating blocks */
+
+	timeout = AW_USB_TIMEOUT;
+	for (i = 0; i < sizeof(aw_tune_chunk_sizes) / sizeof(aw_tune_chunk_sizes[0]); i++) {
+		double t1, t2, rate;
+		if ((size_t)aw_tune_chunk_sizes[i] > len)
+			break;
+		usb_bulk_chunk = aw_tune_chunk_sizes[i];
+		usb_slowest_send = 0;
+		t1 = gettime();
+		aw_fel_write(usb, buf, offset, len);
+		t2 = gettime();
+		rate = t2 > t1 ? len / (t2 - t1) : 0;
+		printf("%8d byte transfers: %8.1f KB/s, slowest %.1f ms\n",
+		       usb_bulk_chunk, rate / 1000., usb_slowest_send * 1000.);
+		/* a larger chunk has to be clearly faster, not just noise */
+		if (rate > best_rate * 1.02) {
+			best_rate = rate;
+			best_chunk = usb_bulk_chunk;
+			best_slowest = usb_slowest_send;
+		}
+	}
+	free(buf);
+
+	usb_bulk_chunk = best_chunk;
+	timeout = best_slowest * 4 * 1000. + 0.5;
+	if (timeout < AW_USB_MIN_TUNED_TIMEOUT)
+		timeout = AW_USB_MIN_TUNED_TIMEOUT;
+	if (timeout > AW_USB_TIMEOUT)
+		timeout = AW_USB_TIMEOUT;
+	printf("Tuned %s: %d byte transfers, %d ms timeout\n", port, usb_bulk_chunk, timeout);
+	span_end_range(span, "fel", "tune", offset, len);
 #ifdef LIBSUNXI
+	libsunxi_set_usb_tuning(port, usb_bulk_chunk, timeout);
+#endif
+}
+
+#ifdef LIBSUNXI
+/*
+ * The device of the fel session in progress, so that aw_session_cleanup()
+ * can let go of it when fel_main() was left by exit()
+ */
+static int session_libusb = 0; /* libusb_init() was called */
+static libusb_device_handle *session_handle = NULL;
+static int session_detached = -1; /* interface whose kernel driver was detached */
+
+void aw_session_cleanup(void)
+{
+	if (session_handle) {
+#if defined(__linux__)
+		if (session_detached >= 0)
+			libusb_attach_kernel_driver(session_handle, session_detached);
+#endif
+		libusb_release_interface(session_handle, 0);
+		libusb_close(session_handle);
+		session_handle = NULL;
+	}
+	session_detached = -1;
+	if (session_libusb)
+		libusb_exit(NULL);
+	session_libusb = 0;
+}
+
 int fel_main(int argc, char **argv)
 #else
 int main(int argc, char **argv)
@@ -1103,17 +2011,26 @@ int main(int argc, char **argv)
 	int uboot_autostart = 0; /* flag for "uboot" command = U-Boot autostart */
 	int rc;
 	libusb_device_handle *handle = NULL;
-	libusb_context *ctx = NULL; //a libusb session
 
 	int busnum = -1, devnum = -1;
+	const char *want_port = NULL;
 	int iface_detached = -1;
-	rc = libusb_init(&ctx);
+	int tuned = 0;
+	int command_index = 0;
+	char port[64];
+	uint64_t span = span_begin();
+	/* the default context, which the libusb calls below use anyway */
+	rc = libusb_init(NULL);
 	assert(rc == 0);
+#ifdef LIBSUNXI
+	session_libusb = 1;
+#endif
 
 	if (argc <= 1) {
 		printf("Usage: %s [options] command arguments... [command...]\n"
 			"	-v, --verbose			Verbose logging\n"
 			"	-d, --dev busnum:devnum		Specify the USB device to use\n"
+			"	-P, --port bus-port[.port...]	Use the device on this USB port\n"
 			"	-p, --progress			Show progress bar when transferring large files\n"
 			"\n"
 			"	spl file			Load and execute U-Boot SPL\n"
@@ -1132,13 +2049,20 @@ int main(int argc, char **argv)
 			"	read address length file	Write memory contents into file\n"
 			"	write address file		Store file contents into memory\n"
 			"	ver[sion]			Show BROM version\n"
+			"	sid				Show the SoC's Security ID\n"
 			"	clear address length		Clear memory\n"
 			"	fill address length value	Fill memory\n"
+			"	sync address file		Like write, but only send blocks that\n"
+			"					differ from device memory\n"
+			"	tune address length		Find the best bulk transfer size for\n"
+			"					this USB port, using scratch memory.\n"
+			"					Skipped if the port is already tuned\n"
+			"	retune address length		Like tune, but always probes\n"
+			"	verify address file		Check that memory holds the file\n"
 			, argv[0]
 		);
 	}
 
-	handle = libusb_open_device_with_vid_pid(NULL, 0x1f3a, 0xefe8);
 	while (argc > 1) {
 		if (argv[1][0] != '-')
 			break;
@@ -1161,11 +2085,27 @@ int main(int argc, char **argv)
 			argv += 1;
 		}
 
+		if ((strcmp(argv[1], "--port") == 0 ||
+		     strcmp(argv[1], "-P") == 0) && argc > 2) {
+			want_port = argv[2];
+			argc -= 1;
+			argv += 1;
+		}
+
 		argc -= 1;
 		argv += 1;
 	}
 
-	if (busnum >= 0 && devnum >= 0) {
+#ifdef LIBSUNXI
+	if (busnum < 0 && !fel_enum_present(want_port)) {
+		if (want_port)
+			fprintf(stderr, "ERROR: No USB FEL device on port %s\n", want_port);
+		else
+			fprintf(stderr, "ERROR: Allwinner USB FEL device not found!\n");
+		exit(1);
+	}
+#endif
+	if ((busnum >= 0 && devnum >= 0) || want_port) {
 		struct libusb_device_descriptor desc;
 		size_t ndevs, i;
 		libusb_device **list;
@@ -1173,10 +2113,16 @@ int main(int argc, char **argv)
 
 		ndevs = libusb_get_device_list(NULL, &list);
 		for (i = 0; i < ndevs; i++) {
-			if (libusb_get_bus_number(list[i]) != busnum ||
-			    libusb_get_device_address(list[i]) != devnum) {
+			if (want_port)
+				aw_usb_port_path(list[i], port, sizeof(port));
+			if (want_port ? strcmp(port, want_port) != 0 :
+			    (libusb_get_bus_number(list[i]) != busnum ||
+			     libusb_get_device_address(list[i]) != devnum)) {
 				if (i == ndevs-1) {
-					fprintf(stderr, "ERROR: No USB FEL device at 0x%x:0x%x\n", busnum, devnum);
+					if (want_port)
+						fprintf(stderr, "ERROR: No USB FEL device on port %s\n", want_port);
+					else
+						fprintf(stderr, "ERROR: No USB FEL device at 0x%x:0x%x\n", busnum, devnum);
 					exit(1);
 				}
 				continue;
@@ -1208,11 +2154,17 @@ int main(int argc, char **argv)
 		}
 		exit(1);
 	}
+#ifdef LIBSUNXI
+	session_handle = handle;
+#endif
 	rc = libusb_claim_interface(handle, 0);
 #if defined(__linux__)
 	if (rc != LIBUSB_SUCCESS) {
 		libusb_detach_kernel_driver(handle, 0);
 		iface_detached = 0;
+#ifdef LIBSUNXI
+		session_detached = 0;
+#endif
 		rc = libusb_claim_interface(handle, 0);
 	}
 #endif
@@ -1225,8 +2177,36 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	/* fel_main runs many times per process, each session starts from the defaults */
+	usb_bulk_chunk = AW_USB_MAX_BULK_SEND;
+	timeout = AW_USB_TIMEOUT;
+	aw_usb_port_path(libusb_get_device(handle), port, sizeof(port));
+	span_set_device(port);
+	span_end(span, "fel", "open");
+#ifdef LIBSUNXI
+	libsunxi_on_device(port, 0, NULL);
+	{
+		uint32_t chunk, timeout_ms;
+		if (libsunxi_find_usb_tuning(port, &chunk, &timeout_ms)) {
+			usb_bulk_chunk = chunk;
+			timeout = timeout_ms;
+			tuned = 1;
+			pr_info("USB port %s: %d byte transfers, %d ms timeout\n", port, usb_bulk_chunk, timeout);
+		}
+	}
+#endif
+
 	while (argc > 1 ) {
 		int skip = 1;
+		const char *command = argv[1];
+#ifdef LIBSUNXI
+		if (libsunxi_cancelled()) {
+			fprintf(stderr, "ERROR: Cancelled before %s\n", argv[1]);
+			exit(2);
+		}
+		libsunxi_on_command(command_index++, argv[1]);
+#endif
+		span = span_begin();
 		if (strncmp(argv[1], "hex", 3) == 0 && argc > 3) {
 			aw_fel_hexdump(handle, strtoul(argv[2], NULL, 0), strtoul(argv[3], NULL, 0));
 			skip = 3;
@@ -1236,17 +2216,28 @@ int main(int argc, char **argv)
 		} else if ((strncmp(argv[1], "exe", 3) == 0 && argc > 2)
 			) {
 			aw_fel_execute(handle, strtoul(argv[2], NULL, 0));
+			skip=2;
+		} else if (strcmp(argv[1], "verify") == 0 && argc > 3) {
+			size_t size;
+			void *buf = load_file(argv[3], &size);
+			aw_fel_verify(handle, strtoul(argv[2], NULL, 0), buf, size,
+				      payload_block_hashes(argv[3], size));
+			pr_info("Verified %.1f KB\n", (double)size / 1000.);
+			unload_file(argv[3], buf);
 			skip=3;
-		} else if (strncmp(argv[1], "ver", 3) == 0 && argc > 1) {
+		} else if (strcmp(argv[1], "sid") == 0) {
+			char sid[40];
+			printf("%s\n", aw_fel_get_sid(handle, sid, sizeof(sid)) ? sid : "unknown");
+		} else if (strncmp(argv[1], "ver", 3) == 0 && argc > 1) { /* after "verify" */
 			aw_fel_print_version(handle);
 			skip=1;
 		} else if (strcmp(argv[1], "write") == 0 && argc > 3) {
 			double t1, t2;
 			size_t size;
-			void *buf = load_file(argv[3], &size);
+			int image_type = IH_TYPE_INVALID;
 			uint32_t offset = strtoul(argv[2], NULL, 0);
 			t1 = gettime();
-			aw_fel_write(handle, buf, offset, size);
+			size = aw_fel_write_file(handle, offset, argv[3], &image_type);
 			t2 = gettime();
 			if (t2 > t1)
 				pr_info("Written %.1f KB in %.1f sec (speed: %.1f KB/s)\n",
@@ -1256,17 +2247,28 @@ int main(int argc, char **argv)
 			 * If we have transferred a script, try to inform U-Boot
 			 * about its address.
 			 */
-			if (get_image_type(buf, size) == IH_TYPE_SCRIPT)
+			if (image_type == IH_TYPE_SCRIPT)
 				pass_fel_information(handle, offset);
 
-			free(buf);
+			skip=3;
+		} else if (strcmp(argv[1], "sync") == 0 && argc > 3) {
+			size_t size, sent;
+			void *buf = load_file(argv[3], &size);
+			uint32_t offset = strtoul(argv[2], NULL, 0);
+			sent = aw_fel_sync(handle, offset, buf, size, payload_block_hashes(argv[3], size));
+			pr_info("Synced %.1f KB, sent %.1f KB\n",
+				(double)size / 1000., (double)sent / 1000.);
+			if (get_image_type(buf, size) == IH_TYPE_SCRIPT)
+				pass_fel_information(handle, offset);
+			unload_file(argv[3], buf);
 			skip=3;
 		} else if (strcmp(argv[1], "read") == 0 && argc > 4) {
-			size_t size = strtoul(argv[3], NULL, 0);
-			void *buf = malloc(size);
-			aw_fel_read(handle, strtoul(argv[2], NULL, 0), buf, size);
-			save_file(argv[4], buf, size);
-			free(buf);
+			int fd = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (fd < 0) {
+				perror("Failed to open output file: ");
+				exit(1);
+			}
+			aw_fel_read_to_fd(handle, strtoul(argv[2], NULL, 0), strtoul(argv[3], NULL, 0), fd, 0);
 			skip=4;
 		} else if (strcmp(argv[1], "clear") == 0 && argc > 2) {
 			aw_fel_fill(handle, strtoul(argv[2], NULL, 0), strtoul(argv[3], NULL, 0), 0);
@@ -1274,6 +2276,13 @@ int main(int argc, char **argv)
 		} else if (strcmp(argv[1], "fill") == 0 && argc > 3) {
 			aw_fel_fill(handle, strtoul(argv[2], NULL, 0), strtoul(argv[3], NULL, 0), (unsigned char)strtoul(argv[4], NULL, 0));
 			skip=4;
+		} else if ((strcmp(argv[1], "tune") == 0 || strcmp(argv[1], "retune") == 0) && argc > 3) {
+			if (tuned && strcmp(argv[1], "tune") == 0)
+				pr_info("USB port %s is already tuned\n", port);
+			else
+				aw_fel_tune(handle, port, strtoul(argv[2], NULL, 0), strtoul(argv[3], NULL, 0));
+			tuned = 1;
+			skip=3;
 		} else if (strcmp(argv[1], "spl") == 0 && argc > 2) {
 			aw_fel_process_spl_and_uboot(handle, argv[2]);
 			skip=2;
@@ -1287,6 +2296,7 @@ int main(int argc, char **argv)
 			fprintf(stderr,"Invalid command %s\n", argv[1]);
 			exit(1);
 		}
+		span_end(span, "command", command);
 		argc-=skip;
 		argv+=skip;
 	}
@@ -1310,7 +2320,12 @@ int main(int argc, char **argv)
 			return 1;
 		} else {
 			libusb_close(handle); //close the device we opened
-			libusb_exit(ctx); //needs to be called to end the
+			libusb_exit(NULL); //needs to be called to end the
+#ifdef LIBSUNXI
+			session_handle = NULL;
+			session_detached = -1;
+			session_libusb = 0;
+#endif
 		}
 	}
 	return 0;
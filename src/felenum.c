@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <unistd.h>
+#endif
+
+#include "felenum.h"
+
+#define FEL_VENDOR	0x1f3a
+#define FEL_PRODUCT	0xefe8
+#define CACHE_MAX	64
+
+/* Reads a sysfs attribute as a number in 'base'; -1 if it is missing */
+static long read_attribute(const char *root, const char *device, const char *name, int base)
+{
+	char path[512], value[32];
+	FILE *f;
+	long result = -1;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", root, device, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fgets(value, sizeof(value), f))
+		result = strtol(value, NULL, base);
+	fclose(f);
+	return result;
+}
+
+static int compare_ports(const void *a, const void *b)
+{
+	return strcmp(((const struct fel_enum_device *)a)->port, ((const struct fel_enum_device *)b)->port);
+}
+
+int fel_enum_scan(const char *root, struct fel_enum_device *devices, int max)
+{
+	DIR *dir = opendir(root);
+	struct dirent *entry;
+	int count = 0;
+
+	if (!dir)
+		return -1;
+	while ((entry = readdir(dir)) != NULL) {
+		const char *name = entry->d_name;
+		/* devices are "bus-port.port...", skip root hubs ("usbN") and interfaces ("...:1.0") */
+		if (!strchr(name, '-') || strchr(name, ':') || strlen(name) >= FEL_ENUM_PORT_LEN)
+			continue;
+		if (read_attribute(root, name, "idVendor", 16) != FEL_VENDOR ||
+		    read_attribute(root, name, "idProduct", 16) != FEL_PRODUCT)
+			continue;
+		if (count < max) {
+			devices[count].busnum = read_attribute(root, name, "busnum", 10);
+			devices[count].devnum = read_attribute(root, name, "devnum", 10);
+			strcpy(devices[count].port, name);
+		}
+		count++;
+	}
+	closedir(dir);
+	qsort(devices, count < max ? count : max, sizeof(*devices), compare_ports);
+	return count;
+}
+
+static const char *sysfs_root(void)
+{
+	const char *root = getenv("CHIP_BOOT_REPAIR_SYSFS");
+	return root && *root ? root : "/sys/bus/usb/devices";
+}
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fel_enum_device cache[CACHE_MAX];
+static int cache_count;
+static int cache_valid = 0;
+static char cache_root[256];
+static int uevent_fd = -1;
+static int uevent_tried = 0;
+
+#ifdef __linux__
+static void open_uevents(void)
+{
+	struct sockaddr_nl addr;
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+	if (fd < 0)
+		return;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1; /* kernel events */
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return;
+	}
+	uevent_fd = fd;
+}
+
+/* Whether a USB uevent arrived since the last call; messages are "action@path\0KEY=value\0..." */
+static int usb_uevents(void)
+{
+	char buf[4096];
+	int changed = 0;
+
+	for (;;) {
+		ssize_t n = recv(uevent_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		ssize_t i;
+		if (n < 0)
+			return changed || errno == ENOBUFS; /* overrun: events were lost */
+		buf[n] = 0;
+		for (i = 0; i < n; i += strlen(buf + i) + 1) {
+			if (strcmp(buf + i, "SUBSYSTEM=usb") == 0)
+				changed = 1;
+		}
+	}
+}
+#else
+static void open_uevents(void)
+{
+}
+
+static int usb_uevents(void)
+{
+	return 1;
+}
+#endif
+
+int fel_enum_devices(struct fel_enum_device *devices, int max)
+{
+	const char *root = sysfs_root();
+	int count;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!uevent_tried) {
+		open_uevents(); /* before the first scan, so no change slips in between */
+		uevent_tried = 1;
+	}
+	if (strcmp(root, cache_root) != 0 || uevent_fd < 0 || usb_uevents())
+		cache_valid = 0;
+	if (!cache_valid) {
+		cache_count = fel_enum_scan(root, cache, CACHE_MAX);
+		snprintf(cache_root, sizeof(cache_root), "%s", root);
+		cache_valid = 1;
+	}
+	count = cache_count;
+	if (count > 0) {
+		int n = count < CACHE_MAX ? count : CACHE_MAX;
+		memcpy(devices, cache, (n < max ? n : max) * sizeof(*devices));
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return count;
+}
+
+int fel_enum_present(const char *port)
+{
+	struct fel_enum_device found[CACHE_MAX];
+	int i, n = fel_enum_devices(found, CACHE_MAX);
+
+	if (n < 0 || (n > 0 && !port))
+		return 1;
+	for (i = 0; i < n && i < CACHE_MAX; i++) {
+		if (strcmp(found[i].port, port) == 0)
+			return 1;
+	}
+	return n > CACHE_MAX; /* more than were looked at */
+}
+
+void fel_enum_invalidate(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	cache_valid = 0;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void fel_enum_reset(void)
+{
+	/* the fork()ing thread was the only one, so nobody holds cache_lock */
+#ifdef __linux__
+	if (uevent_fd >= 0)
+		close(uevent_fd);
+#endif
+	uevent_fd = -1;
+	uevent_tried = 0;
+	cache_valid = 0;
+}
@@ -19,9 +19,18 @@
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "CancelToken.h"
+#include "PayloadBundle.h"
+#include "UsbTuning.h"
 
 extern "C" {
 #include "libsunxi.h"
+#include "usbtrace.h"
+#include "spantrace.h"
 
 /* Notes on translation from c to cpp
  *
@@ -73,6 +82,22 @@ char * slurpFileIntoBuffer(const std::string& path)
 //}
 
 
+/* The real stdout and stderr while call_main has redirected fds 1 and 2 */
+static volatile int savedStdout = -1;
+static volatile int savedStderr = -1;
+
+int libsunxi_stdout_fd(void)
+{
+	int fd = savedStdout;
+	return fd >= 0 ? fd : FILENO(stdout);
+}
+
+int libsunxi_stderr_fd(void)
+{
+	int fd = savedStderr;
+	return fd >= 0 ? fd : FILENO(stderr);
+}
+
 // caller needs to free the returned returnBuffer!
 int call_main(int argc, char **argv, MAIN_FUNC main_func, char ** returnBuffer)
 {
@@ -81,13 +106,19 @@ int call_main(int argc, char **argv, MAIN_FUNC main_func, char ** returnBuffer)
 
 	/* See http://stackoverflow.com/questions/7664788/freopen-stdout-and-console */
 	/* redirecting stdout to a file */
-    int stdout_dupfd;
+    int stdout_dupfd, stderr_dupfd;
     FILE *temp_out;
 
-    FILE * stdErrFile = freopen(tempFileNameStdErr.c_str(),"w",stderr);
+    /* stderr the same way, so the stream stays usable after the call */
+    fflush(stderr);
+    stderr_dupfd = DUP(2);
+    savedStderr = stderr_dupfd;
+    FILE * stdErrFile = fopen(tempFileNameStdErr.c_str(),"w");
+    DUP2(FILENO(stdErrFile), 2);
 
     /* duplicate stdout */
     stdout_dupfd = DUP(1);
+    savedStdout = stdout_dupfd;
 
     temp_out = fopen(tempFileName.c_str(), "w");
 
@@ -109,8 +140,11 @@ int call_main(int argc, char **argv, MAIN_FUNC main_func, char ** returnBuffer)
 
 
     /* flush output so it goes to our file */
-    fflush(stdErrFile);
+    fflush(stderr);
     fclose(stdErrFile);
+    DUP2(stderr_dupfd, 2);
+    savedStderr = -1;
+    CLOSE(stderr_dupfd);
 
 
 	fflush(stdout);
@@ -118,6 +152,7 @@ int call_main(int argc, char **argv, MAIN_FUNC main_func, char ** returnBuffer)
 
     /* Now restore stdout */
     DUP2(stdout_dupfd, 1);
+    savedStdout = -1;
     CLOSE(stdout_dupfd);
 
 	if (result == 0) {
@@ -132,11 +167,153 @@ int call_main(int argc, char **argv, MAIN_FUNC main_func, char ** returnBuffer)
 }
 
 
+static thread_local RETRY_FUNC retryHandler = NULL;
+static thread_local void *retryContext = NULL;
+
+void libsunxi_set_retry_handler(RETRY_FUNC handler, void *context)
+{
+	retryHandler = handler;
+	retryContext = context;
+}
+
+void libsunxi_on_retry(uint32_t address, int attempt, int error)
+{
+	if (retryHandler)
+		retryHandler(retryContext, address, attempt, error);
+}
+
+static thread_local COMMAND_FUNC commandHandler = NULL;
+static thread_local void *commandContext = NULL;
+
+void libsunxi_set_command_handler(COMMAND_FUNC handler, void *context)
+{
+	commandHandler = handler;
+	commandContext = context;
+}
+
+void libsunxi_on_command(int index, const char *command)
+{
+	if (commandHandler)
+		commandHandler(commandContext, index, command);
+}
+
+static thread_local DEVICE_FUNC deviceHandler = NULL;
+static thread_local void *deviceContext = NULL;
+
+void libsunxi_set_device_handler(DEVICE_FUNC handler, void *context)
+{
+	deviceHandler = handler;
+	deviceContext = context;
+}
+
+void libsunxi_on_device(const char *port, uint32_t soc_id, const char *sid)
+{
+	if (deviceHandler)
+		deviceHandler(deviceContext, port, soc_id, sid);
+}
+
+static thread_local BYTES_FUNC bytesHandler = NULL;
+static thread_local void *bytesContext = NULL;
+
+void libsunxi_set_bytes_handler(BYTES_FUNC handler, void *context)
+{
+	bytesHandler = handler;
+	bytesContext = context;
+}
+
+void libsunxi_on_bytes(uint32_t bytes)
+{
+	if (bytesHandler)
+		bytesHandler(bytesContext, bytes);
+}
+
+const void *libsunxi_find_payload(const char *name, size_t *size)
+{
+	PayloadBundle * bundle = PayloadBundle::shared();
+	const PayloadBundle::Entry * entry = bundle ? bundle->find(name) : NULL;
+	if (!entry)
+		return NULL;
+	if (size)
+		*size = entry->size;
+	return entry->data;
+}
+
+static std::mutex hashLock;
+static std::map<std::string, std::vector<uint32_t> > payloadHashes; // by "name/block size"
+
+const uint32_t *libsunxi_payload_hashes(const char *name, size_t block_size, uint32_t *count)
+{
+	PayloadBundle * bundle = PayloadBundle::shared();
+	const PayloadBundle::Entry * entry = bundle ? bundle->find(name) : NULL;
+	if (!entry || block_size == 0)
+		return NULL;
+	std::lock_guard<std::mutex> guard(hashLock);
+	std::vector<uint32_t> & hashes = payloadHashes[std::string(name) + "/" + std::to_string(block_size)];
+	if (hashes.empty() && entry->size >= block_size) {
+		uint64_t span = span_begin();
+		for (size_t offset = 0; offset + block_size <= entry->size; offset += block_size)
+			hashes.push_back(aw_block_hash(entry->data + offset, block_size));
+		span_end(span, "host", "hash_payload");
+	}
+	*count = hashes.size();
+	return hashes.data();
+}
+
+int libsunxi_find_usb_tuning(const char *port, uint32_t *chunk_size, uint32_t *timeout_ms)
+{
+	UsbTuning::Values values;
+	if (!UsbTuning::find(port, values))
+		return 0;
+	*chunk_size = values.chunkSize;
+	*timeout_ms = values.timeoutMs;
+	return 1;
+}
+
+void libsunxi_set_usb_tuning(const char *port, uint32_t chunk_size, uint32_t timeout_ms)
+{
+	UsbTuning::Values values = { chunk_size, timeout_ms };
+	std::string error;
+	if (!UsbTuning::save(port, values, &error))
+		fprintf(stderr, "%s\n", error.c_str()); // the tuning still holds for this session
+}
+
+int libsunxi_bulk_transfer(struct libusb_device_handle *usb, unsigned char ep, unsigned char *data,
+			   int length, int *done, unsigned int timeout)
+{
+	return CancelToken::bulkTransfer(usb, ep, data, length, done, timeout);
+}
+
+int libsunxi_cancelled(void)
+{
+	CancelToken * token = CancelToken::current();
+	return token && token->cancelled();
+}
+
+
+/* Marks the start of a fel call in the USB trace, with its command line */
+static void traceCommand(int argc, char **argv)
+{
+	std::string command;
+	for (int i = 0; i < argc; i++) {
+		if (i)
+			command += ' ';
+		command += argv[i];
+	}
+	usb_trace_mark(command.c_str());
+}
+
 int fel(int argc, char **argv, char ** returnBuffer)
 {
+	traceCommand(argc, argv);
 	int result = call_main(argc, argv, fel_main, returnBuffer);
+	aw_stream_cleanup(); // in case fel_main was left in the middle of a stream
+	aw_session_cleanup(); // or with the device open
+	usb_trace_flush();
+	span_trace_flush();
 	if (result != 0) {
-		if (strstr(*returnBuffer, "permission") != NULL)
+		if (libsunxi_cancelled())
+			result = FEL_CANCELLED;
+		else if (strstr(*returnBuffer, "permission") != NULL)
 			result = FEL_NO_PERMISSION;
 		else if (strstr(*returnBuffer, "not found") != NULL)
 			result = FEL_NOT_FOUND;
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ConsoleRepairView.h"
+#include "GtkDashboardView.h"
+#include "GtkRepairView.h"
+#include "Startup.h"
+extern "C" {
+#include "usbtrace.h"
+#include "spantrace.h"
+}
+
+/* GTK is only brought up when there is a display to talk to */
+static bool hasDisplay(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--headless") == 0)
+			return false;
+	}
+#if defined(__linux__)
+	return getenv("DISPLAY") || getenv("WAYLAND_DISPLAY");
+#else
+	return true;
+#endif
+}
+
+/* CHIP_BOOT_REPAIR_TRACE=file records all FEL USB traffic, see usbtrace.h */
+static void startTrace() {
+	const char * path = getenv("CHIP_BOOT_REPAIR_TRACE");
+	if (!path || !*path)
+		return;
+	const char * payloads = getenv("CHIP_BOOT_REPAIR_TRACE_PAYLOADS");
+	if (usb_trace_open(path, payloads && *payloads && strcmp(payloads, "0") != 0) != 0)
+		perror(path);
+}
+
+/* CHIP_BOOT_REPAIR_SPANS=file writes Chrome trace events, see spantrace.h */
+static void startSpans() {
+	const char * path = getenv("CHIP_BOOT_REPAIR_SPANS");
+	if (path && *path && span_trace_open(path) != 0)
+		perror(path);
+}
+
+/* --port bus-port[.port...]: repair only the board on that port, one process per board */
+static const char * boardPort(int argc, char *argv[]) {
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--port") == 0)
+			return argv[i + 1];
+	}
+	return nullptr;
+}
+
+/* --dashboard: a tile per board in FEL mode instead of one board at a time, where sysfs lists them */
+static bool dashboard(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--dashboard") == 0)
+			return GtkDashboardView::available();
+	}
+	return false;
+}
+
+int main(int argc, char *argv[]) {
+	startTrace();
+	startSpans();
+	Startup::begin();
+
+	const char * port = boardPort(argc, argv);
+	if (!port && hasDisplay(argc, argv) && GtkRepairView::init(argc, argv)) {
+		if (dashboard(argc, argv)) {
+			auto view = new GtkDashboardView();
+			delete view;
+		} else {
+			auto view = new GtkRepairView();
+			delete view;
+		}
+	} else {
+		ConsoleRepairView view;
+		if (port)
+			view.setPort(port);
+		view.main();
+	}
+}
@@ -0,0 +1,29 @@
+#include <unistd.h>
+#include <iostream>
+
+#include "RepairDaemon.h"
+#include "RepairTool.h"
+
+/* chip-boot-repaird: repairs boards for the frontends that ask it to, see RepairDaemon.h */
+int main() {
+	if (geteuid() != 0) {
+		std::cerr << "chip-boot-repaird needs to run as root" << std::endl;
+		return 1;
+	}
+	RepairDaemon daemon;
+	std::string error;
+	if (!daemon.listen(&error)) {
+		std::cerr << error << std::endl;
+		return 1;
+	}
+	/*
+	 * Before any worker is forked, so that they all share them. No libusb
+	 * here: its contexts do not survive fork()
+	 */
+	if (RepairTool::mapPayloads(&error))
+		RepairTool::hashPayloads();
+	else
+		std::cerr << error << std::endl;
+	daemon.run();
+	return 1;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "spantrace.h"
+
+volatile int span_trace_active = 0;
+
+static pthread_mutex_t span_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *span_file = NULL;
+static uint64_t span_start = 0;
+static unsigned span_count = 0;
+static int span_next_tid = 0;
+static __thread int span_tid = 0;
+static __thread char span_device[32];
+
+uint64_t span_trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int span_trace_open(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (!file)
+		return -1;
+	fputs("[\n", file);
+
+	pthread_mutex_lock(&span_lock);
+	if (span_file)
+		fclose(span_file);
+	span_file = file;
+	span_count = 0;
+	span_start = span_trace_now();
+	span_trace_active = 1;
+	pthread_mutex_unlock(&span_lock);
+	return 0;
+}
+
+void span_trace_close(void)
+{
+	pthread_mutex_lock(&span_lock);
+	span_trace_active = 0;
+	if (span_file) {
+		fputs("\n]\n", span_file);
+		fclose(span_file);
+	}
+	span_file = NULL;
+	pthread_mutex_unlock(&span_lock);
+}
+
+void span_trace_flush(void)
+{
+	pthread_mutex_lock(&span_lock);
+	if (span_file)
+		fflush(span_file);
+	pthread_mutex_unlock(&span_lock);
+}
+
+void span_set_device(const char *device)
+{
+	snprintf(span_device, sizeof(span_device), "%s", device ? device : "");
+}
+
+/* Names come from fel command lines, keep them valid JSON */
+static void write_string(FILE *file, const char *text)
+{
+	fputc('"', file);
+	for (; *text; text++) {
+		if (*text == '"' || *text == '\\')
+			fputc('\\', file);
+		if ((unsigned char)*text >= 0x20)
+			fputc(*text, file);
+	}
+	fputc('"', file);
+}
+
+static void write_span(uint64_t start, const char *category, const char *name,
+		       int has_range, uint32_t address, uint32_t length)
+{
+	uint64_t end = span_trace_now();
+	if (!span_tid)
+		span_tid = __sync_add_and_fetch(&span_next_tid, 1);
+
+	pthread_mutex_lock(&span_lock);
+	if (span_file && start >= span_start) {
+		FILE *f = span_file;
+		fputs(span_count++ ? ",\n{\"name\":" : "{\"name\":", f);
+		write_string(f, name);
+		fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"device\":",
+			category, (start - span_start) / 1e3, (end - start) / 1e3, (int)getpid(), span_tid);
+		write_string(f, span_device);
+		if (has_range)
+			fprintf(f, ",\"address\":\"0x%08x\",\"length\":%u", address, length);
+		fputs("}}", f);
+	}
+	pthread_mutex_unlock(&span_lock);
+}
+
+void span_end(uint64_t start, const char *category, const char *name)
+{
+	if (start)
+		write_span(start, category, name, 0, 0, 0);
+}
+
+void span_end_range(uint64_t start, const char *category, const char *name,
+		    uint32_t address, uint32_t length)
+{
+	if (start)
+		write_span(start, category, name, 1, address, length);
+}
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "usbstats.h"
+
+const char *const usb_stats_op_names[USB_STATS_OPS] = {
+	"version", "read", "write", "exec", "status"
+};
+
+const char *const usb_stats_size_names[USB_STATS_SIZES] = {
+	"64B", "4K", "64K", "512K", "4M", "over_4M"
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usb_stats stats;
+/* Bulk transfer bytes of the fel calls this thread made, for per-repair totals */
+static __thread uint64_t thread_bytes;
+
+uint64_t usb_stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t ns)
+{
+	int msb, index;
+	if (ns < USB_STATS_SUB_BUCKETS)
+		return (int)ns;
+	msb = 63 - __builtin_clzll(ns);
+	index = (msb - 3) * USB_STATS_SUB_BUCKETS + (int)((ns >> (msb - 4)) & (USB_STATS_SUB_BUCKETS - 1));
+	return index < USB_STATS_BUCKETS ? index : USB_STATS_BUCKETS - 1;
+}
+
+uint64_t usb_stats_bucket_low(int index)
+{
+	int msb;
+	if (index < USB_STATS_SUB_BUCKETS)
+		return index;
+	msb = index / USB_STATS_SUB_BUCKETS + 3;
+	return (uint64_t)(USB_STATS_SUB_BUCKETS + index % USB_STATS_SUB_BUCKETS) << (msb - 4);
+}
+
+uint64_t usb_stats_bucket_high(int index)
+{
+	if (index < USB_STATS_SUB_BUCKETS)
+		return index;
+	return usb_stats_bucket_low(index) + ((uint64_t)1 << (index / USB_STATS_SUB_BUCKETS - 1)) - 1;
+}
+
+static void record(struct usb_stats_histogram *h, uint64_t bytes, uint64_t ns, int failed)
+{
+	if (failed) {
+		h->errors++;
+		return;
+	}
+	if (!h->count || ns < h->min_ns)
+		h->min_ns = ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->count++;
+	h->bytes += bytes;
+	h->sum_ns += ns;
+	h->buckets[bucket_index(ns)]++;
+}
+
+static enum usb_stats_size size_class(uint32_t length)
+{
+	if (length <= 64)
+		return USB_STATS_UP_TO_64B;
+	if (length <= 4096)
+		return USB_STATS_UP_TO_4K;
+	if (length <= 65536)
+		return USB_STATS_UP_TO_64K;
+	if (length <= 512 * 1024)
+		return USB_STATS_UP_TO_512K;
+	if (length <= 4 * 1024 * 1024)
+		return USB_STATS_UP_TO_4M;
+	return USB_STATS_OVER_4M;
+}
+
+void usb_stats_transfer(int in, uint32_t length, uint32_t transferred, uint64_t ns, int result)
+{
+	pthread_mutex_lock(&stats_lock);
+	record(&stats.transfers[in ? 1 : 0][size_class(length)], transferred, ns, result != 0);
+	pthread_mutex_unlock(&stats_lock);
+	thread_bytes += transferred;
+}
+
+uint64_t usb_stats_thread_bytes(void)
+{
+	return thread_bytes;
+}
+
+void usb_stats_op(enum usb_stats_op op, uint32_t length, uint64_t ns, int failed)
+{
+	pthread_mutex_lock(&stats_lock);
+	record(&stats.ops[op], length, ns, failed);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+double usb_stats_write_rate(void)
+{
+	double rate = 0;
+	pthread_mutex_lock(&stats_lock);
+	if (stats.ops[USB_STATS_WRITE].sum_ns > 0)
+		rate = stats.ops[USB_STATS_WRITE].bytes * 1e9 / stats.ops[USB_STATS_WRITE].sum_ns;
+	pthread_mutex_unlock(&stats_lock);
+	return rate;
+}
+
+void usb_stats_snapshot(struct usb_stats *copy)
+{
+	pthread_mutex_lock(&stats_lock);
+	memcpy(copy, &stats, sizeof(stats));
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void usb_stats_reset(void)
+{
+	pthread_mutex_lock(&stats_lock);
+	memset(&stats, 0, sizeof(stats));
+	pthread_mutex_unlock(&stats_lock);
+}
+
+uint64_t usb_stats_percentile(const struct usb_stats_histogram *h, double p)
+{
+	uint64_t rank, seen = 0;
+	int i;
+	if (!h->count)
+		return 0;
+	rank = (uint64_t)(p / 100 * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < USB_STATS_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return usb_stats_bucket_high(i) < h->max_ns ? usb_stats_bucket_high(i) : h->max_ns;
+	}
+	return h->max_ns;
+}
+
+/* Prometheus bucket bounds in seconds; counts are exact to within one histogram bucket */
+static const double prometheus_bounds[] = {
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+	0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static void write_histogram(FILE *f, const char *name, const char *labels,
+			    const struct usb_stats_histogram *h)
+{
+	size_t b;
+	int i = 0;
+	uint64_t cumulative = 0;
+	for (b = 0; b < sizeof(prometheus_bounds) / sizeof(prometheus_bounds[0]); b++) {
+		for (; i < USB_STATS_BUCKETS && usb_stats_bucket_high(i) <= prometheus_bounds[b] * 1e9; i++)
+			cumulative += h->buckets[i];
+		fprintf(f, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels, prometheus_bounds[b],
+			(unsigned long long)cumulative);
+	}
+	fprintf(f, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)h->count);
+	fprintf(f, "%s_sum{%s} %.9f\n", name, labels, h->sum_ns / 1e9);
+	fprintf(f, "%s_count{%s} %llu\n", name, labels, (unsigned long long)h->count);
+}
+
+static void write_counter(FILE *f, const char *name, const char *labels, uint64_t value)
+{
+	fprintf(f, "%s{%s} %llu\n", name, labels, (unsigned long long)value);
+}
+
+int usb_stats_write_prometheus(const char *path)
+{
+	static const char *const directions[2] = { "out", "in" };
+	struct usb_stats *copy;
+	char temp_path[4096], labels[64];
+	FILE *f;
+	int op, dir, size, ok;
+
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+	f = fopen(temp_path, "w");
+	if (!f)
+		return -1;
+	copy = malloc(sizeof(*copy)); /* too large for the stack of some threads */
+	if (!copy) {
+		fclose(f);
+		remove(temp_path);
+		return -1;
+	}
+	usb_stats_snapshot(copy);
+
+	fprintf(f, "# HELP chip_boot_repair_fel_op_duration_seconds FEL operations, request to status\n");
+	fprintf(f, "# TYPE chip_boot_repair_fel_op_duration_seconds histogram\n");
+	for (op = 0; op < USB_STATS_OPS; op++) {
+		snprintf(labels, sizeof(labels), "op=\"%s\"", usb_stats_op_names[op]);
+		write_histogram(f, "chip_boot_repair_fel_op_duration_seconds", labels, &copy->ops[op]);
+	}
+	fprintf(f, "# HELP chip_boot_repair_fel_op_bytes_total Bytes moved by completed FEL operations\n");
+	fprintf(f, "# TYPE chip_boot_repair_fel_op_bytes_total counter\n");
+	for (op = 0; op < USB_STATS_OPS; op++) {
+		snprintf(labels, sizeof(labels), "op=\"%s\"", usb_stats_op_names[op]);
+		write_counter(f, "chip_boot_repair_fel_op_bytes_total", labels, copy->ops[op].bytes);
+	}
+	fprintf(f, "# HELP chip_boot_repair_fel_op_errors_total FEL operations cut short by a USB error\n");
+	fprintf(f, "# TYPE chip_boot_repair_fel_op_errors_total counter\n");
+	for (op = 0; op < USB_STATS_OPS; op++) {
+		snprintf(labels, sizeof(labels), "op=\"%s\"", usb_stats_op_names[op]);
+		write_counter(f, "chip_boot_repair_fel_op_errors_total", labels, copy->ops[op].errors);
+	}
+
+	fprintf(f, "# HELP chip_boot_repair_usb_transfer_duration_seconds Bulk transfers by direction and size\n");
+	fprintf(f, "# TYPE chip_boot_repair_usb_transfer_duration_seconds histogram\n");
+	for (dir = 0; dir < 2; dir++) {
+		for (size = 0; size < USB_STATS_SIZES; size++) {
+			snprintf(labels, sizeof(labels), "direction=\"%s\",size=\"%s\"",
+				 directions[dir], usb_stats_size_names[size]);
+			write_histogram(f, "chip_boot_repair_usb_transfer_duration_seconds", labels,
+					&copy->transfers[dir][size]);
+		}
+	}
+	fprintf(f, "# HELP chip_boot_repair_usb_transfer_bytes_total Bytes moved by bulk transfers\n");
+	fprintf(f, "# TYPE chip_boot_repair_usb_transfer_bytes_total counter\n");
+	for (dir = 0; dir < 2; dir++) {
+		for (size = 0; size < USB_STATS_SIZES; size++) {
+			snprintf(labels, sizeof(labels), "direction=\"%s\",size=\"%s\"",
+				 directions[dir], usb_stats_size_names[size]);
+			write_counter(f, "chip_boot_repair_usb_transfer_bytes_total", labels,
+				      copy->transfers[dir][size].bytes);
+		}
+	}
+	fprintf(f, "# HELP chip_boot_repair_usb_transfer_errors_total Failed bulk transfers\n");
+	fprintf(f, "# TYPE chip_boot_repair_usb_transfer_errors_total counter\n");
+	for (dir = 0; dir < 2; dir++) {
+		for (size = 0; size < USB_STATS_SIZES; size++) {
+			snprintf(labels, sizeof(labels), "direction=\"%s\",size=\"%s\"",
+				 directions[dir], usb_stats_size_names[size]);
+			write_counter(f, "chip_boot_repair_usb_transfer_errors_total", labels,
+				      copy->transfers[dir][size].errors);
+		}
+	}
+	free(copy);
+
+	ok = !ferror(f);
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(temp_path, path) != 0) {
+		remove(temp_path);
+		return -1;
+	}
+	return 0;
+}
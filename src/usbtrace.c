@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "portable_endian.h"
+#include "crc32.h"
+#include "usbtrace.h"
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file = NULL;
+static int trace_payloads = 0;
+static uint64_t trace_start = 0;
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int usb_trace_open(const char *path, int payloads)
+{
+	struct usb_trace_header header;
+	FILE *file = fopen(path, "wb");
+	if (!file)
+		return -1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, USB_TRACE_MAGIC, sizeof(header.magic));
+	header.version = htole32(USB_TRACE_VERSION);
+	header.flags = htole32(payloads ? USB_TRACE_PAYLOADS : 0);
+	if (fwrite(&header, sizeof(header), 1, file) != 1) {
+		fclose(file);
+		return -1;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file)
+		fclose(trace_file);
+	trace_file = file;
+	trace_payloads = payloads;
+	trace_start = monotonic_ns();
+	pthread_mutex_unlock(&trace_lock);
+	return 0;
+}
+
+void usb_trace_close(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file)
+		fclose(trace_file);
+	trace_file = NULL;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+uint64_t usb_trace_now(void)
+{
+	return trace_file ? monotonic_ns() : 0;
+}
+
+static void write_record(uint64_t start, uint64_t end, int endpoint, const void *data,
+			 int length, int transferred, int result, int keep)
+{
+	struct usb_trace_record record;
+	if (transferred < 0)
+		transferred = 0;
+
+	record.timestamp_ns = htole64(start - trace_start);
+	record.duration_ns = htole32((uint32_t)(end - start));
+	record.endpoint = endpoint;
+	record.flags = keep ? USB_TRACE_DATA : 0;
+	record.result = htole16(result);
+	record.length = htole32(length);
+	record.transferred = htole32(transferred);
+	record.crc32 = htole32(calc_crc32(data, transferred, 0));
+	fwrite(&record, sizeof(record), 1, trace_file);
+	if (keep)
+		fwrite(data, 1, transferred, trace_file);
+}
+
+void usb_trace_transfer(uint64_t start, int endpoint, const void *data,
+			int length, int transferred, int result)
+{
+	if (!trace_file)
+		return;
+	uint64_t end = monotonic_ns();
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file)
+		write_record(start, end, endpoint, data, length, transferred, result,
+			     trace_payloads || transferred <= USB_TRACE_INLINE_MAX);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void usb_trace_mark(const char *text)
+{
+	if (!trace_file)
+		return;
+	uint64_t now = monotonic_ns();
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file)
+		write_record(now, now, 0, text, strlen(text), strlen(text), 0, 1);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void usb_trace_flush(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file)
+		fflush(trace_file);
+	pthread_mutex_unlock(&trace_lock);
+}
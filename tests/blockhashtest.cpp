@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "libsunxi.h"
+}
+
+/*
+ * Checks that the block hash of fel's verify and sync tells apart blocks
+ * that differ only in the high bits of their words, which a hash over
+ * whole words lets cancel out.
+ *
+ *   chip-boot-repair-blockhashtest
+ *
+ * Exits with 1 on the first pair of different blocks with the same hash.
+ */
+
+static void fail(const std::string & what) {
+	printf("FAIL: %s\n", what.c_str());
+	exit(1);
+}
+
+int main() {
+	std::vector<uint8_t> block(LIBSUNXI_HASH_BLOCK);
+	for (size_t i = 0; i < block.size(); i++)
+		block[i] = i * 31 + (i >> 12);
+	uint32_t hash = aw_block_hash(block.data(), block.size());
+
+	/* bit 31 of two words (the last byte of each, little endian) */
+	std::vector<uint8_t> changed = block;
+	changed[3] ^= 0x80;
+	changed[0x1003] ^= 0x80;
+	if (aw_block_hash(changed.data(), changed.size()) == hash)
+		fail("bit 31 flipped in two words");
+
+	/* the top byte of two words, every way round */
+	unsigned collisions = 0;
+	for (unsigned a = 1; a < 256; a++) {
+		changed = block;
+		changed[7] ^= a;
+		changed[0x2007] ^= a;
+		if (aw_block_hash(changed.data(), changed.size()) == hash)
+			collisions++;
+	}
+	if (collisions)
+		fail(std::to_string(collisions) + " of 255 changes to the top byte of two words");
+
+	/* every single bit */
+	for (size_t bit = 0; bit < 64 * 8; bit++) {
+		changed = block;
+		changed[bit / 8] ^= 1 << (bit % 8);
+		if (aw_block_hash(changed.data(), changed.size()) == hash)
+			fail("bit " + std::to_string(bit) + " flipped");
+	}
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "PayloadBundle.h"
+#include "RepairTool.h"
+#include "../tools/BenchPayload.h"
+#include "../tools/FakeUsb.h"
+#include "../tools/FelEmulator.h"
+
+/*
+ * Runs a repair plan against an emulated FEL device and checks what it
+ * left in memory. The whole plan goes to fel as one argument list, so a
+ * command that takes the wrong number of arguments swallows or misreads
+ * the step after it; the plan has steps after each of its execs. Its
+ * verify compares the emulated device's block hashes with the host's.
+ *
+ *   chip-boot-repair-plantest [ERROR_RATE]
+ *
+ * With ERROR_RATE, that share of the USB transfers time out, and the
+ * repair has to get through them with fel's retries.
+ * The payloads, plan, tuning, history and journal go to a scratch
+ * directory. Exits with 1 if the repair fails or left the wrong memory.
+ */
+
+static const uint32_t FILL_ADDRESS = 0x43000000;
+static const size_t FILL_LENGTH = 0x100;
+
+static void fail(const std::string & what) {
+	printf("FAIL: %s\n", what.c_str());
+	exit(1);
+}
+
+static bool filled(const FelEmulator & device, uint32_t address, uint8_t value) {
+	std::vector<uint8_t> data(FILL_LENGTH);
+	device.read(address, data.data(), data.size());
+	return std::count(data.begin(), data.end(), value) == (long)data.size();
+}
+
+int main(int argc, char ** argv) {
+	if (argc > 1) {
+		LinkModel link;
+		link.errorRate = atof(argv[1]);
+		FakeUsb::setLinkModel(link);
+	}
+	char dir[] = "/tmp/chip-boot-repair-plantest-XXXXXX";
+	if (!mkdtemp(dir))
+		fail("cannot make a scratch directory");
+	std::string scratch = dir;
+	std::string payload = BenchPayload::make(scratch);
+	std::string plan = scratch + "/test.plan";
+	std::string tuning = scratch + "/tuning", history = scratch + "/history.csv", journal = scratch + "/journal.csv";
+	setenv("CHIP_BOOT_REPAIR_PAYLOAD", payload.c_str(), 1);
+	setenv("CHIP_BOOT_REPAIR_PLAN", plan.c_str(), 1);
+	setenv("CHIP_BOOT_REPAIR_TUNING", tuning.c_str(), 1);
+	setenv("CHIP_BOOT_REPAIR_HISTORY", history.c_str(), 1);
+	setenv("CHIP_BOOT_REPAIR_JOURNAL", journal.c_str(), 1);
+
+	FILE * out = fopen(plan.c_str(), "w");
+	if (!out)
+		fail("cannot write " + plan);
+	fprintf(out,
+		"spl payload:%s\n"
+		"write payload:%s\n"
+		"verify payload:%s\n"
+		"exec payload:%s\n"
+		"fill 0x%x 0x%zx 0x5a\n"
+		"exec 0x%x\n"
+		"exec 0x%x\n"
+		"fill 0x%x 0x%zx 0xa5\n",
+		SPL_PAYLOAD.c_str(), UBOOT_PAYLOAD.c_str(), UBOOT_PAYLOAD.c_str(), UBOOT_PAYLOAD.c_str(), FILL_ADDRESS, FILL_LENGTH,
+		FILL_ADDRESS, FILL_ADDRESS, FILL_ADDRESS + (uint32_t)FILL_LENGTH, FILL_LENGTH);
+	fclose(out);
+
+	std::string error;
+	if (!RepairTool::mapPayloads(&error))
+		fail(error);
+	FelEmulator device;
+	FakeUsb::attach(&device);
+	device.powerOn();
+	bool ok;
+	{
+		RepairTool tool;
+		tool.setPort("1-1");
+		tool.setExecSettleTime(0);
+		ok = tool.repair(false);
+	}
+	for (auto & path : { payload, plan, tuning, history, journal })
+		unlink(path.c_str());
+	rmdir(dir);
+
+	if (!ok)
+		fail("the repair failed");
+	const std::vector<uint32_t> & executed = device.executed();
+	uint32_t uboot = PayloadBundle::shared()->find(UBOOT_PAYLOAD)->loadAddress;
+	if (std::count(executed.begin(), executed.end(), uboot) != 1)
+		fail("U-Boot was not executed once");
+	if (std::count(executed.begin(), executed.end(), FILL_ADDRESS) != 2)
+		fail("the filled memory was not executed twice");
+	if (!filled(device, FILL_ADDRESS, 0x5a) || !filled(device, FILL_ADDRESS + FILL_LENGTH, 0xa5))
+		fail("a fill after an exec did not run");
+	printf("ok, %u USB errors injected\n", FakeUsb::takeInjectedErrors());
+	return 0;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "portable_endian.h"
+extern "C" {
+#include "crc32.h"
+}
+#include "PayloadBundle.h"
+#include "RepairTool.h"
+#include "BenchPayload.h"
+
+static void writeFile(const std::string & path, const std::vector<uint8_t> & data) {
+	FILE * out = fopen(path.c_str(), "wb");
+	if (!out || fwrite(data.data(), 1, data.size(), out) != data.size() || fclose(out) != 0) {
+		perror(path.c_str());
+		exit(1);
+	}
+}
+
+static std::vector<uint8_t> randomData(size_t size, unsigned seed) {
+	std::vector<uint8_t> data(size);
+	for (size_t i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+	return data;
+}
+
+std::string BenchPayload::make(const std::string & dir) {
+	std::vector<uint8_t> spl = randomData(16 * 1024, 1);
+	uint32_t * words = (uint32_t *)spl.data();
+	memcpy(spl.data() + 4, "eGON.BT0", 8);
+	words[3] = htole32(0x5F0A6C39);
+	words[4] = htole32(spl.size());
+	memcpy(spl.data() + 0x14, "SPL\x01", 4);
+	uint32_t sum = 0;
+	for (size_t i = 0; i < spl.size() / 4; i++)
+		sum += le32toh(words[i]);
+	words[3] = htole32(sum);
+
+	std::vector<uint8_t> script = randomData(1042, 2);
+	uint32_t * header = (uint32_t *)script.data();
+	header[0] = htobe32(0x27051956);
+	header[3] = htobe32(script.size() - 64);
+	script[29] = 2; // ARM
+	script[30] = 6; // script
+
+	std::vector<PayloadBundle::Source> sources(4);
+	sources[0].name = SPL_PAYLOAD;
+	sources[0].loadAddress = 0;
+	sources[1].name = SPL_ECC_PAYLOAD;
+	sources[1].loadAddress = 0x43200000;
+	sources[2].name = UBOOT_PAYLOAD;
+	sources[2].loadAddress = 0x4a000000;
+	sources[3].name = UBOOT_SCRIPT_PAYLOAD;
+	sources[3].loadAddress = 0x43100000;
+	std::vector<uint8_t> contents[4] = { spl, randomData(3537408, 3), randomData(4 * 1024 * 1024, 4), script };
+	for (int i = 0; i < 4; i++) {
+		sources[i].alignment = 4096;
+		sources[i].path = dir + "/" + sources[i].name;
+		writeFile(sources[i].path, contents[i]);
+	}
+
+	std::string path = dir + "/payload.bundle";
+	std::string error;
+	bool written = PayloadBundle::write(path, 1, sources, &error);
+	for (auto & source : sources)
+		unlink(source.path.c_str());
+	if (!written) {
+		fprintf(stderr, "%s\n", error.c_str());
+		exit(1);
+	}
+	return path;
+}
+
+bool BenchPayload::repaired(const FelEmulator & device, const PayloadBundle * bundle) {
+	char signature[8];
+	device.read(4, signature, sizeof(signature));
+	if (memcmp(signature, "eGON.FEL", 8) != 0)
+		return false;
+	for (auto name : { SPL_ECC_PAYLOAD, UBOOT_PAYLOAD, UBOOT_SCRIPT_PAYLOAD }) {
+		const PayloadBundle::Entry * entry = bundle->find(name);
+		std::vector<uint8_t> data(entry->size);
+		device.read(entry->loadAddress, data.data(), data.size());
+		if (calc_crc32(data.data(), data.size(), 0) != entry->crc32)
+			return false;
+	}
+	const std::vector<uint32_t> & executed = device.executed();
+	return std::find(executed.begin(), executed.end(), bundle->find(UBOOT_PAYLOAD)->loadAddress) != executed.end();
+}
@@ -0,0 +1,22 @@
+#ifndef _DEF_BENCH_PAYLOAD_H
+#define _DEF_BENCH_PAYLOAD_H
+
+#include <string>
+
+#include "FelEmulator.h"
+
+class PayloadBundle;
+
+/* The payloads of the benchmarks that run whole repairs against FelEmulator */
+namespace BenchPayload {
+	/*
+	 * A bundle with payloads of the real sizes in the directory 'dir': an
+	 * eGON SPL with a sunxi header (so the script address gets passed) and
+	 * a mkimage script. Returns its path; exits if it cannot be written.
+	 */
+	std::string make(const std::string & dir);
+	/* Did the payloads arrive, was the SPL run and U-Boot started? */
+	bool repaired(const FelEmulator & device, const PayloadBundle * bundle);
+}
+
+#endif
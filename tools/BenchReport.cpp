@@ -0,0 +1,47 @@
+#include <math.h>
+#include <algorithm>
+
+#include "BenchReport.h"
+
+double BenchReport::percentile(std::vector<double> samples, double p) {
+	if (samples.empty())
+		return 0;
+	std::sort(samples.begin(), samples.end());
+	size_t rank = (size_t)ceil(p / 100 * samples.size());
+	return samples[rank ? rank - 1 : 0];
+}
+
+void BenchReport::setContext(const std::string & key, double value) {
+	context.push_back(std::make_pair(key, value));
+}
+
+void BenchReport::add(const Series & s) {
+	series.push_back(s);
+}
+
+void BenchReport::write(FILE * out) const {
+	fprintf(out, "{\n  \"context\": {");
+	for (size_t i = 0; i < context.size(); i++)
+		fprintf(out, "%s\"%s\": %.15g", i ? ", " : "", context[i].first.c_str(), context[i].second);
+	fprintf(out, "},\n  \"benchmarks\": [");
+	for (size_t i = 0; i < series.size(); i++) {
+		const Series & s = series[i];
+		double mean = 0;
+		for (double v : s.nsPerOp)
+			mean += v;
+		if (!s.nsPerOp.empty())
+			mean /= s.nsPerOp.size();
+		double median = percentile(s.nsPerOp, 50);
+		fprintf(out, "%s\n    {\"name\": \"%s\", \"iterations\": %d, \"samples\": %zu, "
+			"\"min_ns\": %.1f, \"median_ns\": %.1f, \"mean_ns\": %.1f, \"p90_ns\": %.1f, "
+			"\"p99_ns\": %.1f, \"max_ns\": %.1f",
+			i ? "," : "", s.name.c_str(), s.iterations, s.nsPerOp.size(),
+			percentile(s.nsPerOp, 0), median, mean, percentile(s.nsPerOp, 90),
+			percentile(s.nsPerOp, 99), percentile(s.nsPerOp, 100));
+		if (s.bytes && median > 0)
+			fprintf(out, ", \"bytes\": %zu, \"mib_per_s\": %.1f", s.bytes,
+				s.bytes / (median / 1e9) / (1024 * 1024));
+		fprintf(out, "}");
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
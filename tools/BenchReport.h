@@ -0,0 +1,35 @@
+#ifndef _DEF_BENCH_REPORT_H
+#define _DEF_BENCH_REPORT_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+/*
+ * Timing samples of one benchmark, and the JSON report shared by the
+ * benchmark tools:
+ *
+ *   {"context": {...}, "benchmarks": [{"name": ..., "min_ns": ..., ...}]}
+ */
+class BenchReport {
+public:
+	struct Series {
+		std::string name;
+		size_t bytes; // processed per operation, 0 if throughput is meaningless
+		int iterations; // operations behind every sample
+		std::vector<double> nsPerOp;
+	};
+
+	/* Nearest-rank percentile of 'samples' (0 < p <= 100) */
+	static double percentile(std::vector<double> samples, double p);
+
+	void setContext(const std::string & key, double value);
+	void add(const Series & series);
+	void write(FILE * out) const;
+
+private:
+	std::vector<std::pair<std::string, double> > context;
+	std::vector<Series> series;
+};
+
+#endif
@@ -0,0 +1,536 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <random>
+
+#include <libusb.h>
+#include <stdio.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include "felenum.h"
+}
+#include "FakeUsb.h"
+
+/*
+ * The libusb-1.0 entry points used by fel.c, FelAsync and Startup, backed by
+ * the simulated devices. Everything that isn't a bulk transfer just succeeds.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+struct libusb_device {
+	int bus;
+	int address;
+	int port;
+	libusb_context * context; // null for the default one
+};
+
+struct libusb_device_handle {
+	libusb_device * device;
+};
+
+/* A port of the root hub */
+struct Port {
+	libusb_device usb;
+	FakeDevice * attached;
+	std::mutex link; // one transfer at a time; taken before 'lock'
+	Clock::time_point busyUntil; // of the asynchronous transfers queued on the link
+};
+
+/* A context of its own: the same ports, seen through devices of the context */
+struct libusb_context {
+	libusb_device devices[FakeUsb::MAX_PORTS + 1];
+};
+
+/* An asynchronous transfer on its way, done at 'due' */
+struct Pending {
+	Clock::time_point due;
+	libusb_transfer * transfer;
+	bool injectError;
+};
+
+static std::mutex lock;
+static Port ports[FakeUsb::MAX_PORTS + 1]; // [0] unused
+static LinkModel linkModel;
+static std::mt19937 rng(1);
+static unsigned injectedErrors = 0;
+static std::list<Pending> pending;
+static std::deque<libusb_transfer *> finished; // cancelled or unplugged, their callbacks are due
+static std::condition_variable eventsChanged;
+static bool interrupted = false;
+
+static struct PortSetup {
+	PortSetup() {
+		for (int i = 1; i <= FakeUsb::MAX_PORTS; i++) {
+			ports[i].usb.bus = 1;
+			ports[i].usb.address = i + 1;
+			ports[i].usb.port = i;
+			ports[i].usb.context = nullptr;
+			ports[i].attached = nullptr;
+		}
+	}
+} portSetup;
+
+static const uint16_t FEL_VENDOR = 0x1f3a;
+static const uint16_t FEL_PRODUCT = 0xefe8;
+static const unsigned char EP_OUT = 0x01;
+static const unsigned char EP_IN = 0x82;
+
+/*
+ * The sysfs tree fel.c enumerates (CHIP_BOOT_REPAIR_SYSFS): the root hub,
+ * and the FEL device of every port that has one attached.
+ */
+static std::string sysfsRoot;
+
+static void writeAttribute(const std::string & dir, const char * name, const char * value) {
+	FILE * f = fopen((dir + "/" + name).c_str(), "w");
+	if (f) {
+		fprintf(f, "%s\n", value);
+		fclose(f);
+	}
+}
+
+static void removeDevice(const std::string & dir) {
+	for (const char * name : { "idVendor", "idProduct", "busnum", "devnum" })
+		remove((dir + "/" + name).c_str());
+	rmdir(dir.c_str());
+}
+
+static void removeSysfs() {
+	for (int i = 1; i <= FakeUsb::MAX_PORTS; i++)
+		removeDevice(sysfsRoot + "/1-" + std::to_string(i));
+	removeDevice(sysfsRoot + "/usb1");
+	rmdir(sysfsRoot.c_str());
+}
+
+static void updateSysfs(int port, bool present) {
+	if (sysfsRoot.empty()) {
+		char dir[] = "/tmp/chip-boot-repair-sysfs-XXXXXX";
+		if (!mkdtemp(dir))
+			return;
+		sysfsRoot = dir;
+		mkdir((sysfsRoot + "/usb1").c_str(), 0755);
+		writeAttribute(sysfsRoot + "/usb1", "idVendor", "1d6b");
+		writeAttribute(sysfsRoot + "/usb1", "idProduct", "0002");
+		writeAttribute(sysfsRoot + "/usb1", "busnum", "1");
+		writeAttribute(sysfsRoot + "/usb1", "devnum", "1");
+		setenv("CHIP_BOOT_REPAIR_SYSFS", sysfsRoot.c_str(), 1);
+		atexit(removeSysfs);
+	}
+	std::string device = sysfsRoot + "/1-" + std::to_string(port);
+	if (present) {
+		mkdir(device.c_str(), 0755);
+		writeAttribute(device, "idVendor", "1f3a");
+		writeAttribute(device, "idProduct", "efe8");
+		writeAttribute(device, "busnum", "1");
+		writeAttribute(device, "devnum", std::to_string(port + 1).c_str());
+	} else {
+		removeDevice(device);
+	}
+	fel_enum_invalidate(); // what the uevent would do
+}
+
+void FakeUsb::attach(FakeDevice * device) {
+	attach(1, device);
+}
+
+void FakeUsb::attach(int port, FakeDevice * device) {
+	if (port < 1 || port > MAX_PORTS)
+		abort();
+	std::lock_guard<std::mutex> link(ports[port].link);
+	std::lock_guard<std::mutex> guard(lock);
+	ports[port].attached = device;
+	updateSysfs(port, device != nullptr);
+	if (device)
+		return;
+	/* unplugged: what was on its way fails right away */
+	for (auto i = pending.begin(); i != pending.end(); ) {
+		if (i->transfer->dev_handle->device->port != port) {
+			++i;
+			continue;
+		}
+		i->transfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+		i->transfer->actual_length = 0;
+		finished.push_back(i->transfer);
+		i = pending.erase(i);
+	}
+	eventsChanged.notify_all();
+}
+
+void FakeUsb::setLinkModel(const LinkModel & model) {
+	std::lock_guard<std::mutex> guard(lock);
+	linkModel = model;
+	rng.seed(model.seed);
+}
+
+unsigned FakeUsb::takeInjectedErrors() {
+	std::lock_guard<std::mutex> guard(lock);
+	unsigned result = injectedErrors;
+	injectedErrors = 0;
+	return result;
+}
+
+/* Microseconds a transfer of 'length' bytes takes on a link, with 'lock' held */
+static double linkDelay(int length) {
+	double us = linkModel.latencyUs;
+	if (linkModel.jitterUs > 0)
+		us += std::uniform_real_distribution<double>(0, linkModel.jitterUs)(rng);
+	if (linkModel.bytesPerSecond > 0)
+		us += length * 1e6 / linkModel.bytesPerSecond;
+	return us;
+}
+
+/* Whether the link model fails the next transfer, with 'lock' held */
+static bool injectError() {
+	if (linkModel.errorRate > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < linkModel.errorRate) {
+		injectedErrors++;
+		return true;
+	}
+	return false;
+}
+
+static void sleepUs(double us) {
+	if (us <= 0)
+		return;
+	struct timespec ts;
+	ts.tv_sec = (time_t)(us / 1e6);
+	ts.tv_nsec = (long)((us - ts.tv_sec * 1e6) * 1000);
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+extern "C" {
+
+int libusb_init(libusb_context ** ctx) {
+	if (!ctx)
+		return 0;
+	*ctx = new libusb_context;
+	for (int i = 1; i <= FakeUsb::MAX_PORTS; i++) {
+		(*ctx)->devices[i] = ports[i].usb;
+		(*ctx)->devices[i].context = *ctx;
+	}
+	return 0;
+}
+
+void libusb_exit(libusb_context * ctx) {
+	delete ctx;
+}
+
+/* The device of 'port' as context 'ctx' sees it */
+static libusb_device * contextDevice(libusb_context * ctx, int port) {
+	return ctx ? &ctx->devices[port] : &ports[port].usb;
+}
+
+const char * libusb_error_name(int error) {
+	switch (error) {
+	case LIBUSB_ERROR_TIMEOUT: return "LIBUSB_ERROR_TIMEOUT";
+	case LIBUSB_ERROR_PIPE: return "LIBUSB_ERROR_PIPE";
+	case LIBUSB_ERROR_NO_DEVICE: return "LIBUSB_ERROR_NO_DEVICE";
+	case LIBUSB_ERROR_IO: return "LIBUSB_ERROR_IO";
+	default: return "LIBUSB_ERROR_OTHER";
+	}
+}
+
+ssize_t libusb_get_device_list(libusb_context * ctx, libusb_device *** list) {
+	std::lock_guard<std::mutex> guard(lock);
+	ssize_t n = 0;
+	*list = (libusb_device **)calloc(FakeUsb::MAX_PORTS + 1, sizeof(libusb_device *));
+	for (int i = 1; i <= FakeUsb::MAX_PORTS; i++) {
+		if (ports[i].attached)
+			(*list)[n++] = contextDevice(ctx, i);
+	}
+	return n;
+}
+
+void libusb_free_device_list(libusb_device ** list, int unref_devices) {
+	free(list);
+}
+
+libusb_device * libusb_ref_device(libusb_device * device) {
+	return device;
+}
+
+void libusb_unref_device(libusb_device * device) {
+}
+
+uint8_t libusb_get_bus_number(libusb_device * device) {
+	return device->bus;
+}
+
+uint8_t libusb_get_device_address(libusb_device * device) {
+	return device->address;
+}
+
+/* Plugged into the root hub */
+int libusb_get_port_numbers(libusb_device * device, uint8_t * port_numbers, int port_numbers_len) {
+	if (port_numbers_len < 1)
+		return LIBUSB_ERROR_OVERFLOW;
+	port_numbers[0] = device->port;
+	return 1;
+}
+
+int libusb_get_device_descriptor(libusb_device * device, struct libusb_device_descriptor * desc) {
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = sizeof(*desc);
+	desc->idVendor = FEL_VENDOR;
+	desc->idProduct = FEL_PRODUCT;
+	desc->bNumConfigurations = 1;
+	return 0;
+}
+
+int libusb_open(libusb_device * device, libusb_device_handle ** handle) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (!ports[device->port].attached)
+		return LIBUSB_ERROR_NO_DEVICE;
+	*handle = new libusb_device_handle;
+	(*handle)->device = device;
+	return 0;
+}
+
+libusb_device_handle * libusb_open_device_with_vid_pid(libusb_context * ctx, uint16_t vendor, uint16_t product) {
+	libusb_device_handle * handle = nullptr;
+	int port = 1;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		while (port < FakeUsb::MAX_PORTS && !ports[port].attached)
+			port++;
+	}
+	if (vendor != FEL_VENDOR || product != FEL_PRODUCT || libusb_open(contextDevice(ctx, port), &handle) != 0) {
+		errno = ENODEV;
+		return nullptr;
+	}
+	return handle;
+}
+
+void libusb_close(libusb_device_handle * handle) {
+	delete handle;
+}
+
+libusb_device * libusb_get_device(libusb_device_handle * handle) {
+	return handle->device;
+}
+
+int libusb_claim_interface(libusb_device_handle * handle, int interface) {
+	return 0;
+}
+
+int libusb_release_interface(libusb_device_handle * handle, int interface) {
+	return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle * handle, int interface) {
+	return 0;
+}
+
+int libusb_attach_kernel_driver(libusb_device_handle * handle, int interface) {
+	return 0;
+}
+
+int libusb_get_active_config_descriptor(libusb_device * device, struct libusb_config_descriptor ** config) {
+	static struct libusb_endpoint_descriptor endpoints[2];
+	static struct libusb_interface_descriptor setting;
+	static struct libusb_interface interface;
+	static struct libusb_config_descriptor descriptor;
+
+	endpoints[0].bEndpointAddress = EP_OUT;
+	endpoints[0].bmAttributes = LIBUSB_TRANSFER_TYPE_BULK;
+	endpoints[1].bEndpointAddress = EP_IN;
+	endpoints[1].bmAttributes = LIBUSB_TRANSFER_TYPE_BULK;
+	setting.bNumEndpoints = 2;
+	setting.endpoint = endpoints;
+	interface.altsetting = &setting;
+	interface.num_altsetting = 1;
+	descriptor.bNumInterfaces = 1;
+	descriptor.interface = &interface;
+	*config = &descriptor;
+	return 0;
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor * config) {
+}
+
+int libusb_bulk_transfer(libusb_device_handle * handle, unsigned char endpoint, unsigned char * data,
+			 int length, int * transferred, unsigned int timeout) {
+	Port & port = ports[handle->device->port];
+	std::lock_guard<std::mutex> link(port.link);
+	*transferred = 0;
+	double us;
+	bool fail;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!port.attached)
+			return LIBUSB_ERROR_NO_DEVICE;
+		us = linkDelay(length);
+		fail = injectError();
+	}
+	sleepUs(us);
+	if (fail)
+		return LIBUSB_ERROR_TIMEOUT;
+	return port.attached->bulkTransfer(endpoint, data, length, transferred);
+}
+
+int libusb_clear_halt(libusb_device_handle * handle, unsigned char endpoint) {
+	Port & port = ports[handle->device->port];
+	std::lock_guard<std::mutex> link(port.link);
+	if (port.attached)
+		port.attached->resetLink();
+	return 0;
+}
+
+int libusb_reset_device(libusb_device_handle * handle) {
+	Port & port = ports[handle->device->port];
+	std::lock_guard<std::mutex> link(port.link);
+	if (!port.attached)
+		return LIBUSB_ERROR_NOT_FOUND;
+	port.attached->resetLink();
+	return 0;
+}
+
+/*
+ * Asynchronous transfers: submitting one queues it on its port's link, where
+ * it is due once the transfers before it and its own delay have passed. The
+ * event handling does the transfers that are due and calls their callbacks.
+ */
+
+struct libusb_transfer * libusb_alloc_transfer(int iso_packets) {
+	if (iso_packets > 0)
+		return nullptr; // bulk only
+	return (struct libusb_transfer *)calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer * transfer) {
+	free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer * transfer) {
+	Port & port = ports[transfer->dev_handle->device->port];
+	std::lock_guard<std::mutex> guard(lock);
+	if (!port.attached)
+		return LIBUSB_ERROR_NO_DEVICE;
+	Clock::time_point start = std::max(Clock::now(), port.busyUntil);
+	Pending queued = { start + std::chrono::microseconds((long long)linkDelay(transfer->length)), transfer,
+		injectError() };
+	port.busyUntil = queued.due;
+	pending.push_back(queued);
+	eventsChanged.notify_all();
+	return 0;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer * transfer) {
+	std::lock_guard<std::mutex> guard(lock);
+	for (auto i = pending.begin(); i != pending.end(); ++i) {
+		if (i->transfer != transfer)
+			continue;
+		transfer->status = LIBUSB_TRANSFER_CANCELLED;
+		transfer->actual_length = 0;
+		finished.push_back(transfer);
+		pending.erase(i);
+		eventsChanged.notify_all();
+		return 0;
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static enum libusb_transfer_status transferStatus(int rc) {
+	switch (rc) {
+	case 0: return LIBUSB_TRANSFER_COMPLETED;
+	case LIBUSB_ERROR_TIMEOUT: return LIBUSB_TRANSFER_TIMED_OUT;
+	case LIBUSB_ERROR_PIPE: return LIBUSB_TRANSFER_STALL;
+	case LIBUSB_ERROR_NO_DEVICE: return LIBUSB_TRANSFER_NO_DEVICE;
+	case LIBUSB_ERROR_OVERFLOW: return LIBUSB_TRANSFER_OVERFLOW;
+	default: return LIBUSB_TRANSFER_ERROR;
+	}
+}
+
+static bool inContext(libusb_transfer * transfer, libusb_context * ctx) {
+	return transfer->dev_handle->device->context == ctx;
+}
+
+/* Takes the earliest transfer of 'ctx' that is due, with 'lock' held; false if none is yet */
+static bool takeDue(libusb_context * ctx, Pending & due) {
+	auto first = pending.end();
+	for (auto i = pending.begin(); i != pending.end(); ++i) {
+		if (inContext(i->transfer, ctx) && (first == pending.end() || i->due < first->due))
+			first = i;
+	}
+	if (first == pending.end() || first->due > Clock::now())
+		return false;
+	due = *first;
+	pending.erase(first);
+	return true;
+}
+
+int libusb_handle_events_timeout_completed(libusb_context * ctx, struct timeval * tv, int * completed) {
+	Clock::time_point deadline = Clock::now() + std::chrono::seconds(tv->tv_sec) +
+		std::chrono::microseconds(tv->tv_usec);
+	std::deque<libusb_transfer *> callbacks;
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;) {
+		Pending due;
+		bool found = false;
+		while (takeDue(ctx, due)) {
+			/* as a blocking transfer would, on the link of its port */
+			found = true;
+			libusb_transfer * transfer = due.transfer;
+			Port & port = ports[transfer->dev_handle->device->port];
+			guard.unlock();
+			{
+				std::lock_guard<std::mutex> link(port.link);
+				int done = 0;
+				int rc = due.injectError ? LIBUSB_ERROR_TIMEOUT : !port.attached ? LIBUSB_ERROR_NO_DEVICE :
+					port.attached->bulkTransfer(transfer->endpoint, transfer->buffer, transfer->length, &done);
+				transfer->status = transferStatus(rc);
+				transfer->actual_length = done;
+			}
+			callbacks.push_back(transfer);
+			guard.lock();
+		}
+		for (auto i = finished.begin(); i != finished.end(); ) {
+			if (!inContext(*i, ctx)) {
+				++i;
+				continue;
+			}
+			found = true;
+			callbacks.push_back(*i);
+			i = finished.erase(i);
+		}
+		if (found || interrupted || (completed && *completed) || Clock::now() >= deadline)
+			break;
+		Clock::time_point wake = deadline;
+		for (auto & transfer : pending) {
+			if (inContext(transfer.transfer, ctx))
+				wake = std::min(wake, transfer.due);
+		}
+		eventsChanged.wait_until(guard, wake);
+	}
+	interrupted = false;
+	guard.unlock();
+	for (auto transfer : callbacks)
+		transfer->callback(transfer);
+	return 0;
+}
+
+int libusb_handle_events_completed(libusb_context * ctx, int * completed) {
+	struct timeval tv = { 60, 0 };
+	return libusb_handle_events_timeout_completed(ctx, &tv, completed);
+}
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+void libusb_interrupt_event_handler(libusb_context * ctx) {
+	std::lock_guard<std::mutex> guard(lock);
+	interrupted = true;
+	eventsChanged.notify_all();
+}
+#endif
+
+}
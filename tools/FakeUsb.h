@@ -0,0 +1,51 @@
+#ifndef _DEF_FAKE_USB_H
+#define _DEF_FAKE_USB_H
+
+#include <stdint.h>
+
+/*
+ * A stand-in for libusb-1.0: linking FakeUsb.cpp instead of libusb puts
+ * simulated FEL devices (vendor 0x1f3a, product 0xefe8) on the ports of
+ * root hub 1, behind the libusb calls made by fel.c and FelAsync. Bulk
+ * transfers go to the FakeDevice attached to their port, after the delay
+ * of the link model; each port has a link of its own. Asynchronous
+ * transfers complete in libusb_handle_events_timeout_completed() of their
+ * context; every context sees the same ports. A matching fake sysfs tree
+ * is kept in a temporary directory, for felenum.c.
+ */
+class FakeDevice {
+public:
+	virtual ~FakeDevice() {}
+	/*
+	 * One bulk transfer. Returns 0 or a LIBUSB_ERROR code, and sets
+	 * 'transferred' to the bytes the device took (OUT) or produced (IN).
+	 */
+	virtual int bulkTransfer(unsigned char endpoint, unsigned char * data, int length, int * transferred) = 0;
+	/* libusb_reset_device() or libusb_clear_halt(): back to a clean protocol state */
+	virtual void resetLink() {}
+};
+
+/* Cost of every bulk transfer: latency + uniform(0, jitter) + length / bandwidth */
+struct LinkModel {
+	double bytesPerSecond; // 0 for unlimited
+	double latencyUs;
+	double jitterUs;
+	double errorRate; // probability of a transfer failing with LIBUSB_ERROR_TIMEOUT
+	unsigned seed;
+
+	LinkModel() : bytesPerSecond(0), latencyUs(0), jitterUs(0), errorRate(0), seed(1) {}
+};
+
+namespace FakeUsb {
+	static const int MAX_PORTS = 16;
+
+	/* nullptr unplugs the device; on port 1 ("1-1", address 2) */
+	void attach(FakeDevice * device);
+	/* The same on 'port' (1 to MAX_PORTS): "1-N", address N + 1 */
+	void attach(int port, FakeDevice * device);
+	void setLinkModel(const LinkModel & model);
+	/* Transfers failed on purpose by the link model since the last call */
+	unsigned takeInjectedErrors();
+}
+
+#endif
@@ -0,0 +1,296 @@
+#include <string.h>
+#include <algorithm>
+
+#include <libusb.h>
+
+#include "portable_endian.h"
+#include "FelEmulator.h"
+
+static const uint32_t PAGE_SIZE = 64 * 1024;
+
+static const uint16_t AW_USB_READ = 0x11;
+static const uint16_t AW_USB_WRITE = 0x12;
+static const uint32_t AWUC_SIZE = 32;
+static const uint32_t AWUS_SIZE = 13;
+static const uint32_t FEL_REQUEST_SIZE = 16;
+static const uint32_t FEL_STATUS_SIZE = 8;
+
+static const uint32_t AW_FEL_VERSION = 0x001;
+static const uint32_t AW_FEL_1_WRITE = 0x101;
+static const uint32_t AW_FEL_1_EXEC = 0x102;
+static const uint32_t AW_FEL_1_READ = 0x103;
+
+/* First instruction of the snippets fel.c executes, see fel.c */
+static const uint32_t CODE_ENABLE_L2 = 0xee112f30;
+static const uint32_t CODE_STACKINFO = 0xe10f0000;
+static const uint32_t CODE_GET_TTBR0 = 0xee122f10;
+static const uint32_t CODE_GET_SCTLR = 0xee112f10;
+static const uint32_t CODE_DISABLE_MMU = 0xee110f10;
+static const uint32_t CODE_HASH_BLOCKS = 0xe92d0070;
+
+/* Where the SID registers are on A10/A13/A20 */
+static const uint32_t SID_ADDRESS = 0x01c23800;
+static const uint32_t DEFAULT_SID[4] = { 0x16254321, 0x0a1b2c3d, 0x4e5f6071, 0x8293a4b5 };
+
+/* What an A13 BROM reports: stacks in SRAM A1, MMU off */
+static const uint32_t BROM_SP_IRQ = 0x2000;
+static const uint32_t BROM_SP = 0x7000;
+static const uint32_t BROM_SCTLR = 0x00c50078;
+
+static uint32_t le32(const uint8_t * p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+FelEmulator::FelEmulator(uint32_t socId) : socId(socId) {
+	memcpy(sid, DEFAULT_SID, sizeof(sid));
+	powerOn();
+}
+
+void FelEmulator::powerOn() {
+	pages.clear();
+	executedAddresses.clear();
+	for (int i = 0; i < 4; i++)
+		setWord(SID_ADDRESS + 4 * i, sid[i]);
+	resetLink();
+}
+
+void FelEmulator::setSid(const uint32_t key[4]) {
+	memcpy(sid, key, sizeof(sid));
+	for (int i = 0; i < 4; i++)
+		setWord(SID_ADDRESS + 4 * i, sid[i]);
+}
+
+void FelEmulator::resetLink() {
+	usbState = USB_IDLE;
+	usbLeft = 0;
+	felState = FEL_IDLE;
+	felLeft = 0;
+	request.clear();
+	reply.clear();
+}
+
+void FelEmulator::read(uint32_t address, void * buf, size_t length) const {
+	uint8_t * out = (uint8_t *)buf;
+	while (length > 0) {
+		uint32_t offset = address % PAGE_SIZE;
+		size_t n = std::min<size_t>(length, PAGE_SIZE - offset);
+		auto page = pages.find(address / PAGE_SIZE);
+		if (page == pages.end())
+			memset(out, 0, n);
+		else
+			memcpy(out, page->second.data() + offset, n);
+		address += n;
+		out += n;
+		length -= n;
+	}
+}
+
+void FelEmulator::write(uint32_t address, const void * buf, size_t length) {
+	const uint8_t * in = (const uint8_t *)buf;
+	while (length > 0) {
+		uint32_t offset = address % PAGE_SIZE;
+		size_t n = std::min<size_t>(length, PAGE_SIZE - offset);
+		std::vector<uint8_t> & page = pages[address / PAGE_SIZE];
+		if (page.empty())
+			page.resize(PAGE_SIZE);
+		memcpy(page.data() + offset, in, n);
+		address += n;
+		in += n;
+		length -= n;
+	}
+}
+
+uint32_t FelEmulator::word(uint32_t address) const {
+	uint8_t buf[4];
+	read(address, buf, sizeof(buf));
+	return le32(buf);
+}
+
+void FelEmulator::setWord(uint32_t address, uint32_t value) {
+	value = htole32(value);
+	write(address, &value, sizeof(value));
+}
+
+int FelEmulator::bulkTransfer(unsigned char endpoint, unsigned char * data, int length, int * transferred) {
+	if (!(endpoint & LIBUSB_ENDPOINT_IN)) {
+		if (usbState == USB_IDLE) {
+			if (length < (int)AWUC_SIZE || memcmp(data, "AWUC", 4) != 0)
+				return LIBUSB_ERROR_PIPE;
+			uint16_t type = data[16] | data[17] << 8;
+			usbLeft = le32(data + 8);
+			if (type == AW_USB_WRITE)
+				usbState = usbLeft ? USB_DATA_OUT : USB_STATUS;
+			else if (type == AW_USB_READ)
+				usbState = usbLeft ? USB_DATA_IN : USB_STATUS;
+			else
+				return LIBUSB_ERROR_PIPE;
+			*transferred = AWUC_SIZE;
+			return 0;
+		}
+		if (usbState != USB_DATA_OUT)
+			return LIBUSB_ERROR_PIPE;
+		uint32_t n = std::min<uint32_t>(length, usbLeft);
+		consume(data, n);
+		usbLeft -= n;
+		if (!usbLeft)
+			usbState = USB_STATUS;
+		*transferred = n;
+		return 0;
+	}
+
+	if (usbState == USB_DATA_IN) {
+		uint32_t n = std::min<uint32_t>(length, usbLeft);
+		produce(data, n);
+		usbLeft -= n;
+		if (!usbLeft)
+			usbState = USB_STATUS;
+		*transferred = n;
+		return 0;
+	}
+	if (usbState == USB_STATUS) {
+		uint32_t n = std::min<uint32_t>(length, AWUS_SIZE);
+		uint8_t status[AWUS_SIZE] = { 'A', 'W', 'U', 'S' };
+		memcpy(data, status, n);
+		usbState = USB_IDLE;
+		*transferred = n;
+		return 0;
+	}
+	return LIBUSB_ERROR_TIMEOUT; // nothing to send, the host waits in vain
+}
+
+void FelEmulator::consume(const uint8_t * data, uint32_t length) {
+	while (length > 0) {
+		uint32_t n;
+		if (felState == FEL_WRITE_DATA) {
+			n = std::min(length, felLeft);
+			write(felAddress, data, n);
+			felAddress += n;
+			felLeft -= n;
+			if (!felLeft) {
+				felState = FEL_SEND_STATUS;
+				reply.assign(FEL_STATUS_SIZE, 0);
+			}
+		} else if (felState == FEL_IDLE) {
+			n = std::min<uint32_t>(length, FEL_REQUEST_SIZE - request.size());
+			request.insert(request.end(), data, data + n);
+			if (request.size() == FEL_REQUEST_SIZE) {
+				handleRequest();
+				request.clear();
+			}
+		} else {
+			n = length; // not expecting data, dropped like the BROM would
+		}
+		data += n;
+		length -= n;
+	}
+}
+
+void FelEmulator::produce(uint8_t * data, uint32_t length) {
+	while (length > 0) {
+		uint32_t n;
+		if (felState == FEL_READ_DATA) {
+			n = std::min(length, felLeft);
+			read(felAddress, data, n);
+			felAddress += n;
+			felLeft -= n;
+			if (!felLeft) {
+				felState = FEL_SEND_STATUS;
+				reply.assign(FEL_STATUS_SIZE, 0);
+			}
+		} else if (!reply.empty()) {
+			n = std::min<uint32_t>(length, reply.size());
+			memcpy(data, reply.data(), n);
+			reply.erase(reply.begin(), reply.begin() + n);
+			if (reply.empty()) {
+				if (felState == FEL_SEND_VERSION) {
+					felState = FEL_SEND_STATUS;
+					reply.assign(FEL_STATUS_SIZE, 0);
+				} else {
+					felState = FEL_IDLE;
+				}
+			}
+		} else {
+			n = length;
+			memset(data, 0, n);
+		}
+		data += n;
+		length -= n;
+	}
+}
+
+void FelEmulator::handleRequest() {
+	uint32_t type = le32(&request[0]);
+	felAddress = le32(&request[4]);
+	felLeft = le32(&request[8]);
+
+	if (type == AW_FEL_VERSION) {
+		uint8_t version[32] = { 'A', 'W', 'U', 'S', 'B', 'F', 'E', 'X' };
+		uint32_t id = htole32(socId << 8);
+		memcpy(version + 8, &id, 4);
+		version[12] = 1; // unknown_0a
+		version[16] = 1; // protocol
+		version[18] = 0x44;
+		version[19] = 0x08;
+		version[20] = 0x00; // scratchpad 0x7e00
+		version[21] = 0x7e;
+		reply.assign(version, version + sizeof(version));
+		felState = FEL_SEND_VERSION;
+		return;
+	}
+	if (type == AW_FEL_1_WRITE && felLeft) {
+		felState = FEL_WRITE_DATA;
+		return;
+	}
+	if (type == AW_FEL_1_READ && felLeft) {
+		felState = FEL_READ_DATA;
+		return;
+	}
+	if (type == AW_FEL_1_EXEC)
+		execute(felAddress);
+	felState = FEL_SEND_STATUS;
+	reply.assign(FEL_STATUS_SIZE, 0);
+}
+
+void FelEmulator::execute(uint32_t address) {
+	executedAddresses.push_back(address);
+	switch (word(address)) {
+	case CODE_ENABLE_L2:
+	case CODE_DISABLE_MMU:
+		break;
+	case CODE_STACKINFO:
+		setWord(address + 0x24, BROM_SP_IRQ);
+		setWord(address + 0x28, BROM_SP);
+		break;
+	case CODE_GET_TTBR0:
+		setWord(address + 0x14, 0);
+		break;
+	case CODE_GET_SCTLR:
+		setWord(address + 0x14, BROM_SCTLR);
+		break;
+	case CODE_HASH_BLOCKS: {
+		/* parameters follow the 18 instructions: addr, size, count, results, prime, basis */
+		uint32_t params = address + 18 * 4;
+		uint32_t from = word(params), size = word(params + 4), count = word(params + 8);
+		uint32_t results = word(params + 12), prime = word(params + 16), basis = word(params + 20);
+		std::vector<uint8_t> block(size);
+		for (uint32_t i = 0; i < count; i++, from += size) {
+			uint32_t hash = basis;
+			read(from, block.data(), size);
+			for (uint32_t j = 0; j < size; j++)
+				hash = (hash ^ block[j]) * prime;
+			setWord(results + i * 4, hash);
+		}
+		break;
+	}
+	default: {
+		/* the SPL, entered through the thunk, reports back in its header */
+		char signature[8];
+		read(4, signature, sizeof(signature));
+		if (memcmp(signature, "eGON.BT0", 8) == 0)
+			write(4, "eGON.FEL", 8);
+		break;
+	}
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef _DEF_FEL_EMULATOR_H
+#define _DEF_FEL_EMULATOR_H
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#include "FakeUsb.h"
+
+/*
+ * The BROM side of the FEL protocol, as far as fel.c uses it: AWUC/AWUS
+ * framing, FEL version, read, write and execute, on a sparse memory.
+ *
+ * There is no CPU. Executing one of the code snippets fel.c uploads (L2
+ * enable, stack info, TTBR0/SCTLR reads, block hashes) stores the result
+ * that snippet would produce; executing anything else while an eGON SPL is
+ * loaded marks it as run ("eGON.FEL"), like the real SPL does. The SID
+ * registers (sun4i/5i/7i address) hold a fixed Security ID unless set.
+ */
+class FelEmulator : public FakeDevice {
+public:
+	explicit FelEmulator(uint32_t socId = 0x1625);
+
+	int bulkTransfer(unsigned char endpoint, unsigned char * data, int length, int * transferred);
+	void resetLink();
+
+	/* Power cycle: protocol state and memory are cleared, the SID is kept */
+	void powerOn();
+	/* The Security ID the SID registers read back, all zero for an unprogrammed chip */
+	void setSid(const uint32_t sid[4]);
+
+	void read(uint32_t address, void * buf, size_t length) const;
+	void write(uint32_t address, const void * buf, size_t length);
+	/* Addresses passed to FEL execute since power on */
+	const std::vector<uint32_t> & executed() const { return executedAddresses; }
+
+private:
+	enum UsbState { USB_IDLE, USB_DATA_OUT, USB_DATA_IN, USB_STATUS };
+	enum FelState { FEL_IDLE, FEL_WRITE_DATA, FEL_READ_DATA, FEL_SEND_VERSION, FEL_SEND_STATUS };
+
+	uint32_t socId;
+	uint32_t sid[4];
+	std::map<uint32_t, std::vector<uint8_t> > pages;
+	std::vector<uint32_t> executedAddresses;
+
+	UsbState usbState;
+	uint32_t usbLeft;
+	FelState felState;
+	uint32_t felAddress;
+	uint32_t felLeft;
+	std::vector<uint8_t> request; // FEL request being collected
+	std::vector<uint8_t> reply; // FEL reply being sent
+
+	uint32_t word(uint32_t address) const;
+	void setWord(uint32_t address, uint32_t value);
+	void consume(const uint8_t * data, uint32_t length);
+	void produce(uint8_t * data, uint32_t length);
+	void handleRequest();
+	void execute(uint32_t address);
+};
+
+#endif
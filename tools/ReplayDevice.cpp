@@ -0,0 +1,59 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include <libusb.h>
+
+extern "C" {
+#include "crc32.h"
+}
+#include "ReplayDevice.h"
+
+ReplayDevice::ReplayDevice(const UsbTrace & trace, bool recordedTiming)
+	: trace(trace), recordedTiming(recordedTiming), next(0), mismatches(0) {
+}
+
+void ReplayDevice::seekCommand(size_t n) {
+	size_t marks = 0;
+	for (next = 0; next < trace.records.size(); next++) {
+		if (trace.records[next].isMark() && marks++ == n) {
+			next++;
+			return;
+		}
+	}
+}
+
+int ReplayDevice::bulkTransfer(unsigned char endpoint, unsigned char * data, int length, int * transferred) {
+	if (exhausted())
+		return LIBUSB_ERROR_NO_DEVICE;
+	const UsbTrace::Record & record = trace.records[next];
+	if (record.isMark()) {
+		mismatches++; // more transfers than the recording has for this command
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+	next++;
+
+	if (recordedTiming) {
+		struct timespec ts;
+		ts.tv_sec = record.durationNs / 1000000000;
+		ts.tv_nsec = record.durationNs % 1000000000;
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+	}
+
+	int n = std::min<int>(length, record.transferred);
+	if (record.endpoint != endpoint || record.length != (uint32_t)length)
+		mismatches++;
+	else if (!(endpoint & LIBUSB_ENDPOINT_IN) && calc_crc32(data, n, 0) != record.crc32)
+		mismatches++;
+
+	if (endpoint & LIBUSB_ENDPOINT_IN) {
+		if (record.hasData)
+			memcpy(data, record.data.data(), n);
+		else
+			memset(data, 0, n);
+	}
+	*transferred = n;
+	return record.result;
+}
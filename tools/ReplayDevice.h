@@ -0,0 +1,32 @@
+#ifndef _DEF_REPLAY_DEVICE_H
+#define _DEF_REPLAY_DEVICE_H
+
+#include "FakeUsb.h"
+#include "UsbTrace.h"
+
+/*
+ * Plays the device side of a recorded USB trace back to fel.c: every bulk
+ * transfer gets the recorded result, and IN transfers the recorded data
+ * (zeros where the trace kept only a CRC). Transfers that don't match the
+ * recording (endpoint, or the CRC of OUT data) are counted as divergences.
+ */
+class ReplayDevice : public FakeDevice {
+public:
+	/* With 'recordedTiming', every transfer takes as long as it did when recorded */
+	ReplayDevice(const UsbTrace & trace, bool recordedTiming);
+
+	int bulkTransfer(unsigned char endpoint, unsigned char * data, int length, int * transferred);
+
+	/* Skip to the transfers following the n-th marker */
+	void seekCommand(size_t n);
+	size_t divergences() const { return mismatches; }
+	bool exhausted() const { return next >= trace.records.size(); }
+
+private:
+	const UsbTrace & trace;
+	bool recordedTiming;
+	size_t next;
+	size_t mismatches;
+};
+
+#endif
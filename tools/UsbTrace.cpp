@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "portable_endian.h"
+extern "C" {
+#include "usbtrace.h"
+}
+#include "UsbTrace.h"
+
+static void setError(std::string * error, const std::string & message) {
+	if (error)
+		*error = message;
+}
+
+static uint32_t le32(const uint8_t * p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+bool UsbTrace::load(const std::string & path, UsbTrace & trace, std::string * error) {
+	FILE * in = fopen(path.c_str(), "rb");
+	if (!in) {
+		setError(error, "Cannot open " + path);
+		return false;
+	}
+	usb_trace_header header;
+	if (fread(&header, sizeof(header), 1, in) != 1 ||
+	    memcmp(header.magic, USB_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+	    le32toh(header.version) != USB_TRACE_VERSION) {
+		fclose(in);
+		setError(error, path + " is not a USB trace");
+		return false;
+	}
+	trace.payloads = le32toh(header.flags) & USB_TRACE_PAYLOADS;
+	trace.records.clear();
+
+	usb_trace_record raw;
+	while (fread(&raw, sizeof(raw), 1, in) == 1) {
+		Record record;
+		record.timestampNs = le64toh(raw.timestamp_ns);
+		record.durationNs = le32toh(raw.duration_ns);
+		record.endpoint = raw.endpoint;
+		record.result = (int16_t)le16toh(raw.result);
+		record.length = le32toh(raw.length);
+		record.transferred = le32toh(raw.transferred);
+		record.crc32 = le32toh(raw.crc32);
+		record.hasData = raw.flags & USB_TRACE_DATA;
+		if (record.hasData) {
+			record.data.resize(record.transferred);
+			if (fread(record.data.data(), 1, record.transferred, in) != record.transferred)
+				break; // cut off while the trace was written, like the rest
+		}
+		trace.records.push_back(record);
+	}
+	fclose(in);
+	return true;
+}
+
+/* One AWUC / data / AWUS exchange */
+struct Exchange {
+	bool write;
+	bool complete;
+	uint32_t length;
+	uint64_t startNs;
+	uint64_t endNs;
+	int errors;
+	std::string command;
+	std::vector<uint8_t> data; // of the first data transfer, if it was kept
+};
+
+static std::vector<Exchange> exchanges(const std::vector<UsbTrace::Record> & records) {
+	std::vector<Exchange> result;
+	std::string command;
+	Exchange * open = nullptr;
+	uint32_t received = 0;
+	bool awaitingStatus = false;
+
+	for (auto & record : records) {
+		if (record.isMark()) {
+			command = record.text();
+			continue;
+		}
+		if (record.result != 0) {
+			if (open) {
+				open->endNs = record.endNs();
+				open = nullptr;
+			}
+			if (!result.empty())
+				result.back().errors++; // failed AWUCs belong to what came before
+			continue;
+		}
+		if (!record.isIn() && record.hasData && record.transferred == 32 &&
+		    memcmp(record.data.data(), "AWUC", 4) == 0) {
+			Exchange exchange;
+			exchange.write = (record.data[16] | record.data[17] << 8) == 0x12;
+			exchange.complete = false;
+			exchange.length = le32(&record.data[8]);
+			exchange.startNs = record.timestampNs;
+			exchange.endNs = record.endNs();
+			exchange.errors = 0;
+			exchange.command = command;
+			result.push_back(exchange);
+			open = &result.back();
+			received = 0;
+			awaitingStatus = exchange.length == 0;
+			continue;
+		}
+		if (!open)
+			continue;
+		open->endNs = record.endNs();
+		if (awaitingStatus) {
+			if (record.isIn() && record.hasData && record.transferred >= 4 &&
+			    memcmp(record.data.data(), "AWUS", 4) == 0)
+				open->complete = true;
+			open = nullptr;
+			continue;
+		}
+		if (received == 0 && record.hasData)
+			open->data = record.data;
+		received += record.transferred;
+		awaitingStatus = received >= open->length;
+	}
+	return result;
+}
+
+std::vector<UsbTrace::FelOperation> UsbTrace::decode() const {
+	static const struct { uint32_t request; const char * name; bool data; } TYPES[] = {
+		{ 0x001, "version", true },
+		{ 0x101, "write", true },
+		{ 0x102, "exec", false },
+		{ 0x103, "read", true },
+	};
+	std::vector<Exchange> list = exchanges(records);
+	std::vector<FelOperation> result;
+
+	for (size_t i = 0; i < list.size(); ) {
+		const Exchange & request = list[i++];
+		FelOperation op;
+		op.type = "unknown";
+		op.command = request.command;
+		op.address = 0;
+		op.length = 0;
+		op.startNs = request.startNs;
+		op.requestNs = request.endNs - request.startNs;
+		op.dataNs = 0;
+		op.statusNs = 0;
+		op.totalNs = op.requestNs;
+		op.errors = request.errors + !request.complete;
+
+		bool hasData = false;
+		if (request.write && request.length == 16 && request.data.size() == 16) {
+			uint32_t type = le32(&request.data[0]);
+			for (auto & t : TYPES) {
+				if (t.request == type) {
+					op.type = t.name;
+					hasData = t.data;
+				}
+			}
+			op.address = le32(&request.data[4]);
+			op.length = type == 0x001 ? 32 : le32(&request.data[8]);
+			hasData = hasData && op.length > 0;
+		}
+		if (op.type == "unknown" || op.errors) {
+			result.push_back(op);
+			continue;
+		}
+
+		/* the data phase (if any), then the 8 byte status */
+		bool gotStatus = false;
+		for (int phase = hasData ? 0 : 1; phase < 2 && i < list.size(); phase++) {
+			const Exchange & next = list[i];
+			bool expected = phase == 1 ? (!next.write && next.length == 8)
+				: (next.write == (op.type == "write") && next.length == op.length);
+			if (!expected || next.command != op.command)
+				break;
+			i++;
+			(phase == 0 ? op.dataNs : op.statusNs) = next.endNs - next.startNs;
+			op.totalNs = next.endNs - op.startNs;
+			op.errors += next.errors + !next.complete;
+			if (!next.complete)
+				break;
+			gotStatus = phase == 1;
+		}
+		if (!gotStatus && !op.errors)
+			op.errors++; // cut short, the error itself wasn't recorded
+		result.push_back(op);
+	}
+	return result;
+}
@@ -0,0 +1,53 @@
+#ifndef _DEF_USB_TRACE_H
+#define _DEF_USB_TRACE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * A USB trace written by usbtrace.c, in memory, plus its decoding into FEL
+ * operations: every operation is a FEL request, an optional data phase
+ * and the status read, each of them an AWUC / transfer / AWUS exchange.
+ */
+class UsbTrace {
+public:
+	struct Record {
+		uint64_t timestampNs;
+		uint32_t durationNs;
+		uint8_t endpoint;
+		int16_t result;
+		uint32_t length;
+		uint32_t transferred;
+		uint32_t crc32;
+		bool hasData;
+		std::vector<uint8_t> data;
+
+		bool isMark() const { return endpoint == 0; }
+		bool isIn() const { return endpoint & 0x80; }
+		std::string text() const { return std::string(data.begin(), data.end()); }
+		uint64_t endNs() const { return timestampNs + durationNs; }
+	};
+
+	struct FelOperation {
+		std::string type; // "version", "write", "read", "exec" or "unknown"
+		std::string command; // the fel command line it belongs to
+		uint32_t address;
+		uint32_t length;
+		uint64_t startNs;
+		uint64_t requestNs; // sending the FEL request
+		uint64_t dataNs; // the data phase, 0 if there is none
+		uint64_t statusNs; // reading the FEL status
+		uint64_t totalNs; // from the first to the last transfer
+		int errors; // failed transfers within the operation
+	};
+
+	static bool load(const std::string & path, UsbTrace & trace, std::string * error = nullptr);
+
+	bool payloads;
+	std::vector<Record> records;
+
+	std::vector<FelOperation> decode() const;
+};
+
+#endif
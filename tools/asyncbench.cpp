@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FelAsync.h"
+#include "PayloadBundle.h"
+#include "RepairTool.h"
+#include "BenchPayload.h"
+#include "BenchReport.h"
+#include "FakeUsb.h"
+#include "FelEmulator.h"
+
+/*
+ * Repairs several emulated boards, each on a port with a modelled USB link
+ * of its own, and compares one thread driving all of them through FelAsync
+ * with blocking repairs one board after the other:
+ *
+ *   chip-boot-repair-asyncbench [--boards N] [--iterations N]
+ *       [--bandwidth KB/s] [--latency US] [--jitter US] [--payload BUNDLE]
+ *       [--out FILE]
+ *
+ * Without --payload a bundle with payloads of the real sizes is generated.
+ * An untimed blocking repair of every board first tunes its port, so both
+ * sides use the same transfer sizes; the tuning and the history go to
+ * scratch files unless CHIP_BOOT_REPAIR_TUNING and CHIP_BOOT_REPAIR_HISTORY
+ * are set. Reported are "sequential/total" (every board, blocking),
+ * "async/total" (every board, from one FelLoop) and "async/board" (each
+ * board's own time in the asynchronous runs).
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+static double ns(Clock::time_point start, Clock::time_point end) {
+	return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+static std::string port(int board) {
+	return "1-" + std::to_string(board + 1);
+}
+
+/* Every board repaired by its own RepairTool, one after the other */
+static bool repairSequentially(std::vector<FelEmulator> & boards, const PayloadBundle * bundle) {
+	bool ok = true;
+	for (size_t i = 0; i < boards.size(); i++) {
+		boards[i].powerOn();
+		RepairTool tool;
+		tool.setPort(port(i));
+		tool.setExecSettleTime(0);
+		tool.repair(false);
+		ok = BenchPayload::repaired(boards[i], bundle) && ok;
+	}
+	return ok;
+}
+
+/* Every board at once from one loop thread; 'ends' gets the time each one finished */
+static bool repairAsynchronously(FelLoop & loop, std::vector<FelEmulator> & boards, const PayloadBundle * bundle,
+		const RepairPlan & plan, Clock::time_point & start, std::vector<Clock::time_point> & ends) {
+	std::vector<FelDevice *> devices;
+	for (size_t i = 0; i < boards.size(); i++) {
+		boards[i].powerOn();
+		devices.push_back(new FelDevice(loop));
+		int rc = devices.back()->open(port(i));
+		if (rc != 0) {
+			fprintf(stderr, "Cannot open %s: %d\n", port(i).c_str(), rc);
+			exit(1);
+		}
+	}
+
+	std::mutex lock;
+	std::condition_variable finished;
+	size_t left = boards.size();
+	std::vector<int> errors(boards.size(), 0);
+	ends.assign(boards.size(), Clock::time_point());
+	start = Clock::now();
+	for (size_t i = 0; i < devices.size(); i++) {
+		devices[i]->run(plan, [&, i](int error) {
+			std::lock_guard<std::mutex> guard(lock);
+			ends[i] = Clock::now();
+			errors[i] = error;
+			left--;
+			finished.notify_all();
+		});
+	}
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		while (left > 0)
+			finished.wait(guard);
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < devices.size(); i++) {
+		if (errors[i])
+			fprintf(stderr, "%s: %s\n", port(i).c_str(), devices[i]->error().c_str());
+		ok = !errors[i] && BenchPayload::repaired(boards[i], bundle) && ok;
+		delete devices[i];
+	}
+	return ok;
+}
+
+int main(int argc, char ** argv) {
+	int boards = 4;
+	int iterations = 3;
+	LinkModel link;
+	link.bytesPerSecond = 8000 * 1000.0;
+	link.latencyUs = 125;
+	link.jitterUs = 50;
+	std::string payloadPath;
+	std::string outPath;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--boards") && i + 1 < argc)
+			boards = std::min(FakeUsb::MAX_PORTS, std::max(1, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+			iterations = std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--bandwidth") && i + 1 < argc)
+			link.bytesPerSecond = atof(argv[++i]) * 1000;
+		else if (!strcmp(argv[i], "--latency") && i + 1 < argc)
+			link.latencyUs = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--jitter") && i + 1 < argc)
+			link.jitterUs = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--payload") && i + 1 < argc)
+			payloadPath = argv[++i];
+		else if (!strcmp(argv[i], "--out") && i + 1 < argc)
+			outPath = argv[++i];
+		else {
+			fprintf(stderr, "Usage: %s [--boards n] [--iterations n] [--bandwidth KB/s] [--latency us]\n"
+				"\t[--jitter us] [--payload bundle] [--out file]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* Opened up front: the fel calls leave stderr redirected */
+	FILE * out = outPath.empty() ? stdout : fopen(outPath.c_str(), "w");
+	if (!out) {
+		perror(outPath.c_str());
+		return 1;
+	}
+
+	char dir[] = "/tmp/chip-boot-repair-asyncbench-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	bool generated = payloadPath.empty();
+	if (generated)
+		payloadPath = BenchPayload::make(dir);
+	std::string tuningPath = std::string(dir) + "/usb-tuning";
+	std::string journalPath = std::string(dir) + "/journal.csv";
+	std::string historyPath = std::string(dir) + "/history.csv";
+	setenv("CHIP_BOOT_REPAIR_TUNING", tuningPath.c_str(), 0);
+	setenv("CHIP_BOOT_REPAIR_HISTORY", historyPath.c_str(), 0);
+	setenv("CHIP_BOOT_REPAIR_JOURNAL", journalPath.c_str(), 0);
+	unsetenv("CHIP_BOOT_REPAIR_SKIP_REPAIRED");
+	setenv("CHIP_BOOT_REPAIR_PAYLOAD", payloadPath.c_str(), 1);
+	std::string error;
+	if (!RepairTool::mapPayloads(&error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	const PayloadBundle * bundle = PayloadBundle::shared();
+	const RepairPlan * plan = RepairTool::repairPlan();
+
+	std::vector<FelEmulator> devices(boards);
+	for (int i = 0; i < boards; i++)
+		FakeUsb::attach(i + 1, &devices[i]);
+	FakeUsb::setLinkModel(link);
+
+	/* Warm-up, which also tunes every port */
+	int failures = repairSequentially(devices, bundle) ? 0 : 1;
+
+	BenchReport::Series sequential = { "sequential/total", 0, 1, {} };
+	BenchReport::Series async = { "async/total", 0, 1, {} };
+	BenchReport::Series board = { "async/board", 0, 1, {} };
+	FelLoop loop;
+	if (!loop.start()) {
+		fprintf(stderr, "Cannot start the event loop\n");
+		return 1;
+	}
+	for (int n = 0; n < iterations; n++) {
+		Clock::time_point start = Clock::now();
+		if (!repairSequentially(devices, bundle))
+			failures++;
+		sequential.nsPerOp.push_back(ns(start, Clock::now()));
+
+		std::vector<Clock::time_point> ends;
+		if (!repairAsynchronously(loop, devices, bundle, *plan, start, ends))
+			failures++;
+		async.nsPerOp.push_back(ns(start, *std::max_element(ends.begin(), ends.end())));
+		for (auto & end : ends)
+			board.nsPerOp.push_back(ns(start, end));
+	}
+	loop.stop();
+	for (int i = 0; i < boards; i++)
+		FakeUsb::attach(i + 1, nullptr);
+
+	BenchReport report;
+	report.setContext("boards", boards);
+	report.setContext("iterations", iterations);
+	report.setContext("bandwidth_kb_per_s", link.bytesPerSecond / 1000);
+	report.setContext("latency_us", link.latencyUs);
+	report.setContext("jitter_us", link.jitterUs);
+	report.setContext("failures", failures);
+	report.setContext("date", time(nullptr));
+	report.add(sequential);
+	report.add(async);
+	report.add(board);
+	report.write(out);
+	if (out != stdout)
+		fclose(out);
+
+	if (generated)
+		unlink(payloadPath.c_str()); // still mapped, which is fine
+	unlink(tuningPath.c_str());
+	unlink(journalPath.c_str());
+	unlink(historyPath.c_str());
+	rmdir(dir);
+	return failures ? 2 : 0;
+}
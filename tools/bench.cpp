@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "portable_endian.h"
+extern "C" {
+#include "libsunxi.h"
+#include "crc32.h"
+}
+#include "PayloadBundle.h"
+#include "RepairTool.h"
+#include "BenchReport.h"
+
+/*
+ * Microbenchmarks for the host-side hot paths of a repair, no device needed:
+ *
+ *   chip-boot-repair-bench [--filter SUBSTRING] [--repetitions N] [--out FILE]
+ *
+ * Every benchmark is run once to warm up, then timed 'repetitions' times; the
+ * report is JSON (see BenchReport.h) so runs can be diffed between commits.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+struct Benchmark {
+	std::string name;
+	size_t bytes; // processed per iteration, 0 if throughput is meaningless
+	int iterations; // per repetition
+	std::function<void()> body;
+};
+
+/* Results are folded in here so the compiler cannot drop the work */
+static volatile uint32_t sink;
+
+static const size_t BIG_SIZE = 4 * 1024 * 1024;
+static const size_t HEXDUMP_SIZE = 64 * 1024;
+
+static std::string makeTempFile(const std::vector<uint8_t> & data) {
+	char path[] = "/tmp/chip-boot-repair-bench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0 || write(fd, data.data(), data.size()) != (ssize_t)data.size()) {
+		perror("bench temp file");
+		exit(1);
+	}
+	close(fd);
+	return path;
+}
+
+/* A minimal but valid eGON SPL: header, padding, and a correct checksum */
+static std::vector<uint8_t> makeSpl(size_t size) {
+	std::vector<uint8_t> spl(size);
+	for (size_t i = 0; i < size; i++)
+		spl[i] = (uint8_t)(i * 31);
+	uint32_t * words = (uint32_t *)spl.data();
+	memcpy(spl.data() + 4, "eGON.BT0", 8);
+	words[3] = htole32(0x5F0A6C39);
+	words[4] = htole32(size);
+	uint32_t sum = 0;
+	for (size_t i = 0; i < size / 4; i++)
+		sum += le32toh(words[i]);
+	words[3] = htole32(sum);
+	return spl;
+}
+
+static int trivialMain(int argc, char ** argv) {
+	printf("%s\n", argv[argc - 1]);
+	return 0;
+}
+
+static BenchReport::Series run(const Benchmark & benchmark, int repetitions) {
+	BenchReport::Series result;
+	result.name = benchmark.name;
+	result.bytes = benchmark.bytes;
+	result.iterations = benchmark.iterations;
+	benchmark.body();
+	for (int r = 0; r < repetitions; r++) {
+		Clock::time_point start = Clock::now();
+		for (int i = 0; i < benchmark.iterations; i++)
+			benchmark.body();
+		double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+		result.nsPerOp.push_back(ns / benchmark.iterations);
+	}
+	return result;
+}
+
+int main(int argc, char ** argv) {
+	std::string filter;
+	std::string outPath;
+	int repetitions = 10;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+			filter = argv[++i];
+		else if (!strcmp(argv[i], "--repetitions") && i + 1 < argc)
+			repetitions = std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--out") && i + 1 < argc)
+			outPath = argv[++i];
+		else {
+			fprintf(stderr, "Usage: %s [--filter substring] [--repetitions n] [--out file]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* Opened up front, so that a bad --out fails before the benchmarks run */
+	FILE * out = outPath.empty() ? stdout : fopen(outPath.c_str(), "w");
+	if (!out) {
+		perror(outPath.c_str());
+		return 1;
+	}
+
+	std::vector<uint8_t> big(BIG_SIZE);
+	for (size_t i = 0; i < big.size(); i++)
+		big[i] = (uint8_t)(i * 2654435761u >> 24);
+	std::string bigPath = makeTempFile(big);
+	std::vector<uint8_t> spl = makeSpl(24 * 1024);
+
+	std::string bundlePath = bigPath + ".bundle";
+	std::vector<PayloadBundle::Source> sources(1);
+	sources[0].name = "padded-uboot";
+	sources[0].loadAddress = 0x4a000000;
+	sources[0].alignment = 4096;
+	sources[0].path = bigPath;
+	if (!PayloadBundle::write(bundlePath, 1, sources)) {
+		fprintf(stderr, "Cannot write %s\n", bundlePath.c_str());
+		return 1;
+	}
+
+	std::vector<uint32_t> tt(4096);
+	for (uint32_t i = 0; i < tt.size(); i++)
+		tt[i] = (i << 20) | 0xC02;
+	std::vector<char> hexdump((HEXDUMP_SIZE / 16 + 1) * HEXDUMP_LINE_LEN);
+	Strings felWrite = { "./fel", "write", "0x4a000000", "PREFIXpadded-uboot" };
+
+	std::vector<Benchmark> benchmarks = {
+		{ "load_file", BIG_SIZE, 4, [&] {
+			size_t size;
+			void * buf = load_file(bigPath.c_str(), &size);
+			sink += ((uint8_t *)buf)[size - 1];
+			unload_file(bigPath.c_str(), buf);
+		} },
+		{ "mmap_touch", BIG_SIZE, 4, [&] {
+			int fd = open(bigPath.c_str(), O_RDONLY);
+			void * map = mmap(nullptr, BIG_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+			for (size_t i = 0; i < BIG_SIZE; i += 4096)
+				sink += ((uint8_t *)map)[i];
+			munmap(map, BIG_SIZE);
+			close(fd);
+		} },
+		{ "payload_bundle_open_verify", BIG_SIZE, 4, [&] {
+			PayloadBundle * bundle = PayloadBundle::open(bundlePath);
+			sink += bundle->verify();
+			delete bundle;
+		} },
+		{ "prefixed_string_array", 0, 1000, [&] {
+			char ** args = prefixedStringArray(LIBSUNXI_PAYLOAD_PREFIX, felWrite);
+			for (size_t i = 0; i < felWrite.size(); i++) {
+				sink += args[i][0];
+				free(args[i]);
+			}
+			delete[] args;
+		} },
+		{ "call_main", 0, 50, [&] {
+			char * args[] = { (char *)"./fel", (char *)"version" };
+			char * output = nullptr;
+			sink += call_main(2, args, trivialMain, &output);
+			free(output);
+		} },
+		{ "check_spl_header", spl.size(), 1000, [&] {
+			sink += aw_check_spl_header(spl.data(), spl.size());
+		} },
+		{ "build_spl_thunk", 0, 1000, [&] {
+			size_t size;
+			uint32_t * thunk = aw_build_spl_thunk(aw_find_sram_info(0x1625), &size);
+			sink += thunk[0] + size;
+			free(thunk);
+		} },
+		{ "check_mmu_tt", tt.size() * 4, 1000, [&] {
+			aw_check_mmu_tt(tt.data());
+			sink += tt[0];
+		} },
+		{ "hexdump_format", HEXDUMP_SIZE, 20, [&] {
+			sink += hexdump_format(hexdump.data(), big.data(), 0, HEXDUMP_SIZE);
+		} },
+		{ "crc32", BIG_SIZE, 4, [&] {
+			sink += calc_crc32(big.data(), big.size(), 0);
+		} },
+		{ "block_hash", BIG_SIZE, 4, [&] {
+			sink += aw_block_hash(big.data(), big.size());
+		} },
+	};
+
+	BenchReport report;
+	report.setContext("repetitions", repetitions);
+	report.setContext("date", time(nullptr));
+	for (auto & benchmark : benchmarks) {
+		if (filter.empty() || benchmark.name.find(filter) != std::string::npos)
+			report.add(run(benchmark, repetitions));
+	}
+	unlink(bundlePath.c_str());
+	unlink(bigPath.c_str());
+
+	report.write(out);
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "BenchReport.h"
+#include "RepairHistory.h"
+
+/*
+ * Throughput and failure statistics from the repair history log:
+ *
+ *   chip-boot-repair-history [--since WHEN] [--until WHEN] [--by KEY] [FILE]
+ *
+ * WHEN is an age ("90m", "12h", "7d"), a local date ("2026-10-18", with an
+ * optional " 14:30"), or "@" and seconds since the epoch. KEY groups the
+ * repairs by station (host and port, the default), host, port, soc, bundle,
+ * day or hour. FILE defaults to the log RepairTool writes, see
+ * RepairHistory.h.
+ */
+
+static bool parseWhen(const char * text, int64_t now, int64_t & when) {
+	char * end;
+	if (text[0] == '@') {
+		when = strtoll(text + 1, &end, 10);
+		return end != text + 1 && !*end;
+	}
+	double amount = strtod(text, &end);
+	if (end != text && end[0] && !end[1]) {
+		static const struct { char unit; int seconds; } UNITS[] = { { 's', 1 }, { 'm', 60 }, { 'h', 3600 }, { 'd', 86400 } };
+		for (auto & unit : UNITS) {
+			if (*end == unit.unit) {
+				when = now - (int64_t)(amount * unit.seconds);
+				return true;
+			}
+		}
+	}
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	int n = sscanf(text, "%d-%d-%d %d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min);
+	if (n != 3 && n != 5)
+		return false;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	when = mktime(&tm);
+	return when != -1;
+}
+
+static std::string localTime(int64_t when, const char * format) {
+	time_t t = when;
+	char buf[64];
+	strftime(buf, sizeof(buf), format, localtime(&t));
+	return buf;
+}
+
+static std::string groupOf(const RepairHistory::Record & record, const std::string & by) {
+	if (by == "host")
+		return record.host;
+	if (by == "port")
+		return record.port;
+	if (by == "soc") {
+		char soc[16];
+		snprintf(soc, sizeof(soc), "%04x", record.socId);
+		return record.socId ? soc : "unknown";
+	}
+	if (by == "bundle")
+		return std::to_string(record.bundleVersion);
+	if (by == "day")
+		return localTime(record.time, "%Y-%m-%d");
+	if (by == "hour")
+		return localTime(record.time, "%Y-%m-%d %H:00");
+	return record.host + " " + record.port;
+}
+
+struct Totals {
+	size_t repairs, failed, skipped;
+	uint64_t bytes;
+	double planMs;
+	long retries;
+	std::vector<double> totalMs;
+
+	Totals() : repairs(0), failed(0), skipped(0), bytes(0), planMs(0), retries(0) {}
+
+	void add(const RepairHistory::Record & record) {
+		repairs++;
+		if (record.outcome == "failed")
+			failed++;
+		if (record.outcome == "skipped")
+			skipped++;
+		bytes += record.bytes;
+		planMs += record.planMs;
+		retries += record.retries;
+		totalMs.push_back(record.totalMs);
+	}
+};
+
+static void printHeading(const char * key) {
+	printf("%-28s %8s %7s %7s %8s %9s %9s %9s %9s %8s\n", key, "repairs", "failed", "fail %", "skipped", "per hour",
+		"p50 s", "p95 s", "MB/s", "retries");
+}
+
+static void printTotals(const std::string & name, const Totals & t, double hours) {
+	printf("%-28s %8zu %7zu %7.1f %8zu %9s %9.1f %9.1f %9.2f %8.2f\n", name.c_str(), t.repairs, t.failed,
+		100.0 * t.failed / t.repairs, t.skipped, hours > 0 ? std::to_string((int)(t.repairs / hours + 0.5)).c_str() : "-",
+		BenchReport::percentile(t.totalMs, 50) / 1e3, BenchReport::percentile(t.totalMs, 95) / 1e3,
+		t.planMs > 0 ? t.bytes / (t.planMs / 1e3) / 1e6 : 0.0, (double)t.retries / t.repairs);
+}
+
+int main(int argc, char ** argv) {
+	int64_t now = time(nullptr);
+	int64_t since = INT64_MIN, until = INT64_MAX;
+	std::string by = "station";
+	std::string path;
+	bool usage = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--since") && i + 1 < argc)
+			usage = usage || !parseWhen(argv[++i], now, since);
+		else if (!strcmp(argv[i], "--until") && i + 1 < argc)
+			usage = usage || !parseWhen(argv[++i], now, until);
+		else if (!strcmp(argv[i], "--by") && i + 1 < argc)
+			by = argv[++i];
+		else if (argv[i][0] != '-' && path.empty())
+			path = argv[i];
+		else
+			usage = true;
+	}
+	static const char * KEYS[] = { "station", "host", "port", "soc", "bundle", "day", "hour" };
+	if (std::find_if(std::begin(KEYS), std::end(KEYS), [&](const char * key) { return by == key; }) == std::end(KEYS))
+		usage = true;
+	if (usage) {
+		fprintf(stderr, "Usage: %s [--since when] [--until when] [--by station|host|port|soc|bundle|day|hour] [history]\n",
+			argv[0]);
+		return 1;
+	}
+	if (path.empty())
+		path = RepairHistory::path();
+
+	std::vector<RepairHistory::Record> all;
+	std::string error;
+	size_t damaged = 0;
+	if (!RepairHistory::load(path, all, &error, &damaged)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	std::vector<RepairHistory::Record> records;
+	for (auto & record : all) {
+		if (record.time >= since && record.time < until)
+			records.push_back(record);
+	}
+	printf("%s: %zu repairs in the window, %zu in all", path.c_str(), records.size(), all.size());
+	if (damaged)
+		printf(", %zu damaged lines skipped", damaged);
+	printf("\n");
+	if (records.empty())
+		return 0;
+
+	/* the window, narrowed to the records when it is open ended */
+	int64_t first = records.front().time, last = records.front().time;
+	for (auto & record : records) {
+		first = std::min(first, record.time);
+		last = std::max(last, record.time);
+	}
+	int64_t from = since != INT64_MIN ? since : first;
+	int64_t to = until != INT64_MAX ? std::min(until, now) : last;
+	double hours = (to - from) / 3600.0;
+	printf("from %s to %s\n\n", localTime(from, "%Y-%m-%d %H:%M").c_str(), localTime(to, "%Y-%m-%d %H:%M").c_str());
+
+	Totals overall;
+	std::map<std::string, Totals> groups;
+	std::map<std::string, std::vector<double> > phases;
+	std::map<std::string, double> phaseMs;
+	std::vector<std::string> phaseOrder;
+	std::map<std::string, int> errors;
+	double planMs = 0;
+	for (auto & record : records) {
+		overall.add(record);
+		groups[groupOf(record, by)].add(record);
+		planMs += record.planMs;
+		for (auto & phase : record.phases) {
+			if (!phases.count(phase.name))
+				phaseOrder.push_back(phase.name);
+			phases[phase.name].push_back(phase.ms);
+			phaseMs[phase.name] += phase.ms;
+		}
+		if (record.outcome == "failed")
+			errors[record.error.empty() ? "(no output)" : record.error]++;
+	}
+
+	printHeading(by.c_str());
+	for (auto & group : groups)
+		printTotals(group.first, group.second, hours);
+	if (groups.size() > 1)
+		printTotals("all", overall, hours);
+
+	printf("\n%-40s %8s %10s %10s %8s\n", "plan step", "runs", "p50 ms", "p95 ms", "% plan");
+	for (auto & name : phaseOrder) {
+		const std::vector<double> & samples = phases[name];
+		printf("%-40s %8zu %10.1f %10.1f %8.1f\n", name.c_str(), samples.size(),
+			BenchReport::percentile(samples, 50), BenchReport::percentile(samples, 95),
+			planMs > 0 ? 100.0 * phaseMs[name] / planMs : 0.0);
+	}
+
+	if (!errors.empty()) {
+		std::vector<std::pair<int, std::string> > byCount;
+		for (auto & error : errors)
+			byCount.push_back(std::make_pair(-error.second, error.first));
+		std::sort(byCount.begin(), byCount.end());
+		printf("\n%8s  %s\n", "failures", "last line of the fel output");
+		for (size_t i = 0; i < byCount.size() && i < 10; i++)
+			printf("%8d  %s\n", -byCount[i].first, byCount[i].second.c_str());
+	}
+	return 0;
+}
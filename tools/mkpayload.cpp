@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "PayloadBundle.h"
+
+/*
+ * Builds the payload bundle installed next to chip-boot-repair:
+ *
+ *   chip-boot-repair-mkpayload OUTPUT VERSION NAME:ADDRESS:ALIGNMENT:FILE...
+ */
+int main(int argc, char **argv) {
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s output version name:address:alignment:file...\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<PayloadBundle::Source> sources;
+	for (int i = 3; i < argc; i++) {
+		std::string spec = argv[i];
+		size_t addressAt = spec.find(':');
+		size_t alignmentAt = addressAt == std::string::npos ? addressAt : spec.find(':', addressAt + 1);
+		size_t fileAt = alignmentAt == std::string::npos ? alignmentAt : spec.find(':', alignmentAt + 1);
+		if (fileAt == std::string::npos) {
+			fprintf(stderr, "Bad payload specification: %s\n", argv[i]);
+			return 1;
+		}
+		PayloadBundle::Source source;
+		source.name = spec.substr(0, addressAt);
+		source.loadAddress = strtoul(spec.substr(addressAt + 1, alignmentAt - addressAt - 1).c_str(), NULL, 0);
+		source.alignment = strtoul(spec.substr(alignmentAt + 1, fileAt - alignmentAt - 1).c_str(), NULL, 0);
+		source.path = spec.substr(fileAt + 1);
+		sources.push_back(source);
+	}
+
+	std::string error;
+	if (!PayloadBundle::write(argv[1], strtoul(argv[2], NULL, 0), sources, &error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "spantrace.h"
+#include "usbstats.h"
+#include "usbtrace.h"
+}
+#include "PayloadBundle.h"
+#include "RepairTool.h"
+#include "RepairObserver.h"
+#include "UsbTuning.h"
+#include "BenchPayload.h"
+#include "BenchReport.h"
+#include "FakeUsb.h"
+#include "FelEmulator.h"
+
+/*
+ * Runs the whole RepairTool::repair() sequence against an emulated FEL
+ * device behind a modelled USB link, and reports the time of every phase:
+ *
+ *   chip-boot-repair-repairbench [--iterations N] [--bandwidth KB/s]
+ *       [--latency US] [--jitter US] [--error-rate P] [--seed N]
+ *       [--payload BUNDLE] [--trace FILE] [--spans FILE] [--metrics FILE]
+ *       [--out FILE]
+ *
+ * Without --payload a bundle with payloads of the real sizes is generated.
+ * An untimed first repair tunes the USB transfers, into a scratch tuning
+ * file unless CHIP_BOOT_REPAIR_TUNING is set. The repairs go to a scratch
+ * history too, unless CHIP_BOOT_REPAIR_HISTORY is set; every one of them
+ * repairs the same emulated board, so CHIP_BOOT_REPAIR_SKIP_REPAIRED is
+ * ignored.
+ * With CHIP_BOOT_REPAIR_PLAN, its labelled steps make up the phases, which
+ * are reported under the built-in names as long as there are five of them.
+ * --trace records the USB traffic, for chip-boot-repair-trace. --spans
+ * writes the timed steps as Chrome trace events. --metrics writes the USB
+ * statistics of the timed repairs as a Prometheus textfile.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+struct Phase {
+	float fraction; // what RepairTool reports when the phase starts
+	const char * name;
+	const std::string * payload; // transferred in this phase, if any
+};
+
+static const Phase PHASES[] = {
+	{ 0.1f, "spl", &SPL_PAYLOAD },
+	{ 0.3f, "spl_ecc", &SPL_ECC_PAYLOAD },
+	{ 0.5f, "uboot", &UBOOT_PAYLOAD },
+	{ 0.7f, "script", &UBOOT_SCRIPT_PAYLOAD },
+	{ 0.9f, "exec", nullptr },
+};
+static const int PHASE_COUNT = sizeof(PHASES) / sizeof(PHASES[0]);
+
+/* Timestamps every phase change reported through notify() */
+class PhaseTimer : public RepairObserver {
+public:
+	PhaseTimer() : retries(0) {
+		for (int i = 0; i <= PHASE_COUNT; i++)
+			starts[i] = Clock::time_point();
+	}
+
+	void onNotify(const std::string & progressText, float progressFraction, const std::string * details) {
+		if (progressText == lastText) {
+			if (details)
+				retries++; // the same step again: RepairTool::onRetry()
+			return;
+		}
+		lastText = progressText;
+		for (int i = 0; i < PHASE_COUNT; i++) {
+			if (progressFraction > PHASES[i].fraction - 0.01f && progressFraction < PHASES[i].fraction + 0.01f) {
+				starts[i] = Clock::now();
+				return;
+			}
+		}
+		if (progressFraction >= 1.0f)
+			starts[PHASE_COUNT] = Clock::now();
+	}
+
+	/* Nanoseconds spent in phase 'i', -1 if it did not complete */
+	double phaseNs(int i) const {
+		if (starts[i] == Clock::time_point() || starts[i + 1] == Clock::time_point())
+			return -1;
+		return std::chrono::duration<double, std::nano>(starts[i + 1] - starts[i]).count();
+	}
+
+	Clock::time_point starts[PHASE_COUNT + 1];
+	int retries;
+	std::string lastText;
+};
+
+int main(int argc, char ** argv) {
+	int iterations = 10;
+	LinkModel link;
+	link.bytesPerSecond = 8000 * 1000.0;
+	link.latencyUs = 125;
+	link.jitterUs = 50;
+	std::string payloadPath;
+	std::string tracePath;
+	std::string spansPath;
+	std::string metricsPath;
+	std::string outPath;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+			iterations = std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--bandwidth") && i + 1 < argc)
+			link.bytesPerSecond = atof(argv[++i]) * 1000;
+		else if (!strcmp(argv[i], "--latency") && i + 1 < argc)
+			link.latencyUs = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--jitter") && i + 1 < argc)
+			link.jitterUs = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--error-rate") && i + 1 < argc)
+			link.errorRate = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+			link.seed = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--payload") && i + 1 < argc)
+			payloadPath = argv[++i];
+		else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+			tracePath = argv[++i];
+		else if (!strcmp(argv[i], "--spans") && i + 1 < argc)
+			spansPath = argv[++i];
+		else if (!strcmp(argv[i], "--metrics") && i + 1 < argc)
+			metricsPath = argv[++i];
+		else if (!strcmp(argv[i], "--out") && i + 1 < argc)
+			outPath = argv[++i];
+		else {
+			fprintf(stderr, "Usage: %s [--iterations n] [--bandwidth KB/s] [--latency us] [--jitter us]\n"
+				"\t[--error-rate p] [--seed n] [--payload bundle] [--trace file] [--spans file]\n"
+				"\t[--metrics file] [--out file]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* Opened up front: the fel calls leave stderr redirected */
+	FILE * out = outPath.empty() ? stdout : fopen(outPath.c_str(), "w");
+	if (!out) {
+		perror(outPath.c_str());
+		return 1;
+	}
+
+	char dir[] = "/tmp/chip-boot-repair-repairbench-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	bool generated = payloadPath.empty();
+	if (generated)
+		payloadPath = BenchPayload::make(dir);
+	std::string tuningPath = std::string(dir) + "/usb-tuning";
+	std::string journalPath = std::string(dir) + "/journal.csv";
+	setenv("CHIP_BOOT_REPAIR_TUNING", tuningPath.c_str(), 0);
+	setenv("CHIP_BOOT_REPAIR_HISTORY", (std::string(dir) + "/history.csv").c_str(), 0);
+	setenv("CHIP_BOOT_REPAIR_JOURNAL", journalPath.c_str(), 0);
+	unsetenv("CHIP_BOOT_REPAIR_SKIP_REPAIRED");
+	setenv("CHIP_BOOT_REPAIR_PAYLOAD", payloadPath.c_str(), 1);
+	std::string error;
+	if (!RepairTool::mapPayloads(&error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	const PayloadBundle * bundle = PayloadBundle::shared();
+
+	if (!tracePath.empty() && usb_trace_open(tracePath.c_str(), 0) != 0) {
+		perror(tracePath.c_str());
+		return 1;
+	}
+	if (!spansPath.empty() && span_trace_open(spansPath.c_str()) != 0) {
+		perror(spansPath.c_str());
+		return 1;
+	}
+
+	FelEmulator device;
+	FakeUsb::attach(&device);
+	FakeUsb::setLinkModel(link);
+
+	std::vector<BenchReport::Series> series(PHASE_COUNT + 1);
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		series[i].name = std::string("repair/") + PHASES[i].name;
+		series[i].bytes = PHASES[i].payload ? bundle->find(*PHASES[i].payload)->size : 0;
+		series[i].iterations = 1;
+	}
+	series[PHASE_COUNT].name = "repair/total";
+	series[PHASE_COUNT].bytes = 0;
+	series[PHASE_COUNT].iterations = 1;
+
+	/* Warm-up, which also tunes the port (the fake device sits on "1-1") */
+	device.powerOn();
+	RepairTool warmUp;
+	warmUp.setExecSettleTime(0);
+	warmUp.repair(false);
+	FakeUsb::takeInjectedErrors();
+	UsbTuning::Values tuning = { 0, 0 };
+	UsbTuning::find("1-1", tuning);
+	usb_stats_reset();
+
+	int failures = 0, retries = 0;
+	unsigned injected = 0;
+	for (int n = 0; n < iterations; n++) {
+		device.powerOn();
+		PhaseTimer timer;
+		RepairTool tool;
+		tool.addObserver(&timer);
+		tool.setExecSettleTime(0);
+		tool.repair(false);
+		retries += timer.retries;
+		injected += FakeUsb::takeInjectedErrors();
+
+		bool complete = true;
+		for (int i = 0; i < PHASE_COUNT; i++) {
+			double ns = timer.phaseNs(i);
+			if (ns < 0)
+				complete = false;
+			else
+				series[i].nsPerOp.push_back(ns);
+		}
+		if (!complete || !BenchPayload::repaired(device, bundle)) {
+			failures++;
+			continue;
+		}
+		series[PHASE_COUNT].nsPerOp.push_back(
+			std::chrono::duration<double, std::nano>(timer.starts[PHASE_COUNT] - timer.starts[0]).count());
+	}
+	FakeUsb::attach(nullptr);
+	usb_trace_close();
+	span_trace_close();
+	if (!metricsPath.empty() && usb_stats_write_prometheus(metricsPath.c_str()) != 0) {
+		perror(metricsPath.c_str());
+		return 1;
+	}
+
+	BenchReport report;
+	report.setContext("iterations", iterations);
+	report.setContext("bandwidth_kb_per_s", link.bytesPerSecond / 1000);
+	report.setContext("latency_us", link.latencyUs);
+	report.setContext("jitter_us", link.jitterUs);
+	report.setContext("error_rate", link.errorRate);
+	report.setContext("injected_errors", injected);
+	report.setContext("retries", retries);
+	report.setContext("failures", failures);
+	report.setContext("usb_chunk_bytes", tuning.chunkSize);
+	report.setContext("usb_timeout_ms", tuning.timeoutMs);
+	report.setContext("date", time(nullptr));
+	for (auto & s : series)
+		report.add(s);
+	report.write(out);
+	if (out != stdout)
+		fclose(out);
+
+	if (generated)
+		unlink(payloadPath.c_str()); // still mapped, which is fine
+	unlink(tuningPath.c_str());
+	unlink(journalPath.c_str());
+	rmdir(dir);
+	return failures ? 2 : 0;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "libsunxi.h"
+}
+#include "PayloadBundle.h"
+#include "FakeUsb.h"
+#include "ReplayDevice.h"
+#include "UsbTrace.h"
+
+/*
+ * Re-runs the fel commands of a recorded USB trace against the recorded
+ * device responses, to reproduce a field problem without the board:
+ *
+ *   chip-boot-repair-replay [--timing] [--payload BUNDLE] TRACE
+ *
+ * With --timing every transfer takes as long as it did when recorded.
+ * Commands that name payloads need the bundle they were recorded with.
+ * Replayed tune commands save their result to a scratch tuning file, which
+ * the later commands read, not to the station's.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+int main(int argc, char ** argv) {
+	bool timing = false;
+	std::string payloadPath;
+	std::string tracePath;
+	bool usage = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--timing"))
+			timing = true;
+		else if (!strcmp(argv[i], "--payload") && i + 1 < argc)
+			payloadPath = argv[++i];
+		else if (argv[i][0] != '-' && tracePath.empty())
+			tracePath = argv[i];
+		else
+			usage = true;
+	}
+	if (usage || tracePath.empty()) {
+		fprintf(stderr, "Usage: %s [--timing] [--payload bundle] trace\n", argv[0]);
+		return 1;
+	}
+
+	UsbTrace trace;
+	std::string error;
+	if (!UsbTrace::load(tracePath, trace, &error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	if (!payloadPath.empty() && !PayloadBundle::shared(payloadPath, &error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	std::vector<size_t> marks;
+	for (size_t i = 0; i < trace.records.size(); i++) {
+		if (trace.records[i].isMark())
+			marks.push_back(i);
+	}
+	if (marks.empty()) {
+		fprintf(stderr, "%s has no fel commands to replay\n", tracePath.c_str());
+		return 1;
+	}
+
+	char dir[] = "/tmp/chip-boot-repair-replay-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	std::string tuningPath = std::string(dir) + "/usb-tuning";
+	setenv("CHIP_BOOT_REPAIR_TUNING", tuningPath.c_str(), 1);
+
+	ReplayDevice device(trace, timing);
+	FakeUsb::attach(&device);
+	int failed = 0;
+	for (size_t n = 0; n < marks.size(); n++) {
+		const UsbTrace::Record & mark = trace.records[marks[n]];
+		size_t last = n + 1 < marks.size() ? marks[n + 1] - 1 : trace.records.size() - 1;
+		double recordedMs = (trace.records[last].endNs() - mark.timestampNs) / 1e6;
+
+		std::vector<std::string> words;
+		std::istringstream split(mark.text());
+		for (std::string word; split >> word; )
+			words.push_back(word);
+		std::vector<char *> args;
+		for (auto & word : words)
+			args.push_back(&word[0]);
+
+		size_t before = device.divergences();
+		device.seekCommand(n);
+		char * output = nullptr;
+		Clock::time_point start = Clock::now();
+		int result = fel(args.size(), args.data(), &output);
+		double replayMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+		printf("%3zu  %-60s rc=%-5d recorded %9.3f ms  replayed %9.3f ms  divergences %zu\n",
+			n, mark.text().c_str(), result, recordedMs, replayMs, device.divergences() - before);
+		if (result != 0) {
+			failed++;
+			if (output && *output)
+				printf("     %s\n", output);
+		}
+		fflush(stdout); // before the next fel call redirects it
+		free(output);
+	}
+	FakeUsb::attach(nullptr);
+	unlink(tuningPath.c_str());
+	rmdir(dir);
+
+	printf("%zu commands, %d failed, %zu divergences\n", marks.size(), failed, device.divergences());
+	return failed || device.divergences() ? 2 : 0;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "BenchReport.h"
+#include "UsbTrace.h"
+
+/*
+ * Breaks a recorded USB trace down into FEL operations:
+ *
+ *   chip-boot-repair-trace [--ops] TRACE
+ *
+ * Prints the time per fel command, and per operation type the time spent
+ * sending requests, moving data and reading the status. --ops lists every
+ * operation on its own.
+ */
+
+struct Totals {
+	size_t count;
+	uint64_t bytes;
+	uint64_t requestNs, dataNs, statusNs, totalNs;
+	int errors;
+	std::vector<double> samples;
+
+	Totals() : count(0), bytes(0), requestNs(0), dataNs(0), statusNs(0), totalNs(0), errors(0) {}
+
+	void add(const UsbTrace::FelOperation & op) {
+		count++;
+		if (op.type == "write" || op.type == "read")
+			bytes += op.length;
+		requestNs += op.requestNs;
+		dataNs += op.dataNs;
+		statusNs += op.statusNs;
+		totalNs += op.totalNs;
+		errors += op.errors;
+		samples.push_back(op.totalNs);
+	}
+};
+
+int main(int argc, char ** argv) {
+	bool listOps = false;
+	const char * path = nullptr;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--ops"))
+			listOps = true;
+		else
+			path = argv[i];
+	}
+	if (!path) {
+		fprintf(stderr, "Usage: %s [--ops] trace\n", argv[0]);
+		return 1;
+	}
+
+	UsbTrace trace;
+	std::string error;
+	if (!UsbTrace::load(path, trace, &error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	std::vector<UsbTrace::FelOperation> ops = trace.decode();
+
+	size_t transfers = 0, failedTransfers = 0;
+	for (auto & record : trace.records) {
+		if (record.isMark())
+			continue;
+		transfers++;
+		if (record.result != 0)
+			failedTransfers++;
+	}
+	printf("%s: %zu transfers (%zu failed), %zu FEL operations%s\n\n", path, transfers, failedTransfers,
+		ops.size(), trace.payloads ? ", with payloads" : "");
+
+	if (listOps) {
+		printf("%12s  %-8s %10s %10s %10s %10s %10s %10s %s\n", "start ms", "op", "address", "length",
+			"request us", "data us", "status us", "total us", "errors");
+		for (auto & op : ops)
+			printf("%12.3f  %-8s 0x%08x %10u %10.1f %10.1f %10.1f %10.1f %d\n", op.startNs / 1e6,
+				op.type.c_str(), op.address, op.length, op.requestNs / 1e3, op.dataNs / 1e3,
+				op.statusNs / 1e3, op.totalNs / 1e3, op.errors);
+		printf("\n");
+	}
+
+	/* per fel command, in the order they ran */
+	std::vector<std::string> commands;
+	std::map<std::string, Totals> byCommand;
+	for (auto & op : ops) {
+		if (!byCommand.count(op.command))
+			commands.push_back(op.command);
+		byCommand[op.command].add(op);
+	}
+	printf("%-56s %6s %10s %10s %6s\n", "command", "ops", "bytes", "time ms", "errors");
+	for (auto & command : commands) {
+		const Totals & t = byCommand[command];
+		printf("%-56s %6zu %10llu %10.3f %6d\n", command.empty() ? "(none)" : command.c_str(), t.count,
+			(unsigned long long)t.bytes, t.totalNs / 1e6, t.errors);
+	}
+	printf("\n");
+
+	std::map<std::string, Totals> byType;
+	for (auto & op : ops)
+		byType[op.type].add(op);
+	printf("%-8s %6s %10s %10s %12s %12s %12s %10s %10s %10s\n", "op", "count", "bytes", "time ms",
+		"request us", "data us", "status us", "p50 us", "p99 us", "KB/s");
+	for (auto & entry : byType) {
+		const Totals & t = entry.second;
+		printf("%-8s %6zu %10llu %10.3f %12.1f %12.1f %12.1f %10.1f %10.1f %10.1f\n", entry.first.c_str(),
+			t.count, (unsigned long long)t.bytes, t.totalNs / 1e6, t.requestNs / 1e3 / t.count,
+			t.dataNs / 1e3 / t.count, t.statusNs / 1e3 / t.count,
+			BenchReport::percentile(t.samples, 50) / 1e3, BenchReport::percentile(t.samples, 99) / 1e3,
+			t.totalNs ? t.bytes / (t.totalNs / 1e9) / 1000 : 0.0);
+	}
+	return 0;
+}